@@ -0,0 +1,182 @@
+// connrate.cc - measures how fast a server can accept new TCP connections
+//
+// Each client thread repeatedly dials the server, exchanges one small message
+// and closes the connection. The server runs several acceptor threads on the
+// same listener, so this exercises the sharded accept queues.
+
+extern "C" {
+#include <base/log.h>
+#include <net/ip.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "net.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+
+namespace {
+
+using namespace std::chrono;
+using sec = duration<double>;
+using micro = duration<double, std::micro>;
+
+constexpr uint16_t kConnratePort = 8081;
+constexpr uint64_t kConnrateMagic = 0xC044EC7ED00DF00D;
+
+void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
+  uint64_t magic;
+  ssize_t ret = c->ReadFull(&magic, sizeof(magic));
+  if (ret != static_cast<ssize_t>(sizeof(magic))) {
+    if (ret == 0 || ret == -ECONNRESET) return;
+    log_err("read failed, ret = %ld", ret);
+    return;
+  }
+  if (magic != kConnrateMagic) {
+    log_err("invalid magic %lx", magic);
+    return;
+  }
+  ret = c->WriteFull(&magic, sizeof(magic));
+  if (ret != static_cast<ssize_t>(sizeof(magic)) && ret != -EPIPE &&
+      ret != -ECONNRESET)
+    log_err("write failed, ret = %ld", ret);
+}
+
+void RunServer(int acceptors) {
+  std::unique_ptr<rt::TcpQueue> q(
+      rt::TcpQueue::Listen({0, kConnratePort}, 4096));
+  if (q == nullptr) panic("couldn't listen for connections");
+
+  std::vector<rt::Thread> ths;
+  for (int i = 0; i < acceptors; ++i) {
+    ths.emplace_back(rt::Thread([&q] {
+      while (true) {
+        rt::TcpConn *c = q->Accept();
+        if (c == nullptr) panic("couldn't accept a connection");
+        rt::Thread([=] {
+          ServerWorker(std::unique_ptr<rt::TcpConn>(c));
+        }).Detach();
+      }
+    }));
+  }
+  for (auto &t : ths) t.Join();
+}
+
+std::vector<double> ClientWorker(netaddr raddr, steady_clock::time_point end) {
+  std::vector<double> samples;
+  while (steady_clock::now() < end) {
+    auto start = steady_clock::now();
+    std::unique_ptr<rt::TcpConn> c(rt::TcpConn::Dial({0, 0}, raddr));
+    if (unlikely(c == nullptr)) panic("couldn't connect to raddr.");
+
+    uint64_t magic = kConnrateMagic;
+    ssize_t ret = c->WriteFull(&magic, sizeof(magic));
+    if (ret != static_cast<ssize_t>(sizeof(magic)))
+      panic("write failed, ret = %ld", ret);
+    ret = c->ReadFull(&magic, sizeof(magic));
+    if (ret != static_cast<ssize_t>(sizeof(magic)))
+      panic("read failed, ret = %ld", ret);
+    c.reset();
+
+    samples.push_back(
+        duration_cast<micro>(steady_clock::now() - start).count());
+  }
+  return samples;
+}
+
+void RunClient(netaddr raddr, int threads, double seconds) {
+  std::vector<std::vector<double>> samples(threads);
+
+  // |--- start experiment duration timing ---|
+  barrier();
+  auto start = steady_clock::now();
+  barrier();
+
+  auto end = start + duration_cast<steady_clock::duration>(sec(seconds));
+  std::vector<rt::Thread> ths;
+  for (int i = 0; i < threads; ++i) {
+    ths.emplace_back(rt::Thread(
+        [&samples, i, raddr, end] { samples[i] = ClientWorker(raddr, end); }));
+  }
+  for (auto &t : ths) t.Join();
+
+  // |--- end experiment duration timing ---|
+  barrier();
+  auto finish = steady_clock::now();
+  barrier();
+
+  // report results
+  std::vector<double> all;
+  for (auto &v : samples) all.insert(all.end(), v.begin(), v.end());
+  if (all.empty()) panic("no connections completed");
+  std::sort(all.begin(), all.end());
+
+  double elapsed = duration_cast<sec>(finish - start).count();
+  std::cout << "connections: " << all.size() << ", "
+            << static_cast<double>(all.size()) / elapsed << " conns/s, "
+            << "p50 " << all[all.size() / 2] << " us, "
+            << "p99 " << all[all.size() * 99 / 100] << " us" << std::endl;
+}
+
+int StringToAddr(const char *str, uint32_t *addr) {
+  uint8_t a, b, c, d;
+  if (sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) return -EINVAL;
+  *addr = MAKE_IP_ADDR(a, b, c, d);
+  return 0;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: [cfg_file] [command] ..." << std::endl;
+    std::cerr << "commands>" << std::endl;
+    std::cerr << "\tserver [acceptors] - runs a connection rate server"
+              << std::endl;
+    std::cerr << "\tclient [ip_addr] [threads] [seconds] - opens and closes "
+                 "connections as fast as possible"
+              << std::endl;
+    return -EINVAL;
+  }
+
+  std::string cmd = argv[2];
+  netaddr raddr = {};
+  int acceptors = 1, threads = 0;
+  double seconds = 0;
+  if (cmd.compare("server") == 0) {
+    if (argc > 4) {
+      std::cerr << "usage: [cfg_file] server [acceptors]" << std::endl;
+      return -EINVAL;
+    }
+    if (argc == 4) acceptors = std::stoi(argv[3], nullptr, 0);
+    if (acceptors < 1) return -EINVAL;
+  } else if (cmd.compare("client") == 0) {
+    if (argc != 6) {
+      std::cerr << "usage: [cfg_file] client [ip_addr] [threads] [seconds]"
+                << std::endl;
+      return -EINVAL;
+    }
+    int ret = StringToAddr(argv[3], &raddr.ip);
+    if (ret) return -EINVAL;
+    raddr.port = kConnratePort;
+    threads = std::stoi(argv[4], nullptr, 0);
+    seconds = std::stod(argv[5], nullptr);
+  } else {
+    std::cerr << "invalid command: " << cmd << std::endl;
+    return -EINVAL;
+  }
+
+  return rt::RuntimeInit(argv[1], [=]() {
+    std::string cmd = argv[2];
+    if (cmd.compare("server") == 0)
+      RunServer(acceptors);
+    else
+      RunClient(raddr, threads, seconds);
+  });
+}
@@ -40,6 +40,8 @@ netaddr raddr;
 uint64_t n;
 // the mean service time in us.
 double st;
+// the most datagrams the server moves per call (1 uses Read() and Write()).
+int batch = 1;
 
 void ServerWorker(rt::UdpConn *c) {
   union {
@@ -75,6 +77,54 @@ void ServerWorker(rt::UdpConn *c) {
   }
 }
 
+void BatchServerWorker(rt::UdpConn *c) {
+  std::vector<unsigned char> bufs(batch * rt::UdpConn::kMaxPayloadSize);
+  std::vector<udp_msg> msgs(batch);
+  std::unique_ptr<FakeWorker> w(FakeWorkerFactory("stridedmem:3200:64"));
+  if (unlikely(w == nullptr)) panic("couldn't create worker");
+
+  while (true) {
+    // Receive as many network requests as are ready.
+    for (int i = 0; i < batch; ++i) {
+      msgs[i].buf = &bufs[i * rt::UdpConn::kMaxPayloadSize];
+      msgs[i].len = rt::UdpConn::kMaxPayloadSize;
+    }
+    ssize_t ret = c->ReadBatch(msgs.data(), batch);
+    if (ret <= 0) {
+      if (ret == 0) break;
+      panic("udp read failed, ret = %ld", ret);
+    }
+
+    // Perform fake work, stopping at a kill request.
+    int nr;
+    bool kill = false;
+    for (nr = 0; nr < ret; ++nr) {
+      payload *p = static_cast<payload *>(msgs[nr].buf);
+      if (unlikely(p->tag == kKill)) {
+        kill = true;
+        break;
+      }
+      if (p->workn != 0) w->Work(p->workn * 82.0);
+    }
+
+    // Echo the requests back (the socket is dialed, so raddr is ignored).
+    for (int sent = 0; sent < nr;) {
+      ssize_t sret = c->WriteBatch(&msgs[sent], nr - sent);
+      if (sret <= 0) {
+        if (sret == -EPIPE) return;
+        panic("udp write failed, ret = %ld", sret);
+      }
+      sent += sret;
+    }
+
+    // Determine if the connection is being killed.
+    if (unlikely(kill)) {
+      c->Shutdown();
+      break;
+    }
+  }
+}
+
 void ServerHandler(void *arg) {
   std::unique_ptr<rt::UdpConn> c(rt::UdpConn::Listen({0, kNetbenchPort}));
   if (unlikely(c == nullptr)) panic("couldn't listen for control connections");
@@ -104,7 +154,8 @@ void ServerHandler(void *arg) {
         std::unique_ptr<rt::UdpConn> cin(rt::UdpConn::Dial({0, 0}, raddr));
 	if (unlikely(cin == nullptr)) panic("couldn't dial data connection");
 	resp.ports[i] = cin->LocalAddr().port;
-        threads.emplace_back(rt::Thread(std::bind(ServerWorker, cin.get())));
+        threads.emplace_back(rt::Thread(std::bind(
+            batch > 1 ? BatchServerWorker : ServerWorker, cin.get())));
         conns.emplace_back(std::move(cin));
       }
 
@@ -373,6 +424,17 @@ int main(int argc, char *argv[]) {
 
   std::string cmd = argv[2];
   if (cmd.compare("server") == 0) {
+    if (argc > 4) {
+      std::cerr << "usage: [cfg_file] server [batch]" << std::endl;
+      return -EINVAL;
+    }
+    if (argc == 4) batch = std::stoi(argv[3], nullptr, 0);
+    if (batch < 1 || batch > rt::UdpConn::kMaxBatch) {
+      std::cerr << "batch must be between 1 and " << rt::UdpConn::kMaxBatch
+                << std::endl;
+      return -EINVAL;
+    }
+
     ret = runtime_init(argv[1], ServerHandler, NULL);
     if (ret) {
       printf("failed to start runtime\n");
@@ -0,0 +1,128 @@
+// rwlock_bench.cc - compares rwmutex_t and the big-reader lock as the number
+// of threads (one per kthread) grows, for read-mostly workloads
+//
+// Workers never yield, so idle kthreads steal them and each ends up on its own
+// kthread. Run with "runtime_kthreads" larger than the largest thread count;
+// the thread count is capped to leave one kthread for the main thread.
+
+extern "C" {
+#include <base/log.h>
+#include <runtime/sync.h>
+}
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+namespace {
+
+constexpr uint64_t kDurationUs = 1000000;
+// operations between checks of the deadline
+constexpr uint64_t kDeadlineCheckOps = 64;
+// reads per write
+constexpr int kRatios[] = {99, 999};
+// a small read-mostly table, like a routing table
+constexpr int kTableSize = 16;
+
+struct Table {
+  uint64_t entries[kTableSize];
+};
+
+class RwMutexLock {
+ public:
+  RwMutexLock() { rwmutex_init(&m_); }
+  void Lock() { rwmutex_wrlock(&m_); }
+  void Unlock() { rwmutex_unlock(&m_); }
+  void RLock() { rwmutex_rdlock(&m_); }
+  void RUnlock() { rwmutex_unlock(&m_); }
+
+ private:
+  rwmutex_t m_;
+};
+
+template <typename L>
+void Worker(L *lock, Table *t, int ratio, uint64_t deadline_us,
+            uint64_t *ops_out) {
+  uint64_t ops = 0, sum = 0, rand = reinterpret_cast<uintptr_t>(&ops);
+
+  // each worker stops on its own, even if it shares a kthread with the timer
+  // that would otherwise tell it to
+  while (ops % kDeadlineCheckOps != 0 || rt::MicroTime() < deadline_us) {
+    rand = rand * 6364136223846793005UL + 1442695040888963407UL;
+    if ((rand >> 33) % (ratio + 1) == 0) {
+      rt::ScopedLock<L> l(lock);
+      t->entries[ops % kTableSize]++;
+    } else {
+      rt::ScopedReadLock<L> l(lock);
+      for (int i = 0; i < kTableSize; ++i) sum += t->entries[i];
+    }
+    ops++;
+  }
+
+  // keep the reads from being optimized away
+  if (sum == 1) log_info("unlikely");
+  *ops_out = ops;
+}
+
+template <typename L>
+double RunOne(int nthreads, int ratio) {
+  L lock;
+  Table t = {};
+  std::vector<uint64_t> ops(nthreads);
+  std::vector<rt::Thread> ths;
+  uint64_t deadline_us = rt::MicroTime() + kDurationUs;
+
+  for (int i = 0; i < nthreads; ++i) {
+    uint64_t *out = &ops[i];
+    ths.emplace_back(
+        [&, out] { Worker(&lock, &t, ratio, deadline_us, out); });
+  }
+  for (auto &th : ths) th.Join();
+
+  uint64_t total = 0;
+  for (uint64_t n : ops) total += n;
+  return static_cast<double>(total) / kDurationUs;
+}
+
+void RunBench(int max_threads) {
+  int max_workers = static_cast<int>(rt::RuntimeMaxCores()) - 1;
+  if (max_threads > max_workers) {
+    max_threads = max_workers;
+    if (max_threads <= 0) panic("need at least 2 kthreads");
+    log_warn("capping threads to %d, raise runtime_kthreads for more",
+             max_threads);
+  }
+
+  std::cout << "ratio threads rwmutex_mops brlock_mops" << std::endl;
+  for (int ratio : kRatios) {
+    for (int n = 1; n <= max_threads; n *= 2) {
+      double rw = RunOne<RwMutexLock>(n, ratio);
+      double br = RunOne<rt::BigReaderLock>(n, ratio);
+      std::cout << ratio << ":1 " << n << " " << rw << " " << br << std::endl;
+    }
+  }
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    std::cerr << "usage: [cfg_file] [max_threads]" << std::endl;
+    return -EINVAL;
+  }
+
+  int max_threads = std::stoi(argv[2], nullptr, 0);
+  if (max_threads <= 0) {
+    std::cerr << "invalid max_threads: " << argv[2] << std::endl;
+    return -EINVAL;
+  }
+
+  return rt::RuntimeInit(argv[1], [=]() { RunBench(max_threads); });
+}
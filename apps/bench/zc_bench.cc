@@ -0,0 +1,179 @@
+// zc_bench.cc - compares copying and zero-copy TCP transmit throughput
+//
+// Run the client with "runtime_kthreads 1" to get per-core numbers, and with
+// "tcp_zc_region_mb" set large enough for kBuffers of the largest write.
+
+extern "C" {
+#include <base/log.h>
+#include <net/ip.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "net.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+
+namespace {
+
+using namespace std::chrono;
+using sec = duration<double>;
+
+constexpr uint16_t kZcBenchPort = 8081;
+constexpr size_t kMaxWrite = 1024 * 1024;
+constexpr size_t kSinkBuffer = 64 * 1024;
+// buffers in flight per connection, so writes overlap with ACKs
+constexpr int kBuffers = 4;
+constexpr size_t kWriteSizes[] = {4 * 1024, 16 * 1024, 64 * 1024,
+                                  256 * 1024, 1024 * 1024};
+
+void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
+  std::unique_ptr<char[]> buf(new char[kSinkBuffer]);
+  while (true) {
+    ssize_t ret = c->Read(buf.get(), kSinkBuffer);
+    if (ret <= 0) {
+      if (ret != 0 && ret != -ECONNRESET)
+        log_err("read failed, ret = %ld", ret);
+      break;
+    }
+  }
+}
+
+void RunServer() {
+  std::unique_ptr<rt::TcpQueue> q(
+      rt::TcpQueue::Listen({0, kZcBenchPort}, 4096));
+  if (q == nullptr) panic("couldn't listen for connections");
+
+  while (true) {
+    rt::TcpConn *c = q->Accept();
+    if (c == nullptr) panic("couldn't accept a connection");
+    rt::Thread([=] { ServerWorker(std::unique_ptr<rt::TcpConn>(c)); }).Detach();
+  }
+}
+
+void ZeroCopyDone(void *arg) { static_cast<rt::WaitGroup *>(arg)->Done(); }
+
+// Writes @len bytes from @buf, tracking each partial write in @wg.
+void WriteZeroCopyFull(rt::TcpConn *c, const char *buf, size_t len,
+                       rt::WaitGroup *wg) {
+  size_t n = 0;
+  while (n < len) {
+    wg->Add(1);
+    ssize_t ret = c->WriteZeroCopy(buf + n, len - n, ZeroCopyDone, wg);
+    if (ret <= 0) panic("zero-copy write failed, ret = %ld", ret);
+    n += ret;
+  }
+}
+
+// Both kinds of runs stop the clock once the peer has ACKed everything: a
+// final one-byte zero-copy write from @fence completes only after every byte
+// before it was ACKed.
+double RunOne(rt::TcpConn *c, char **bufs, const char *fence, size_t buflen,
+              int samples, bool zc) {
+  rt::WaitGroup wgs[kBuffers], fence_wg;
+
+  barrier();
+  auto start = steady_clock::now();
+  barrier();
+
+  for (int i = 0; i < samples; ++i) {
+    int idx = i % kBuffers;
+    if (zc) {
+      // can't reuse a buffer until the stack is done with it
+      wgs[idx].Wait();
+      WriteZeroCopyFull(c, bufs[idx], buflen, &wgs[idx]);
+    } else {
+      ssize_t ret = c->WriteFull(bufs[idx], buflen);
+      if (ret != static_cast<ssize_t>(buflen))
+        panic("write failed, ret = %ld", ret);
+    }
+  }
+  WriteZeroCopyFull(c, fence, 1, &fence_wg);
+  fence_wg.Wait();
+  for (auto &wg : wgs) wg.Wait();
+
+  barrier();
+  auto finish = steady_clock::now();
+  barrier();
+
+  double seconds = duration_cast<sec>(finish - start).count();
+  return static_cast<double>(buflen) * samples * 8 / seconds / 1e9;
+}
+
+void RunClient(netaddr raddr, size_t total_mb) {
+  std::unique_ptr<rt::TcpConn> c(rt::TcpConn::Dial({0, 0}, raddr));
+  if (c == nullptr) panic("couldn't connect to raddr.");
+
+  char *copy_bufs[kBuffers], *zc_bufs[kBuffers];
+  char *fence = static_cast<char *>(rt::TcpConn::ZeroCopyAlloc(1));
+  if (fence == nullptr) panic("raise tcp_zc_region_mb in the config");
+  for (int i = 0; i < kBuffers; ++i) {
+    copy_bufs[i] = new char[kMaxWrite]();
+    zc_bufs[i] = static_cast<char *>(rt::TcpConn::ZeroCopyAlloc(kMaxWrite));
+    if (zc_bufs[i] == nullptr) panic("raise tcp_zc_region_mb in the config");
+    memset(zc_bufs[i], 0, kMaxWrite);
+  }
+
+  std::cout << "write_size copy_gbps zc_gbps" << std::endl;
+  for (size_t buflen : kWriteSizes) {
+    int samples = std::max<size_t>(total_mb * 1024 * 1024 / buflen, kBuffers);
+    double copy_gbps =
+        RunOne(c.get(), copy_bufs, fence, buflen, samples, false);
+    double zc_gbps = RunOne(c.get(), zc_bufs, fence, buflen, samples, true);
+    std::cout << buflen << " " << copy_gbps << " " << zc_gbps << std::endl;
+  }
+
+  for (int i = 0; i < kBuffers; ++i) delete[] copy_bufs[i];
+}
+
+int StringToAddr(const char *str, uint32_t *addr) {
+  uint8_t a, b, c, d;
+  if (sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) return -EINVAL;
+  *addr = MAKE_IP_ADDR(a, b, c, d);
+  return 0;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: [cfg_file] [command] ..." << std::endl;
+    std::cerr << "commands>" << std::endl;
+    std::cerr << "\tserver - runs a TCP sink" << std::endl;
+    std::cerr << "\tclient - compares copy and zero-copy writes" << std::endl;
+    return -EINVAL;
+  }
+
+  std::string cmd = argv[2];
+  netaddr raddr = {};
+  size_t total_mb = 0;
+  if (cmd.compare("client") == 0) {
+    if (argc != 5) {
+      std::cerr << "usage: [cfg_file] client [ip_addr] [mb_per_size]"
+                << std::endl;
+      return -EINVAL;
+    }
+    int ret = StringToAddr(argv[3], &raddr.ip);
+    if (ret) return -EINVAL;
+    raddr.port = kZcBenchPort;
+    total_mb = std::stoul(argv[4], nullptr, 0);
+  } else if (cmd.compare("server") != 0) {
+    std::cerr << "invalid command: " << cmd << std::endl;
+    return -EINVAL;
+  }
+
+  return rt::RuntimeInit(argv[1], [=]() {
+    std::string cmd = argv[2];
+    if (cmd.compare("server") == 0) {
+      RunServer();
+    } else if (cmd.compare("client") == 0) {
+      RunClient(raddr, total_mb);
+    }
+  });
+}
@@ -127,7 +127,10 @@ RandomMemtouchWorker *RandomMemtouchWorker::Create(std::size_t size,
 }
 
 void RandomMemtouchWorker::Work(uint64_t n) {
-  for (uint64_t i = 0; i < n; ++i) buf_[schedule_[i % schedule_.size()]]++;
+  for (uint64_t i = 0; i < n; ++i) {
+    volatile char &c = buf_[schedule_[i % schedule_.size()]];
+    c = c + 1;
+  }
 }
 
 CacheAntagonistWorker *CacheAntagonistWorker::Create(std::size_t size) {
@@ -0,0 +1,148 @@
+// timeslice.cc - head-of-line blocking under bimodal service times
+//
+// Requests arrive open-loop and each runs in its own uthread, so short
+// requests that land behind a long one wait for it unless the runtime time
+// slices (see runtime_quantum_us). Run once with the quantum set and once
+// without, then compare the latency of the short class.
+
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include "distribution.h"
+#include "synthetic_worker.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// number of measurement steps to take
+constexpr double kSteps = 9.0;
+// measurement duration in us
+constexpr double kDuration = 2000000.0;
+// how long to calibrate the synthetic worker for in us
+constexpr double kCalibrateUS = 100000.0;
+
+// Measures how many worker iterations it takes to burn one microsecond.
+double Calibrate(SyntheticWorker *worker) {
+  uint64_t n = 1000;
+  while (true) {
+    Timer t;
+    worker->Work(n);
+    double elapsed = t.Elapsed();
+    if (elapsed >= kCalibrateUS) return static_cast<double>(n) / elapsed;
+    n *= 2;
+  }
+}
+
+std::vector<work_unit> RunExperiment(double offered_rps, Distribution *sd,
+                                     SyntheticWorker *worker,
+                                     double iters_per_us) {
+  std::mt19937 rg(rand());
+  std::exponential_distribution<double> rd(1.0 / (1000000.0 / offered_rps));
+  std::vector<work_unit> w =
+      GenerateWork(std::bind(rd, rg), sd, 0, kDuration, 0);
+
+  Timer t;
+  rt::WaitGroup wg(w.size());
+  for (work_unit &u : w) {
+    t.SpinUntil(u.start_us);
+    work_unit *up = &u;
+    rt::Spawn([&, up] {
+      worker->Work(static_cast<uint64_t>(up->work_us * iters_per_us));
+      up->duration_us = t.Elapsed() - up->start_us;
+      wg.Done();
+    });
+  }
+  wg.Wait();
+  return w;
+}
+
+void PrintClass(double offered_rps, const char *name,
+                std::vector<work_unit> w) {
+  if (w.empty()) return;
+
+  std::sort(w.begin(), w.end(), [](const work_unit &s1, work_unit &s2) {
+    return s1.duration_us < s2.duration_us;
+  });
+
+  double count = static_cast<double>(w.size());
+  double p50 = w[count * 0.5].duration_us;
+  double p99 = w[count * 0.99].duration_us;
+  double p999 = w[count * 0.999].duration_us;
+  double max = w[w.size() - 1].duration_us;
+
+  std::cout << std::setprecision(4) << std::fixed << offered_rps << ","
+            << name << "," << count << "," << p50 << "," << p99 << ","
+            << p999 << "," << max << std::endl;
+}
+
+void PrintResults(double offered_rps, double threshold_us,
+                  const std::vector<work_unit> &w) {
+  std::vector<work_unit> short_w, long_w;
+  for (const work_unit &u : w)
+    (u.work_us < threshold_us ? short_w : long_w).push_back(u);
+
+  static bool first = true;
+  if (first) {
+    first = false;
+    std::cout << "offered_rps,class,count,p50,p99,p999,max" << std::endl;
+  }
+
+  PrintClass(offered_rps, "short", std::move(short_w));
+  PrintClass(offered_rps, "long", std::move(long_w));
+}
+
+int MainHandler(int argc, char *argv[]) {
+  std::unique_ptr<Distribution> sd(DistributionFactory(argv[2]));
+  if (!sd) return -EINVAL;
+  double max_load = std::stod(argv[3], nullptr);
+  if (max_load <= 0.0 || max_load >= 1.0) return -EINVAL;
+  if (rt::RuntimeGuaranteedCores() < 2) return -EINVAL;
+
+  std::unique_ptr<SyntheticWorker> worker(SyntheticWorkerFactory("sqrt"));
+  double iters_per_us = Calibrate(worker.get());
+
+  // one core generates load, the rest serve it
+  int workers = rt::RuntimeGuaranteedCores() - 1;
+  double max_rps = 1000000.0 / sd->Mean() * workers * max_load;
+
+  // anything shorter than the mean counts as a short request
+  double threshold_us = sd->Mean();
+
+  for (double rps = max_rps / kSteps; rps <= max_rps; rps += max_rps / kSteps) {
+    auto w = RunExperiment(rps, sd.get(), worker.get(), iters_per_us);
+    PrintResults(rps, threshold_us, w);
+  }
+
+  return 0;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    std::cerr << "usage: [cfg_file] [work_dist] [max_load]" << std::endl;
+    std::cerr << "  e.g. timeslice tq.cfg bimodal:10:5000:0.995 0.8"
+              << std::endl;
+    return -EINVAL;
+  }
+
+  int ret = rt::RuntimeInit(argv[1], [argc, argv] { MainHandler(argc, argv); });
+  if (ret) {
+    std::cerr << "failed to start runtime\n" << std::endl;
+    return ret;
+  }
+
+  return 0;
+}
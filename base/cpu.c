@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/syscall.h>
 
 #include <base/stddef.h>
@@ -29,7 +30,7 @@ static int cpu_scan_topology(void)
 	DEFINE_BITMAP(numa_mask, NNUMA);
 	DEFINE_BITMAP(cpu_mask, NCPU);
 	uint64_t tmp;
-	int i;
+	int i, j;
 
 	/* How many NUMA nodes? */
 	if (sysfs_parse_bitlist("/sys/devices/system/node/online",
@@ -88,6 +89,25 @@ static int cpu_scan_topology(void)
 		if (sysfs_parse_bitlist(path,
 			cpu_info_tbl[i].thread_siblings_mask, cpu_count))
 			return -EIO;
+
+		/* assume the whole package shares a cache if L3 isn't listed */
+		snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+			 "/index3/shared_cpu_list", i);
+		if (sysfs_parse_bitlist(path,
+			cpu_info_tbl[i].llc_siblings_mask, cpu_count)) {
+			memcpy(cpu_info_tbl[i].llc_siblings_mask,
+			       cpu_info_tbl[i].core_siblings_mask,
+			       sizeof(cpu_info_tbl[i].llc_siblings_mask));
+		}
+	}
+
+	/* Scan the NUMA node of each CPU. */
+	for (i = 0; i < numa_count; i++) {
+		snprintf(path, sizeof(path), SYSFS_NODE_PATH "/cpulist", i);
+		if (sysfs_parse_bitlist(path, cpu_mask, NCPU))
+			return -EIO;
+		bitmap_for_each_set(cpu_mask, cpu_count, j)
+			cpu_info_tbl[j].numa_node = i;
 	}
 
 	return 0;
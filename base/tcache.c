@@ -195,6 +195,28 @@ void tcache_init_perthread(struct tcache *tc, struct tcache_perthread *ltc)
 	ltc->capacity = tc->mag_size; 
 }
 
+/**
+ * tcache_flush_perthread - returns the spare magazine of a per-thread handle
+ *                          to the shared pool
+ * @ltc: the per-thread handle
+ *
+ * Call this when the thread goes idle so that tcache_reclaim() can free the
+ * items it was holding on to. The partially used loaded magazine is kept.
+ */
+void tcache_flush_perthread(struct tcache_perthread *ltc)
+{
+	struct tcache *tc = ltc->tc;
+
+	if (!ltc->previous)
+		return;
+
+	spin_lock(&tc->lock);
+	ltc->previous->next_mag = tc->shared_mags;
+	tc->shared_mags = ltc->previous;
+	spin_unlock(&tc->lock);
+	ltc->previous = NULL;
+}
+
 /**
  * tcache_reclaim - reclaims unused memory from a thread-local cache
  * @tc: the thread-local cache
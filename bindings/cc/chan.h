@@ -0,0 +1,221 @@
+// chan.h - support for channels
+
+#pragma once
+
+extern "C" {
+#include <base/assert.h>
+#include <runtime/chan.h>
+}
+
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rt {
+
+template <typename T>
+class Channel;
+
+namespace chan_internal {
+
+// Trivially copyable values are copied through the channel, and anything else
+// is moved into a heap allocation and its pointer is sent instead.
+template <typename T>
+constexpr bool kBoxed = !std::is_trivially_copyable<T>::value;
+
+template <typename T>
+using Wire = std::conditional_t<kBoxed<T>, T *, T>;
+
+}  // namespace chan_internal
+
+// A Go-style channel of T. A capacity of zero means senders wait for a
+// receiver, and kUnbounded means they never wait.
+template <typename T>
+class Channel {
+  friend class Select;
+  using Wire = chan_internal::Wire<T>;
+
+ public:
+  static constexpr unsigned int kUnbounded = CHAN_UNBOUNDED;
+
+  explicit Channel(unsigned int cap = 0) {
+    BUG_ON(chan_init(&c_, sizeof(Wire), cap));
+  }
+  ~Channel() {
+    if constexpr (chan_internal::kBoxed<T>) {
+      Wire w;
+      while (chan_try_recv(&c_, &w) == 0) delete w;
+    }
+    chan_destroy(&c_);
+  }
+
+  // Sends a value, waiting for room if necessary. Returns false if the
+  // channel is closed.
+  bool Send(T val) {
+    if constexpr (chan_internal::kBoxed<T>) {
+      Wire w = new T(std::move(val));
+      if (chan_send(&c_, &w) == 0) return true;
+      delete w;
+      return false;
+    } else {
+      return chan_send(&c_, &val) == 0;
+    }
+  }
+
+  // Sends a value only if it won't wait. Returns false if the channel is
+  // full or closed.
+  bool TrySend(T val) {
+    if constexpr (chan_internal::kBoxed<T>) {
+      Wire w = new T(std::move(val));
+      if (chan_try_send(&c_, &w) == 0) return true;
+      delete w;
+      return false;
+    } else {
+      return chan_try_send(&c_, &val) == 0;
+    }
+  }
+
+  // Receives a value, waiting for one if necessary. Returns std::nullopt
+  // once the channel is closed and drained.
+  std::optional<T> Recv() {
+    Wire w;
+    if (chan_recv(&c_, &w)) return std::nullopt;
+    return Unwrap(w);
+  }
+
+  // Receives a value only if one is ready. Returns std::nullopt otherwise.
+  std::optional<T> TryRecv() {
+    Wire w;
+    if (chan_try_recv(&c_, &w)) return std::nullopt;
+    return Unwrap(w);
+  }
+
+  // Closes the channel, failing later sends. May only be called once.
+  void Close() { chan_close(&c_); }
+
+ private:
+  static T Unwrap(Wire w) {
+    if constexpr (chan_internal::kBoxed<T>) {
+      T val(std::move(*w));
+      delete w;
+      return val;
+    } else {
+      return w;
+    }
+  }
+
+  chan_t c_;
+
+  Channel(const Channel &) = delete;
+  Channel &operator=(const Channel &) = delete;
+};
+
+// Waits on several channel operations, like Go's select statement. Cases are
+// numbered in the order they are added, and exactly one of them happens.
+//
+//   std::optional<int> v;
+//   rt::Select s;
+//   s.Recv(&in, &v).Send(&out, 42);
+//   int ret = s.Wait(10 * rt::kMilliseconds);
+class Select {
+ public:
+  Select() {}
+  ~Select() { Finish(-1); }
+
+  // Adds a receive from @ch into @out (left empty if the channel closed).
+  // @out must stay valid until Wait() returns.
+  template <typename T>
+  Select &Recv(Channel<T> *ch, std::optional<T> *out) {
+    static_assert(sizeof(chan_internal::Wire<T>) <= sizeof(Case::wire),
+                  "receive a pointer (or a std::unique_ptr) to large values");
+    Add(&ch->c_, false, out, [](Case *cs, bool chosen) {
+      auto *dst = static_cast<std::optional<T> *>(cs->user);
+      if (!chosen) return;
+      if (cs->cc.ret) {
+        dst->reset();
+        return;
+      }
+      *dst = Channel<T>::Unwrap(*reinterpret_cast<chan_internal::Wire<T> *>(
+          &cs->wire));
+    });
+    return *this;
+  }
+
+  // Adds a send of @val to @ch.
+  template <typename T>
+  Select &Send(Channel<T> *ch, T val) {
+    static_assert(sizeof(chan_internal::Wire<T>) <= sizeof(Case::wire),
+                  "send a pointer (or a std::unique_ptr) to large values");
+    Add(&ch->c_, true, nullptr, [](Case *cs, bool chosen) {
+      if constexpr (chan_internal::kBoxed<T>) {
+        // the receiver owns the value only if the send happened
+        if (!chosen || cs->cc.ret) delete *reinterpret_cast<T **>(&cs->wire);
+      }
+    });
+    auto *w = reinterpret_cast<chan_internal::Wire<T> *>(&cases_.back().wire);
+    if constexpr (chan_internal::kBoxed<T>) {
+      *w = new T(std::move(val));
+    } else {
+      *w = val;
+    }
+    return *this;
+  }
+
+  // Performs one ready case, waiting up to @timeout_us (zero to only poll, or
+  // negative to wait forever). Returns the index of the case, -EAGAIN if
+  // polling found nothing ready, or -ETIMEDOUT. A send to a closed channel
+  // counts as ready, see SendFailed(). The cases are cleared afterward.
+  int Wait(int64_t timeout_us = -1) {
+    std::vector<chan_case> ccs;
+    ccs.reserve(cases_.size());
+    for (Case &cs : cases_) {
+      cs.cc.buf = &cs.wire;
+      ccs.push_back(cs.cc);
+    }
+
+    int ret = chan_select(ccs.data(), ccs.size(), timeout_us);
+    if (ret >= 0) {
+      cases_[ret].cc.ret = ccs[ret].ret;
+      send_failed_ = cases_[ret].cc.send && ccs[ret].ret;
+    }
+    Finish(ret);
+    return ret;
+  }
+
+  // Returns true if the case chosen by the last Wait() was a send to a closed
+  // channel.
+  bool SendFailed() const { return send_failed_; }
+
+ private:
+  struct Case {
+    chan_case cc;
+    alignas(16) unsigned char wire[64];
+    void *user;
+    void (*finish)(Case *cs, bool chosen);
+  };
+
+  void Add(chan_t *c, bool send, void *user, void (*finish)(Case *, bool)) {
+    Case cs;
+    cs.cc.c = c;
+    cs.cc.send = send;
+    cs.cc.ret = 0;
+    cs.user = user;
+    cs.finish = finish;
+    cases_.push_back(cs);
+  }
+
+  void Finish(int chosen) {
+    for (size_t i = 0; i < cases_.size(); ++i)
+      cases_[i].finish(&cases_[i], static_cast<int>(i) == chosen);
+    cases_.clear();
+  }
+
+  std::vector<Case> cases_;
+  bool send_failed_ = false;
+
+  Select(const Select &) = delete;
+  Select &operator=(const Select &) = delete;
+};
+
+}  // namespace rt
@@ -0,0 +1,232 @@
+#include "connpool.h"
+
+#include <algorithm>
+
+#include "runtime.h"
+#include "thread.h"
+
+namespace rt {
+
+namespace {
+
+struct IdleConn {
+  TcpConn *c;
+  uint64_t last_used_us;
+};
+
+// The reaper never sleeps for less than this.
+constexpr uint64_t kMinReapIntervalUS = 10 * kMilliseconds;
+
+}  // namespace
+
+struct alignas(CACHE_LINE_SIZE) ConnPoolShard {
+  Spin lock;
+  // most recently used last, so the oldest connections age out first
+  std::vector<IdleConn> idle;
+};
+
+struct ConnPool::State {
+  netaddr raddr;
+  Options opts;
+  std::vector<ConnPoolShard> shards;
+  bool closing = false;
+
+  // Closes idle connections last used before @cutoff_us.
+  void Reap(uint64_t cutoff_us) {
+    std::vector<TcpConn *> stale;
+    for (auto &s : shards) {
+      {
+        SpinGuard g(&s.lock);
+        auto it = std::find_if(s.idle.begin(), s.idle.end(),
+                               [cutoff_us](const IdleConn &ic) {
+                                 return ic.last_used_us >= cutoff_us;
+                               });
+        for (auto pos = s.idle.begin(); pos != it; ++pos)
+          stale.push_back(pos->c);
+        s.idle.erase(s.idle.begin(), it);
+      }
+      for (TcpConn *c : stale) delete c;
+      stale.clear();
+    }
+  }
+};
+
+void ConnPool::Conn::Release() {
+  if (!c_) return;
+
+  ConnPoolShard &s = st_->shards[home_];
+  s.lock.Lock();
+  if (unlikely(st_->closing) || s.idle.size() >= st_->opts.max_idle) {
+    s.lock.Unlock();
+    delete c_;
+  } else {
+    s.idle.push_back({c_, MicroTime()});
+    s.lock.Unlock();
+  }
+  c_ = nullptr;
+}
+
+ConnPool *ConnPool::Create(netaddr raddr, Options opts) {
+  if (!opts.health_check) opts.health_check = CheckConn;
+
+  auto st = std::make_shared<State>();
+  st->raddr = raddr;
+  st->opts = std::move(opts);
+  st->shards = std::vector<ConnPoolShard>(RuntimeMaxCores());
+  // reserve up front so returning a connection never allocates under a lock
+  for (auto &s : st->shards) s.idle.reserve(st->opts.max_idle);
+
+  if (st->opts.idle_timeout_us) {
+    uint64_t interval =
+        std::max(st->opts.idle_timeout_us / 2, kMinReapIntervalUS);
+    Spawn([st, interval] {
+      while (true) {
+        Sleep(interval);
+        if (read_once(st->closing)) return;
+        uint64_t now = MicroTime();
+        if (now > st->opts.idle_timeout_us)
+          st->Reap(now - st->opts.idle_timeout_us);
+      }
+    });
+  }
+
+  return new ConnPool(std::move(st));
+}
+
+ConnPool::~ConnPool() {
+  // the reaper may outlive the pool by up to one interval; it sees this flag
+  // and exits without touching the shards
+  write_once(st_->closing, true);
+  st_->Reap(UINT64_MAX);
+}
+
+ConnPool::Conn ConnPool::Get() {
+  unsigned int k = get_current_affinity();
+  ConnPoolShard &s = st_->shards[k];
+
+  while (true) {
+    s.lock.Lock();
+    if (s.idle.empty()) {
+      s.lock.Unlock();
+      break;
+    }
+    IdleConn ic = s.idle.back();
+    s.idle.pop_back();
+    s.lock.Unlock();
+
+    if (MicroTime() - ic.last_used_us > st_->opts.check_after_us &&
+        !st_->opts.health_check(ic.c)) {
+      delete ic.c;
+      continue;
+    }
+    return Conn(st_.get(), ic.c, k);
+  }
+
+  TcpConn *c = TcpConn::DialAffinity(k, st_->raddr);
+  if (!c) return Conn();
+  return Conn(st_.get(), c, k);
+}
+
+void ConnPool::Reap() {
+  uint64_t now = MicroTime();
+  if (st_->opts.idle_timeout_us && now > st_->opts.idle_timeout_us)
+    st_->Reap(now - st_->opts.idle_timeout_us);
+}
+
+bool ConnPool::CheckConn(TcpConn *c) {
+  char byte;
+
+  c->SetNonblocking(true);
+  ssize_t ret = c->Read(&byte, sizeof(byte));
+  c->SetNonblocking(false);
+
+  // anything but "nothing to read yet" means EOF, an error, or stray bytes
+  return ret == -EAGAIN;
+}
+
+struct PipelinedConn::Pending {
+  explicit Pending(void *rsp) : rsp(rsp), ret(0), done(false), next(nullptr) {}
+
+  void *rsp;
+  int ret;
+  bool done;
+  ThreadWaker w;
+  Pending *next;
+};
+
+int PipelinedConn::Call(const iovec *iov, int iovcnt, void *rsp) {
+  Pending p(rsp);
+
+  // queue and send the request, keeping the queue in wire order
+  write_mu_.Lock();
+  lock_.Lock();
+  if (unlikely(err_)) {
+    int err = err_;
+    lock_.Unlock();
+    write_mu_.Unlock();
+    return err;
+  }
+  if (tail_)
+    tail_->next = &p;
+  else
+    head_ = &p;
+  tail_ = &p;
+  lock_.Unlock();
+
+  ssize_t ret = c_->WritevFull(iov, iovcnt);
+  if (unlikely(ret < 0)) {
+    // unblocks any caller waiting on a response that will never come
+    c_->Abort();
+    SpinGuard g(&lock_);
+    if (!err_) err_ = static_cast<int>(ret);
+  }
+  write_mu_.Unlock();
+
+  // wait for the response, reading it ourselves if no one else is
+  lock_.Lock();
+  while (!p.done) {
+    if (!reading_) {
+      ReadResponses(&p);
+      break;
+    }
+    p.w.Arm();
+    lock_.UnlockAndPark();
+    lock_.Lock();
+  }
+  lock_.Unlock();
+
+  return p.ret;
+}
+
+// Reads responses in order until @p's arrives, completing the callers queued
+// ahead of it along the way. Called and returns with the lock held.
+void PipelinedConn::ReadResponses(Pending *p) {
+  assert(lock_.IsHeld());
+  reading_ = true;
+
+  while (!p->done) {
+    Pending *h = head_;
+    assert(h != nullptr);
+    ssize_t ret = err_;
+
+    if (!ret) {
+      lock_.Unlock();
+      ret = read_rsp_(c_.get(), h->rsp);
+      lock_.Lock();
+      if (unlikely(ret <= 0) && !err_)
+        err_ = ret < 0 ? static_cast<int>(ret) : -ECONNRESET;
+    }
+
+    head_ = h->next;
+    if (!head_) tail_ = nullptr;
+    h->ret = ret > 0 ? 0 : err_;
+    h->done = true;
+    if (h != p) h->w.Wake();
+  }
+
+  // hand the reader role to the next caller in line
+  reading_ = false;
+  if (head_) head_->w.Wake();
+}
+
+}  // namespace rt
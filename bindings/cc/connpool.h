@@ -0,0 +1,177 @@
+// connpool.h - reusable and multiplexed client TCP connections
+
+#pragma once
+
+extern "C" {
+#include <base/stddef.h>
+}
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "net.h"
+#include "sync.h"
+#include "timer.h"
+
+namespace rt {
+
+// A pool of client connections to one backend.
+//
+// Each kthread keeps its own free list of connections dialed with affinity to
+// it (see tcp_dial_affinity()), so the packets of a connection borrowed there
+// are received on the same kthread and getting or returning one touches no
+// shared state. Idle connections are closed in the background after a timeout,
+// and connections that sat idle for a while are health checked before reuse.
+class ConnPool {
+  struct State;
+
+ public:
+  struct Options {
+    // The most idle connections kept per kthread.
+    unsigned int max_idle = 8;
+    // Idle connections are closed after this long (0 keeps them forever).
+    uint64_t idle_timeout_us = 30 * kSeconds;
+    // Connections idle for longer than this are checked before reuse.
+    uint64_t check_after_us = 1 * kSeconds;
+    // Returns false if a connection can no longer be used. CheckConn() is used
+    // if this is empty.
+    std::function<bool(TcpConn *)> health_check;
+  };
+
+  // A borrowed connection. It goes back to the pool when destroyed, unless
+  // Discard() was called. It must be destroyed before the pool.
+  class Conn {
+   public:
+    Conn() : st_(nullptr), c_(nullptr), home_(0) {}
+    ~Conn() { Release(); }
+
+    // disable copy.
+    Conn(const Conn &) = delete;
+    Conn &operator=(const Conn &) = delete;
+
+    // allow move.
+    Conn(Conn &&c) : st_(c.st_), c_(c.c_), home_(c.home_) { c.c_ = nullptr; }
+    Conn &operator=(Conn &&c) {
+      Release();
+      st_ = c.st_;
+      c_ = c.c_;
+      home_ = c.home_;
+      c.c_ = nullptr;
+      return *this;
+    }
+
+    TcpConn *get() const { return c_; }
+    TcpConn *operator->() const { return c_; }
+    explicit operator bool() const { return c_ != nullptr; }
+
+    // Closes the connection instead of returning it to the pool. Use this
+    // after an I/O error or when the stream is left mid-message.
+    void Discard() {
+      delete c_;
+      c_ = nullptr;
+    }
+
+   private:
+    friend class ConnPool;
+    Conn(State *st, TcpConn *c, unsigned int home)
+        : st_(st), c_(c), home_(home) {}
+
+    void Release();
+
+    State *st_;
+    TcpConn *c_;
+    unsigned int home_;
+  };
+
+  // Creates a pool of connections to @raddr.
+  static ConnPool *Create(netaddr raddr) { return Create(raddr, Options()); }
+  static ConnPool *Create(netaddr raddr, Options opts);
+  ~ConnPool();
+
+  // Borrows a connection, reusing an idle one from the running kthread's free
+  // list or dialing a new one with affinity to it. Returns an empty Conn if
+  // dialing fails.
+  Conn Get();
+
+  // Closes idle connections older than the idle timeout on every kthread.
+  // This also runs periodically in the background.
+  void Reap();
+
+  // The default health check. It costs no round trip: a connection is usable
+  // if the peer hasn't closed it and it has no unread bytes (which would mean
+  // the stream is out of sync with the protocol).
+  static bool CheckConn(TcpConn *c);
+
+ private:
+  explicit ConnPool(std::shared_ptr<State> st) : st_(std::move(st)) {}
+
+  // disable move and copy.
+  ConnPool(const ConnPool &) = delete;
+  ConnPool &operator=(const ConnPool &) = delete;
+
+  // shared with the background reaper
+  std::shared_ptr<State> st_;
+};
+
+// Multiplexes request/response exchanges from many threads over one
+// connection.
+//
+// Requests are written back-to-back without waiting for earlier responses, and
+// responses are matched to requests in order, so the protocol must answer in
+// order (e.g., memcached, redis, or HTTP/1.1). There is no reader thread.
+// Instead, a waiting caller reads responses, both its own and those of the
+// callers ahead of it. An uncontended Call() therefore completes on the
+// calling thread with no wakeups, and under load one caller reads many
+// responses in a row.
+class PipelinedConn {
+ public:
+  // Reads one response into @rsp. Returns a positive value if successful, or
+  // 0 or a negative error if the stream failed.
+  using ResponseReader = std::function<ssize_t(TcpConn *c, void *rsp)>;
+
+  PipelinedConn(std::unique_ptr<TcpConn> c, ResponseReader read_rsp)
+      : c_(std::move(c)),
+        read_rsp_(std::move(read_rsp)),
+        head_(nullptr),
+        tail_(nullptr),
+        reading_(false),
+        err_(0) {}
+  ~PipelinedConn() { assert(head_ == nullptr); }
+
+  // Sends a request and waits until its response is read into @rsp. Returns 0
+  // if successful, otherwise a negative error. After an error, the connection
+  // fails all further calls.
+  int Call(const iovec *iov, int iovcnt, void *rsp);
+  int Call(const void *req, size_t len, void *rsp) {
+    iovec iov = {const_cast<void *>(req), len};
+    return Call(&iov, 1, rsp);
+  }
+
+  // Returns the error that broke the connection, or 0 if it is still usable.
+  int Error() {
+    SpinGuard g(&lock_);
+    return err_;
+  }
+
+ private:
+  struct Pending;
+
+  // disable move and copy.
+  PipelinedConn(const PipelinedConn &) = delete;
+  PipelinedConn &operator=(const PipelinedConn &) = delete;
+
+  void ReadResponses(Pending *p);
+
+  std::unique_ptr<TcpConn> c_;
+  ResponseReader read_rsp_;
+  // serializes writes so requests go out in queue order
+  Mutex write_mu_;
+  // protects everything below
+  Spin lock_;
+  Pending *head_, *tail_;
+  bool reading_;
+  int err_;
+};
+
+}  // namespace rt
@@ -0,0 +1,444 @@
+// coro.h - support for C++20 coroutines
+//
+// A coroutine that waits keeps only its frame (a small heap allocation), not
+// a uthread stack. When the event it waits for fires, a new uthread is
+// spawned on the waking kthread's runqueue to resume it, and that uthread
+// exits (returning its stack to the cache) as soon as the coroutine waits
+// again or finishes. This lets one uthread fan out to many pending I/Os.
+//
+//   rt::Task<ssize_t> Echo(rt::AsyncTcpConn *c) {
+//     char buf[64];
+//     ssize_t n = co_await c->Read(buf, sizeof(buf));
+//     if (n <= 0) co_return n;
+//     co_return co_await c->WriteFull(buf, n);
+//   }
+
+#pragma once
+
+extern "C" {
+#include <base/assert.h>
+#include <base/lock.h>
+#include <base/time.h>
+#include <runtime/poll.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+}
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "net.h"
+#include "sync.h"
+
+namespace rt {
+namespace coro_internal {
+
+inline void ResumeTrampoline(void *arg) {
+  std::coroutine_handle<>::from_address(arg).resume();
+}
+
+// Resumes a suspended coroutine on a new uthread on this kthread's runqueue.
+// Safe to call from softirqs and with spin locks held.
+inline void Resume(std::coroutine_handle<> h) {
+  if (unlikely(thread_spawn(ResumeTrampoline, h.address()))) BUG();
+}
+
+inline void ResumeCallback(unsigned long arg) {
+  Resume(std::coroutine_handle<>::from_address(reinterpret_cast<void *>(arg)));
+}
+
+// A level-triggered readiness flag that at most one coroutine waits on.
+class Event {
+ public:
+  Event() { spin_lock_init(&lock_); }
+
+  // Forgets earlier signals. Call before checking the condition.
+  void Clear() {
+    spin_lock_np(&lock_);
+    ready_ = false;
+    spin_unlock_np(&lock_);
+  }
+
+  // Sets the flag and resumes the waiter, if any.
+  void Signal() {
+    spin_lock_np(&lock_);
+    ready_ = true;
+    std::coroutine_handle<> h = std::exchange(waiter_, nullptr);
+    spin_unlock_np(&lock_);
+    if (h) Resume(h);
+  }
+
+  // Waits for a Signal() since the last Clear().
+  auto operator co_await() {
+    struct Awaiter {
+      Event *e;
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> h) {
+        spin_lock_np(&e->lock_);
+        if (e->ready_) {
+          spin_unlock_np(&e->lock_);
+          return false;
+        }
+        e->waiter_ = h;
+        spin_unlock_np(&e->lock_);
+        return true;
+      }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{this};
+  }
+
+ private:
+  spinlock_t lock_;
+  bool ready_ = false;
+  std::coroutine_handle<> waiter_;
+
+  Event(const Event &) = delete;
+  Event &operator=(const Event &) = delete;
+};
+
+template <typename T>
+struct TaskResult {
+  std::optional<T> value;
+  template <typename U>
+  void return_value(U &&v) {
+    value.emplace(std::forward<U>(v));
+  }
+  T take() { return std::move(*value); }
+};
+
+template <>
+struct TaskResult<void> {
+  void return_void() {}
+  void take() {}
+};
+
+}  // namespace coro_internal
+
+// A lazily started coroutine that produces a T. Start it by co_await-ing it
+// from another coroutine, or with Run() or BlockOn() from a uthread.
+template <typename T = void>
+class [[nodiscard]] Task {
+ public:
+  struct promise_type : coro_internal::TaskResult<T> {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept {
+      struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<promise_type> h) noexcept {
+          // continue the awaiting coroutine on this same uthread
+          return h.promise().continuation;
+        }
+        void await_resume() const noexcept {}
+      };
+      return FinalAwaiter{};
+    }
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+  Task(Task &&t) noexcept : h_(std::exchange(t.h_, nullptr)) {}
+  Task &operator=(Task &&t) noexcept {
+    if (h_) h_.destroy();
+    h_ = std::exchange(t.h_, nullptr);
+    return *this;
+  }
+  ~Task() {
+    if (h_) h_.destroy();
+  }
+
+  auto operator co_await() && noexcept {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> h;
+      bool await_ready() const noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) {
+        h.promise().continuation = cont;
+        return h;
+      }
+      T await_resume() {
+        if (h.promise().exception)
+          std::rethrow_exception(h.promise().exception);
+        return h.promise().take();
+      }
+    };
+    return Awaiter{h_};
+  }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+  std::coroutine_handle<promise_type> h_;
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+};
+
+namespace coro_internal {
+
+// An eagerly started coroutine that frees itself when it finishes.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+inline Detached RunDetached(Task<void> t) { co_await std::move(t); }
+
+// Parks a uthread until a coroutine finishes.
+struct Completion {
+  Completion() { spin_lock_init(&lock); }
+
+  void Done() {
+    spin_lock_np(&lock);
+    done = true;
+    thread_t *th = std::exchange(waiter, nullptr);
+    spin_unlock_np(&lock);
+    if (th) thread_ready(th);
+  }
+
+  void Wait() {
+    spin_lock_np(&lock);
+    if (done) {
+      spin_unlock_np(&lock);
+      return;
+    }
+    waiter = thread_self();
+    thread_park_and_unlock_np(&lock);
+  }
+
+  spinlock_t lock;
+  bool done = false;
+  thread_t *waiter = nullptr;
+};
+
+template <typename T>
+Detached RunAndSignal(Task<T> t, std::optional<T> *out, Completion *c) {
+  out->emplace(co_await std::move(t));
+  c->Done();
+}
+
+inline Detached RunAndSignal(Task<void> t, std::optional<bool> *out,
+                             Completion *c) {
+  co_await std::move(t);
+  out->emplace(true);
+  c->Done();
+}
+
+// Counts down finished tasks, waking one coroutine at zero.
+struct Latch {
+  explicit Latch(size_t n) : remaining(n) {
+    if (n == 0) done.Signal();
+  }
+
+  void CountDown() {
+    if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) done.Signal();
+  }
+
+  std::atomic<size_t> remaining;
+  Event done;
+};
+
+template <typename T>
+Detached RunAndCount(Task<T> t, std::optional<T> *out, Latch *l) {
+  out->emplace(co_await std::move(t));
+  l->CountDown();
+}
+
+inline Detached RunAndCount(Task<void> t, Latch *l) {
+  co_await std::move(t);
+  l->CountDown();
+}
+
+}  // namespace coro_internal
+
+// Runs several tasks concurrently and returns their results in order. Each
+// runs on the calling uthread until it first waits.
+template <typename T>
+Task<std::vector<T>> WhenAll(std::vector<Task<T>> tasks) {
+  coro_internal::Latch latch(tasks.size());
+  std::vector<std::optional<T>> results(tasks.size());
+  for (size_t i = 0; i < tasks.size(); ++i)
+    coro_internal::RunAndCount(std::move(tasks[i]), &results[i], &latch);
+  co_await latch.done;
+
+  std::vector<T> out;
+  out.reserve(results.size());
+  for (auto &r : results) out.push_back(std::move(*r));
+  co_return out;
+}
+
+// Runs several tasks concurrently and waits for all of them.
+inline Task<void> WhenAll(std::vector<Task<void>> tasks) {
+  coro_internal::Latch latch(tasks.size());
+  for (auto &t : tasks) coro_internal::RunAndCount(std::move(t), &latch);
+  co_await latch.done;
+}
+
+// Starts a task without waiting for it. It runs on the calling uthread until
+// it first waits, and its frame is freed when it finishes.
+inline void Run(Task<void> t) { coro_internal::RunDetached(std::move(t)); }
+
+// Runs a task and parks the calling uthread until it finishes.
+template <typename T>
+T BlockOn(Task<T> t) {
+  coro_internal::Completion c;
+  if constexpr (std::is_void_v<T>) {
+    std::optional<bool> done;
+    coro_internal::RunAndSignal(std::move(t), &done, &c);
+    c.Wait();
+  } else {
+    std::optional<T> out;
+    coro_internal::RunAndSignal(std::move(t), &out, &c);
+    c.Wait();
+    return std::move(*out);
+  }
+}
+
+// Suspends the calling coroutine until a microsecond deadline.
+inline auto SleepUntilAsync(uint64_t deadline_us) {
+  struct Awaiter {
+    uint64_t deadline_us;
+    timer_entry e;
+    bool await_ready() const { return microtime() >= deadline_us; }
+    void await_suspend(std::coroutine_handle<> h) {
+      timer_init(&e, coro_internal::ResumeCallback,
+                 reinterpret_cast<unsigned long>(h.address()));
+      timer_start(&e, deadline_us);
+    }
+    void await_resume() const noexcept {}
+  };
+  return Awaiter{deadline_us, {}};
+}
+
+// Suspends the calling coroutine for a microsecond duration.
+inline auto SleepAsync(uint64_t duration_us) {
+  return SleepUntilAsync(microtime() + duration_us);
+}
+
+// Suspends the calling coroutine until it holds @m. Release it with
+// m->Unlock() as usual.
+inline auto LockAsync(Mutex *m) {
+  struct Awaiter {
+    mutex_t *m;
+    mutex_waiter w;
+    // a coroutine can move between uthreads, so mutex_lock_async() records a
+    // placeholder owner that spinning waiters don't wait on
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+      return !mutex_lock_async(m, &w, coro_internal::ResumeCallback,
+                               reinterpret_cast<unsigned long>(h.address()));
+    }
+    void await_resume() const noexcept {}
+  };
+  return Awaiter{&m->mu_, {}};
+}
+
+// A TCP or UDP connection with reads and writes that coroutines can await.
+// At most one coroutine may read and one may write at a time.
+template <typename Conn>
+class AsyncConn {
+ public:
+  // Takes ownership of @c, switching it to nonblocking mode.
+  explicit AsyncConn(Conn *c) : c_(c) {
+    poll_init_cb(&w_, &AsyncConn::OnEvents);
+    c_->SetNonblocking(true);
+    BUG_ON(c_->PollAdd(&w_, POLLEV_IN | POLLEV_OUT | POLLEV_HUP,
+                       reinterpret_cast<unsigned long>(this)));
+  }
+  ~AsyncConn() { c_->PollDel(); }
+
+  // Gets the underlying connection.
+  Conn *get() { return c_.get(); }
+
+  // Reads up to @len bytes (or one datagram).
+  Task<ssize_t> Read(void *buf, size_t len) {
+    return Retry(&in_, [=, this] { return c_->Read(buf, len); });
+  }
+
+  // Writes up to @len bytes (or one datagram).
+  Task<ssize_t> Write(const void *buf, size_t len) {
+    return Retry(&out_, [=, this] { return c_->Write(buf, len); });
+  }
+
+  // Reads a datagram and gets its source address (UDP only).
+  Task<ssize_t> ReadFrom(void *buf, size_t len, netaddr *raddr) {
+    return Retry(&in_, [=, this] { return c_->ReadFrom(buf, len, raddr); });
+  }
+
+  // Writes a datagram to a remote address (UDP only).
+  Task<ssize_t> WriteTo(const void *buf, size_t len, const netaddr *raddr) {
+    return Retry(&out_, [=, this] { return c_->WriteTo(buf, len, raddr); });
+  }
+
+  // Reads exactly @len bytes from a stream.
+  Task<ssize_t> ReadFull(void *buf, size_t len) {
+    char *pos = reinterpret_cast<char *>(buf);
+    size_t n = 0;
+    while (n < len) {
+      ssize_t ret = co_await Read(pos + n, len - n);
+      if (ret <= 0) co_return ret;
+      n += ret;
+    }
+    co_return n;
+  }
+
+  // Writes exactly @len bytes to a stream.
+  Task<ssize_t> WriteFull(const void *buf, size_t len) {
+    const char *pos = reinterpret_cast<const char *>(buf);
+    size_t n = 0;
+    while (n < len) {
+      ssize_t ret = co_await Write(pos + n, len - n);
+      if (ret < 0) co_return ret;
+      n += ret;
+    }
+    co_return n;
+  }
+
+ private:
+  static void OnEvents(unsigned long data, unsigned int events) {
+    auto *ac = reinterpret_cast<AsyncConn *>(data);
+    if (events & (POLLEV_IN | POLLEV_HUP)) ac->in_.Signal();
+    if (events & (POLLEV_OUT | POLLEV_HUP)) ac->out_.Signal();
+  }
+
+  // Retries @op until it no longer fails with -EAGAIN.
+  template <typename Op>
+  static Task<ssize_t> Retry(coro_internal::Event *e, Op op) {
+    while (true) {
+      e->Clear();
+      ssize_t ret = op();
+      if (ret != -EAGAIN) co_return ret;
+      co_await *e;
+    }
+  }
+
+  std::unique_ptr<Conn> c_;
+  poll_waiter_t w_;
+  coro_internal::Event in_;
+  coro_internal::Event out_;
+
+  AsyncConn(const AsyncConn &) = delete;
+  AsyncConn &operator=(const AsyncConn &) = delete;
+};
+
+using AsyncTcpConn = AsyncConn<TcpConn>;
+using AsyncUdpConn = AsyncConn<UdpConn>;
+
+}  // namespace rt
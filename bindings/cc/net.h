@@ -24,6 +24,8 @@ class UdpConn : public NetConn {
 
   // The maximum possible payload size (with the maximum MTU).
   static constexpr size_t kMaxPayloadSize = UDP_MAX_PAYLOAD;
+  // The most datagrams WriteBatch() sends per call.
+  static constexpr int kMaxBatch = UDP_BATCH_MAX;
 
   // Creates a UDP connection between a local and remote address.
   static UdpConn *Dial(netaddr laddr, netaddr raddr) {
@@ -66,12 +68,33 @@ class UdpConn : public NetConn {
     return udp_write_to(c_, buf, len, raddr);
   }
 
+  // Reads up to @nr datagrams, waiting until at least one is available. Each
+  // message's len is set to the bytes read and raddr to the sender.
+  ssize_t ReadBatch(udp_msg *msgs, int nr) {
+    return udp_read_batch(c_, msgs, nr);
+  }
+
+  // Writes up to @nr datagrams (at most kMaxBatch per call). Returns how many
+  // were sent.
+  ssize_t WriteBatch(const udp_msg *msgs, int nr) {
+    return udp_write_batch(c_, msgs, nr);
+  }
+
   // Reads a datagram.
   ssize_t Read(void *buf, size_t len) { return udp_read(c_, buf, len); }
 
   // Writes a datagram.
   ssize_t Write(const void *buf, size_t len) { return udp_write(c_, buf, len); }
 
+  // Makes reads and writes fail with -EAGAIN instead of blocking.
+  void SetNonblocking(bool nonblocking) { udp_set_nonblocking(c_, nonblocking); }
+  // Registers for edge-triggered readiness events (POLLEV_*) on a poller.
+  int PollAdd(poll_waiter_t *w, unsigned int events, unsigned long data) {
+    return udp_poll_add(c_, w, events, data);
+  }
+  // Unregisters from the poller.
+  void PollDel() { udp_poll_del(c_); }
+
   // Shutdown the socket (no more receives).
   void Shutdown() { udp_shutdown(c_); }
 
@@ -120,6 +143,15 @@ class TcpConn : public NetConn {
   netaddr LocalAddr() const { return tcp_local_addr(c_); }
   // Gets the remote TCP address.
   netaddr RemoteAddr() const { return tcp_remote_addr(c_); }
+  // Gets the round-trip time, retransmission, and congestion control
+  // statistics.
+  tcp_stats Stats() const {
+    tcp_stats stats;
+    tcp_get_stats(c_, &stats);
+    return stats;
+  }
+  // Selects the congestion control algorithm ("reno", "cubic", or "dctcp").
+  int SetCongestionControl(const char *name) { return tcp_set_cc(c_, name); }
 
   // Reads from the TCP stream.
   ssize_t Read(void *buf, size_t len) { return tcp_read(c_, buf, len); };
@@ -133,6 +165,23 @@ class TcpConn : public NetConn {
   ssize_t Writev(const iovec *iov, int iovcnt) {
     return tcp_writev(c_, iov, iovcnt);
   }
+  // Borrows up to @iovcnt received segments in place instead of copying them.
+  // Returns the number of segments, or 0 at the end of the stream. The views
+  // stay valid until their bytes are handed back with ReleaseZeroCopy().
+  ssize_t ReadZeroCopy(iovec *iov, int iovcnt) {
+    return tcp_read_zc(c_, iov, iovcnt);
+  }
+  // Hands back the oldest @len borrowed bytes and reopens the receive window.
+  void ReleaseZeroCopy(size_t len) { tcp_read_zc_release(c_, len); }
+  // Sends from a buffer allocated with ZeroCopyAlloc() without copying it.
+  // @done(@arg) runs once the bytes written are acknowledged; don't touch the
+  // buffer until then.
+  ssize_t WriteZeroCopy(const void *buf, size_t len, void (*done)(void *arg),
+                        void *arg) {
+    return tcp_write_zc(c_, buf, len, done, arg);
+  }
+  // Allocates a buffer for WriteZeroCopy(). It is never freed.
+  static void *ZeroCopyAlloc(size_t len) { return tcp_zc_alloc(len); }
 
   // Reads exactly @len bytes from the TCP stream.
   ssize_t ReadFull(void *buf, size_t len) {
@@ -177,6 +226,15 @@ class TcpConn : public NetConn {
     return WritevFullRaw(iov, iovcnt);
   }
 
+  // Makes reads and writes fail with -EAGAIN instead of blocking.
+  void SetNonblocking(bool nonblocking) { tcp_set_nonblocking(c_, nonblocking); }
+  // Registers for edge-triggered readiness events (POLLEV_*) on a poller.
+  int PollAdd(poll_waiter_t *w, unsigned int events, unsigned long data) {
+    return tcp_poll_add(c_, w, events, data);
+  }
+  // Unregisters from the poller.
+  void PollDel() { tcp_poll_del(c_); }
+
   // Gracefully shutdown the TCP connection.
   int Shutdown(int how) { return tcp_shutdown(c_, how); }
   // Ungracefully force the TCP connection to shutdown.
@@ -154,6 +154,7 @@ class Spin {
 // Pthread-like mutex support.
 class Mutex {
   friend class CondVar;
+  friend auto LockAsync(Mutex *m);
 
  public:
   Mutex() { mutex_init(&mu_); }
@@ -179,7 +180,33 @@ class Mutex {
   Mutex& operator=(const Mutex&) = delete;
 };
 
-// RAII lock support (works with Spin, Preempt, and Mutex).
+// Reader-writer lock for read-mostly data, where readers scale across cores
+// but writers are slow.
+class BigReaderLock {
+ public:
+  BigReaderLock() { BUG_ON(brlock_init(&l_)); }
+  ~BigReaderLock() { brlock_destroy(&l_); }
+
+  // Locks for writing (exclusive).
+  void Lock() { brlock_wrlock(&l_); }
+
+  // Unlocks for writing.
+  void Unlock() { brlock_wrunlock(&l_); }
+
+  // Locks for reading (shared).
+  void RLock() { brlock_rdlock(&l_); }
+
+  // Unlocks for reading.
+  void RUnlock() { brlock_rdunlock(&l_); }
+
+ private:
+  brlock_t l_;
+
+  BigReaderLock(const BigReaderLock&) = delete;
+  BigReaderLock& operator=(const BigReaderLock&) = delete;
+};
+
+// RAII lock support (works with Spin, Preempt, Mutex, and BigReaderLock).
 template <typename L>
 class ScopedLock {
  public:
@@ -210,6 +237,23 @@ class ScopedLock {
 using SpinGuard = ScopedLock<Spin>;
 using MutexGuard = ScopedLock<Mutex>;
 using PreemptGuard = ScopedLock<Preempt>;
+using BigReaderWriteGuard = ScopedLock<BigReaderLock>;
+
+// RAII shared lock support (works with BigReaderLock).
+template <typename L>
+class ScopedReadLock {
+ public:
+  explicit ScopedReadLock(L *lock) : lock_(lock) { lock_->RLock(); }
+  ~ScopedReadLock() { lock_->RUnlock(); }
+
+ private:
+  L *const lock_;
+
+  ScopedReadLock(const ScopedReadLock&) = delete;
+  ScopedReadLock& operator=(const ScopedReadLock&) = delete;
+};
+
+using BigReaderReadGuard = ScopedReadLock<BigReaderLock>;
 
 // RAII lock and park support (works with both Spin and Preempt).
 template <typename L>
@@ -1,22 +1,346 @@
 extern "C" {
 #include <base/log.h>
 #include <base/stddef.h>
+#include <runtime/net.h>
 }
 
+#include <cstring>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "connpool.h"
+#include "coro.h"
+#include "net.h"
 #include "runtime.h"
+#include "sync.h"
 #include "thread.h"
 #include "timer.h"
 
 namespace {
 
 constexpr int kTestValue = 10;
+constexpr int kCoroutines = 1000;
+constexpr uint16_t kAsyncPort = 9000;
+// enough to fill the send and receive windows both ways
+constexpr size_t kAsyncBytes = 4 * 1024 * 1024;
+constexpr size_t kAsyncChunk = 16 * 1024;
+constexpr uint16_t kMsgPort = 9001;
+// the message server closes the connection instead of echoing this
+constexpr uint64_t kCloseMsg = ~0UL;
+constexpr int kPipelineCallers = 64;
+constexpr int kPipelineCalls = 1000;
+constexpr int kPoolRounds = 100;
+constexpr uint64_t kPoolIdleTimeout = 50 * rt::kMilliseconds;
+// long enough for a close to reach the other end over loopback
+constexpr uint64_t kSettle = 10 * rt::kMilliseconds;
 
 void foo(int arg) {
   if (arg != kTestValue) BUG();
 }
 
+rt::Task<int> Child(int i, rt::Mutex *m, int *counter) {
+  co_await rt::SleepAsync(100);
+  co_await rt::LockAsync(m);
+  (*counter)++;
+  m->Unlock();
+  co_return i;
+}
+
+rt::Task<int> FanOut() {
+  rt::Mutex m;
+  int counter = 0, sum = 0;
+  std::vector<rt::Task<int>> children;
+
+  for (int i = 0; i < kCoroutines; ++i)
+    children.push_back(Child(i, &m, &counter));
+  for (int v : co_await rt::WhenAll(std::move(children))) sum += v;
+  if (counter != kCoroutines) BUG();
+  co_return sum;
+}
+
+inline char Pattern(size_t off) { return static_cast<char>(off % 251); }
+
+rt::Task<void> AsyncEcho(rt::AsyncTcpConn *c) {
+  std::unique_ptr<char[]> buf(new char[kAsyncChunk]);
+  while (true) {
+    ssize_t n = co_await c->Read(buf.get(), kAsyncChunk);
+    if (n <= 0) co_return;
+    if (co_await c->WriteFull(buf.get(), n) != n) BUG();
+  }
+}
+
+rt::Task<void> AsyncSend(rt::AsyncTcpConn *c) {
+  std::unique_ptr<char[]> buf(new char[kAsyncChunk]);
+  for (size_t off = 0; off < kAsyncBytes; off += kAsyncChunk) {
+    for (size_t i = 0; i < kAsyncChunk; ++i) buf[i] = Pattern(off + i);
+    if (co_await c->WriteFull(buf.get(), kAsyncChunk) != kAsyncChunk) BUG();
+  }
+  if (c->get()->Shutdown(SHUT_WR)) BUG();
+}
+
+rt::Task<void> AsyncRecv(rt::AsyncTcpConn *c) {
+  std::unique_ptr<char[]> buf(new char[kAsyncChunk]);
+  size_t off = 0;
+  while (true) {
+    ssize_t n = co_await c->Read(buf.get(), kAsyncChunk);
+    if (n < 0) BUG();
+    if (n == 0) break;
+    for (ssize_t i = 0; i < n; ++i)
+      if (buf[i] != Pattern(off + i)) BUG();
+    off += n;
+  }
+  if (off != kAsyncBytes) BUG();
+}
+
+// Streams through an echo server over loopback with coroutines on both ends,
+// reading and writing concurrently so both directions back up and wait.
+void TestAsyncConn() {
+  std::unique_ptr<rt::TcpQueue> q(rt::TcpQueue::Listen({0, kAsyncPort}, 16));
+  if (!q) BUG();
+
+  rt::Thread server([&] {
+    rt::TcpConn *c = q->Accept();
+    if (!c) BUG();
+    rt::AsyncTcpConn ac(c);
+    rt::BlockOn(AsyncEcho(&ac));
+  });
+
+  rt::TcpConn *c = rt::TcpConn::Dial({0, 0}, {net_local_ip(), kAsyncPort});
+  if (!c) BUG();
+  rt::AsyncTcpConn ac(c);
+  std::vector<rt::Task<void>> tasks;
+  tasks.push_back(AsyncSend(&ac));
+  tasks.push_back(AsyncRecv(&ac));
+  rt::BlockOn(rt::WhenAll(std::move(tasks)));
+  server.Join();
+  log_info("echoed %zu bytes through an AsyncTcpConn", kAsyncBytes);
+}
+
+// Echoes 8-byte messages in order on every connection, counting connections.
+struct MsgServer {
+  std::unique_ptr<rt::TcpQueue> q;
+  rt::WaitGroup workers;
+  rt::Spin lock;
+  int accepted = 0;
+  int closed = 0;
+
+  int Closed() {
+    rt::SpinGuard g(&lock);
+    return closed;
+  }
+};
+
+void ServeMsgs(MsgServer *s, rt::TcpConn *c) {
+  uint64_t msg;
+  while (c->ReadFull(&msg, sizeof(msg)) == sizeof(msg)) {
+    if (msg == kCloseMsg) break;
+    if (c->WriteFull(&msg, sizeof(msg)) != sizeof(msg)) break;
+  }
+  delete c;
+  {
+    rt::SpinGuard g(&s->lock);
+    s->closed++;
+  }
+  s->workers.Done();
+}
+
+void AcceptMsgs(MsgServer *s) {
+  while (rt::TcpConn *c = s->q->Accept()) {
+    {
+      rt::SpinGuard g(&s->lock);
+      s->accepted++;
+    }
+    s->workers.Add(1);
+    rt::Spawn([s, c] { ServeMsgs(s, c); });
+  }
+}
+
+inline uint64_t MakeMsg(int caller, int i) {
+  return static_cast<uint64_t>(caller) << 32 | i;
+}
+
+struct MsgResponse {
+  uint64_t msg;
+  // the caller that read this response off the connection
+  thread_t *reader;
+};
+
+ssize_t ReadMsgResponse(rt::TcpConn *c, void *rsp) {
+  auto *r = static_cast<MsgResponse *>(rsp);
+  ssize_t ret = c->ReadFull(&r->msg, sizeof(r->msg));
+  if (ret > 0) r->reader = thread_self();
+  return ret;
+}
+
+rt::PipelinedConn *DialPipelined() {
+  std::unique_ptr<rt::TcpConn> c(
+      rt::TcpConn::Dial({0, 0}, {net_local_ip(), kMsgPort}));
+  if (!c) BUG();
+  return new rt::PipelinedConn(std::move(c), ReadMsgResponse);
+}
+
+// Many callers share one connection. Each response must reach its own caller,
+// and under load many are read by another caller holding the reader role.
+void TestPipelinedCalls() {
+  std::unique_ptr<rt::PipelinedConn> pc(DialPipelined());
+  std::vector<rt::Thread> callers;
+  rt::Spin lock;
+  int handoffs = 0;
+
+  for (int t = 0; t < kPipelineCallers; ++t) {
+    callers.emplace_back([&, t] {
+      int n = 0;
+      for (int i = 0; i < kPipelineCalls; ++i) {
+        uint64_t msg = MakeMsg(t, i);
+        MsgResponse rsp;
+        if (pc->Call(&msg, sizeof(msg), &rsp)) BUG();
+        if (rsp.msg != msg) BUG();
+        if (rsp.reader != thread_self()) n++;
+      }
+      rt::SpinGuard g(&lock);
+      handoffs += n;
+    });
+  }
+  for (auto &th : callers) th.Join();
+
+  if (pc->Error()) BUG();
+  if (handoffs == 0) BUG();
+  log_info("%d pipelined calls, %d read by another caller",
+           kPipelineCallers * kPipelineCalls, handoffs);
+}
+
+// The server drops the connection partway through. Every caller, including
+// those queued behind the failed read, must get an error instead of hanging,
+// and the connection must stay failed.
+void TestPipelinedError() {
+  std::unique_ptr<rt::PipelinedConn> pc(DialPipelined());
+  std::vector<rt::Thread> callers;
+
+  for (int t = 0; t < kPipelineCallers; ++t) {
+    callers.emplace_back([&, t] {
+      for (int i = 0;; ++i) {
+        bool close = t == 0 && i == kPipelineCalls / 10;
+        uint64_t msg = close ? kCloseMsg : MakeMsg(t, i);
+        MsgResponse rsp;
+        int ret = pc->Call(&msg, sizeof(msg), &rsp);
+        if (ret > 0) BUG();
+        if (ret < 0) break;
+        if (close || rsp.msg != msg) BUG();
+      }
+    });
+  }
+  for (auto &th : callers) th.Join();
+
+  int err = pc->Error();
+  if (err >= 0) BUG();
+  uint64_t msg = MakeMsg(0, 0);
+  MsgResponse rsp;
+  if (pc->Call(&msg, sizeof(msg), &rsp) != err) BUG();
+  log_info("pipelined connection failed with %d", err);
+}
+
+bool PoolEcho(rt::TcpConn *c, uint64_t msg) {
+  uint64_t rsp;
+  return c->WriteFull(&msg, sizeof(msg)) == sizeof(msg) &&
+         c->ReadFull(&rsp, sizeof(rsp)) == sizeof(rsp) && rsp == msg;
+}
+
+// Connections are reused, dead ones are caught by the health check before
+// reuse, and idle ones are closed after the timeout.
+void TestConnPool(MsgServer *s) {
+  rt::Spin lock;
+  int failed_checks = 0;
+  rt::ConnPool::Options opts;
+  opts.idle_timeout_us = kPoolIdleTimeout;
+  opts.check_after_us = 0;
+  opts.health_check = [&](rt::TcpConn *c) {
+    bool ok = rt::ConnPool::CheckConn(c);
+    rt::SpinGuard g(&lock);
+    if (!ok) failed_checks++;
+    return ok;
+  };
+  std::unique_ptr<rt::ConnPool> pool(
+      rt::ConnPool::Create({net_local_ip(), kMsgPort}, std::move(opts)));
+  int accepted;
+  {
+    rt::SpinGuard g(&s->lock);
+    accepted = s->accepted;
+  }
+  // let the server finish closing connections from earlier tests
+  while (s->Closed() != accepted) rt::Sleep(kSettle);
+
+  // a connection that was just used isn't reaped
+  {
+    rt::ConnPool::Conn c = pool->Get();
+    if (!c || !PoolEcho(c.get(), MakeMsg(0, 0))) BUG();
+  }
+  int closed = s->Closed();
+  pool->Reap();
+  rt::Sleep(kSettle);
+  if (s->Closed() != closed) BUG();
+
+  // each kthread dials at most once, then reuses its connection
+  for (int i = 0; i < kPoolRounds; ++i) {
+    rt::ConnPool::Conn c = pool->Get();
+    if (!c || !PoolEcho(c.get(), MakeMsg(0, i))) BUG();
+  }
+  int dialed;
+  {
+    rt::SpinGuard g(&s->lock);
+    dialed = s->accepted - accepted;
+  }
+  if (dialed == 0 || dialed > static_cast<int>(rt::RuntimeMaxCores())) BUG();
+
+  // the server closes a connection that then goes back to the pool as if it
+  // were fine; it must never be handed out again
+  {
+    rt::ConnPool::Conn c = pool->Get();
+    if (!c) BUG();
+    uint64_t msg = kCloseMsg;
+    if (c->WriteFull(&msg, sizeof(msg)) != sizeof(msg)) BUG();
+    rt::Sleep(kSettle);
+  }
+  for (int i = 0; i < kPoolRounds; ++i) {
+    rt::ConnPool::Conn c = pool->Get();
+    if (!c || !PoolEcho(c.get(), MakeMsg(1, i))) BUG();
+    rt::SpinGuard g(&lock);
+    if (failed_checks) break;
+  }
+  {
+    rt::SpinGuard g(&lock);
+    if (failed_checks != 1) BUG();
+  }
+
+  // once idle past the timeout, every pooled connection is closed
+  rt::Sleep(kPoolIdleTimeout + kSettle);
+  pool->Reap();
+  rt::Sleep(kSettle);
+  {
+    rt::SpinGuard g(&s->lock);
+    if (s->closed != s->accepted) BUG();
+    dialed = s->accepted - accepted;
+  }
+  log_info("connection pool dialed %d connections", dialed);
+}
+
+// Exercises PipelinedConn and ConnPool against an in-order echo server over
+// loopback.
+void TestClientConns() {
+  MsgServer s;
+  s.q.reset(rt::TcpQueue::Listen({0, kMsgPort}, 4096));
+  if (!s.q) BUG();
+  rt::Thread acceptor([&] { AcceptMsgs(&s); });
+
+  TestPipelinedCalls();
+  TestPipelinedError();
+  TestConnPool(&s);
+
+  s.q->Shutdown();
+  acceptor.Join();
+  s.workers.Wait();
+}
+
 void MainHandler() {
   std::string str = "captured!";
   int i = kTestValue;
@@ -43,6 +367,13 @@ void MainHandler() {
     foo(i);
   });
   th.Join();
+
+  int sum = rt::BlockOn(FanOut());
+  if (sum != kCoroutines * (kCoroutines - 1) / 2) BUG();
+  log_info("hello from %d coroutines!", kCoroutines);
+
+  TestAsyncConn();
+  TestClientConns();
 }
 
 }  // anonymous namespace
@@ -41,6 +41,12 @@ else
 FLAGS += -mssse3
 endif
 endif
+ifeq ($(CONFIG_FRAME_POINTERS),y)
+FLAGS += -fno-omit-frame-pointer
+endif
+ifeq ($(CONFIG_NET_EMULATION),y)
+FLAGS += -DNET_EMULATION
+endif
 ifeq ($(CONFIG_MLX5),y)
 FLAGS += -DMLX5
 else
@@ -62,7 +68,7 @@ FLAGS += -DDIRECTPATH
 endif
 
 CFLAGS = -std=gnu11 $(FLAGS)
-CXXFLAGS = -std=gnu++17 $(FLAGS)
+CXXFLAGS = -std=gnu++20 $(FLAGS)
 
 # handy for debugging
 print-%  : ; @echo $* = $($*) 
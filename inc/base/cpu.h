@@ -14,7 +14,9 @@ extern int numa_count; /* the number of NUMA nodes */
 struct cpu_info {
 	DEFINE_BITMAP(thread_siblings_mask, NCPU);
 	DEFINE_BITMAP(core_siblings_mask, NCPU);
+	DEFINE_BITMAP(llc_siblings_mask, NCPU);
 	int package;
+	int numa_node;
 };
 
 extern struct cpu_info cpu_info_tbl[NCPU];
@@ -19,9 +19,13 @@ struct rx_net_hdr {
 /* preamble to egress network packets */
 struct tx_net_hdr {
 	unsigned long completion_data; /* a tag to help complete the request */
+	unsigned long ext_payload; /* shmptr to more packet data (zero-copy) */
+	unsigned int ext_len;	/* the length of @ext_payload (or 0) */
+	unsigned int pad;
 	unsigned int len;	/* the length of the payload */
 	unsigned int olflags;	/* offload flags */
-	unsigned short pad;	/* because of 14 byte ethernet header */
+	unsigned short tso_segsz; /* MSS for OLFLAG_TCP_TSO (also pads the
+				     14 byte ethernet header) */
 	char	     payload[];	/* packet data */
 } __attribute__((__packed__));
 
@@ -51,6 +55,11 @@ enum {
 #define OLFLAG_TCP_CHKSUM	BIT(1)	/* enable TCP checksum generation */
 #define OLFLAG_IPV4		BIT(2)  /* indicates the packet is IPv4 */
 #define OLFLAG_IPV6		BIT(3)  /* indicates the packet is IPv6 */
+#define OLFLAG_TCP_TSO		BIT(4)	/* split the TCP payload into @tso_segsz
+					   segments (implies OLFLAG_TCP_CHKSUM) */
+
+/* the most segments a single OLFLAG_TCP_TSO packet may be split into */
+#define TXPKT_TSO_MAX_SEGS	64
 
 /*
  * RX queues: IOKERNEL -> RUNTIMES
@@ -35,6 +35,9 @@ struct mbuf {
 
 	unsigned short	network_off;	/* the offset of the network header */
 	unsigned short	transport_off;	/* the offset of the transport header */
+	unsigned short	tso_segsz;	/* TSO segment size (OLFLAG_TCP_TSO) */
+	unsigned char	*ext_data;	/* TX payload stored past the buffer */
+	unsigned int	ext_len;	/* the length of @ext_data */
 	unsigned long   release_data;	/* data for the release method */
 	void		(*release)(struct mbuf *m); /* frees the mbuf */
 
@@ -44,6 +47,8 @@ struct mbuf {
 	uint32_t	seg_seq;    /* the first seg number */
 	uint32_t	seg_end;    /* the last seg number (noninclusive) */
 	uint8_t		flags;	    /* which flags were set? */
+	bool		retransmitted; /* was the packet ever resent? */
+	bool		sacked;	    /* selectively acked by the receiver? */
 	atomic_t	ref;	    /* a reference count for the mbuf */
 };
 
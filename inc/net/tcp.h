@@ -52,6 +52,10 @@ struct tcp_hdr {
 #define TCP_OPT_NOP	1 /* used for padding */
 #define TCP_OPT_MSS	2 /* maximum segment size negotiation */
 #define TCP_OPT_WSCALE	3 /* window scaling factor */
+#define TCP_OPT_SACK_PERM 4 /* selective acknowledgements permitted */
+#define TCP_OPT_SACK	5 /* selective acknowledgement blocks */
 
 #define TCP_OLEN_MSS	4
 #define TCP_OLEN_WSCALE	3
+#define TCP_OLEN_SACK_PERM 2
+#define TCP_OLEN_SACK_BLOCK 8
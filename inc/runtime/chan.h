@@ -0,0 +1,63 @@
+/*
+ * chan.h - support for channels (message passing between uthreads)
+ *
+ * Channels carry fixed-size values by copy. Bounded channels use a lock-free
+ * ring, so sends and receives that don't need to block never take a lock.
+ * Unbuffered channels (a capacity of zero) make each sender wait for a
+ * receiver, and unbounded channels never make senders wait. When a receiver
+ * is already parked, a sender copies its value straight into the receiver and
+ * makes it the next uthread to run on the sender's kthread.
+ */
+
+#pragma once
+
+#include <limits.h>
+
+#include <base/stddef.h>
+#include <base/list.h>
+#include <base/lock.h>
+
+/* a capacity for channels that never block senders */
+#define CHAN_UNBOUNDED		UINT_MAX
+/* the maximum number of cases in one chan_select() */
+#define CHAN_SELECT_MAX		64
+
+struct chan {
+	/* the producer and consumer positions, on separate cache lines */
+	uint64_t		tail __aligned(CACHE_LINE_SIZE);
+	uint64_t		head __aligned(CACHE_LINE_SIZE);
+
+	/* read-mostly state */
+	unsigned char		*slots __aligned(CACHE_LINE_SIZE);
+	size_t			elem_size;
+	size_t			stride;	/* the size of a slot */
+	uint64_t		mask;	/* the number of slots minus one */
+	unsigned int		cap;
+	bool			closed;
+
+	/* slow path state */
+	atomic_t		recv_waiters;
+	atomic_t		send_waiters;
+	spinlock_t		lock;
+	struct list_head	recvq;
+	struct list_head	sendq;
+};
+
+typedef struct chan chan_t;
+
+/* one operation of a chan_select() */
+struct chan_case {
+	chan_t			*c;
+	void			*buf;	/* the value to send or to receive into */
+	bool			send;
+	int			ret;	/* set when the case is chosen */
+};
+
+extern int chan_init(chan_t *c, size_t elem_size, unsigned int cap);
+extern void chan_destroy(chan_t *c);
+extern int chan_send(chan_t *c, const void *src);
+extern int chan_recv(chan_t *c, void *dst);
+extern int chan_try_send(chan_t *c, const void *src);
+extern int chan_try_recv(chan_t *c, void *dst);
+extern void chan_close(chan_t *c);
+extern int chan_select(struct chan_case *cases, int n, int64_t timeout_us);
@@ -12,3 +12,4 @@ struct netaddr {
 };
 
 extern int str_to_netaddr(const char *str, struct netaddr *addr);
+extern uint32_t net_local_ip(void);
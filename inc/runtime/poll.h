@@ -9,28 +9,48 @@
 #include <runtime/thread.h>
 #include <runtime/sync.h>
 
+/* readiness events (edge-triggered, reported once per change) */
+#define POLLEV_IN	BIT(0) /* data can be read */
+#define POLLEV_OUT	BIT(1) /* data can be written */
+#define POLLEV_HUP	BIT(2) /* the peer closed or an error occurred */
+
+/* a callback for events, instead of waiting (see poll_init_cb()) */
+typedef void (*poll_cb_t)(unsigned long data, unsigned int events);
+
 typedef struct poll_waiter {
 	spinlock_t		lock;
 	struct list_head	triggered;
 	thread_t		*waiting_th;
+	poll_cb_t		cb;
 } poll_waiter_t;
 
 typedef struct poll_trigger {
 	struct list_node	link;
 	struct poll_waiter	*waiter;
 	bool			triggered;
+	unsigned int		mask;	/* the events of interest */
+	unsigned int		events;	/* events fired since the last wait */
 	unsigned long		data;
 } poll_trigger_t;
 
+/* an event returned by poll_wait_batch() */
+struct poll_event {
+	unsigned long		data;
+	unsigned int		events;
+};
+
 
 /*
  * Waiter API
  */
 
 extern void poll_init(poll_waiter_t *w);
-extern void poll_arm(poll_waiter_t *w, poll_trigger_t *t, unsigned long data);
+extern void poll_init_cb(poll_waiter_t *w, poll_cb_t cb);
+extern void poll_arm(poll_waiter_t *w, poll_trigger_t *t, unsigned int mask,
+		     unsigned long data);
 extern void poll_disarm(poll_trigger_t *t);
 extern unsigned long poll_wait(poll_waiter_t *w);
+extern int poll_wait_batch(poll_waiter_t *w, struct poll_event *evs, int n);
 
 
 /*
@@ -45,6 +65,9 @@ static inline void poll_trigger_init(poll_trigger_t *t)
 {
 	t->waiter = NULL;
 	t->triggered = false;
+	t->mask = 0;
+	t->events = 0;
 }
 
-extern void poll_trigger(poll_waiter_t *w, poll_trigger_t *t);
+extern void poll_trigger(poll_waiter_t *w, poll_trigger_t *t,
+			 unsigned int events);
@@ -19,13 +19,26 @@ struct mutex {
 	atomic_t		held;
 	spinlock_t		waiter_lock;
 	struct list_head	waiters;
+	thread_t		*owner;		/* a hint for spinning waiters */
+	unsigned int		spin_cycles;	/* the learned spin budget */
 };
 
 typedef struct mutex mutex_t;
 
+/* a waiter that gets a callback instead of parking (see mutex_lock_async()) */
+struct mutex_waiter {
+	struct list_node	link;
+	thread_t		*th;
+	void			(*fn)(unsigned long arg);
+	unsigned long		arg;
+};
+
 extern void __mutex_lock(mutex_t *m);
 extern void __mutex_unlock(mutex_t *m);
+extern bool mutex_lock_async(mutex_t *m, struct mutex_waiter *w,
+			     void (*fn)(unsigned long arg), unsigned long arg);
 extern void mutex_init(mutex_t *m);
+extern void mutex_profile_dump(void);
 
 /**
  * mutex_try_lock - attempts to acquire a mutex
@@ -35,7 +48,11 @@ extern void mutex_init(mutex_t *m);
  */
 static inline bool mutex_try_lock(mutex_t *m)
 {
-	return atomic_cmpxchg(&m->held, 0, 1);
+	if (!atomic_cmpxchg(&m->held, 0, 1))
+		return false;
+
+	m->owner = thread_self();
+	return true;
 }
 
 /**
@@ -44,8 +61,10 @@ static inline bool mutex_try_lock(mutex_t *m)
  */
 static inline void mutex_lock(mutex_t *m)
 {
-	if (likely(atomic_cmpxchg(&m->held, 0, 1)))
+	if (likely(atomic_cmpxchg(&m->held, 0, 1))) {
+		m->owner = thread_self();
 		return;
+	}
 
 	__mutex_lock(m);
 }
@@ -56,6 +75,7 @@ static inline void mutex_lock(mutex_t *m)
  */
 static inline void mutex_unlock(mutex_t *m)
 {
+	m->owner = NULL;
 	if (likely(atomic_cmpxchg(&m->held, 1, 0)))
 		return;
 
@@ -201,3 +221,60 @@ extern void rwmutex_wrlock(rwmutex_t *m);
 extern bool rwmutex_try_rdlock(rwmutex_t *m);
 extern bool rwmutex_try_wrlock(rwmutex_t *m);
 extern void rwmutex_unlock(rwmutex_t *m);
+
+
+/*
+ * Big-reader lock support
+ *
+ * A reader-writer lock for read-mostly data. Readers only touch a counter
+ * private to their kthread, so they scale without sharing cache lines, but
+ * writers must drain every kthread's counter and are much slower than with
+ * rwmutex_t.
+ */
+
+struct brlock_slot {
+	atomic_t		readers;
+} __aligned(CACHE_LINE_SIZE);
+
+struct brlock {
+	struct brlock_slot	*slots;
+	unsigned int		nr_slots;
+	bool			writer;
+	spinlock_t		waiter_lock;
+	struct list_head	read_waiters;
+	struct list_head	write_waiters;
+};
+
+typedef struct brlock brlock_t;
+
+extern int brlock_init(brlock_t *l);
+extern void brlock_destroy(brlock_t *l);
+extern void __brlock_rdlock(brlock_t *l, unsigned int idx);
+extern void brlock_wrlock(brlock_t *l);
+extern void brlock_wrunlock(brlock_t *l);
+
+/**
+ * brlock_rdlock - acquires a read lock on a big-reader lock
+ * @l: the lock to acquire
+ */
+static inline void brlock_rdlock(brlock_t *l)
+{
+	unsigned int idx = kthread_idx;
+
+	atomic_inc(&l->slots[idx].readers);
+	if (unlikely(ACCESS_ONCE(l->writer)))
+		__brlock_rdlock(l, idx);
+}
+
+/**
+ * brlock_rdunlock - releases a read lock on a big-reader lock
+ * @l: the lock to release
+ *
+ * The thread may have moved to another kthread since acquiring the lock, in
+ * which case the counts of both kthreads are off by one, but their sum (the
+ * only thing writers look at) is still right.
+ */
+static inline void brlock_rdunlock(brlock_t *l)
+{
+	atomic_dec(&l->slots[kthread_idx].readers);
+}
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <runtime/net.h>
+#include <runtime/poll.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
 
@@ -25,10 +26,36 @@ extern void tcp_qshutdown(tcpqueue_t *q);
 extern void tcp_qclose(tcpqueue_t *q);
 extern struct netaddr tcp_local_addr(tcpconn_t *c);
 extern struct netaddr tcp_remote_addr(tcpconn_t *c);
+
+/* round-trip time and retransmission statistics for a connection */
+struct tcp_stats {
+	uint32_t	srtt_us;	/* smoothed round-trip time */
+	uint32_t	rttvar_us;	/* round-trip time variation */
+	uint32_t	rto_us;		/* retransmission timeout (w/ backoff) */
+	uint64_t	timeouts;	/* retransmission timeouts */
+	uint64_t	fast_retransmits;
+	uint32_t	cwnd;		/* congestion window in bytes */
+	uint32_t	ssthresh;	/* slow start threshold in bytes */
+	uint64_t	ece_acks;	/* ACKs that echoed congestion (ECN) */
+	uint64_t	sack_retransmits; /* holes resent using SACK */
+	uint32_t	rcv_wnd;	/* receive window we advertise in bytes */
+};
+
+extern void tcp_get_stats(tcpconn_t *c, struct tcp_stats *stats);
+extern int tcp_set_cc(tcpconn_t *c, const char *name);
 extern ssize_t tcp_read(tcpconn_t *c, void *buf, size_t len);
 extern ssize_t tcp_write(tcpconn_t *c, const void *buf, size_t len);
 extern ssize_t tcp_readv(tcpconn_t *c, const struct iovec *iov, int iovcnt);
 extern ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt);
+extern ssize_t tcp_read_zc(tcpconn_t *c, struct iovec *iov, int iovcnt);
+extern void tcp_read_zc_release(tcpconn_t *c, size_t len);
+extern void *tcp_zc_alloc(size_t len);
+extern ssize_t tcp_write_zc(tcpconn_t *c, const void *buf, size_t len,
+			    void (*done)(void *arg), void *arg);
+extern int tcp_poll_add(tcpconn_t *c, poll_waiter_t *w, unsigned int events,
+			unsigned long data);
+extern void tcp_poll_del(tcpconn_t *c);
+extern void tcp_set_nonblocking(tcpconn_t *c, bool nonblocking);
 extern int tcp_shutdown(tcpconn_t *c, int how);
 extern void tcp_abort(tcpconn_t *c);
 extern void tcp_close(tcpconn_t *c);
@@ -13,6 +13,13 @@ struct thread;
 typedef void (*thread_fn_t)(void *arg);
 typedef struct thread thread_t;
 
+/* uthread priority classes, higher priority classes always run first */
+enum {
+	THREAD_PRIO_LC = 0, /* latency-critical (the default) */
+	THREAD_PRIO_BE,     /* best-effort background work */
+	THREAD_PRIO_NR,
+};
+
 
 /*
  * Low-level routines, these are helpful for bindings and synchronization
@@ -23,6 +30,7 @@ extern void thread_park_and_unlock_np(spinlock_t *l);
 extern void thread_park_and_preempt_enable(void);
 extern void thread_ready(thread_t *thread);
 extern void thread_ready_head(thread_t *thread);
+extern void thread_ready_batch(thread_t **ths, unsigned int n);
 extern thread_t *thread_create(thread_fn_t fn, void *arg);
 extern thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t len);
 
@@ -53,4 +61,7 @@ extern void set_uthread_specific(uint64_t val);
 
 extern void thread_yield(void);
 extern int thread_spawn(thread_fn_t fn, void *arg);
+extern int thread_spawn_prio(thread_fn_t fn, void *arg, unsigned int prio);
+extern int thread_set_prio(unsigned int prio);
+extern void thread_set_deadline(uint64_t deadline_us);
 extern void thread_exit(void) __noreturn;
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <base/stddef.h>
+#include <base/list.h>
 
 typedef void (*timer_fn_t)(unsigned long arg);
 
@@ -13,6 +14,8 @@ struct kthread;
 struct timer_entry {
 	bool		armed;
 	unsigned int	idx;
+	uint64_t	deadline_us;
+	struct list_node link;
 	timer_fn_t	fn;
 	unsigned long	arg;
 	struct kthread *localk;
@@ -33,6 +36,7 @@ static inline void
 timer_init(struct timer_entry *e, timer_fn_t fn, unsigned long arg)
 {
 	e->armed = false;
+	e->localk = NULL;
 	e->fn = fn;
 	e->arg = arg;
 }
@@ -9,6 +9,7 @@
 #include <net/ip.h>
 #include <net/udp.h>
 #include <runtime/net.h>
+#include <runtime/poll.h>
 #include <sys/uio.h>
 
 /* the maximum possible payload size (for the largest possible MTU) */
@@ -33,6 +34,16 @@ static inline unsigned int udp_get_payload_size(void)
 struct udpconn;
 typedef struct udpconn udpconn_t;
 
+/* the most datagrams udp_write_batch() sends per call */
+#define UDP_BATCH_MAX	64
+
+/* a datagram for udp_read_batch() and udp_write_batch() */
+struct udp_msg {
+	void		*buf;	/* the payload */
+	size_t		len;	/* the payload length (buffer size for reads) */
+	struct netaddr	raddr;	/* the remote address */
+};
+
 extern int udp_dial(struct netaddr laddr, struct netaddr raddr,
 		    udpconn_t **c_out);
 extern int udp_listen(struct netaddr laddr, udpconn_t **c_out);
@@ -43,8 +54,15 @@ extern ssize_t udp_read_from(udpconn_t *c, void *buf, size_t len,
 			     struct netaddr *raddr);
 extern ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
 			    const struct netaddr *raddr);
+extern ssize_t udp_read_batch(udpconn_t *c, struct udp_msg *msgs, int nr);
+extern ssize_t udp_write_batch(udpconn_t *c, const struct udp_msg *msgs,
+			       int nr);
 extern ssize_t udp_read(udpconn_t *c, void *buf, size_t len);
 extern ssize_t udp_write(udpconn_t *c, const void *buf, size_t len);
+extern int udp_poll_add(udpconn_t *c, poll_waiter_t *w, unsigned int events,
+			unsigned long data);
+extern void udp_poll_del(udpconn_t *c);
+extern void udp_set_nonblocking(udpconn_t *c, bool nonblocking);
 extern void udp_shutdown(udpconn_t *c);
 extern void udp_close(udpconn_t *c);
 
@@ -45,6 +45,8 @@ extern struct iokernel_cfg cfg;
 #define IOKERNEL_NUM_COMPLETIONS	32767
 #define IOKERNEL_OVERFLOW_BATCH_DRAIN	64
 #define IOKERNEL_TX_BURST_SIZE		64
+#define IOKERNEL_NUM_GSO_MBUFS		8192
+#define IOKERNEL_NUM_EXT_MBUFS		8192
 #define IOKERNEL_CMD_BURST_SIZE		64
 #define IOKERNEL_RX_BURST_SIZE		64
 #define IOKERNEL_CONTROL_BURST_SIZE	4
@@ -252,6 +254,8 @@ enum {
 struct dataplane {
 	uint8_t			port;
 	bool			is_mlx;
+	bool			tso;
+	bool			multi_segs;
 	struct rte_mempool	*rx_mbuf_pool;
 
 	struct shm_region		ingress_mbuf_region;
@@ -297,6 +301,10 @@ enum {
 	BATCH_TOTAL,
 	TX_PULLED,
 	TX_BACKPRESSURE,
+	TX_GSO_SEGS,
+	TX_GSO_DROPS,
+	TX_ZC_DROPS,
+	TX_ZC_LINEARIZED,
 
 	RQ_GRANT,
 	RX_GRANT,
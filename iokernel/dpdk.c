@@ -105,6 +105,21 @@ static inline int dpdk_port_init(uint8_t port, struct rte_mempool *mbuf_pool)
 		nb_txd = MLX5_TX_RING_SIZE;
 	}
 
+	/* let the NIC split large TCP sends, otherwise tx.c does it (GSO) */
+	dp.tso = !!(dev_info.tx_offload_capa & DEV_TX_OFFLOAD_TCP_TSO);
+	if (dp.tso)
+		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_TCP_TSO;
+	log_info("dpdk: TCP segmentation offload in %s",
+		 dp.tso ? "hardware" : "software");
+
+	/* zero-copy sends are chained, otherwise tx.c copies them into one */
+	dp.multi_segs = !!(dev_info.tx_offload_capa &
+			   DEV_TX_OFFLOAD_MULTI_SEGS);
+	if (dp.multi_segs)
+		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MULTI_SEGS;
+	log_info("dpdk: multi-segment transmit %s",
+		 dp.multi_segs ? "supported" : "not supported, copying");
+
 	/* Configure the Ethernet device. */
 	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
 	if (retval != 0)
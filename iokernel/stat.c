@@ -24,6 +24,10 @@ static const char *stat_names[] = {
 	"BATCH_TOTAL",
 	"TX_PULLED",
 	"TX_BACKPRESSURE",
+	"TX_GSO_SEGS",
+	"TX_GSO_DROPS",
+	"TX_ZC_DROPS",
+	"TX_ZC_LINEARIZED",
 	"RQ_GRANT",
 	"RX_GRANT",
 	"ADJUSTS",
@@ -21,6 +21,14 @@ struct thread *ts[NCPU];
 
 static struct rte_mempool *tx_mbuf_pool;
 
+/* segments that point at zero-copy payloads (never send completions) */
+static struct rte_mempool *tx_ext_mbuf_pool;
+
+/* segments built by software GSO, waiting for room in the NIC TX ring */
+static struct rte_mempool *gso_mbuf_pool;
+static struct rte_mbuf *gso_bufs[IOKERNEL_TX_BURST_SIZE * TXPKT_TSO_MAX_SEGS];
+static unsigned int gso_pos, gso_len;
+
 /*
  * Private data stored in egress mbufs, used to send completions to runtimes.
  */
@@ -75,6 +83,17 @@ static void tx_prepare_tx_mbuf(struct rte_mbuf *buf,
 		buf->l4_len = sizeof(struct rte_tcp_hdr);
 		buf->l3_len = sizeof(struct rte_ipv4_hdr);
 		buf->l2_len = RTE_ETHER_HDR_LEN;
+
+		if (net_hdr->olflags & OLFLAG_TCP_TSO) {
+			const struct rte_tcp_hdr *tcphdr;
+
+			/* the NIC must know where the payload begins */
+			tcphdr = (const struct rte_tcp_hdr *)(net_hdr->payload +
+				 buf->l2_len + buf->l3_len);
+			buf->l4_len = (tcphdr->data_off >> 4) * 4;
+			buf->ol_flags |= PKT_TX_TCP_SEG | PKT_TX_TCP_CKSUM;
+			buf->tso_segsz = net_hdr->tso_segsz;
+		}
 	}
 
 	/* initialize the private data, used to send completion events */
@@ -92,6 +111,56 @@ static void tx_prepare_tx_mbuf(struct rte_mbuf *buf,
 	proc_get(p);
 }
 
+/*
+ * Chains segments onto @buf for the zero-copy payload of @net_hdr. A segment
+ * can't cross a 2MB page, because only pages are physically contiguous.
+ * Returns 0 if successful.
+ */
+static int tx_attach_ext(struct rte_mbuf *buf, const struct tx_net_hdr *net_hdr,
+			 struct proc *p)
+{
+	struct rte_mbuf *last = buf, *seg;
+	struct tx_pktmbuf_priv *priv_data;
+	char *pos, *end;
+	uint32_t page_number;
+	size_t seglen;
+
+	pos = shmptr_to_ptr(&p->region, net_hdr->ext_payload, net_hdr->ext_len);
+	if (unlikely(!pos))
+		return -EINVAL;
+	end = pos + net_hdr->ext_len;
+
+	while (pos < end) {
+		seg = rte_pktmbuf_alloc(tx_ext_mbuf_pool);
+		if (unlikely(!seg))
+			return -ENOMEM;
+
+		seglen = MIN(end - pos, PGSIZE_2MB - PGOFF_2MB(pos));
+		seglen = MIN(seglen, UINT16_MAX);
+		page_number = PGN_2MB((uintptr_t)pos - (uintptr_t)p->region.base);
+		seg->buf_addr = pos;
+		seg->buf_physaddr = p->page_paddrs[page_number] + PGOFF_2MB(pos);
+		seg->buf_len = seglen;
+		seg->data_off = 0;
+		seg->data_len = seglen;
+
+		/* @p is left NULL, only the head mbuf sends a completion */
+		priv_data = tx_pktmbuf_get_priv(seg);
+#ifdef MLX
+		priv_data->lkey = p->lkey;
+#endif /* MLX */
+
+		/* the caller frees a partial chain along with @buf */
+		last->next = seg;
+		last = seg;
+		buf->nb_segs++;
+		buf->pkt_len += seglen;
+		pos += seglen;
+	}
+
+	return 0;
+}
+
 /*
  * Send a completion event to the runtime for the mbuf pointed to by obj.
  */
@@ -208,18 +277,193 @@ static int tx_drain_queue(struct thread *t, int n,
 }
 
 
+/*
+ * Sends as many pending software GSO segments as the NIC will take. Returns
+ * true if none are left.
+ */
+static bool tx_gso_flush(void)
+{
+	int ret;
+
+	ret = rte_eth_tx_burst(dp.port, 0, &gso_bufs[gso_pos], gso_len);
+	gso_pos += ret;
+	gso_len -= ret;
+	if (unlikely(gso_len > 0)) {
+		STAT_INC(TX_BACKPRESSURE, gso_len);
+		return false;
+	}
+
+	gso_pos = 0;
+	return true;
+}
+
+/*
+ * Splits a TSO packet into MSS-sized packets, copying each one into a new
+ * mbuf at the tail of the GSO queue. Returns 0 if successful.
+ */
+static int tx_gso_segment(struct rte_mbuf *buf)
+{
+	struct rte_mbuf *segs[TXPKT_TSO_MAX_SEGS];
+	const char *pkt = rte_pktmbuf_mtod(buf, const char *);
+	const struct rte_tcp_hdr *tcphdr;
+	unsigned int hdr_len, payload_len, off, seglen, nsegs, i;
+	uint16_t mss = buf->tso_segsz;
+
+	hdr_len = buf->l2_len + buf->l3_len + buf->l4_len;
+	if (unlikely(mss == 0 || hdr_len >= buf->pkt_len ||
+		     hdr_len > buf->data_len ||
+		     hdr_len + mss > rte_pktmbuf_data_room_size(gso_mbuf_pool) -
+				     RTE_PKTMBUF_HEADROOM))
+		return -EINVAL;
+
+	payload_len = buf->pkt_len - hdr_len;
+	nsegs = div_up(payload_len, mss);
+	if (unlikely(nsegs > TXPKT_TSO_MAX_SEGS))
+		return -EINVAL;
+	if (unlikely(rte_pktmbuf_alloc_bulk(gso_mbuf_pool, segs, nsegs)))
+		return -ENOMEM;
+
+	tcphdr = (const struct rte_tcp_hdr *)(pkt + buf->l2_len + buf->l3_len);
+	for (i = 0, off = 0; i < nsegs; i++, off += seglen) {
+		struct rte_mbuf *seg = segs[i];
+		struct rte_ipv4_hdr *seg_iphdr;
+		struct rte_tcp_hdr *seg_tcphdr;
+		const void *src;
+		char *p;
+
+		seglen = MIN(mss, payload_len - off);
+		p = rte_pktmbuf_append(seg, hdr_len + seglen);
+		memcpy(p, pkt, hdr_len);
+		/* zero-copy payloads live in chained segments */
+		src = rte_pktmbuf_read(buf, hdr_len + off, seglen, p + hdr_len);
+		if (src != p + hdr_len)
+			memcpy(p + hdr_len, src, seglen);
+
+		seg_iphdr = (struct rte_ipv4_hdr *)(p + buf->l2_len);
+		seg_iphdr->total_length = rte_cpu_to_be_16(buf->l3_len +
+							   buf->l4_len + seglen);
+		seg_iphdr->hdr_checksum = 0;
+
+		seg_tcphdr = (struct rte_tcp_hdr *)(p + buf->l2_len + buf->l3_len);
+		seg_tcphdr->sent_seq = rte_cpu_to_be_32(
+			rte_be_to_cpu_32(tcphdr->sent_seq) + off);
+		/* CWR goes on the first segment, FIN and PSH on the last */
+		if (i > 0)
+			seg_tcphdr->tcp_flags &= ~RTE_TCP_CWR_FLAG;
+		if (i < nsegs - 1)
+			seg_tcphdr->tcp_flags &= ~(RTE_TCP_FIN_FLAG |
+						   RTE_TCP_PSH_FLAG);
+
+		seg->l2_len = buf->l2_len;
+		seg->l3_len = buf->l3_len;
+		seg->l4_len = buf->l4_len;
+		seg->ol_flags = PKT_TX_IPV4 | PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM;
+		seg_tcphdr->cksum = rte_ipv4_phdr_cksum(seg_iphdr, seg->ol_flags);
+
+		gso_bufs[gso_pos + gso_len++] = seg;
+	}
+
+	STAT_INC(TX_GSO_SEGS, nsegs);
+	return 0;
+}
+
+/*
+ * Copies a chained (zero-copy) packet into a single new mbuf at the tail of the
+ * GSO queue, for NICs that can't send chains. Returns 0 if successful.
+ */
+static int tx_linearize(struct rte_mbuf *buf)
+{
+	struct rte_mbuf *seg;
+	const void *src;
+	char *p;
+
+	if (unlikely(buf->pkt_len > rte_pktmbuf_data_room_size(gso_mbuf_pool) -
+				    RTE_PKTMBUF_HEADROOM))
+		return -EINVAL;
+
+	seg = rte_pktmbuf_alloc(gso_mbuf_pool);
+	if (unlikely(!seg))
+		return -ENOMEM;
+
+	p = rte_pktmbuf_append(seg, buf->pkt_len);
+	src = rte_pktmbuf_read(buf, 0, buf->pkt_len, p);
+	if (src != p)
+		memcpy(p, src, buf->pkt_len);
+
+	seg->l2_len = buf->l2_len;
+	seg->l3_len = buf->l3_len;
+	seg->l4_len = buf->l4_len;
+	seg->ol_flags = buf->ol_flags;
+
+	gso_bufs[gso_pos + gso_len++] = seg;
+	STAT_INC(TX_ZC_LINEARIZED, 1);
+	return 0;
+}
+
+/* does @buf need work the NIC can't do (segmenting or linearizing)? */
+static bool tx_gso_needed_one(const struct rte_mbuf *buf)
+{
+	return (!dp.tso && (buf->ol_flags & PKT_TX_TCP_SEG)) ||
+	       (!dp.multi_segs && buf->nb_segs > 1);
+}
+
+/*
+ * Moves a burst to the GSO queue in order, segmenting TSO packets in software
+ * if the NIC can't, and copying chained packets into one mbuf if the NIC can't
+ * send chains. The original of each copied packet is completed right away.
+ */
+static void tx_gso_burst(struct rte_mbuf **bufs, int n)
+{
+	int i, ret;
+
+	for (i = 0; i < n; i++) {
+		if (!tx_gso_needed_one(bufs[i])) {
+			gso_bufs[gso_pos + gso_len++] = bufs[i];
+			continue;
+		}
+
+		/* a TSO chain is segmented even with hardware TSO */
+		if (bufs[i]->ol_flags & PKT_TX_TCP_SEG)
+			ret = tx_gso_segment(bufs[i]);
+		else
+			ret = tx_linearize(bufs[i]);
+		if (unlikely(ret)) {
+			/* TCP will retransmit it */
+			log_warn_ratelimited("tx: couldn't copy packet");
+			STAT_INC(TX_GSO_DROPS, 1);
+		}
+		rte_pktmbuf_free(bufs[i]);
+	}
+}
+
+static bool tx_gso_needed(struct rte_mbuf **bufs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (tx_gso_needed_one(bufs[i]))
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Process a batch of outgoing packets.
  */
 bool tx_burst(void)
 {
-	const struct tx_net_hdr *hdrs[IOKERNEL_TX_BURST_SIZE];
+	static const struct tx_net_hdr *hdrs[IOKERNEL_TX_BURST_SIZE];
 	static struct rte_mbuf *bufs[IOKERNEL_TX_BURST_SIZE];
-	struct thread *threads[IOKERNEL_TX_BURST_SIZE];
+	static struct thread *threads[IOKERNEL_TX_BURST_SIZE];
 	int i, j, ret, pulltotal = 0;
 	static unsigned int pos = 0, n_pkts = 0, n_bufs = 0;
 	struct thread *t;
 
+	/* GSO segments go out before anything queued after them */
+	if (unlikely(gso_len > 0) && !tx_gso_flush())
+		return true;
+
 	/*
 	 * Poll each kthread in each runtime until all have been polled or we
 	 * have PKT_BURST_SIZE pkts.
@@ -258,14 +502,37 @@ full:
 	}
 
 	/* fill in packet metadata */
-	for (i = n_bufs; i < n_pkts; i++) {
+	for (i = n_bufs, j = n_bufs; i < n_pkts; i++) {
 		if (i + TX_PREFETCH_STRIDE < n_pkts)
 			prefetch(hdrs[i + TX_PREFETCH_STRIDE]);
 		tx_prepare_tx_mbuf(bufs[i], hdrs[i], threads[i]);
+
+		if (hdrs[i]->ext_len &&
+		    unlikely(tx_attach_ext(bufs[i], hdrs[i], threads[i]->p))) {
+			/* completes the packet, TCP will retransmit it */
+			log_warn_ratelimited("tx: couldn't attach zero-copy payload");
+			STAT_INC(TX_ZC_DROPS, 1);
+			rte_pktmbuf_free(bufs[i]);
+			continue;
+		}
+		bufs[j++] = bufs[i];
 	}
+	n_pkts = j;
 
 	n_bufs = n_pkts;
 
+	/*
+	 * without NIC support, split TSO packets here (software GSO) and copy
+	 * chained zero-copy packets into one mbuf
+	 */
+	if ((unlikely(!dp.tso) || unlikely(!dp.multi_segs)) &&
+	    tx_gso_needed(bufs, n_pkts)) {
+		tx_gso_burst(bufs, n_pkts);
+		n_pkts = n_bufs = 0;
+		tx_gso_flush();
+		return true;
+	}
+
 	/* finally, send the packets on the wire */
 	ret = rte_eth_tx_burst(dp.port, 0, bufs, n_pkts);
 	log_debug("tx: transmitted %d packets on port %d", ret, dp.port);
@@ -360,5 +627,23 @@ int tx_init(void)
 		return -1;
 	}
 
+	/* create a mempool for segments that reference zero-copy payloads */
+	tx_ext_mbuf_pool = tx_pktmbuf_completion_pool_create("TX_EXT_MBUF_POOL",
+			IOKERNEL_NUM_EXT_MBUFS, sizeof(struct tx_pktmbuf_priv),
+			rte_socket_id());
+	if (tx_ext_mbuf_pool == NULL) {
+		log_err("tx: couldn't create tx ext mbuf pool");
+		return -1;
+	}
+
+	/* create a mempool for segments built by software GSO */
+	gso_mbuf_pool = rte_pktmbuf_pool_create("TX_GSO_MBUF_POOL",
+			IOKERNEL_NUM_GSO_MBUFS, 0, 0, RTE_MBUF_DEFAULT_BUF_SIZE,
+			rte_socket_id());
+	if (gso_mbuf_pool == NULL) {
+		log_err("tx: couldn't create gso mbuf pool");
+		return -1;
+	}
+
 	return 0;
 }
@@ -205,6 +205,155 @@ static int parse_runtime_qdelay_us(const char *name, const char *val)
 	return 0;
 }
 
+static int parse_runtime_remote_steal_qdelay_us(const char *name,
+						const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("runtime_remote_steal_qdelay_us must be positive");
+		return -EINVAL;
+	}
+
+	cfg_remote_steal_qdelay_us = tmp;
+	return 0;
+}
+
+static int parse_runtime_quantum_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	/* signal delivery costs a few microseconds, so tiny quanta thrash */
+	if (tmp != 0 && (tmp < 5 || tmp > 100000)) {
+		log_err("runtime_quantum_us must be 0 (off) or between 5 and 100000");
+		return -EINVAL;
+	}
+
+	cfg_quantum_us = tmp;
+	return 0;
+}
+
+static int parse_tcp_rto_min_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp <= 0) {
+		log_err("tcp_rto_min_us must be positive");
+		return -EINVAL;
+	}
+
+	cfg_tcp_rto_min_us = tmp;
+	return 0;
+}
+
+static int parse_tcp_tx_drop_ppm(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > 1000000) {
+		log_err("tcp_tx_drop_ppm must be between 0 and 1000000");
+		return -EINVAL;
+	}
+
+	cfg_tcp_tx_drop_ppm = tmp;
+	return 0;
+}
+
+static int parse_tcp_tso_segs(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > TXPKT_TSO_MAX_SEGS) {
+		log_err("tcp_tso_segs must be between 0 and %d",
+			TXPKT_TSO_MAX_SEGS);
+		return -EINVAL;
+	}
+
+	cfg_tcp_tso_segs = tmp;
+	return 0;
+}
+
+static int parse_tcp_zc_region_mb(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > UINT_MAX) {
+		log_err("tcp_zc_region_mb must be non-negative");
+		return -EINVAL;
+	}
+
+	cfg_tcp_zc_region_mb = tmp;
+	return 0;
+}
+
+static int parse_tcp_cc(const char *name, const char *val)
+{
+	int ret;
+
+	ret = tcp_cc_set_default(val);
+	if (ret)
+		log_err("tcp_cc must be one of reno, cubic, or dctcp");
+	return ret;
+}
+
+static int parse_rx_bottleneck(const char *name, const char *val)
+{
+#ifdef NET_EMULATION
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > UINT_MAX) {
+		log_err("%s must be non-negative", name);
+		return -EINVAL;
+	}
+
+	if (!strcmp(name, "host_rx_bottleneck_mbps"))
+		cfg_rx_bottleneck_mbps = tmp;
+	else if (!strcmp(name, "host_rx_bottleneck_queue_kb"))
+		cfg_rx_bottleneck_queue_kb = tmp;
+	else
+		cfg_rx_bottleneck_ecn_kb = tmp;
+	return 0;
+#else
+	log_err("%s requires building with CONFIG_NET_EMULATION=y", name);
+	return -EINVAL;
+#endif
+}
+
 static int parse_mac_address(const char *name, const char *val)
 {
 	int ret = str_to_mac(val, &netcfg.mac);
@@ -260,6 +409,76 @@ static int parse_static_arp_entry(const char *name, const char *val)
 	return 0;
 }
 
+static int parse_profiler_hz(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > 10000) {
+		log_err("profiler_hz must be between 0 and 10000");
+		return -EINVAL;
+	}
+
+	cfg_prof_hz = tmp;
+	return 0;
+}
+
+static int parse_profiler_path(const char *name, const char *val)
+{
+	cfg_prof_path = strdup(val);
+	if (!cfg_prof_path)
+		return -ENOMEM;
+	return 0;
+}
+
+static int parse_runtime_trace_kb(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > 1024 * 1024) {
+		log_err("runtime_trace_kb must be between 0 and %d", 1024 * 1024);
+		return -EINVAL;
+	}
+
+	cfg_trace_kb = tmp;
+	return 0;
+}
+
+static int parse_runtime_trace_path(const char *name, const char *val)
+{
+	cfg_trace_path = strdup(val);
+	if (!cfg_trace_path)
+		return -ENOMEM;
+	return 0;
+}
+
+static int parse_lock_profile_interval_s(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > UINT_MAX) {
+		log_err("lock_profile_interval_s must be non-negative");
+		return -EINVAL;
+	}
+
+	cfg_lock_profile_s = tmp;
+	return 0;
+}
+
 static int parse_log_level(const char *name, const char *val)
 {
 	long tmp;
@@ -362,7 +581,23 @@ static const struct cfg_handler cfg_handlers[] = {
 	{ "runtime_priority", parse_runtime_priority, false },
 	{ "runtime_ht_punish_us", parse_runtime_ht_punish_us, false },
 	{ "runtime_qdelay_us", parse_runtime_qdelay_us, false },
+	{ "runtime_remote_steal_qdelay_us",
+			parse_runtime_remote_steal_qdelay_us, false },
+	{ "runtime_quantum_us", parse_runtime_quantum_us, false },
 	{ "static_arp", parse_static_arp_entry, false },
+	{ "tcp_rto_min_us", parse_tcp_rto_min_us, false },
+	{ "tcp_tx_drop_ppm", parse_tcp_tx_drop_ppm, false },
+	{ "tcp_tso_segs", parse_tcp_tso_segs, false },
+	{ "tcp_zc_region_mb", parse_tcp_zc_region_mb, false },
+	{ "tcp_cc", parse_tcp_cc, false },
+	{ "host_rx_bottleneck_mbps", parse_rx_bottleneck, false },
+	{ "host_rx_bottleneck_queue_kb", parse_rx_bottleneck, false },
+	{ "host_rx_bottleneck_ecn_kb", parse_rx_bottleneck, false },
+	{ "runtime_trace_kb", parse_runtime_trace_kb, false },
+	{ "runtime_trace_path", parse_runtime_trace_path, false },
+	{ "profiler_hz", parse_profiler_hz, false },
+	{ "profiler_path", parse_profiler_path, false },
+	{ "lock_profile_interval_s", parse_lock_profile_interval_s, false },
 	{ "log_level", parse_log_level, false },
 	{ "disable_watchdog", parse_watchdog_flag, false },
 	{ "preferred_socket", parse_preferred_socket, false },
@@ -459,14 +694,24 @@ int cfg_load(const char *path)
 		goto out;
 	}
 
+#ifdef DIRECTPATH
+	/* directpath TX descriptors can only describe one MTU-sized packet */
+	if (cfg_directpath_enabled && cfg_tcp_tso_segs > 1) {
+		log_warn("cfg: tcp_tso_segs is not supported with directpath");
+		cfg_tcp_tso_segs = 0;
+	}
+#endif
+
 	/* log some relevant config parameters */
 	log_info("cfg: provisioned %d cores "
 		 "(%d guaranteed, %d burstable, %d spinning)",
 		 maxks, guaranteedks, maxks - guaranteedks, spinks);
 	log_info("cfg: task is %s",
 		 cfg_prio_is_lc ? "latency critical (LC)" : "best effort (BE)");
-	log_info("cfg: THRESH_QD: %ld, THRESH_HT: %ld",
-		 cfg_qdelay_us, cfg_ht_punish_us);
+	log_info("cfg: THRESH_QD: %ld, THRESH_HT: %ld, THRESH_REMOTE_STEAL: %ld",
+		 cfg_qdelay_us, cfg_ht_punish_us, cfg_remote_steal_qdelay_us);
+	if (cfg_quantum_us)
+		log_info("cfg: time slicing uthreads every %ld us", cfg_quantum_us);
 	log_info("cfg: storage %s, directpath %s",
 #ifdef DIRECT_STORAGE
 		 cfg_storage_enabled ? "enabled" : "disabled",
@@ -0,0 +1,691 @@
+/*
+ * chan.c - support for channels
+ *
+ * Bounded channels keep values in a ring of sequence-numbered slots (as in
+ * Vyukov's bounded MPMC queue), so the send and receive fast paths are a
+ * compare-and-swap and a copy. Everything that might block goes through
+ * chan_select() under the channel's spin lock: waiters enqueue a struct
+ * chan_waiter on each channel and park. Waiters publish themselves in
+ * recv_waiters and send_waiters before polling the ring one last time, and
+ * the lock-free paths check those counts after touching the ring, so either
+ * the waiter sees the value or the other side sees the waiter.
+ *
+ * Any channel (or the timeout) may complete a select, so they race to claim
+ * it with a compare-and-swap on its winner. The claimer either hands a value
+ * over directly (the receiver was parked on an empty channel) or just wakes
+ * the selector to poll again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/lock.h>
+#include <runtime/chan.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+
+#include "defs.h"
+
+/* the initial number of slots of an unbounded channel */
+#define CHAN_UNBOUNDED_SLOTS	16
+
+/* the winner of a select that hasn't been claimed yet */
+#define CHAN_WAITING		-1
+/* the winner of a select that timed out */
+#define CHAN_TIMEDOUT		INT_MAX
+
+/* how a claimer completes a select */
+enum {
+	CHAN_DONE = 0,	/* the value was transferred */
+	CHAN_RETRY,	/* the selector should poll its cases again */
+};
+
+struct chan_sel {
+	thread_t		*th;
+	atomic_t		winner;
+	spinlock_t		lock;
+	bool			parked;
+	bool			done;
+	int			result;
+	bool			timer_done;
+};
+
+struct chan_waiter {
+	struct list_node	link;
+	struct chan_sel		*sel;
+	void			*buf;
+	int			idx;
+	bool			queued;
+};
+
+
+/*
+ * Buffer support
+ */
+
+static inline unsigned char *chan_slot(chan_t *c, uint64_t pos)
+{
+	return c->slots + (pos & c->mask) * c->stride;
+}
+
+static inline bool chan_is_ring(chan_t *c)
+{
+	return c->cap != 0 && c->cap != CHAN_UNBOUNDED;
+}
+
+/* must be called with preemption disabled, so no slot stays half-written */
+static bool chan_ring_push(chan_t *c, const void *src)
+{
+	uint64_t pos = ACCESS_ONCE(c->tail), seq, old;
+	unsigned char *slot;
+	int64_t diff;
+
+	while (true) {
+		slot = chan_slot(c, pos);
+		seq = load_acquire((uint64_t *)slot);
+		diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			old = __sync_val_compare_and_swap(&c->tail, pos, pos + 1);
+			if (old == pos)
+				break;
+			pos = old;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = ACCESS_ONCE(c->tail);
+		}
+	}
+
+	memcpy(slot + sizeof(uint64_t), src, c->elem_size);
+	store_release((uint64_t *)slot, pos + 1);
+	return true;
+}
+
+/* must be called with preemption disabled, so no slot stays half-read */
+static bool chan_ring_pop(chan_t *c, void *dst)
+{
+	uint64_t pos = ACCESS_ONCE(c->head), seq, old;
+	unsigned char *slot;
+	int64_t diff;
+
+	while (true) {
+		slot = chan_slot(c, pos);
+		seq = load_acquire((uint64_t *)slot);
+		diff = (int64_t)(seq - (pos + 1));
+		if (diff == 0) {
+			old = __sync_val_compare_and_swap(&c->head, pos, pos + 1);
+			if (old == pos)
+				break;
+			pos = old;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = ACCESS_ONCE(c->head);
+		}
+	}
+
+	memcpy(dst, slot + sizeof(uint64_t), c->elem_size);
+	store_release((uint64_t *)slot, pos + c->mask + 1);
+	return true;
+}
+
+/* doubles the slots of an unbounded channel, with the channel lock held */
+static int chan_grow(chan_t *c)
+{
+	uint64_t nr = (c->mask + 1) * 2, pos, i = 0;
+	unsigned char *slots;
+
+	slots = malloc(nr * c->stride);
+	if (!slots)
+		return -ENOMEM;
+
+	for (pos = c->head; pos != c->tail; pos++)
+		memcpy(slots + i++ * c->stride, chan_slot(c, pos), c->stride);
+
+	free(c->slots);
+	c->slots = slots;
+	c->mask = nr - 1;
+	c->head = 0;
+	c->tail = i;
+	return 0;
+}
+
+/* returns 0 if @src was buffered, -EAGAIN if full, or -ENOMEM */
+static int chan_buf_push(chan_t *c, const void *src)
+{
+	int ret;
+
+	assert_spin_lock_held(&c->lock);
+
+	if (chan_is_ring(c))
+		return chan_ring_push(c, src) ? 0 : -EAGAIN;
+	if (c->cap == 0)
+		return -EAGAIN;
+
+	if (c->tail - c->head > c->mask) {
+		ret = chan_grow(c);
+		if (ret)
+			return ret;
+	}
+	memcpy(chan_slot(c, c->tail++), src, c->elem_size);
+	return 0;
+}
+
+static bool chan_buf_pop(chan_t *c, void *dst)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (chan_is_ring(c))
+		return chan_ring_pop(c, dst);
+	if (c->cap == 0 || c->head == c->tail)
+		return false;
+
+	memcpy(dst, chan_slot(c, c->head++), c->elem_size);
+	return true;
+}
+
+static bool chan_buf_empty(chan_t *c)
+{
+	return ACCESS_ONCE(c->head) == ACCESS_ONCE(c->tail);
+}
+
+
+/*
+ * Waiter support
+ */
+
+/* pops the first waiter on @q that can still be claimed, or returns NULL */
+static struct chan_waiter *chan_claim(chan_t *c, struct list_head *q,
+				      atomic_t *waiters)
+{
+	struct chan_waiter *w;
+
+	assert_spin_lock_held(&c->lock);
+
+	while ((w = list_pop(q, struct chan_waiter, link)) != NULL) {
+		w->queued = false;
+		atomic_dec(waiters);
+		if (atomic_cmpxchg(&w->sel->winner, CHAN_WAITING, w->idx))
+			return w;
+	}
+
+	return NULL;
+}
+
+/* finishes a claimed select, waking the selector if it parked */
+static void chan_complete(struct chan_sel *s, int result)
+{
+	thread_t *th = NULL;
+
+	spin_lock_np(&s->lock);
+	s->result = result;
+	s->done = true;
+	if (s->parked)
+		th = s->th;
+	spin_unlock_np(&s->lock);
+
+	if (!th)
+		return;
+
+	/* run a receiver we handed a value to next, like a directed yield */
+	if (result == CHAN_DONE)
+		thread_ready_head(th);
+	else
+		thread_ready(th);
+}
+
+/* wakes a waiter on @q after the lock-free path changed the ring */
+static void chan_kick(chan_t *c, struct list_head *q, atomic_t *waiters)
+{
+	struct chan_waiter *w;
+
+	/* pairs with the atomic increment of @waiters in chan_select() */
+	__sync_synchronize();
+	if (likely(!atomic_read(waiters)))
+		return;
+
+	spin_lock_np(&c->lock);
+	w = chan_claim(c, q, waiters);
+	spin_unlock_np(&c->lock);
+
+	if (w)
+		chan_complete(w->sel, CHAN_RETRY);
+}
+
+static void chan_timeout(unsigned long arg)
+{
+	struct chan_sel *s = (struct chan_sel *)arg;
+
+	if (atomic_cmpxchg(&s->winner, CHAN_WAITING, CHAN_TIMEDOUT))
+		chan_complete(s, CHAN_RETRY);
+	store_release(&s->timer_done, true);
+}
+
+
+/*
+ * Select support
+ */
+
+/* tries a case with its channel's lock held, returns -EAGAIN to block */
+static int chan_try_locked(struct chan_case *cs)
+{
+	chan_t *c = cs->c;
+	struct chan_waiter *w;
+	int ret;
+
+	if (cs->send) {
+		if (c->closed)
+			return -EPIPE;
+
+		/* hand off to a parked receiver unless that would reorder */
+		if (chan_buf_empty(c)) {
+			w = chan_claim(c, &c->recvq, &c->recv_waiters);
+			if (w) {
+				memcpy(w->buf, cs->buf, c->elem_size);
+				chan_complete(w->sel, CHAN_DONE);
+				return 0;
+			}
+		}
+
+		ret = chan_buf_push(c, cs->buf);
+		if (ret)
+			return ret;
+
+		w = chan_claim(c, &c->recvq, &c->recv_waiters);
+		if (w)
+			chan_complete(w->sel, CHAN_RETRY);
+		return 0;
+	}
+
+	if (chan_buf_pop(c, cs->buf)) {
+		w = chan_claim(c, &c->sendq, &c->send_waiters);
+		if (w)
+			chan_complete(w->sel, CHAN_RETRY);
+		return 0;
+	}
+
+	/* take the value of a parked sender */
+	w = chan_claim(c, &c->sendq, &c->send_waiters);
+	if (w) {
+		memcpy(cs->buf, w->buf, c->elem_size);
+		chan_complete(w->sel, CHAN_DONE);
+		return 0;
+	}
+
+	return c->closed ? -EPIPE : -EAGAIN;
+}
+
+static inline atomic_t *chan_case_waiters(struct chan_case *cs)
+{
+	return cs->send ? &cs->c->send_waiters : &cs->c->recv_waiters;
+}
+
+/* sorts the distinct channels of @cases by address, for lock ordering */
+static int chan_lock_order(struct chan_case *cases, int n, chan_t **order)
+{
+	int i, j, nr = 0;
+	chan_t *c;
+
+	for (i = 0; i < n; i++) {
+		c = cases[i].c;
+		for (j = 0; j < nr; j++) {
+			if (order[j] == c)
+				break;
+		}
+		if (j < nr)
+			continue;
+
+		for (j = nr++; j > 0 && order[j - 1] > c; j--)
+			order[j] = order[j - 1];
+		order[j] = c;
+	}
+
+	return nr;
+}
+
+static void chan_lock_all(chan_t **order, int nr)
+{
+	int i;
+
+	preempt_disable();
+	for (i = 0; i < nr; i++)
+		spin_lock(&order[i]->lock);
+}
+
+static void chan_unlock_all(chan_t **order, int nr)
+{
+	int i;
+
+	for (i = nr - 1; i >= 0; i--)
+		spin_unlock(&order[i]->lock);
+	preempt_enable();
+}
+
+/* polls every case with all locks held, returns the chosen one or -1 */
+static int chan_poll_locked(struct chan_case *cases, int n)
+{
+	int i, idx, start = n > 1 ? rdtsc() % n : 0, ret;
+
+	for (i = 0; i < n; i++) {
+		/* start somewhere random so no case starves the others */
+		idx = (start + i) % n;
+		ret = chan_try_locked(&cases[idx]);
+		if (ret != -EAGAIN) {
+			cases[idx].ret = ret;
+			return idx;
+		}
+	}
+
+	return -1;
+}
+
+/* removes the waiters that were never claimed */
+static void chan_dequeue_all(struct chan_case *cases, struct chan_waiter *ws,
+			     int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		spin_lock_np(&cases[i].c->lock);
+		if (ws[i].queued) {
+			list_del_from(cases[i].send ? &cases[i].c->sendq :
+				      &cases[i].c->recvq, &ws[i].link);
+			atomic_dec(chan_case_waiters(&cases[i]));
+			ws[i].queued = false;
+		}
+		spin_unlock_np(&cases[i].c->lock);
+	}
+}
+
+/**
+ * chan_select - waits until one of several channel operations can proceed
+ * @cases: the operations
+ * @n: the number of operations (at most CHAN_SELECT_MAX)
+ * @timeout_us: the most microseconds to wait, zero to only poll, or negative
+ * to wait forever
+ *
+ * Performs exactly one ready operation, picked at random if several are ready.
+ * The chosen case's ret is set to 0 if successful, or -EPIPE if its channel
+ * is closed (and, for receives, drained).
+ *
+ * Returns the index of the chosen case, -EAGAIN if @timeout_us is zero and no
+ * case is ready, -ETIMEDOUT if the timeout expired, or -EINVAL.
+ */
+int chan_select(struct chan_case *cases, int n, int64_t timeout_us)
+{
+	struct chan_waiter ws[CHAN_SELECT_MAX];
+	chan_t *order[CHAN_SELECT_MAX];
+	struct timer_entry timer;
+	struct chan_sel s;
+	uint64_t deadline_us = 0;
+	bool armed = false;
+	int i, nr, idx;
+
+	if (unlikely(n <= 0 || n > CHAN_SELECT_MAX))
+		return -EINVAL;
+
+	nr = chan_lock_order(cases, n, order);
+	if (timeout_us > 0)
+		deadline_us = microtime() + timeout_us;
+
+	s.th = thread_self();
+	spin_lock_init(&s.lock);
+	s.parked = false;
+	s.done = false;
+	s.timer_done = false;
+	atomic_write(&s.winner, CHAN_WAITING);
+
+	while (true) {
+		chan_lock_all(order, nr);
+
+		/* publish the waiters before polling, see chan_kick() */
+		for (i = 0; i < n; i++)
+			atomic_inc(chan_case_waiters(&cases[i]));
+
+		idx = chan_poll_locked(cases, n);
+		if (idx < 0 && timeout_us == 0)
+			idx = -EAGAIN;
+		else if (idx < 0 && timeout_us > 0 && microtime() >= deadline_us)
+			idx = -ETIMEDOUT;
+		if (idx != -1) {
+			for (i = 0; i < n; i++)
+				atomic_dec(chan_case_waiters(&cases[i]));
+			chan_unlock_all(order, nr);
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			ws[i].sel = &s;
+			ws[i].buf = cases[i].buf;
+			ws[i].idx = i;
+			ws[i].queued = true;
+			list_add_tail(cases[i].send ? &cases[i].c->sendq :
+				      &cases[i].c->recvq, &ws[i].link);
+		}
+		chan_unlock_all(order, nr);
+
+		if (timeout_us > 0 && !armed) {
+			timer_init(&timer, chan_timeout, (unsigned long)&s);
+			timer_start(&timer, deadline_us);
+			armed = true;
+		}
+
+		spin_lock_np(&s.lock);
+		if (!s.done) {
+			s.parked = true;
+			thread_park_and_unlock_np(&s.lock);
+		} else {
+			spin_unlock_np(&s.lock);
+		}
+
+		chan_dequeue_all(cases, ws, n);
+		idx = atomic_read(&s.winner);
+		if (idx == CHAN_TIMEDOUT) {
+			idx = -ETIMEDOUT;
+			break;
+		}
+		if (s.result == CHAN_DONE) {
+			cases[idx].ret = 0;
+			break;
+		}
+
+		/*
+		 * Poll again. If the timer fires before the reset it can't
+		 * claim the select, but then the deadline check above catches
+		 * it.
+		 */
+		spin_lock_np(&s.lock);
+		s.parked = false;
+		s.done = false;
+		atomic_write(&s.winner, CHAN_WAITING);
+		spin_unlock_np(&s.lock);
+	}
+
+	/* the timer handler may still be running, and it uses @s */
+	if (armed && !timer_cancel(&timer)) {
+		while (!load_acquire(&s.timer_done))
+			cpu_relax();
+	}
+
+	return idx;
+}
+
+
+/*
+ * Channel API
+ */
+
+/**
+ * chan_send - sends a value, waiting for room if necessary
+ * @c: the channel
+ * @src: the value (elem_size bytes)
+ *
+ * Returns 0 if successful, or -EPIPE if the channel is closed.
+ */
+int chan_send(chan_t *c, const void *src)
+{
+	struct chan_case cs = {.c = c, .buf = (void *)src, .send = true};
+	bool ok;
+
+	/* fast path: there's room and no receiver to hand off to */
+	if (likely(chan_is_ring(c) && !atomic_read(&c->recv_waiters) &&
+		   !ACCESS_ONCE(c->closed))) {
+		preempt_disable();
+		ok = chan_ring_push(c, src);
+		preempt_enable();
+		if (likely(ok)) {
+			chan_kick(c, &c->recvq, &c->recv_waiters);
+			return 0;
+		}
+	}
+
+	chan_select(&cs, 1, -1);
+	return cs.ret;
+}
+
+/**
+ * chan_recv - receives a value, waiting for one if necessary
+ * @c: the channel
+ * @dst: the buffer for the value (elem_size bytes)
+ *
+ * Returns 0 if successful, or -EPIPE if the channel is closed and empty.
+ */
+int chan_recv(chan_t *c, void *dst)
+{
+	struct chan_case cs = {.c = c, .buf = dst, .send = false};
+	bool ok;
+
+	/* fast path: a value is waiting in the ring */
+	if (likely(chan_is_ring(c))) {
+		preempt_disable();
+		ok = chan_ring_pop(c, dst);
+		preempt_enable();
+		if (likely(ok)) {
+			chan_kick(c, &c->sendq, &c->send_waiters);
+			return 0;
+		}
+	}
+
+	chan_select(&cs, 1, -1);
+	return cs.ret;
+}
+
+/**
+ * chan_try_send - sends a value if it can be done without waiting
+ * @c: the channel
+ * @src: the value (elem_size bytes)
+ *
+ * Returns 0 if successful, -EAGAIN if the send would block, or -EPIPE if the
+ * channel is closed.
+ */
+int chan_try_send(chan_t *c, const void *src)
+{
+	struct chan_case cs = {.c = c, .buf = (void *)src, .send = true};
+	int ret;
+
+	ret = chan_select(&cs, 1, 0);
+	return ret < 0 ? ret : cs.ret;
+}
+
+/**
+ * chan_try_recv - receives a value if one is available
+ * @c: the channel
+ * @dst: the buffer for the value (elem_size bytes)
+ *
+ * Returns 0 if successful, -EAGAIN if the receive would block, or -EPIPE if
+ * the channel is closed and empty.
+ */
+int chan_try_recv(chan_t *c, void *dst)
+{
+	struct chan_case cs = {.c = c, .buf = dst, .send = false};
+	int ret;
+
+	ret = chan_select(&cs, 1, 0);
+	return ret < 0 ? ret : cs.ret;
+}
+
+/**
+ * chan_close - closes a channel
+ * @c: the channel
+ *
+ * Later sends fail, and receives fail once the buffered values are drained.
+ * Every waiter is woken to notice. A channel may only be closed once.
+ */
+void chan_close(chan_t *c)
+{
+	struct chan_waiter *w;
+
+	spin_lock_np(&c->lock);
+	BUG_ON(c->closed);
+	c->closed = true;
+	while ((w = chan_claim(c, &c->recvq, &c->recv_waiters)) != NULL)
+		chan_complete(w->sel, CHAN_RETRY);
+	while ((w = chan_claim(c, &c->sendq, &c->send_waiters)) != NULL)
+		chan_complete(w->sel, CHAN_RETRY);
+	spin_unlock_np(&c->lock);
+}
+
+/**
+ * chan_init - initializes a channel
+ * @c: the channel to initialize
+ * @elem_size: the size of each value in bytes
+ * @cap: the number of values to buffer (rounded up to a power of two), 0 for
+ * none, or CHAN_UNBOUNDED
+ *
+ * Returns 0 if successful, or -ENOMEM.
+ */
+int chan_init(chan_t *c, size_t elem_size, unsigned int cap)
+{
+	uint64_t nr = 0, i;
+
+	c->head = c->tail = 0;
+	c->elem_size = elem_size;
+	c->cap = cap;
+	c->closed = false;
+	c->slots = NULL;
+	atomic_write(&c->recv_waiters, 0);
+	atomic_write(&c->send_waiters, 0);
+	spin_lock_init(&c->lock);
+	list_head_init(&c->recvq);
+	list_head_init(&c->sendq);
+
+	if (cap == CHAN_UNBOUNDED) {
+		nr = CHAN_UNBOUNDED_SLOTS;
+		c->stride = MAX(elem_size, 1);
+	} else if (cap) {
+		nr = cap == 1 ? 1 : 1UL << (64 - __builtin_clzl(cap - 1));
+		c->stride = align_up(sizeof(uint64_t) + elem_size,
+				     sizeof(uint64_t));
+	}
+	c->mask = nr - 1;
+
+	if (!nr)
+		return 0;
+
+	c->slots = malloc(nr * c->stride);
+	if (!c->slots)
+		return -ENOMEM;
+
+	/* a slot's sequence number says whose turn it is (see Vyukov) */
+	if (chan_is_ring(c)) {
+		for (i = 0; i < nr; i++)
+			*(uint64_t *)chan_slot(c, i) = i;
+	}
+
+	return 0;
+}
+
+/**
+ * chan_destroy - frees a channel's resources
+ * @c: the channel
+ *
+ * No uthread may be waiting on the channel.
+ */
+void chan_destroy(chan_t *c)
+{
+	BUG_ON(!list_empty(&c->recvq) || !list_empty(&c->sendq));
+	free(c->slots);
+	c->slots = NULL;
+}
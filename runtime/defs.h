@@ -29,11 +29,10 @@
  * TODO: make these configurable?
  */
 
-#define RUNTIME_MAX_THREADS		100000
+#define RUNTIME_MAX_THREADS		(1 << 21)
 #define RUNTIME_STACK_SIZE		256 * KB
 #define RUNTIME_GUARD_SIZE		256 * KB
-#define RUNTIME_RQ_SIZE			32
-#define RUNTIME_MAX_TIMERS		4096
+#define RUNTIME_RQ_SIZE			32 /* initial size, grows as needed */
 #define RUNTIME_SCHED_POLL_ITERS	0
 #define RUNTIME_SCHED_MIN_POLL_US	2
 #define RUNTIME_WATCHDOG_US		50
@@ -96,9 +95,13 @@ struct thread {
 	unsigned int		thread_ready;
 	unsigned int		thread_running;
 	unsigned int		last_cpu;
+	unsigned int		prio;
 	uint64_t		run_start_tsc;
 	uint64_t		ready_tsc;
+	uint64_t		deadline_tsc;
 	uint64_t		tlsvar;
+	uintptr_t		entry_fn;
+	struct list_head	*wake_batch;
 #ifdef GC
 	struct list_node	gc_link;
 	unsigned int		onk;
@@ -152,6 +155,16 @@ static inline void stack_free(struct stack *s)
 	tcache_free(&perthread_get(stack_pt), (void *)s);
 }
 
+/**
+ * stack_flush - hands this kthread's spare stacks back for reclaiming
+ *
+ * Called before the kthread parks, so an idle kthread doesn't pin them.
+ */
+static inline void stack_flush(void)
+{
+	tcache_flush_perthread(&perthread_get(stack_pt));
+}
+
 #define RSP_ALIGNMENT	16
 
 static inline void assert_rsp_aligned(uint64_t rsp)
@@ -224,6 +237,10 @@ struct iokernel_control {
 	const struct iokernel_info *iok_info;
 	void *tx_buf;
 	size_t tx_len;
+	void *tso_buf;
+	size_t tso_len;
+	void *zc_buf;
+	size_t zc_len;
 };
 
 extern struct iokernel_control iok;
@@ -330,6 +347,10 @@ enum {
 	STAT_SCHED_CYCLES,
 	STAT_PROGRAM_CYCLES,
 	STAT_THREADS_STOLEN,
+	STAT_THREADS_STOLEN_SMT,
+	STAT_THREADS_STOLEN_LLC,
+	STAT_THREADS_STOLEN_NODE,
+	STAT_THREADS_STOLEN_REMOTE,
 	STAT_SOFTIRQS_STOLEN,
 	STAT_SOFTIRQS_LOCAL,
 	STAT_PARKS,
@@ -339,7 +360,12 @@ enum {
 	STAT_REMOTE_RUNS,
 	STAT_LOCAL_WAKES,
 	STAT_REMOTE_WAKES,
-	STAT_RQ_OVERFLOW,
+	STAT_RQ_GROWS,
+	STAT_DEADLINE_RUNS,
+	STAT_TIMERS_MERGED,
+	STAT_MUTEX_SPIN_ACQUIRES,
+	STAT_MUTEX_PARKS,
+	STAT_TIME_SLICES,
 
 	/* network stack counters */
 	STAT_RX_BYTES,
@@ -349,8 +375,10 @@ enum {
 	STAT_DROPS,
 	STAT_RX_TCP_IN_ORDER,
 	STAT_RX_TCP_OUT_OF_ORDER,
+	STAT_RX_TCP_COALESCED,
 	STAT_RX_TCP_TEXT_CYCLES,
 	STAT_TXQ_OVERFLOW,
+	STAT_RX_BOTTLENECK_DROPS,
 
 	/* directpath stats */
 	STAT_FLOW_STEERING_CYCLES,
@@ -360,23 +388,46 @@ enum {
 	STAT_NR,
 };
 
-struct timer_idx {
-	uint64_t		deadline_us;
-	struct timer_entry	*e;
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS	div_up(64, TIMER_WHEEL_BITS)
+
+/* a hierarchical timing wheel, with microsecond resolution at level 0 */
+struct timer_wheel {
+	uint64_t		clk_us;
+	uint64_t		next_us;
+	uint64_t		pending[TIMER_WHEEL_LEVELS];
+	struct list_head	slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+BUILD_ASSERT(TIMER_WHEEL_SLOTS <= 64);
+
+/* a power-of-two sized ring buffer backing a runqueue */
+struct rq_buf {
+	uint32_t		mask;
+	thread_t		*slots[];
+};
+
+struct runqueue {
+	uint32_t		head;
+	uint32_t		pad;
+	uint64_t		top;
+	struct rq_buf		*buf;
 };
 
 struct kthread {
 	/* 1st cache-line */
 	spinlock_t		lock;
 	uint32_t		kthread_idx;
-	uint32_t		rq_head;
-	uint32_t		rq_tail;
-	struct list_head	rq_overflow;
 	struct lrpc_chan_in	rxq;
 	pid_t			tid;
 	bool			parked;
+	unsigned long		pad0[3];
 
-	/* 2nd cache-line */
+	/* 2nd cache-line, runqueues (one per priority class) */
+	struct runqueue		rqs[THREAD_PRIO_NR];
+	unsigned long		pad1[8 - 3 * THREAD_PRIO_NR];
+
+	/* 3rd cache-line */
 	struct q_ptrs		*q_ptrs;
 	struct mbufq		txpktq_overflow;
 	struct mbufq		txcmdq_overflow;
@@ -384,22 +435,19 @@ struct kthread {
 	unsigned int		curr_cpu;
 #ifdef GC
 	uint64_t		local_gc_gen;
-	unsigned long		pad1[1];
+	unsigned long		pad2[1];
 #else
-	unsigned long		pad1[2];
+	unsigned long		pad2[2];
 #endif
 
-	/* 3rd cache-line */
+	/* 4th cache-line */
 	struct lrpc_chan_out	txpktq;
 	struct lrpc_chan_out	txcmdq;
 
-	/* 4th-7th cache-line */
-	thread_t		*rq[RUNTIME_RQ_SIZE];
-
-	/* 8th cache-line */
+	/* 5th cache-line */
 	spinlock_t		timer_lock;
 	unsigned int		timern;
-	struct timer_idx	*timers;
+	struct timer_wheel	*timers;
 	thread_t		*iokernel_softirq;
 	thread_t		*directpath_softirq;
 	thread_t		*timer_softirq;
@@ -408,25 +456,25 @@ struct kthread {
 	bool			directpath_busy;
 	bool			timer_busy;
 	bool			storage_busy;
-	unsigned int		pad2[3];
+	unsigned int		pad3[3];
 
-	/* 9th cache-line, storage nvme queues */
+	/* 6th cache-line, storage nvme queues */
 	struct storage_q	storage_q;
 
-	/* 10th cache-line, direct path queues */
+	/* 7th cache-line, direct path queues */
 	struct hardware_q	*directpath_rxq;
 	struct direct_txq	*directpath_txq;
-	unsigned long		pad3[6];
+	unsigned long		pad4[6];
 
-	/* 11th cache-line, statistics counters */
+	/* 8th cache-line, statistics counters */
 	uint64_t		stats[STAT_NR];
 };
 
 /* compile-time verification of cache-line alignment */
 BUILD_ASSERT(offsetof(struct kthread, lock) % CACHE_LINE_SIZE == 0);
+BUILD_ASSERT(offsetof(struct kthread, rqs) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, q_ptrs) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, txpktq) % CACHE_LINE_SIZE == 0);
-BUILD_ASSERT(offsetof(struct kthread, rq) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, timer_lock) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, storage_q) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, directpath_rxq) % CACHE_LINE_SIZE == 0);
@@ -462,6 +510,180 @@ static inline void putk(void)
 	preempt_enable();
 }
 
+
+/*
+ * Runqueue support
+ *
+ * Each kthread has one runqueue per thread priority class (THREAD_PRIO_*),
+ * and each runqueue is a lock-free work-stealing deque. Only the owning
+ * kthread adds threads (at @head, or in front of the oldest thread for
+ * thread_ready_head()). Threads are removed in FIFO order, by the owner or by
+ * thieves, with a single compare-and-swap on @top. @top packs the index of
+ * the oldest thread with a count of removed threads, so a concurrent push to
+ * the front can never be mistaken for an unchanged queue (ABA). The sum of
+ * the counts is also exported to the iokernel as q_ptrs->rq_tail.
+ *
+ * q_ptrs->rq_head and q_ptrs->rq_tail count every ready thread, so the
+ * iokernel wakes (or grants a core to) a kthread with any work queued, even if
+ * it is all best-effort. Only q_ptrs->oldest_tsc, the queueing delay signal,
+ * is limited to latency-critical threads.
+ */
+
+#define RQ_TOP(tail, cnt)	(((uint64_t)(cnt) << 32) | (uint32_t)(tail))
+
+static inline uint32_t rq_top_tail(uint64_t top)
+{
+	return (uint32_t)top;
+}
+
+static inline uint32_t rq_top_cnt(uint64_t top)
+{
+	return (uint32_t)(top >> 32);
+}
+
+extern struct rq_buf *rq_buf_alloc(uint32_t size);
+extern struct rq_buf *rq_grow(struct runqueue *rq, uint32_t need);
+
+/**
+ * rq_len - returns the number of threads in a runqueue (racy)
+ * @rq: the runqueue
+ */
+static inline uint32_t rq_len(struct runqueue *rq)
+{
+	uint32_t tail = rq_top_tail(load_acquire(&rq->top));
+	return load_acquire(&rq->head) - tail;
+}
+
+/**
+ * kthread_rq_empty - returns true if all of a kthread's runqueues are empty
+ * @k: the kthread
+ */
+static inline bool kthread_rq_empty(struct kthread *k)
+{
+	int i;
+
+	for (i = 0; i < THREAD_PRIO_NR; i++) {
+		if (rq_len(&k->rqs[i]) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * rq_publish_tail - exports the removed thread count to the iokernel
+ * @k: the kthread that owns the runqueues
+ *
+ * Removals can race with each other, so only move the counter forward.
+ */
+static inline void rq_publish_tail(struct kthread *k)
+{
+	uint32_t cur, cnt = 0;
+	int i;
+
+	for (i = 0; i < THREAD_PRIO_NR; i++)
+		cnt += rq_top_cnt(load_acquire(&k->rqs[i].top));
+
+	cur = ACCESS_ONCE(k->q_ptrs->rq_tail);
+	while (wraps_lt(cur, cnt)) {
+		if (__sync_bool_compare_and_swap(&k->q_ptrs->rq_tail, cur, cnt))
+			break;
+		cur = ACCESS_ONCE(k->q_ptrs->rq_tail);
+	}
+}
+
+/**
+ * rq_push - adds a thread to the back of a local runqueue
+ * @rq: the runqueue
+ * @th: the thread to add
+ *
+ * Must be called by the owner of the runqueue with preemption disabled.
+ */
+static inline void rq_push(struct runqueue *rq, thread_t *th)
+{
+	struct rq_buf *b = rq->buf;
+	uint32_t head = rq->head;
+
+	if (unlikely(head - rq_top_tail(load_acquire(&rq->top)) > b->mask))
+		b = rq_grow(rq, 1);
+	b->slots[head & b->mask] = th;
+	store_release(&rq->head, head + 1);
+}
+
+/**
+ * rq_push_front - adds a thread to the front of a local runqueue
+ * @rq: the runqueue
+ * @th: the thread to add
+ *
+ * Must be called by the owner of the runqueue with preemption disabled.
+ */
+static inline void rq_push_front(struct runqueue *rq, thread_t *th)
+{
+	struct rq_buf *b;
+	uint64_t top;
+	uint32_t tail;
+
+	do {
+		top = load_acquire(&rq->top);
+		tail = rq_top_tail(top);
+		b = rq->buf;
+		if (unlikely(rq->head - tail > b->mask))
+			b = rq_grow(rq, 1);
+		b->slots[(tail - 1) & b->mask] = th;
+	} while (!__sync_bool_compare_and_swap(&rq->top, top,
+					       RQ_TOP(tail - 1, rq_top_cnt(top))));
+}
+
+/**
+ * rq_pop - removes the oldest thread from a runqueue
+ * @k: the kthread that owns the runqueue
+ * @rq: the runqueue
+ *
+ * Safe to call on any kthread's runqueue.
+ *
+ * Returns a thread, or NULL if the runqueue is empty.
+ */
+static inline thread_t *rq_pop(struct kthread *k, struct runqueue *rq)
+{
+	struct rq_buf *b;
+	thread_t *th;
+	uint64_t top;
+	uint32_t tail;
+
+	do {
+		top = load_acquire(&rq->top);
+		tail = rq_top_tail(top);
+		if (tail == load_acquire(&rq->head))
+			return NULL;
+		b = load_acquire(&rq->buf);
+		th = b->slots[tail & b->mask];
+	} while (!__sync_bool_compare_and_swap(&rq->top, top,
+				RQ_TOP(tail + 1, rq_top_cnt(top) + 1)));
+
+	rq_publish_tail(k);
+	return th;
+}
+
+/**
+ * rq_peek - returns the oldest thread in a runqueue without removing it
+ * @rq: the runqueue
+ *
+ * Deliberately racy, the thread may be removed at any time.
+ *
+ * Returns a thread, or NULL if the runqueue is empty.
+ */
+static inline thread_t *rq_peek(struct runqueue *rq)
+{
+	struct rq_buf *b;
+	uint32_t tail;
+
+	tail = rq_top_tail(load_acquire(&rq->top));
+	if (tail == load_acquire(&rq->head))
+		return NULL;
+	b = load_acquire(&rq->buf);
+	return ACCESS_ONCE(b->slots[tail & b->mask]);
+}
+
 DECLARE_SPINLOCK(klock);
 extern unsigned int spinks;
 extern unsigned int nrks;
@@ -469,6 +691,8 @@ extern struct kthread *ks[NCPU];
 extern bool cfg_prio_is_lc;
 extern uint64_t cfg_ht_punish_us;
 extern uint64_t cfg_qdelay_us;
+extern uint64_t cfg_remote_steal_qdelay_us;
+extern uint64_t cfg_quantum_us;
 
 extern void kthread_park(bool voluntary);
 extern void kthread_wait_to_attach(void);
@@ -476,7 +700,9 @@ extern void kthread_wait_to_attach(void);
 struct cpu_record {
 	struct kthread *recent_kthread;
 	unsigned long sibling_core;
-	unsigned long pad[6];
+	unsigned int llc_core; /* lowest core sharing the last-level cache */
+	unsigned int numa_node;
+	unsigned long pad[5];
 };
 
 BUILD_ASSERT(sizeof(struct cpu_record) == CACHE_LINE_SIZE);
@@ -504,6 +730,13 @@ extern bool softirq_sched(struct kthread *k);
 extern bool softirq_run(void);
 
 
+/*
+ * Timer support
+ */
+
+extern void timer_merge(struct kthread *r);
+
+
 /*
  * Network stack
  */
@@ -530,6 +763,17 @@ struct cfg_arp_static_entry {
 extern int arp_static_count;
 extern struct cfg_arp_static_entry static_entries[MAX_ARP_STATIC_ENTRIES];
 
+extern uint64_t cfg_tcp_rto_min_us;
+extern unsigned int cfg_tcp_tx_drop_ppm;
+extern unsigned int cfg_tcp_tso_segs;
+extern unsigned int cfg_tcp_zc_region_mb;
+extern int tcp_cc_set_default(const char *name);
+#ifdef NET_EMULATION
+extern unsigned int cfg_rx_bottleneck_mbps;
+extern unsigned int cfg_rx_bottleneck_queue_kb;
+extern unsigned int cfg_rx_bottleneck_ecn_kb;
+#endif
+
 extern void net_rx_softirq(struct rx_net_hdr **hdrs, unsigned int nr);
 extern void net_rx_softirq_direct(struct mbuf **ms, unsigned int nr);
 
@@ -603,6 +847,72 @@ void register_cfg_init_##c (void)				\
 }
 
 
+/*
+ * Sampling profiler support
+ */
+
+extern unsigned int cfg_prof_hz;
+extern char *cfg_prof_path;
+extern unsigned int cfg_lock_profile_s;
+
+
+/*
+ * Scheduler event tracing
+ */
+
+enum {
+	TRACE_THREAD_READY = 0,	/* th became runnable, data is its entry fn */
+	TRACE_THREAD_RUN,	/* th started running, data is its entry fn */
+	TRACE_THREAD_PARK,	/* th stopped running */
+	TRACE_THREAD_EXIT,	/* th exited */
+	TRACE_STEAL,		/* arg is the victim kthread, data the count */
+	TRACE_KTHREAD_PARK,	/* this kthread yielded its core */
+	TRACE_KTHREAD_UNPARK,	/* this kthread got a core back */
+	TRACE_SOFTIRQ_BEGIN,	/* arg is TRACE_SOFTIRQ_*, data the owner */
+	TRACE_SOFTIRQ_END,
+	TRACE_TIMER_FIRE,	/* data is the timer handler */
+	TRACE_NR,
+};
+
+enum {
+	TRACE_SOFTIRQ_IOKERNEL = 0,
+	TRACE_SOFTIRQ_DIRECTPATH,
+	TRACE_SOFTIRQ_TIMER,
+	TRACE_SOFTIRQ_STORAGE,
+};
+
+/* a fixed-size binary trace record */
+struct trace_rec {
+	uint64_t	tsc;
+	uint32_t	type;
+	uint32_t	arg;
+	uint64_t	th;
+	uint64_t	data;
+};
+
+extern unsigned int cfg_trace_kb;
+extern char *cfg_trace_path;
+extern __thread struct trace_ring *trace_ring;
+extern void __trace_event(unsigned int type, thread_t *th, unsigned int arg,
+			  uint64_t data);
+
+/**
+ * trace_event - records a scheduler event in this kthread's trace ring
+ * @type: the event type (TRACE_*)
+ * @th: the uthread involved, or NULL
+ * @arg: a small event-specific argument
+ * @data: an event-specific argument
+ *
+ * Does nothing unless tracing was enabled with "runtime_trace_kb".
+ */
+static inline void trace_event(unsigned int type, thread_t *th,
+			       unsigned int arg, uint64_t data)
+{
+	if (unlikely(trace_ring))
+		__trace_event(type, th, arg, data);
+}
+
+
 /*
  * Init
  */
@@ -616,6 +926,9 @@ extern int sched_init_thread(void);
 extern int stat_init_thread(void);
 extern int net_init_thread(void);
 extern int smalloc_init_thread(void);
+extern int prof_init_thread(void);
+extern int preempt_init_thread(void);
+extern int trace_init_thread(void);
 extern int storage_init_thread(void);
 extern int directpath_init_thread(void);
 
@@ -630,6 +943,8 @@ extern int udp_init(void);
 extern int arp_init(void);
 extern int trans_init(void);
 extern int smalloc_init(void);
+extern int prof_init(void);
+extern int trace_init(void);
 extern int storage_init(void);
 extern int directpath_init(void);
 #ifdef GC
@@ -639,9 +954,13 @@ extern int gc_init(void);
 /* late initialization */
 extern int ioqueues_register_iokernel(void);
 extern int arp_init_late(void);
+extern int net_init_late(void);
 extern int stat_init_late(void);
 extern int tcp_init_late(void);
 extern int rcu_init_late(void);
+extern int stack_init_late(void);
+extern int prof_init_late(void);
+extern int sync_init_late(void);
 extern int directpath_init_late(void);
 
 /* configuration loading */
@@ -653,4 +972,65 @@ extern int thread_spawn_main(thread_fn_t fn, void *arg);
 extern void thread_cede(void);
 extern void thread_ready_locked(thread_t *th);
 extern void thread_ready_head_locked(thread_t *th);
+extern void thread_ready_list(struct list_head *l);
 extern void join_kthread(struct kthread *k);
+
+
+/*
+ * Wake batching
+ *
+ * Softirqs can wake many threads in one pass (e.g. one per connection in a
+ * burst of packets). Inside a wake batch, thread_wake() only collects the
+ * threads, and thread_wake_batch_finish() makes them all runnable at once.
+ * The batch belongs to the running uthread, so it survives migration.
+ */
+
+extern void thread_wake_batch_finish(void);
+
+/**
+ * thread_wake_batch_start - starts deferring wakeups by the calling thread
+ * @l: a list to collect the threads in (it must outlive the batch)
+ *
+ * Batches don't nest, and the caller must not block before finishing one.
+ */
+static inline void thread_wake_batch_start(struct list_head *l)
+{
+	thread_t *myth = thread_self();
+
+	/* a nested batch would lose the outer batch's wakeups */
+	BUG_ON(myth->wake_batch);
+	list_head_init(l);
+	myth->wake_batch = l;
+}
+
+/**
+ * thread_wake - makes a parked uthread runnable, or defers it to the batch
+ * @th: the thread to wake
+ */
+static inline void thread_wake(thread_t *th)
+{
+	thread_t *myth = __self;
+
+	if (myth && myth->wake_batch) {
+		list_add_tail(myth->wake_batch, &th->link);
+		return;
+	}
+	thread_ready(th);
+}
+
+/**
+ * thread_wake_list - makes every parked uthread on a list runnable
+ * @l: the list of threads (linked through their link fields)
+ *
+ * The threads are deferred if a wake batch is open. @l is left empty.
+ */
+static inline void thread_wake_list(struct list_head *l)
+{
+	thread_t *myth = __self;
+
+	if (myth && myth->wake_batch) {
+		list_append_list(myth->wake_batch, l);
+		return;
+	}
+	thread_ready_list(l);
+}
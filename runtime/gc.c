@@ -38,8 +38,8 @@ volatile uint64_t gc_gen;
 
 void gc_kthread_report(struct kthread *k)
 {
-	uint32_t i, avail;
 	thread_t *th;
+	int i;
 
 	spin_lock(&gc_lock);
 
@@ -48,23 +48,16 @@ void gc_kthread_report(struct kthread *k)
 	assert(k->local_gc_gen + 1 == gc_gen);
 	assert(!bitmap_test(gc_kthread_reports, k->kthread_idx));
 
-	avail = load_acquire(&k->rq_head) - k->rq_tail;
+	for (i = 0; i < THREAD_PRIO_NR; i++) {
+		while (true) {
+			th = rq_pop(k, &k->rqs[i]);
+			if (!th)
+				break;
 
-	for (i = 0; i < avail; i++) {
-		th = k->rq[k->rq_tail++ % RUNTIME_RQ_SIZE];
-		list_add_tail(&paused_uthreads, &th->link);
-	}
-
-	while (true) {
-		th = list_pop(&k->rq_overflow, struct thread, link);
-		if (!th)
-			break;
-
-		avail++;
-		list_add_tail(&paused_uthreads, &th->link);
+			list_add_tail(&paused_uthreads, &th->link);
+		}
 	}
 
-	ACCESS_ONCE(k->q_ptrs->rq_tail) += avail;
 	k->local_gc_gen = gc_gen;
 	bitmap_atomic_set(gc_kthread_reports, k->kthread_idx);
 	spin_unlock(&gc_lock);
@@ -36,6 +36,8 @@ static const struct init_entry global_init_handlers[] = {
 	GLOBAL_INITIALIZER(sched),
 	GLOBAL_INITIALIZER(preempt),
 	GLOBAL_INITIALIZER(smalloc),
+	GLOBAL_INITIALIZER(prof),
+	GLOBAL_INITIALIZER(trace),
 
 	/* network stack */
 	GLOBAL_INITIALIZER(net),
@@ -59,11 +61,14 @@ static const struct init_entry global_init_handlers[] = {
 static const struct init_entry thread_init_handlers[] = {
 	/* runtime core */
 	THREAD_INITIALIZER(kthread),
+	THREAD_INITIALIZER(trace),
 	THREAD_INITIALIZER(ioqueues),
 	THREAD_INITIALIZER(stack),
 	THREAD_INITIALIZER(sched),
 	THREAD_INITIALIZER(timer),
 	THREAD_INITIALIZER(smalloc),
+	THREAD_INITIALIZER(prof),
+	THREAD_INITIALIZER(preempt),
 
 	/* network stack */
 	THREAD_INITIALIZER(net),
@@ -78,10 +83,14 @@ static const struct init_entry thread_init_handlers[] = {
 
 static const struct init_entry late_init_handlers[] = {
 	/* network stack */
+	LATE_INITIALIZER(net),
 	LATE_INITIALIZER(arp),
 	LATE_INITIALIZER(stat),
 	LATE_INITIALIZER(tcp),
 	LATE_INITIALIZER(rcu),
+	LATE_INITIALIZER(stack),
+	LATE_INITIALIZER(prof),
+	LATE_INITIALIZER(sync),
 	LATE_INITIALIZER(directpath),
 };
 
@@ -28,6 +28,7 @@
 
 #define PACKET_QUEUE_MCOUNT	4096
 #define COMMAND_QUEUE_MCOUNT	4096
+#define TSO_BUF_MCOUNT		256
 
 /* the egress buffer pool must be large enough to fill all the TXQs entirely */
 static size_t calculate_egress_pool_size(void)
@@ -38,6 +39,15 @@ static size_t calculate_egress_pool_size(void)
 			PGSIZE_2MB);
 }
 
+/* large egress buffers for TSO, only reserved if tcp_tso_segs is set */
+static size_t calculate_tso_pool_size(void)
+{
+	if (cfg_tcp_tso_segs <= 1)
+		return 0;
+	return align_up(TSO_BUF_MCOUNT * NET_TSO_BUF_LEN *
+			MAX(1, guaranteedks), PGSIZE_2MB);
+}
+
 struct iokernel_control iok;
 bool cfg_prio_is_lc;
 uint64_t cfg_ht_punish_us;
@@ -102,6 +112,13 @@ static size_t estimate_shm_space(void)
 	ret += calculate_egress_pool_size();
 	ret = align_up(ret, PGSIZE_2MB);
 
+	// TSO egress buffers
+	BUILD_ASSERT(PGSIZE_2MB % NET_TSO_BUF_LEN == 0);
+	ret += calculate_tso_pool_size();
+
+	// Zero-copy egress region
+	ret += align_up((size_t)cfg_tcp_zc_region_mb << 20, PGSIZE_2MB);
+
 #ifdef DIRECTPATH
 	// mlx5 directpath
 	if (cfg_directpath_enabled)
@@ -219,6 +236,12 @@ int ioqueues_init(void)
 
 	iok.tx_len = calculate_egress_pool_size();
 	iok.tx_buf = iok_shm_alloc(iok.tx_len, PGSIZE_2MB, NULL);
+	iok.tso_len = calculate_tso_pool_size();
+	if (iok.tso_len)
+		iok.tso_buf = iok_shm_alloc(iok.tso_len, PGSIZE_2MB, NULL);
+	iok.zc_len = align_up((size_t)cfg_tcp_zc_region_mb << 20, PGSIZE_2MB);
+	if (iok.zc_len)
+		iok.zc_buf = iok_shm_alloc(iok.zc_len, PGSIZE_2MB, NULL);
 
 	return 0;
 }
@@ -246,7 +269,8 @@ int ioqueues_register_iokernel(void)
 	hdr->magic = CONTROL_HDR_MAGIC;
 	hdr->version_no = CONTROL_HDR_VERSION;
 	/* TODO: overestimating is okay, but fix this later */
-	hdr->egress_buf_count = div_up(iok.tx_len, net_get_mtu() + MBUF_HEAD_LEN);
+	hdr->egress_buf_count = div_up(iok.tx_len, net_get_mtu() + MBUF_HEAD_LEN) +
+				iok.tso_len / NET_TSO_BUF_LEN;
 	hdr->thread_count = maxks;
 	hdr->mac = netcfg.mac;
 
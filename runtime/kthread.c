@@ -45,6 +45,7 @@ static int ksched_fd;
 static struct kthread *allock(void)
 {
 	struct kthread *k;
+	int i;
 
 	k = aligned_alloc(CACHE_LINE_SIZE,
 			  align_up(sizeof(*k), CACHE_LINE_SIZE));
@@ -53,11 +54,21 @@ static struct kthread *allock(void)
 
 	memset(k, 0, sizeof(*k));
 	spin_lock_init(&k->lock);
-	list_head_init(&k->rq_overflow);
+	for (i = 0; i < THREAD_PRIO_NR; i++) {
+		k->rqs[i].buf = rq_buf_alloc(RUNTIME_RQ_SIZE);
+		if (!k->rqs[i].buf)
+			goto fail;
+	}
 	mbufq_init(&k->txpktq_overflow);
 	mbufq_init(&k->txcmdq_overflow);
 	spin_lock_init(&k->timer_lock);
 	return k;
+
+fail:
+	while (--i >= 0)
+		free(k->rqs[i].buf);
+	free(k);
+	return NULL;
 }
 
 /**
@@ -220,11 +231,13 @@ void kthread_park(bool voluntary)
 	flows_notify_parking(voluntary);
 
 	STAT(PARKS)++;
+	trace_event(TRACE_KTHREAD_PARK, NULL, voluntary, 0);
 
 	/* perform the actual parking */
 	kthread_yield_to_iokernel();
 
 	/* iokernel has unparked us */
+	trace_event(TRACE_KTHREAD_UNPARK, NULL, 0, myk()->curr_cpu);
 	atomic_inc(&runningks);
 
 	flows_notify_waking();
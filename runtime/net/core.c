@@ -12,6 +12,7 @@
 #include <asm/chksum.h>
 #include <runtime/net.h>
 #include <runtime/smalloc.h>
+#include <runtime/sync.h>
 
 #include "defs.h"
 
@@ -23,11 +24,26 @@ struct net_cfg netcfg __aligned(CACHE_LINE_SIZE);
 struct net_driver_ops net_ops;
 unsigned int eth_mtu = ETH_DEFAULT_MTU;
 
+#ifdef NET_EMULATION
+/* an emulated bottleneck link in front of ingress (for testing) */
+unsigned int cfg_rx_bottleneck_mbps;
+unsigned int cfg_rx_bottleneck_queue_kb = 256;
+unsigned int cfg_rx_bottleneck_ecn_kb;
+static DEFINE_SPINLOCK(rx_bottleneck_lock);
+static uint64_t rx_bottleneck_bytes;
+static uint64_t rx_bottleneck_tsc;
+#endif /* NET_EMULATION */
+
 /* TX buffer allocation */
 struct mempool net_tx_buf_mp;
 static struct tcache *net_tx_buf_tcache;
 static DEFINE_PERTHREAD(struct tcache_perthread, net_tx_buf_pt);
 
+/* TSO buffer allocation (only if tcp_tso_segs is set) */
+static struct mempool net_tx_tso_mp;
+static struct tcache *net_tx_tso_tcache;
+static DEFINE_PERTHREAD(struct tcache_perthread, net_tx_tso_pt);
+
 
 /*
  * RX Networking Functions
@@ -136,7 +152,47 @@ void net_error(struct mbuf *m, int err)
 		trans_error(m, err);
 }
 
-static void net_rx_one(struct mbuf *m)
+#ifdef NET_EMULATION
+/*
+ * Models a switch port of limited capacity in front of this host, so incast
+ * can be reproduced without a switch. Packets are not delayed; instead, a
+ * virtual queue drains at the configured rate, and packets are dropped when
+ * it overflows, or CE-marked when it is above the ECN threshold.
+ *
+ * Returns true if the packet should be dropped.
+ */
+static bool net_rx_bottleneck(struct ip_hdr *iphdr, unsigned int len)
+{
+	uint64_t now = rdtsc(), drained;
+	bool drop = false;
+
+	spin_lock_np(&rx_bottleneck_lock);
+	drained = MIN(now - rx_bottleneck_tsc, cycles_per_us * ONE_SECOND) *
+		  cfg_rx_bottleneck_mbps / (8 * cycles_per_us);
+	if (drained > 0 || !rx_bottleneck_bytes) {
+		rx_bottleneck_bytes -= MIN(drained, rx_bottleneck_bytes);
+		rx_bottleneck_tsc = now;
+	}
+
+	if (rx_bottleneck_bytes + len > cfg_rx_bottleneck_queue_kb * KB) {
+		drop = true;
+	} else {
+		rx_bottleneck_bytes += len;
+		if (cfg_rx_bottleneck_ecn_kb &&
+		    rx_bottleneck_bytes > cfg_rx_bottleneck_ecn_kb * KB &&
+		    (iphdr->tos & IPTOS_ECN_MASK) != IPTOS_ECN_NOTECT)
+			iphdr->tos |= IPTOS_ECN_CE;
+	}
+	spin_unlock_np(&rx_bottleneck_lock);
+
+	if (drop)
+		STAT(RX_BOTTLENECK_DROPS)++;
+	return drop;
+}
+#endif /* NET_EMULATION */
+
+/* handles L2 and L3, and returns true if @m should go to the L4 layer */
+static bool net_rx_l3(struct mbuf *m)
 {
 	const struct eth_hdr *llhdr;
 	const struct ip_hdr *iphdr;
@@ -156,7 +212,7 @@ static void net_rx_one(struct mbuf *m)
 	/* handle ARP requests */
 	if (ntoh16(llhdr->type) == ETHTYPE_ARP) {
 		net_rx_arp(m);
-		return;
+		return false;
 	}
 
 	/* filter out requests we can't handle */
@@ -189,6 +245,12 @@ static void net_rx_one(struct mbuf *m)
 		goto drop;
 	if (len < mbuf_length(m))
 		mbuf_trim(m, mbuf_length(m) - len);
+#ifdef NET_EMULATION
+	if (unlikely(cfg_rx_bottleneck_mbps) &&
+	    net_rx_bottleneck((struct ip_hdr *)iphdr,
+			      sizeof(*llhdr) + sizeof(*iphdr) + len))
+		goto drop;
+#endif
 
 	switch(iphdr->proto) {
 	case IPPROTO_ICMP:
@@ -197,17 +259,23 @@ static void net_rx_one(struct mbuf *m)
 
 	case IPPROTO_UDP:
 	case IPPROTO_TCP:
-		net_rx_trans(m);
-		break;
+		return true;
 
 	default:
 		goto drop;
 	}
 
-	return;
+	return false;
 
 drop:
 	mbuf_drop(m);
+	return false;
+}
+
+static void net_rx_one(struct mbuf *m)
+{
+	if (net_rx_l3(m))
+		net_rx_trans(m);
 }
 
 /**
@@ -217,26 +285,51 @@ drop:
  */
 void net_rx_batch(struct mbuf **ms, unsigned int nr)
 {
+	struct mbuf *l4[TRANS_LOOKUP_BATCH];
+	struct list_head wakes;
+	unsigned int n = 0;
 	int i;
 
+	/* wake every receiver in the burst with one runqueue update */
+	thread_wake_batch_start(&wakes);
 	for (i = 0; i < nr; i++) {
 		if (i + RX_PREFETCH_STRIDE < nr)
 			prefetch(ms[i + RX_PREFETCH_STRIDE]->data);
-		net_rx_one(ms[i]);
+		if (!net_rx_l3(ms[i]))
+			continue;
+
+		/* look up transport entries a batch at a time */
+		l4[n++] = ms[i];
+		if (n == TRANS_LOOKUP_BATCH) {
+			net_rx_trans_batch(l4, n);
+			n = 0;
+		}
 	}
+	if (n)
+		net_rx_trans_batch(l4, n);
+	thread_wake_batch_finish();
 }
 
 static void iokernel_softirq_poll(struct kthread *k)
 {
 	struct rx_net_hdr *hdr;
+	struct list_head wakes;
 	struct mbuf *m;
 	uint64_t cmd;
 	unsigned long payload;
+	unsigned int n = 0;
 
+	thread_wake_batch_start(&wakes);
 	while (true) {
 		if (!lrpc_recv(&k->rxq, &cmd, &payload))
 			break;
 
+		/* don't hold back wakeups for a whole (possibly long) drain */
+		if (++n % RUNTIME_RX_BATCH_SIZE == 0) {
+			thread_wake_batch_finish();
+			thread_wake_batch_start(&wakes);
+		}
+
 		switch (cmd) {
 		case RX_NET_RECV:
 			hdr = shmptr_to_ptr(&netcfg.rx_region,
@@ -251,13 +344,20 @@ static void iokernel_softirq_poll(struct kthread *k)
 			break;
 
 		case RX_NET_COMPLETE:
+			/*
+			 * Freeing can run a zero-copy completion callback,
+			 * which may block, so it can't happen inside a batch.
+			 */
+			thread_wake_batch_finish();
 			mbuf_free((struct mbuf *)payload);
+			thread_wake_batch_start(&wakes);
 			break;
 
 		default:
 			panic("net: invalid RXQ cmd '%ld'", cmd);
 		}
 	}
+	thread_wake_batch_finish();
 }
 
 static void iokernel_softirq(void *arg)
@@ -265,8 +365,12 @@ static void iokernel_softirq(void *arg)
 	struct kthread *k = arg;
 
 	while (true) {
+		trace_event(TRACE_SOFTIRQ_BEGIN, NULL, TRACE_SOFTIRQ_IOKERNEL,
+			    k->kthread_idx);
 		iokernel_softirq_poll(k);
 		preempt_disable();
+		trace_event(TRACE_SOFTIRQ_END, NULL, TRACE_SOFTIRQ_IOKERNEL,
+			    k->kthread_idx);
 		k->iokernel_busy = false;
 		thread_park_and_preempt_enable();
 	}
@@ -287,7 +391,10 @@ static void iokernel_softirq(void *arg)
 void net_tx_release_mbuf(struct mbuf *m)
 {
 	preempt_disable();
-	tcache_free(&perthread_get(net_tx_buf_pt), m);
+	if (unlikely(m->head_len > net_get_mtu()))
+		tcache_free(&perthread_get(net_tx_tso_pt), m);
+	else
+		tcache_free(&perthread_get(net_tx_buf_pt), m);
 	preempt_enable();
 }
 
@@ -314,11 +421,86 @@ struct mbuf *net_tx_alloc_mbuf(void)
 	mbuf_init(m, buf, net_get_mtu(), MBUF_DEFAULT_HEADROOM);
 	m->csum_type = CHECKSUM_TYPE_NEEDED;
 	m->txflags = 0;
+	m->ext_len = 0;
 	m->release_data = 0;
 	m->release = net_tx_release_mbuf;
 	return m;
 }
 
+/**
+ * net_tx_alloc_tso_mbuf - allocates a large mbuf for TCP segmentation offload
+ *
+ * The payload may hold many MSS-sized segments; set OLFLAG_TCP_TSO and
+ * @tso_segsz before transmitting it.
+ *
+ * Returns an mbuf, or NULL if TSO is disabled or out of memory.
+ */
+struct mbuf *net_tx_alloc_tso_mbuf(void)
+{
+	struct mbuf *m;
+	unsigned char *buf;
+
+	if (!net_tx_tso_tcache)
+		return NULL;
+
+	preempt_disable();
+	m = tcache_alloc(&perthread_get(net_tx_tso_pt));
+	preempt_enable();
+	if (unlikely(!m))
+		return NULL;
+
+	buf = (unsigned char *)m + MBUF_HEAD_LEN;
+	mbuf_init(m, buf, NET_TSO_BUF_LEN - MBUF_HEAD_LEN -
+		  MBUF_DEFAULT_HEADROOM, MBUF_DEFAULT_HEADROOM);
+	m->csum_type = CHECKSUM_TYPE_NEEDED;
+	m->txflags = 0;
+	m->ext_len = 0;
+	m->release_data = 0;
+	m->release = net_tx_release_mbuf;
+	return m;
+}
+
+/* memory the NIC can transmit from in place (see tcp_write_zc()) */
+static DEFINE_SPINLOCK(net_tx_zc_lock);
+static size_t net_tx_zc_used;
+
+/**
+ * net_tx_zc_alloc - allocates memory for zero-copy transmission
+ * @len: the number of bytes
+ *
+ * The memory is carved out of the region reserved by "tcp_zc_region_mb" and
+ * is never freed, so it suits long-lived objects.
+ *
+ * Returns a pointer, or NULL if the region is exhausted.
+ */
+void *net_tx_zc_alloc(size_t len)
+{
+	void *p = NULL;
+
+	len = align_up(len, CACHE_LINE_SIZE);
+	spin_lock_np(&net_tx_zc_lock);
+	if (iok.zc_len - net_tx_zc_used >= len) {
+		p = (char *)iok.zc_buf + net_tx_zc_used;
+		net_tx_zc_used += len;
+	}
+	spin_unlock_np(&net_tx_zc_lock);
+
+	return p;
+}
+
+/**
+ * net_tx_zc_valid - checks if a buffer can be transmitted in place
+ * @buf: the start of the buffer
+ * @len: the length of the buffer
+ */
+bool net_tx_zc_valid(const void *buf, size_t len)
+{
+	uintptr_t start = (uintptr_t)iok.zc_buf;
+
+	return (uintptr_t)buf >= start &&
+	       (uintptr_t)buf + len <= start + iok.zc_len;
+}
+
 /* drains overflow queues */
 static void __noinline net_tx_drain_overflow(void)
 {
@@ -350,6 +532,12 @@ static int net_tx_iokernel(struct mbuf *m)
 	hdr->completion_data = (unsigned long)m;
 	hdr->len = len;
 	hdr->olflags = m->txflags;
+	hdr->tso_segsz = m->tso_segsz;
+	hdr->ext_len = m->ext_len;
+	if (m->ext_len) {
+		hdr->ext_payload = ptr_to_shmptr(&netcfg.tx_region, m->ext_data,
+						 m->ext_len);
+	}
 	shmptr_t shm = ptr_to_shmptr(&netcfg.tx_region, hdr, len + sizeof(*hdr));
 
 	if (unlikely(!lrpc_send(&k->txpktq, TXPKT_NET_XMIT, shm))) {
@@ -363,7 +551,7 @@ static int net_tx_iokernel(struct mbuf *m)
 static void net_tx_raw(struct mbuf *m)
 {
 	struct kthread *k;
-	unsigned int len = mbuf_length(m);
+	unsigned int len = mbuf_length(m) + m->ext_len;
 
 	k = getk();
 	/* drain pending overflow packets first */
@@ -403,7 +591,8 @@ void net_tx_eth(struct mbuf *m, uint16_t type, struct eth_addr dhost)
 	net_tx_raw(m);
 }
 
-static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr)
+static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr,
+			   uint8_t tos)
 {
 	struct ip_hdr *iphdr;
 
@@ -411,8 +600,8 @@ static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr)
 	iphdr = mbuf_push_hdr(m, *iphdr);
 	iphdr->version = IPVERSION;
 	iphdr->header_len = 5;
-	iphdr->tos = IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT;
-	iphdr->len = hton16(mbuf_length(m));
+	iphdr->tos = tos;
+	iphdr->len = hton16(mbuf_length(m) + m->ext_len);
 	iphdr->id = 0; /* see RFC 6864 */
 	iphdr->off = hton16(IP_DF);
 	iphdr->ttl = 64;
@@ -430,11 +619,109 @@ static uint32_t net_get_ip_route(uint32_t daddr)
 	return daddr;
 }
 
+/*
+ * Packets sent to our own address are queued here and delivered in order, a
+ * batch at a time, by a single softirq thread.
+ */
+static DEFINE_SPINLOCK(loopback_lock);
+static struct mbufq loopbackq;
+static bool loopback_busy;
+static thread_t *loopback_softirq;
+
+/* copies a looped-back packet into a receive mbuf and completes the transmit */
+static struct mbuf *net_loopback_copy(struct mbuf *txm)
+{
+	unsigned int len = mbuf_length(txm) + txm->ext_len;
+	unsigned char *buf;
+	struct mbuf *m;
+
+	m = smalloc(len + MBUF_HEAD_LEN);
+	if (unlikely(!m)) {
+		mbuf_free(txm);
+		return NULL;
+	}
+
+	/* the sender may still hold @txm (e.g. to retransmit), so copy it */
+	buf = (unsigned char *)m + MBUF_HEAD_LEN;
+	memcpy(buf, mbuf_data(txm), mbuf_length(txm));
+	if (txm->ext_len)
+		memcpy(buf + mbuf_length(txm), txm->ext_data, txm->ext_len);
+	mbuf_free(txm);
+
+	mbuf_init(m, buf, len, 0);
+	m->len = len;
+	/* checksums are left to the NIC, so there are none to verify */
+	m->csum_type = CHECKSUM_TYPE_UNNECESSARY;
+	m->csum = 0;
+	m->rss_hash = 0;
+	m->release = (void (*)(struct mbuf *))sfree;
+	return m;
+}
+
+static void net_loopback_softirq(void *arg)
+{
+	struct mbuf *ms[RUNTIME_RX_BATCH_SIZE], *m;
+	unsigned int i, n, nr;
+
+	while (true) {
+		spin_lock_np(&loopback_lock);
+		for (n = 0; n < RUNTIME_RX_BATCH_SIZE; n++) {
+			ms[n] = mbufq_pop_head(&loopbackq);
+			if (!ms[n])
+				break;
+		}
+		if (!n) {
+			loopback_busy = false;
+			thread_park_and_unlock_np(&loopback_lock);
+			continue;
+		}
+		spin_unlock_np(&loopback_lock);
+
+		/*
+		 * Complete the transmits before receiving, so any zero-copy
+		 * completion callbacks run outside of a wake batch.
+		 */
+		for (i = 0, nr = 0; i < n; i++) {
+			m = net_loopback_copy(ms[i]);
+			if (m)
+				ms[nr++] = m;
+		}
+
+		/* receive the whole batch in order, like a NIC burst */
+		preempt_disable();
+		net_rx_batch(ms, nr);
+		preempt_enable();
+	}
+}
+
+/* sends a packet back to ourselves without going through the iokernel */
+static void net_tx_loopback(struct mbuf *m)
+{
+	struct eth_hdr *eth_hdr;
+	bool wake;
+
+	eth_hdr = mbuf_push_hdr(m, *eth_hdr);
+	eth_hdr->shost = netcfg.mac;
+	eth_hdr->dhost = netcfg.mac;
+	eth_hdr->type = hton16(ETHTYPE_IP);
+
+	/* the caller may hold locks that receiving takes, so defer it */
+	spin_lock_np(&loopback_lock);
+	mbufq_push_tail(&loopbackq, m);
+	wake = !loopback_busy;
+	loopback_busy = true;
+	spin_unlock_np(&loopback_lock);
+
+	if (wake)
+		thread_ready(loopback_softirq);
+}
+
 /**
- * net_tx_ip - transmits an IP packet
+ * net_tx_ip_tos - transmits an IP packet with a given type of service
  * @m: the mbuf to transmit
  * @proto: the transport protocol
  * @daddr: the destination IP address (in native byte order)
+ * @tos: the type of service (DSCP and ECN codepoints)
  *
  * The payload must start with the transport (L4) header. The IPv4 (L3) and
  * ethernet (L2) headers will be prepended by this function.
@@ -444,17 +731,22 @@ static uint32_t net_get_ip_route(uint32_t daddr)
  * Returns 0 if successful. If successful, the mbuf will be freed when the
  * transmit completes. Otherwise, the mbuf still belongs to the caller.
  */
-int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
+int net_tx_ip_tos(struct mbuf *m, uint8_t proto, uint32_t daddr, uint8_t tos)
 {
 	struct eth_addr dhost;
 	int ret;
 
 	/* prepend the IP header */
-	net_push_iphdr(m, proto, daddr);
+	net_push_iphdr(m, proto, daddr, tos);
 
 	/* ask NIC to calculate IP checksum */
 	m->txflags |= OLFLAG_IP_CHKSUM | OLFLAG_IPV4;
 
+	if (unlikely(daddr == netcfg.addr)) {
+		net_tx_loopback(m);
+		return 0;
+	}
+
 	/* apply IP routing */
 	daddr = net_get_ip_route(daddr);
 
@@ -475,6 +767,26 @@ int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
 	return 0;
 }
 
+/**
+ * net_tx_ip - transmits an IP packet
+ * @m: the mbuf to transmit
+ * @proto: the transport protocol
+ * @daddr: the destination IP address (in native byte order)
+ *
+ * The payload must start with the transport (L4) header. The IPv4 (L3) and
+ * ethernet (L2) headers will be prepended by this function.
+ *
+ * @m must have been allocated with net_tx_alloc_mbuf().
+ *
+ * Returns 0 if successful. If successful, the mbuf will be freed when the
+ * transmit completes. Otherwise, the mbuf still belongs to the caller.
+ */
+int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
+{
+	return net_tx_ip_tos(m, proto, daddr,
+			     IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT);
+}
+
 /**
  * net_tx_ip_burst - transmits a burst of IP packets
  * @ms: an array of mbuf pointers to transmit
@@ -490,7 +802,7 @@ int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
  * Returns 0 if successful. If successful, the mbufs will be freed when the
  * transmit completes. Otherwise, the mbufs still belongs to the caller. If
  * ARP doesn't have a cached entry, only the first mbuf will be transmitted
- * when the ARP request resolves.
+ * when the ARP request resolves, and the rest are dropped.
  */
 int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 {
@@ -502,12 +814,19 @@ int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 	/* prepare the mbufs */
 	for (i = 0; i < n; i++) {
 		/* prepend the IP header */
-		net_push_iphdr(ms[i], proto, daddr);
+		net_push_iphdr(ms[i], proto, daddr,
+			       IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT);
 
 		/* ask NIC to calculate IP checksum */
 		ms[i]->txflags |= OLFLAG_IP_CHKSUM | OLFLAG_IPV4;
 	}
 
+	if (unlikely(daddr == netcfg.addr)) {
+		for (i = 0; i < n; i++)
+			net_tx_loopback(ms[i]);
+		return 0;
+	}
+
 	/* apply IP routing */
 	daddr = net_get_ip_route(daddr);
 
@@ -516,6 +835,8 @@ int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 	if (unlikely(ret)) {
 		if (ret == -EINPROGRESS) {
 			/* ARP code now owns the first mbuf */
+			for (i = 1; i < n; i++)
+				mbuf_drop(ms[i]);
 			return 0;
 		} else {
 			/* An unrecoverable error occurred */
@@ -532,6 +853,18 @@ int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 	return 0;
 }
 
+/**
+ * net_local_ip - gets the IP address of this runtime
+ *
+ * Packets sent to this address are looped back without reaching the NIC.
+ *
+ * Returns the address (in native byte order).
+ */
+uint32_t net_local_ip(void)
+{
+	return netcfg.addr;
+}
+
 /**
  * str_to_netaddr - converts a string to an IPv4 address and port
  * @str: the string to convert
@@ -574,6 +907,24 @@ int net_init_thread(void)
 
 	k->iokernel_softirq = th;
 	tcache_init_perthread(net_tx_buf_tcache, &perthread_get(net_tx_buf_pt));
+	if (net_tx_tso_tcache) {
+		tcache_init_perthread(net_tx_tso_tcache,
+				      &perthread_get(net_tx_tso_pt));
+	}
+	return 0;
+}
+
+/**
+ * net_init_late - starts the thread that delivers looped-back packets
+ *
+ * Returns 0 if successful.
+ */
+int net_init_late(void)
+{
+	loopback_softirq = thread_create(net_loopback_softirq, NULL);
+	if (!loopback_softirq)
+		return -ENOMEM;
+
 	return 0;
 }
 
@@ -589,6 +940,8 @@ static void net_dump_config(void)
 		 netcfg.mac.addr[0], netcfg.mac.addr[1], netcfg.mac.addr[2],
 		 netcfg.mac.addr[3], netcfg.mac.addr[4], netcfg.mac.addr[5]);
 	log_info("  mtu:\t\t%d", net_get_mtu());
+	if (net_tx_tso_tcache)
+		log_info("  tso:\t\t%u segments", cfg_tcp_tso_segs);
 }
 
 static int steer_flows_iokernel(unsigned int *new_fg_assignment)
@@ -636,6 +989,18 @@ int net_init(void)
 	if (!net_tx_buf_tcache)
 		return -ENOMEM;
 
+	if (iok.tso_len) {
+		ret = mempool_create(&net_tx_tso_mp, iok.tso_buf, iok.tso_len,
+				     PGSIZE_2MB, NET_TSO_BUF_LEN);
+		if (ret)
+			return ret;
+
+		net_tx_tso_tcache = mempool_create_tcache(&net_tx_tso_mp,
+			"runtime_tx_tso_bufs", TCACHE_DEFAULT_MAG_SIZE);
+		if (!net_tx_tso_tcache)
+			return -ENOMEM;
+	}
+
 	log_info("net: started network stack");
 	net_dump_config();
 
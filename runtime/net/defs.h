@@ -31,6 +31,7 @@ extern void net_rx_arp(struct mbuf *m);
 extern void net_rx_icmp(struct mbuf *m, const struct ip_hdr *iphdr,
 			uint16_t len);
 extern void net_rx_trans(struct mbuf *m);
+extern void net_rx_trans_batch(struct mbuf **ms, unsigned int nr);
 extern void tcp_rx_closed(struct mbuf *m);
 void net_rx_batch(struct mbuf **ms, unsigned int nr);
 
@@ -41,15 +42,22 @@ void net_rx_batch(struct mbuf **ms, unsigned int nr);
 
 /* the size of the region before a buffer to store struct mbuf */
 #define MBUF_HEAD_LEN (align_up(sizeof(struct mbuf), CACHE_LINE_SIZE))
+/* the size of a TX buffer that can hold a TSO payload (including the head) */
+#define NET_TSO_BUF_LEN	(64 * 1024)
 
 extern int arp_lookup(uint32_t daddr, struct eth_addr *dhost_out,
 		      struct mbuf *m) __must_use_return;
 extern struct mbuf *net_tx_alloc_mbuf(void);
+extern struct mbuf *net_tx_alloc_tso_mbuf(void);
+extern void *net_tx_zc_alloc(size_t len);
+extern bool net_tx_zc_valid(const void *buf, size_t len);
 extern void net_tx_release_mbuf(struct mbuf *m);
 extern void net_tx_eth(struct mbuf *m, uint16_t proto,
 		       struct eth_addr dhost);
 extern int net_tx_ip(struct mbuf *m, uint8_t proto,
 		     uint32_t daddr) __must_use_return;
+extern int net_tx_ip_tos(struct mbuf *m, uint8_t proto,
+		     uint32_t daddr, uint8_t tos) __must_use_return;
 extern int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto,
 		     uint32_t daddr) __must_use_return;
 extern int net_tx_icmp(struct mbuf *m, uint8_t type, uint8_t code,
@@ -100,6 +108,9 @@ struct trans_entry;
 struct trans_ops {
 	/* receive an ingress packet */
 	void (*recv) (struct trans_entry *e, struct mbuf *m);
+	/* receive several ingress packets for this entry (optional) */
+	void (*recv_batch) (struct trans_entry *e, struct mbuf **ms,
+			    unsigned int nr);
 	/* propagate a network error */
 	void (*err) (struct trans_entry *e, int err);
 };
@@ -109,11 +120,20 @@ struct trans_entry {
 	uint8_t			proto;
 	struct netaddr		laddr;
 	struct netaddr		raddr;
-	struct rcu_hlist_node	link;
 	struct rcu_head		rcu;
 	const struct trans_ops	*ops;
 };
 
+/* the fields of a packet that select its entry */
+struct trans_key {
+	uint8_t			proto;
+	struct netaddr		laddr;
+	struct netaddr		raddr;
+};
+
+/* the most flows trans_table_lookup_batch() hashes ahead */
+#define TRANS_LOOKUP_BATCH	32
+
 /**
  * trans_init_3tuple - initializes a transport layer entry (3-tuple match)
  * @e: the entry to initialize
@@ -153,6 +173,9 @@ static inline void trans_init_5tuple(struct trans_entry *e, uint8_t proto,
 extern int trans_table_add(struct trans_entry *e);
 extern int trans_table_add_with_ephemeral_port(struct trans_entry *e);
 extern void trans_table_remove(struct trans_entry *e);
+extern struct trans_entry *trans_table_lookup(const struct trans_key *k);
+extern void trans_table_lookup_batch(const struct trans_key *ks,
+				     struct trans_entry **es, unsigned int nr);
 
 
 /*
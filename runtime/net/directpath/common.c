@@ -92,8 +92,12 @@ static void directpath_softirq(void *arg)
 	struct kthread *k = arg;
 
 	while (true) {
+		trace_event(TRACE_SOFTIRQ_BEGIN, NULL, TRACE_SOFTIRQ_DIRECTPATH,
+			    k->kthread_idx);
 		directpath_softirq_one(k);
 		preempt_disable();
+		trace_event(TRACE_SOFTIRQ_END, NULL, TRACE_SOFTIRQ_DIRECTPATH,
+			    k->kthread_idx);
 		k->directpath_busy = false;
 		thread_park_and_preempt_enable();
 	}
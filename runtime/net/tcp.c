@@ -19,8 +19,70 @@ static DEFINE_SPINLOCK(tcp_lock);
 /* a list of all TCP connections */
 static LIST_HEAD(tcp_conns);
 
+/* the floor for retransmission timeouts */
+uint64_t cfg_tcp_rto_min_us = TCP_RTO_MIN;
+/* drop this many egress data segments per million (for testing) */
+unsigned int cfg_tcp_tx_drop_ppm;
+/* the most MSS-sized segments to hand to the NIC at once (0 disables TSO) */
+unsigned int cfg_tcp_tso_segs;
+/* the size of the memory region for zero-copy writes */
+unsigned int cfg_tcp_zc_region_mb;
+
+/*
+ * Each connection arms a timer on the timing wheel for its earliest deadline.
+ * When it fires, the connection is queued for the worker, so a wakeup only
+ * touches connections that have expired. Timers are armed lazily: a deadline
+ * that moves later leaves the timer alone, and the worker re-arms it if it
+ * fires early.
+ */
+
+/* protects @tcp_expired and @tcp_worker_parked */
+static DEFINE_SPINLOCK(tcp_timeout_lock);
+/* connections whose timer fired, waiting for the worker */
+static LIST_HEAD(tcp_expired);
+static thread_t *tcp_worker_th;
+static bool tcp_worker_parked;
+
 static void tcp_retransmit(void *arg);
 
+/* runs in softirq context, so just hand the connection to the worker */
+static void tcp_conn_timer_fire(unsigned long arg)
+{
+	tcpconn_t *c = (tcpconn_t *)arg;
+
+	spin_lock_np(&tcp_timeout_lock);
+	if (!c->timeout_queued) {
+		c->timeout_queued = true;
+		list_add_tail(&tcp_expired, &c->timeout_link);
+	}
+	if (tcp_worker_parked) {
+		tcp_worker_parked = false;
+		thread_ready(tcp_worker_th);
+	}
+	spin_unlock_np(&tcp_timeout_lock);
+}
+
+/**
+ * tcp_timer_arm - makes sure the connection's timer fires by a deadline
+ * @c: the TCP connection
+ * @deadline_us: the deadline in microseconds
+ *
+ * The caller must hold @c->lock.
+ */
+void tcp_timer_arm(tcpconn_t *c, uint64_t deadline_us)
+{
+	assert_spin_lock_held(&c->lock);
+
+	c->next_timeout = MIN(c->next_timeout, deadline_us);
+	if (likely(deadline_us >= c->timer_armed_us) ||
+	    c->pcb.state == TCP_STATE_CLOSED)
+		return;
+
+	timer_cancel(&c->timer);
+	c->timer_armed_us = deadline_us;
+	timer_start(&c->timer, deadline_us);
+}
+
 void tcp_timer_update(tcpconn_t *c)
 {
 	uint64_t next_timeout = -1L;
@@ -36,18 +98,20 @@ void tcp_timer_update(tcpconn_t *c)
 	if (c->ack_delayed)
 		next_timeout = MIN(next_timeout, c->ack_ts + TCP_ACK_TIMEOUT);
 	if (c->zero_wnd)
-		next_timeout = MIN(next_timeout, c->zero_wnd_ts + TCP_ZERO_WND_TIMEOUT);
+		next_timeout = MIN(next_timeout, c->zero_wnd_ts + tcp_rto(c));
 
-	if (!c->tx_exclusive) {
+	if (!c->tx_exclusive && !c->rto_pending) {
 		m = list_top(&c->txq, struct mbuf, link);
 		if (m)
-			next_timeout = MIN(next_timeout, m->timestamp + TCP_RETRANSMIT_TIMEOUT);
+			next_timeout = MIN(next_timeout, m->timestamp + tcp_rto(c));
 	}
 
 	if (!list_empty(&c->rxq_ooo))
 		next_timeout = MIN(next_timeout, microtime() + TCP_OOQ_ACK_TIMEOUT);
 
 	store_release(&c->next_timeout, next_timeout);
+	if (next_timeout != -1L)
+		tcp_timer_arm(c, next_timeout);
 }
 
 /* check for timeouts in a TCP connection */
@@ -56,6 +120,11 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 	bool do_ack = false, do_probe = false, do_retransmit = false;
 
 	spin_lock_np(&c->lock);
+
+	/* the timer fired (or is stale), so arm it from scratch below */
+	timer_cancel(&c->timer);
+	c->timer_armed_us = UINT64_MAX;
+
 	if (unlikely(c->pcb.state == TCP_STATE_CLOSED)) {
 		spin_unlock_np(&c->lock);
 		return;
@@ -83,18 +152,32 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 		do_ack = true;
 	}
 
-	if (c->zero_wnd && now - c->zero_wnd_ts >= TCP_ZERO_WND_TIMEOUT) {
+	if (c->zero_wnd && now - c->zero_wnd_ts >= tcp_rto(c)) {
 		log_debug("tcp: %p zero window timeout", c);
 		c->zero_wnd_ts = now;
+		tcp_rto_backoff(c);
 		do_probe = true;
 	}
 
-	if (!c->tx_exclusive && !list_empty(&c->txq)) {
+	if (!c->tx_exclusive && !c->rto_pending && !list_empty(&c->txq)) {
 		struct mbuf *m = list_top(&c->txq, struct mbuf, link);
-		if (now - m->timestamp >= TCP_RETRANSMIT_TIMEOUT) {
+		if (now - m->timestamp >= tcp_rto(c)) {
 			log_debug("tcp: %p retransmission timeout", c);
 			/* It is safe to take a reference, since state != closed */
 			tcp_conn_get(c);
+			c->rto_pending = true;
+			c->timeouts++;
+			tcp_cc_loss(c, true);
+
+			/*
+			 * The receiver may have reneged on data it SACKed
+			 * (RFC 6675 Section 5.1), so forget all SACK state and
+			 * let the RTO resend every expired segment itself.
+			 */
+			list_for_each(&c->txq, m, link)
+				m->sacked = false;
+			c->sack_high = c->pcb.snd_una;
+			c->sack_rxt_high = c->pcb.snd_nxt;
 			do_retransmit = true;
 		}
 	}
@@ -113,32 +196,73 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 		thread_spawn(tcp_retransmit, c);
 }
 
-/* a periodic background thread that handles timeout events */
+/* pops the next expired connection */
+static tcpconn_t *tcp_worker_pop(void)
+{
+	tcpconn_t *c;
+
+	spin_lock_np(&tcp_timeout_lock);
+	c = list_pop(&tcp_expired, tcpconn_t, timeout_link);
+	if (c)
+		c->timeout_queued = false;
+	spin_unlock_np(&tcp_timeout_lock);
+
+	return c;
+}
+
+/* parks until a connection's timer fires */
+static void tcp_worker_wait(void)
+{
+	spin_lock_np(&tcp_timeout_lock);
+	if (!list_empty(&tcp_expired)) {
+		spin_unlock_np(&tcp_timeout_lock);
+		return;
+	}
+
+	tcp_worker_parked = true;
+	thread_park_and_unlock_np(&tcp_timeout_lock);
+}
+
+/* a background thread that handles timeout events */
 static void tcp_worker(void *arg)
 {
 	tcpconn_t *c;
-	uint64_t now;
 
-	while (true) {
-		bool again = false;
-		now = microtime();
+	tcp_worker_th = thread_self();
 
+	while (true) {
+		/* holding tcp_lock keeps popped connections from being freed */
 		spin_lock_np(&tcp_lock);
-		list_for_each(&tcp_conns, c, global_link) {
-			if (preempt_needed()) {
-				again = true;
-				break;
-			}
-			if (load_acquire(&c->next_timeout) <= now)
-				tcp_handle_timeouts(c, now);
-		}
+		while (!preempt_needed() && (c = tcp_worker_pop()) != NULL)
+			tcp_handle_timeouts(c, microtime());
 		spin_unlock_np(&tcp_lock);
 
-		if (!again)
-			timer_sleep(10 * ONE_MS);
+		tcp_worker_wait();
 	}
 }
 
+/* updates the RTT estimate and the RTO with a new sample (RFC 6298) */
+static void tcp_rtt_update(tcpconn_t *c, uint64_t rtt_us)
+{
+	uint32_t r = MIN(rtt_us, TCP_RTO_MAX) << 3;
+	uint32_t delta;
+	uint64_t rto;
+
+	if (!c->srtt) {
+		c->srtt = MAX(r, 1);
+		c->rttvar = r / 2;
+	} else {
+		delta = c->srtt > r ? c->srtt - r : r - c->srtt;
+		c->rttvar = c->rttvar - c->rttvar / 4 + delta / 4;
+		c->srtt = MAX(c->srtt - c->srtt / 8 + r / 8, 1);
+	}
+
+	/* the clock granularity is one microsecond */
+	rto = (c->srtt + MAX(1 << 3, 4 * c->rttvar)) >> 3;
+	c->rto = MIN(MAX(rto, cfg_tcp_rto_min_us), TCP_RTO_MAX);
+	c->rto_backoff = 0;
+}
+
 /**
  * tcp_conn_ack - removes acknowledged packets from TX queue
  * @c: the TCP connection to update
@@ -149,7 +273,7 @@ static void tcp_worker(void *arg)
  */
 void tcp_conn_ack(tcpconn_t *c, struct list_head *freeq)
 {
-	struct mbuf *m;
+	struct mbuf *m, *last = NULL;
 
 	assert_spin_lock_held(&c->lock);
 
@@ -167,7 +291,12 @@ void tcp_conn_ack(tcpconn_t *c, struct list_head *freeq)
 
 		list_pop(&c->txq, struct mbuf, link);
 		list_add_tail(freeq, &m->link);
+		last = m;
 	}
+
+	/* sample the RTT, except for retransmitted segments (Karn's rule) */
+	if (last && !last->retransmitted)
+		tcp_rtt_update(c, microtime() - last->timestamp);
 }
 
 /**
@@ -186,7 +315,10 @@ void tcp_conn_set_state(tcpconn_t *c, int new_state)
 	/* unblock any threads waiting for the connection to be established */
 	if (c->pcb.state < TCP_STATE_ESTABLISHED &&
 	    new_state >= TCP_STATE_ESTABLISHED) {
+		if (new_state == TCP_STATE_ESTABLISHED)
+			tcp_cc_init(c);
 		waitq_release(&c->tx_wq);
+		tcp_poll_notify(c, POLLEV_OUT);
 	}
 
 	tcp_debug_state_change(c, c->pcb.state, new_state);
@@ -207,6 +339,7 @@ static void tcp_conn_err(struct trans_entry *e, int err)
 /* operations for TCP sockets */
 static const struct trans_ops tcp_conn_ops = {
 	.recv = tcp_rx_conn,
+	.recv_batch = tcp_rx_conn_batch,
 	.err = tcp_conn_err,
 };
 
@@ -245,14 +378,17 @@ tcpconn_t *tcp_conn_alloc(void)
 	spin_lock_init(&c->lock);
 	kref_init(&c->ref);
 	c->err = 0;
+	c->nonblocking = false;
 
 	/* ingress fields */
 	c->rx_closed = false;
 	c->rx_exclusive = false;
 	waitq_init(&c->rx_wq);
 	c->rxq_ooo_len = 0;
+	c->rxq_ooo_recent = 0;
 	list_head_init(&c->rxq_ooo);
 	list_head_init(&c->rxq);
+	list_head_init(&c->rxq_zc);
 
 	/* egress fields */
 	c->tx_closed = false;
@@ -263,21 +399,48 @@ tcpconn_t *tcp_conn_alloc(void)
 	c->tx_pending = NULL;
 	list_head_init(&c->txq);
 	c->do_fast_retransmit = false;
+	c->sack_ok = false;
+	c->sack_retransmits = 0;
+	poll_trigger_init(&c->poll);
 
 	/* timeouts */
 	c->next_timeout = -1L;
+	timer_init(&c->timer, tcp_conn_timer_fire, (unsigned long)c);
+	c->timer_armed_us = UINT64_MAX;
+	c->timeout_queued = false;
 	c->ack_delayed = false;
 	c->ack_ts = 0;
 	c->time_wait_ts = 0;
 	c->rep_acks = 0;
 	c->acks_delayed_cnt = 0;
 	c->zero_wnd = false;
+	c->rto_pending = false;
+
+	/* RTT estimation */
+	c->srtt = 0;
+	c->rttvar = 0;
+	c->rto = TCP_RTO_INITIAL;
+	c->rto_backoff = 0;
+	c->timeouts = 0;
+	c->fast_retransmits = 0;
+
+	/* congestion control (the window is set once established) */
+	c->cc = tcp_cc_default;
+	c->snd_cwnd = 0;
+	c->snd_ssthresh = 0;
+	c->snd_cwnd_cnt = 0;
+	c->cc_recovering = false;
+	c->ecn_ok = false;
+	c->ecn_ce = false;
+	c->ecn_cwr = false;
+	c->ece_acks = 0;
 
 	/* initialize egress PCB */
 	c->pcb.state = TCP_STATE_CLOSED;
 	c->pcb.iss = rand_crc32c(0x12345678); /* TODO: not enough */
 	c->pcb.snd_nxt = c->pcb.iss;
 	c->pcb.snd_una = c->pcb.iss;
+	c->sack_high = c->sack_rxt_high = c->pcb.iss;
 
 	/* initialize ingress PCB */
 	c->winmax = TCP_WIN;
@@ -329,12 +492,17 @@ static void tcp_conn_release(struct rcu_head *h)
 
 	spin_lock_np(&tcp_lock);
 	list_del_from(&tcp_conns, &c->global_link);
+	spin_lock_np(&tcp_timeout_lock);
+	if (c->timeout_queued)
+		list_del_from(&tcp_expired, &c->timeout_link);
+	spin_unlock_np(&tcp_timeout_lock);
 	spin_unlock_np(&tcp_lock);
 
 	if (c->tx_pending)
 		mbuf_free(c->tx_pending);
 	mbuf_list_free(&c->rxq_ooo);
 	mbuf_list_free(&c->rxq);
+	mbuf_list_free(&c->rxq_zc);
 	mbuf_list_free(&c->txq);
 	sfree(c);
 }
@@ -345,6 +513,8 @@ static void tcp_conn_release(struct rcu_head *h)
  */
 void tcp_conn_destroy(tcpconn_t *c)
 {
+	/* a timer already firing finishes within the RCU grace period */
+	timer_cancel(&c->timer);
 	trans_table_remove(&c->e);
 	rcu_free(&c->e.rcu, tcp_conn_release);
 }
@@ -365,45 +535,65 @@ void tcp_conn_release_ref(struct kref *r)
  * Support for accepting new connections
  */
 
+/*
+ * Each kthread queues the connections it receives SYNs for on its own shard,
+ * so softirqs on different cores don't contend. Acceptors take from the shard
+ * of the kthread they are running on first and steal from the others when it
+ * is empty, and only sleeping acceptors touch the shared lock.
+ */
+struct tcpqueue_shard {
+	spinlock_t		l;
+	struct list_head	conns;
+} __aligned(CACHE_LINE_SIZE);
+
 struct tcpqueue {
 	struct trans_entry	e;
 	spinlock_t		l;
 	waitq_t			wq;
-	struct list_head	conns;
-	int			backlog;
+	atomic_t		nr_waiters;
+	atomic_t		backlog;
 	bool			shutdown;
 
 	struct kref ref;
 	struct flow_registration flow;
+
+	unsigned int		nr_shards;
+	struct tcpqueue_shard	shards[];
 };
 
 static void tcp_queue_recv(struct trans_entry *e, struct mbuf *m)
 {
 	tcpqueue_t *q = container_of(e, tcpqueue_t, e);
+	struct tcpqueue_shard *s;
 	tcpconn_t *c;
 	thread_t *th;
 
 	/* make sure the connection queue isn't full */
-	spin_lock_np(&q->l);
-	if (unlikely(q->backlog == 0 || q->shutdown)) {
-		spin_unlock_np(&q->l);
+	if (unlikely(ACCESS_ONCE(q->shutdown)))
+		goto done;
+	if (unlikely(atomic_sub_and_fetch(&q->backlog, 1) < 0)) {
+		atomic_inc(&q->backlog);
 		goto done;
 	}
-	q->backlog--;
-	spin_unlock_np(&q->l);
 
 	/* create a new connection */
 	c = tcp_rx_listener(e->laddr, m);
 	if (!c) {
-		spin_lock_np(&q->l);
-		q->backlog++;
-		spin_unlock_np(&q->l);
+		atomic_inc(&q->backlog);
 		goto done;
 	}
 
-	/* wake a thread to accept the connection */
+	/* queue it on the shard of the kthread that received the SYN */
+	s = &q->shards[get_current_affinity() % q->nr_shards];
+	spin_lock_np(&s->l);
+	list_add_tail(&s->conns, &c->queue_link);
+	spin_unlock_np(&s->l);
+
+	/* wake a thread to accept the connection (pairs with tcp_accept()) */
+	mb();
+	if (atomic_read(&q->nr_waiters) == 0)
+		goto done;
 	spin_lock_np(&q->l);
-	list_add_tail(&q->conns, &c->queue_link);
 	th = waitq_signal(&q->wq, &q->l);
 	spin_unlock_np(&q->l);
 	waitq_signal_finish(th);
@@ -440,6 +630,7 @@ static void tcp_queue_release_ref(struct kref *ref)
 int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
 {
 	tcpqueue_t *q;
+	unsigned int i;
 	int ret;
 
 	if (backlog < 1)
@@ -451,17 +642,22 @@ int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
 	else if (laddr.ip != netcfg.addr)
 		return -EINVAL;
 
-	q = smalloc(sizeof(*q));
+	q = smalloc(sizeof(*q) + maxks * sizeof(struct tcpqueue_shard));
 	if (!q)
 		return -ENOMEM;
 
 	trans_init_3tuple(&q->e, IPPROTO_TCP, &tcp_queue_ops, laddr);
 	spin_lock_init(&q->l);
 	waitq_init(&q->wq);
-	list_head_init(&q->conns);
-	q->backlog = backlog;
+	atomic_write(&q->nr_waiters, 0);
+	atomic_write(&q->backlog, backlog);
 	q->shutdown = false;
 	kref_init(&q->ref);
+	q->nr_shards = maxks;
+	for (i = 0; i < q->nr_shards; i++) {
+		spin_lock_init(&q->shards[i].l);
+		list_head_init(&q->shards[i].conns);
+	}
 
 	ret = trans_table_add(&q->e);
 	if (ret) {
@@ -480,33 +676,65 @@ int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
 	return 0;
 }
 
+/* takes a connection from the local shard, or else steals from another */
+static tcpconn_t *tcp_queue_pop(tcpqueue_t *q)
+{
+	struct tcpqueue_shard *s;
+	unsigned int i, start;
+	tcpconn_t *c;
+
+	start = get_current_affinity();
+	for (i = 0; i < q->nr_shards; i++) {
+		s = &q->shards[(start + i) % q->nr_shards];
+		if (list_empty(&s->conns))
+			continue;
+
+		spin_lock_np(&s->l);
+		c = list_pop(&s->conns, tcpconn_t, queue_link);
+		spin_unlock_np(&s->l);
+		if (c) {
+			atomic_inc(&q->backlog);
+			return c;
+		}
+	}
+
+	return NULL;
+}
+
 /**
  * tcp_accept - accepts a TCP connection
  * @q: the listen queue to accept the connection on
  * @c_out: a pointer to store the connection
  *
+ * Connections whose SYN arrived on the calling kthread are preferred.
+ *
  * Returns 0 if successful, otherwise -EPIPE if the listen queue was closed.
  */
 int tcp_accept(tcpqueue_t *q, tcpconn_t **c_out)
 {
 	tcpconn_t *c;
 
+	c = tcp_queue_pop(q);
+	if (likely(c))
+		goto out;
+
+	/*
+	 * Advertise that we might sleep before checking the shards again, so
+	 * tcp_queue_recv() either sees us or we see its connection.
+	 */
 	spin_lock_np(&q->l);
-	while (list_empty(&q->conns) && !q->shutdown)
+	atomic_inc(&q->nr_waiters);
+	mb();
+	while (!(c = tcp_queue_pop(q)) && !q->shutdown)
 		waitq_wait(&q->wq, &q->l);
+	atomic_dec(&q->nr_waiters);
+	spin_unlock_np(&q->l);
 
 	/* was the queue drained and shutdown? */
-	if (list_empty(&q->conns) && q->shutdown) {
-		spin_unlock_np(&q->l);
+	if (!c)
 		return -EPIPE;
-	}
-
-	/* otherwise a new connection is available */
-	q->backlog++;
-	c = list_pop(&q->conns, tcpconn_t, queue_link);
-	assert(c != NULL);
-	spin_unlock_np(&q->l);
 
+out:
 	*c_out = c;
 	return 0;
 }
@@ -549,7 +777,9 @@ void tcp_qshutdown(tcpqueue_t *q)
  */
 void tcp_qclose(tcpqueue_t *q)
 {
+	struct tcpqueue_shard *s;
 	tcpconn_t *c, *nextc;
+	unsigned int i;
 
 	if (!q->shutdown)
 		__tcp_qshutdown(q);
@@ -557,9 +787,12 @@ void tcp_qclose(tcpqueue_t *q)
 	BUG_ON(!waitq_empty(&q->wq));
 
 	/* free all pending connections */
-	list_for_each_safe(&q->conns, c, nextc, queue_link) {
-		list_del_from(&q->conns, &c->queue_link);
-		tcp_conn_destroy(c);
+	for (i = 0; i < q->nr_shards; i++) {
+		s = &q->shards[i];
+		list_for_each_safe(&s->conns, c, nextc, queue_link) {
+			list_del_from(&s->conns, &c->queue_link);
+			tcp_conn_destroy(c);
+		}
 	}
 
 	kref_put(&q->ref, tcp_queue_release_ref);
@@ -599,13 +832,15 @@ int tcp_dial(struct netaddr laddr, struct netaddr raddr, tcpconn_t **c_out)
 		return ret;
 	}
 
-	opts.opt_en = (TCP_OPTION_MSS | TCP_OPTION_WSCALE);
+	opts.opt_en = (TCP_OPTION_MSS | TCP_OPTION_WSCALE | TCP_OPTION_SACK);
 	opts.mss = c->pcb.rcv_mss;
 	opts.wscale = c->pcb.rcv_wscale;
 
-	/* send a SYN to the remote host */
+	/* send a SYN to the remote host, offering ECN (RFC 3168) if the
+	 * congestion controller reacts to it */
 	spin_lock_np(&c->lock);
-	ret = tcp_tx_ctl(c, TCP_SYN, &opts);
+	ret = tcp_tx_ctl(c, TCP_SYN | (c->cc->ecn ? TCP_ECE | TCP_CWR : 0),
+			 &opts);
 	if (unlikely(ret)) {
 		spin_unlock_np(&c->lock);
 		tcp_conn_destroy(c);
@@ -708,19 +943,57 @@ struct netaddr tcp_remote_addr(tcpconn_t *c)
 	return c->e.raddr;
 }
 
+/**
+ * tcp_get_stats - gets the round-trip time, retransmission, and congestion
+ * control statistics
+ * @c: the TCP connection
+ * @stats: a pointer to store the statistics
+ */
+void tcp_get_stats(tcpconn_t *c, struct tcp_stats *stats)
+{
+	spin_lock_np(&c->lock);
+	stats->srtt_us = c->srtt >> 3;
+	stats->rttvar_us = c->rttvar >> 3;
+	stats->rto_us = tcp_rto(c);
+	stats->timeouts = c->timeouts;
+	stats->fast_retransmits = c->fast_retransmits;
+	stats->cwnd = c->snd_cwnd;
+	stats->ssthresh = c->snd_ssthresh;
+	stats->ece_acks = c->ece_acks;
+	stats->sack_retransmits = c->sack_retransmits;
+	stats->rcv_wnd = c->pcb.rcv_wnd;
+	spin_unlock_np(&c->lock);
+}
+
+/* reopens the receive window after @len bytes are consumed */
+static bool tcp_rx_window_open(tcpconn_t *c, size_t len)
+{
+	assert_spin_lock_held(&c->lock);
+
+	/* returns true if the window grew enough to announce it */
+	c->pcb.rcv_wnd += len;
+	return wraps_gte(c->pcb.rcv_nxt + c->pcb.rcv_wnd,
+			 c->tx_last_ack + c->tx_last_win + c->winmax / 4);
+}
+
 static ssize_t tcp_read_wait(tcpconn_t *c, size_t len,
 			     struct list_head *q, struct mbuf **mout)
 {
 	struct mbuf *m;
 	size_t readlen = 0;
-	bool do_ack = false;
+	bool do_ack;
 
 	*mout = NULL;
 	spin_lock_np(&c->lock);
 
 	/* block until there is an actionable event */
-	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq)))
+	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq))) {
+		if (c->nonblocking) {
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->rx_wq, &c->lock);
+	}
 
 	/* is the socket closed? */
 	if (c->rx_closed) {
@@ -752,11 +1025,7 @@ static ssize_t tcp_read_wait(tcpconn_t *c, size_t len,
 		readlen += mbuf_length(m);
 	}
 
-	c->pcb.rcv_wnd += readlen;
-	if (wraps_gte(c->pcb.rcv_nxt + c->pcb.rcv_wnd,
-		      c->tx_last_ack + c->tx_last_win + c->winmax / 4)) {
-		do_ack = true;
-	}
+	do_ack = tcp_rx_window_open(c, readlen);
 	spin_unlock_np(&c->lock);
 
 	if (do_ack)
@@ -916,6 +1185,110 @@ ssize_t tcp_readv(tcpconn_t *c, const struct iovec *iov, int iovcnt)
 	return len;
 }
 
+/**
+ * tcp_read_zc - reads data from a TCP connection without copying it
+ * @c: the TCP connection
+ * @iov: an array to store views of the received payload
+ * @iovcnt: the number of entries in @iov
+ *
+ * Lends out the next in-order payload segments in place instead of copying
+ * them. The views stay valid until they are handed back with
+ * tcp_read_zc_release() (or the connection is closed), and the receive window
+ * stays closed by their size until then.
+ *
+ * Returns the number of entries filled in @iov, 0 if the connection is closed,
+ * or < 0 if an error occurred.
+ */
+ssize_t tcp_read_zc(tcpconn_t *c, struct iovec *iov, int iovcnt)
+{
+	struct mbuf *m;
+	int n = 0;
+
+	if (unlikely(iovcnt <= 0))
+		return -EINVAL;
+
+	spin_lock_np(&c->lock);
+
+	/* block until there is an actionable event */
+	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq))) {
+		if (c->nonblocking) {
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
+		waitq_wait(&c->rx_wq, &c->lock);
+	}
+
+	/* is the socket closed? */
+	if (c->rx_closed) {
+		spin_unlock_np(&c->lock);
+		return -c->err;
+	}
+
+	/* move whole mbufs to the lent out list */
+	while (n < iovcnt) {
+		m = list_top(&c->rxq, struct mbuf, link);
+		if (!m)
+			break;
+
+		if (unlikely((m->flags & TCP_FIN) > 0)) {
+			tcp_conn_shutdown_rx(c);
+			if (mbuf_length(m) == 0)
+				break;
+		}
+
+		list_del_from(&c->rxq, &m->link);
+		list_add_tail(&c->rxq_zc, &m->link);
+		iov[n].iov_base = mbuf_data(m);
+		iov[n++].iov_len = mbuf_length(m);
+	}
+	spin_unlock_np(&c->lock);
+
+	return n;
+}
+
+/**
+ * tcp_read_zc_release - hands back payload lent out by tcp_read_zc()
+ * @c: the TCP connection
+ * @len: the number of bytes to hand back, oldest first
+ *
+ * Reopens the receive window by @len. The views of those bytes must not be
+ * used afterward.
+ */
+void tcp_read_zc_release(tcpconn_t *c, size_t len)
+{
+	struct list_head q;
+	struct mbuf *m;
+	size_t released = 0;
+	bool do_ack;
+
+	list_head_init(&q);
+	spin_lock_np(&c->lock);
+	while (released < len) {
+		m = list_top(&c->rxq_zc, struct mbuf, link);
+		if (unlikely(!m)) {
+			log_warn_ratelimited("tcp: released more than was read");
+			break;
+		}
+
+		/* we may have to hand back only part of a buffer */
+		if (len - released < mbuf_length(m)) {
+			mbuf_pull(m, len - released);
+			released = len;
+			break;
+		}
+
+		released += mbuf_length(m);
+		list_del_from(&c->rxq_zc, &m->link);
+		list_add_tail(&q, &m->link);
+	}
+	do_ack = tcp_rx_window_open(c, released);
+	spin_unlock_np(&c->lock);
+
+	if (do_ack)
+		tcp_tx_ack(c);
+	mbuf_list_free(&q);
+}
+
 static int tcp_write_wait(tcpconn_t *c, size_t *winlen)
 {
 	spin_lock_np(&c->lock);
@@ -925,11 +1298,15 @@ static int tcp_write_wait(tcpconn_t *c, size_t *winlen)
 	       (c->pcb.state < TCP_STATE_ESTABLISHED || c->tx_exclusive ||
 		tcp_is_snd_full(c))) {
 		/* arm window probing if needed */
-		if (!c->zero_wnd && tcp_is_snd_full(c)) {
+		if (!c->zero_wnd && tcp_is_rcv_wnd_full(c)) {
 			c->zero_wnd = true;
 			c->zero_wnd_ts = microtime();
 			tcp_timer_update(c);
 		}
+		if (c->nonblocking) {
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->tx_wq, &c->lock);
 	}
 	c->zero_wnd = false;
@@ -943,7 +1320,7 @@ static int tcp_write_wait(tcpconn_t *c, size_t *winlen)
 	/* drop the lock to allow concurrent RX processing */
 	c->tx_exclusive = true;
 
-	*winlen = c->pcb.snd_una + c->pcb.snd_wnd - c->pcb.snd_nxt;
+	*winlen = c->pcb.snd_una + tcp_snd_wnd(c) - c->pcb.snd_nxt;
 	c->acks_delayed_cnt = 0;
 	c->ack_delayed = false;
 	spin_unlock_np(&c->lock);
@@ -955,7 +1332,8 @@ static void tcp_write_finish(tcpconn_t *c)
 {
 	struct list_head q;
 	struct list_head waiters;
-	struct mbuf *retransmit = NULL;
+	struct mbuf *retransmit[TCP_RETRANSMIT_BATCH];
+	int nr_retransmit = 0;
 
 	assert(c->tx_exclusive == true);
 	list_head_init(&q);
@@ -977,14 +1355,15 @@ static void tcp_write_finish(tcpconn_t *c)
 	} else if (c->do_fast_retransmit) {
 		c->do_fast_retransmit = false;
 		if (c->fast_retransmit_last_ack == c->pcb.snd_una)
-			retransmit = tcp_tx_fast_retransmit_start(c);
+			nr_retransmit = tcp_tx_fast_retransmit_start(c,
+								     retransmit);
 	}
 
 	tcp_timer_update(c);
 	waitq_release_start(&c->tx_wq, &waiters);
 	spin_unlock_np(&c->lock);
 
-	tcp_tx_fast_retransmit_finish(c, retransmit);
+	tcp_tx_fast_retransmit_finish(c, retransmit, nr_retransmit);
 	waitq_release_finish(&waiters);
 	mbuf_list_free(&q);
 }
@@ -1055,6 +1434,87 @@ ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt)
 	return sent > 0 ? sent : ret;
 }
 
+/**
+ * tcp_zc_alloc - allocates a buffer that tcp_write_zc() can send in place
+ * @len: the length of the buffer
+ *
+ * Buffers come from a region reserved by "tcp_zc_region_mb" in the config file
+ * and are never freed, so allocate them once and reuse them.
+ *
+ * Returns a buffer, or NULL if the region is exhausted.
+ */
+void *tcp_zc_alloc(size_t len)
+{
+	return net_tx_zc_alloc(len);
+}
+
+/**
+ * tcp_write_zc - writes data to a TCP connection without copying it
+ * @c: the TCP connection
+ * @buf: a buffer from tcp_zc_alloc() holding the data
+ * @len: the length of the data
+ * @done: called once the stack no longer references @buf
+ * @arg: an argument passed to @done
+ *
+ * @buf must not be modified until @done is called, which happens after the
+ * data sent is acknowledged (or the connection is torn down). @done is only
+ * called if the return value is positive, and it may run in any thread.
+ *
+ * Returns the number of bytes written (could be less than @len), or < 0
+ * if there was a failure.
+ */
+ssize_t tcp_write_zc(tcpconn_t *c, const void *buf, size_t len,
+		     void (*done)(void *arg), void *arg)
+{
+	struct tcp_zc *zc;
+	size_t winlen;
+	ssize_t ret;
+
+#ifdef DIRECTPATH
+	/* directpath descriptors can't reference external memory */
+	if (cfg_directpath_enabled) {
+		ret = tcp_write(c, buf, len);
+		if (ret > 0)
+			done(arg);
+		return ret;
+	}
+#endif
+
+	if (unlikely(!net_tx_zc_valid(buf, len)))
+		return -EINVAL;
+	if (unlikely(len == 0))
+		return 0;
+
+	zc = smalloc(sizeof(*zc));
+	if (unlikely(!zc))
+		return -ENOMEM;
+	atomic_write(&zc->ref, 1);
+	zc->done = done;
+	zc->arg = arg;
+
+	/* block until the data can be sent */
+	ret = tcp_write_wait(c, &winlen);
+	if (ret)
+		goto fail;
+
+	/* actually send the data */
+	ret = tcp_tx_send_zc(c, buf, MIN(len, winlen), zc);
+
+	/* catch up on any pending work */
+	tcp_write_finish(c);
+
+	if (ret <= 0)
+		goto fail;
+	tcp_zc_put(zc);
+	return ret;
+
+fail:
+	/* no segment took a reference, or the send would have succeeded */
+	BUG_ON(atomic_read(&zc->ref) != 1);
+	sfree(zc);
+	return ret;
+}
+
 /* resend any pending egress packets that timed out */
 static void tcp_retransmit(void *arg)
 {
@@ -1069,14 +1529,89 @@ static void tcp_retransmit(void *arg)
 		c->tx_exclusive = true;
 		spin_unlock_np(&c->lock);
 		tcp_tx_retransmit(c);
+
+		/* back off the next timeout (RFC 6298 Section 5.5) */
+		spin_lock_np(&c->lock);
+		tcp_rto_backoff(c);
+		c->rto_pending = false;
+		spin_unlock_np(&c->lock);
 		tcp_write_finish(c);
 	} else {
+		c->rto_pending = false;
 		spin_unlock_np(&c->lock);
 	}
 
 	tcp_conn_put(c);
 }
 
+/**
+ * tcp_poll_add - registers a TCP connection with a poller
+ * @c: the TCP connection
+ * @w: the poller to notify
+ * @events: the events (POLLEV_*) to report
+ * @data: data returned by poll_wait_batch() when an event fires
+ *
+ * Events are edge-triggered: each is reported once when it occurs, so keep
+ * reading or writing until the call would block before waiting again. Events
+ * that are already pending fire right away. A connection can be registered
+ * with one poller at a time.
+ *
+ * Returns 0 if successful, or -EEXIST if @c is already registered.
+ */
+int tcp_poll_add(tcpconn_t *c, poll_waiter_t *w, unsigned int events,
+		 unsigned long data)
+{
+	unsigned int ready = 0;
+
+	spin_lock_np(&c->lock);
+	if (c->poll.waiter) {
+		spin_unlock_np(&c->lock);
+		return -EEXIST;
+	}
+
+	poll_arm(w, &c->poll, events, data);
+	if (c->rx_closed || !list_empty(&c->rxq))
+		ready |= POLLEV_IN;
+	if (c->tx_closed || (c->pcb.state >= TCP_STATE_ESTABLISHED &&
+			     !tcp_is_snd_full(c)))
+		ready |= POLLEV_OUT;
+	if (c->err)
+		ready |= POLLEV_HUP;
+	if (ready)
+		tcp_poll_notify(c, ready);
+	spin_unlock_np(&c->lock);
+
+	return 0;
+}
+
+/**
+ * tcp_set_nonblocking - controls whether reads and writes can block
+ * @c: the TCP connection
+ * @nonblocking: if true, calls that would block fail with -EAGAIN instead
+ *
+ * Use with tcp_poll_add() to serve many connections from one thread.
+ */
+void tcp_set_nonblocking(tcpconn_t *c, bool nonblocking)
+{
+	spin_lock_np(&c->lock);
+	c->nonblocking = nonblocking;
+	spin_unlock_np(&c->lock);
+}
+
+/**
+ * tcp_poll_del - unregisters a TCP connection from its poller
+ * @c: the TCP connection
+ *
+ * tcp_close() does this automatically.
+ */
+void tcp_poll_del(tcpconn_t *c)
+{
+	spin_lock_np(&c->lock);
+	if (c->poll.waiter)
+		poll_disarm(&c->poll);
+	spin_unlock_np(&c->lock);
+}
+
 /**
  * tcp_conn_fail - closes a TCP both sides of a connection with an error
  * @c: the TCP connection to shutdown
@@ -1110,6 +1645,9 @@ void tcp_conn_fail(tcpconn_t *c, int err)
 		mbuf_list_free(&c->rxq);
 	mbuf_list_free(&c->rxq_ooo);
 
+	/* reads and writes now fail immediately */
+	tcp_poll_notify(c, POLLEV_IN | POLLEV_OUT | POLLEV_HUP);
+
 	/* state machine is disabled, drop ref */
 	tcp_conn_put(c);
 }
@@ -1233,6 +1771,8 @@ void tcp_close(tcpconn_t *c)
 
 	spin_lock_np(&c->lock);
 	BUG_ON(!waitq_empty(&c->rx_wq));
+	if (c->poll.waiter)
+		poll_disarm(&c->poll);
 	ret = tcp_conn_shutdown_tx(c);
 	if (ret)
 		tcp_conn_fail(c, -ret);
@@ -6,8 +6,10 @@
 #include <base/list.h>
 #include <base/kref.h>
 #include <base/time.h>
+#include <runtime/poll.h>
 #include <runtime/sync.h>
 #include <runtime/tcp.h>
+#include <runtime/timer.h>
 #include <net/tcp.h>
 #include <net/mbuf.h>
 #include <net/mbufq.h>
@@ -22,11 +24,15 @@
 #define TCP_CONNECT_TIMEOUT	(5 * ONE_SECOND) /* FIXME */
 #define TCP_OOQ_ACK_TIMEOUT	(300 * ONE_MS)
 #define TCP_TIME_WAIT_TIMEOUT	(1 * ONE_SECOND) /* FIXME: should be 8 minutes */
-#define TCP_ZERO_WND_TIMEOUT	(300 * ONE_MS) /* FIXME: should be dynamic */
-#define TCP_RETRANSMIT_TIMEOUT	(300 * ONE_MS) /* FIXME: should be dynamic */
+#define TCP_RTO_INITIAL		(300 * ONE_MS) /* before the first RTT sample */
+#define TCP_RTO_MIN		(500 * ONE_US) /* see tcp_rto_min_us */
+#define TCP_RTO_MAX		(1 * ONE_SECOND)
 #define TCP_FAST_RETRANSMIT_THRESH 3
 #define TCP_OOO_MAX_SIZE	2048
 #define TCP_RETRANSMIT_BATCH	16
+#define TCP_SACK_MAX_BLOCKS	4 /* fits in the option space without timestamps */
+#define TCP_INIT_CWND		10 /* in segments (RFC 6928) */
+#define TCP_CWND_MAX		(1U << 30)
 
 /**
  * tcp_calculate_mss - given an ethernet MTU, returns the TCP MSS
@@ -80,6 +86,25 @@ struct tcp_pcb {
 	uint32_t	rcv_mss;	/* the send max segment size */
 };
 
+struct tcp_cc_ops;
+
+/* per-connection state private to a congestion control algorithm */
+union tcp_cc_state {
+	struct {
+		uint64_t	epoch_us;  /* start of the growth epoch, or 0 */
+		uint32_t	w_max;	   /* the window before the last loss */
+		uint32_t	origin;	   /* the plateau of the cubic curve */
+		uint32_t	k;	   /* time to reach @origin, in 2^-10 s */
+		uint32_t	w_est;	   /* the Reno-friendly window */
+	} cubic;
+	struct {
+		uint32_t	alpha;	   /* fraction of marked bytes, 2^-10 */
+		uint32_t	acked;	   /* bytes acked this window */
+		uint32_t	marked;	   /* bytes acked with ECE this window */
+		uint32_t	next_seq;  /* the end of the current window */
+	} dctcp;
+};
+
 /* the TCP connection struct */
 struct tcpconn {
 	struct trans_entry	e;
@@ -89,6 +114,7 @@ struct tcpconn {
 	spinlock_t		lock;
 	struct kref		ref;
 	int			err; /* error code for read(), write(), etc. */
+	bool			nonblocking; /* fail with -EAGAIN, don't block */
 	uint32_t		winmax; /* initial receive window size */
 
 	/* ingress path */
@@ -96,8 +122,10 @@ struct tcpconn {
 	unsigned int		rx_exclusive:1;
 	waitq_t			rx_wq;
 	unsigned int		rxq_ooo_len;
+	uint32_t		rxq_ooo_recent; /* seq of the newest OOO segment */
 	struct list_head	rxq_ooo;
 	struct list_head	rxq;
+	struct list_head	rxq_zc; /* lent out by tcp_read_zc() */
 
 	/* egress path */
 	unsigned int		tx_closed:1;
@@ -110,8 +138,18 @@ struct tcpconn {
 	bool			do_fast_retransmit;
 	uint32_t		fast_retransmit_last_ack;
 
+	/* selective acknowledgements (RFC 2018) */
+	bool			sack_ok;	/* peer negotiated SACK */
+	uint32_t		sack_high;	/* highest SACKed sequence */
+	uint32_t		sack_rxt_high;	/* highest hole resent in recovery */
+	uint64_t		sack_retransmits;
+
 	/* timeouts */
 	uint64_t 		next_timeout;
+	struct timer_entry	timer;
+	uint64_t		timer_armed_us; /* UINT64_MAX if not armed */
+	struct list_node	timeout_link;
+	bool			timeout_queued; /* on the worker's list */
 	uint64_t		ack_ts;
 	uint64_t		zero_wnd_ts;
 	union {
@@ -120,8 +158,33 @@ struct tcpconn {
 	};
 	bool			zero_wnd;
 	bool			ack_delayed;
+	bool			rto_pending;
 	int			rep_acks;
 	int			acks_delayed_cnt;
+
+	/* RTT estimation (RFC 6298) */
+	uint32_t		srtt;	/* smoothed RTT in 1/8 us, 0 if unknown */
+	uint32_t		rttvar;	/* RTT variation in 1/8 us */
+	uint32_t		rto;	/* retransmission timeout in us */
+	unsigned int		rto_backoff; /* log2 of the backoff factor */
+	uint64_t		timeouts;
+	uint64_t		fast_retransmits;
+
+	/* congestion control */
+	const struct tcp_cc_ops	*cc;
+	uint32_t		snd_cwnd;	/* congestion window */
+	uint32_t		snd_ssthresh;	/* slow start threshold */
+	uint32_t		snd_cwnd_cnt;	/* bytes acked toward growth */
+	uint32_t		cc_recover;	/* snd_nxt at the last reduction */
+	bool			cc_recovering;
+	bool			ecn_ok;		/* peer negotiated ECN */
+	bool			ecn_ce;		/* set ECE on outgoing segments */
+	bool			ecn_cwr;	/* set CWR on the next data segment */
+	uint64_t		ece_acks;
+	union tcp_cc_state	cc_state;
+
+	/* readiness notifications (see tcp_poll_add()) */
+	poll_trigger_t		poll;
 };
 
 extern tcpconn_t *tcp_conn_alloc(void);
@@ -133,6 +196,73 @@ extern void tcp_conn_fail(tcpconn_t *c, int err);
 extern void tcp_conn_shutdown_rx(tcpconn_t *c);
 extern void tcp_conn_destroy(tcpconn_t *c);
 extern void tcp_timer_update(tcpconn_t *c);
+extern void tcp_timer_arm(tcpconn_t *c, uint64_t deadline_us);
+
+/**
+ * tcp_rto - returns the current retransmission timeout, including backoff
+ * @c: the TCP connection
+ */
+static inline uint64_t tcp_rto(tcpconn_t *c)
+{
+	return MIN((uint64_t)ACCESS_ONCE(c->rto) << ACCESS_ONCE(c->rto_backoff),
+		   TCP_RTO_MAX);
+}
+
+/**
+ * tcp_rto_backoff - doubles the retransmission timeout (up to TCP_RTO_MAX)
+ * @c: the TCP connection
+ */
+static inline void tcp_rto_backoff(tcpconn_t *c)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (tcp_rto(c) < TCP_RTO_MAX)
+		c->rto_backoff++;
+}
+
+/*
+ * congestion control
+ */
+
+/* a congestion control algorithm */
+struct tcp_cc_ops {
+	const char	*name;
+	bool		ecn;	/* marks data ECT(0) and reacts to ECE */
+
+	/* resets the algorithm's private state */
+	void (*init)(tcpconn_t *c);
+	/* @acked bytes were newly acknowledged, @ece if the ACK carried ECE */
+	void (*on_ack)(tcpconn_t *c, uint32_t acked, bool ece);
+	/* a loss was detected, by an RTO if @timeout, else by duplicate ACKs */
+	void (*on_loss)(tcpconn_t *c, bool timeout);
+};
+
+extern void tcp_cc_init(tcpconn_t *c);
+extern void tcp_cc_ack(tcpconn_t *c, uint32_t acked, bool ece);
+extern void tcp_cc_loss(tcpconn_t *c, bool timeout);
+extern void tcp_cc_reno_grow(tcpconn_t *c, uint32_t acked);
+extern void tcp_cc_reno_loss(tcpconn_t *c, bool timeout);
+extern const struct tcp_cc_ops *tcp_cc_default;
+
+/**
+ * tcp_flight_size - returns the number of bytes sent but not acknowledged
+ * @c: the TCP connection
+ */
+static inline uint32_t tcp_flight_size(tcpconn_t *c)
+{
+	return c->pcb.snd_nxt - c->pcb.snd_una;
+}
+
+/**
+ * tcp_snd_wnd - returns the usable send window
+ * @c: the TCP connection
+ *
+ * The lesser of the receiver's advertised window and the congestion window.
+ */
+static inline uint32_t tcp_snd_wnd(tcpconn_t *c)
+{
+	return MIN(c->pcb.snd_wnd, c->snd_cwnd);
+}
 
 /**
  * tcp_conn_get - increments the connection ref count
@@ -159,6 +289,7 @@ static inline void tcp_conn_put(tcpconn_t *c)
 
 #define TCP_OPTION_MSS		BIT(0)
 #define TCP_OPTION_WSCALE	BIT(1)
+#define TCP_OPTION_SACK		BIT(2)
 
 struct tcp_options {
 	int		opt_en;
@@ -166,12 +297,20 @@ struct tcp_options {
 	uint8_t		wscale;
 };
 
+/* a range of received data, [@start, @end) */
+struct tcp_sack_block {
+	uint32_t	start;
+	uint32_t	end;
+};
+
 
 /*
  * ingress path
  */
 
 extern void tcp_rx_conn(struct trans_entry *e, struct mbuf *m);
+extern void tcp_rx_conn_batch(struct trans_entry *e, struct mbuf **ms,
+			      unsigned int nr);
 extern tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m);
 
 
@@ -189,9 +328,22 @@ extern int tcp_tx_ctl(tcpconn_t *c, uint8_t flags,
 		      const struct tcp_options *opts);
 extern ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len,
 			   bool push);
+
+/* tracks the segments of a zero-copy write until they are all released */
+struct tcp_zc {
+	atomic_t	ref;
+	void		(*done)(void *arg);
+	void		*arg;
+};
+
+extern ssize_t tcp_tx_send_zc(tcpconn_t *c, const void *buf, size_t len,
+			      struct tcp_zc *zc);
+extern void tcp_zc_put(struct tcp_zc *zc);
 extern void tcp_tx_retransmit(tcpconn_t *c);
-extern struct mbuf *tcp_tx_fast_retransmit_start(tcpconn_t *c);
-extern void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf *m);
+extern int tcp_tx_fast_retransmit_start(tcpconn_t *c, struct mbuf **ms);
+extern void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf **ms,
+					  int n);
+extern int tcp_sack_blocks(tcpconn_t *c, struct tcp_sack_block *blocks);
 
 /*
  * utilities
@@ -216,6 +368,29 @@ static inline bool tcp_is_snd_full(tcpconn_t *c)
 {
 	assert_spin_lock_held(&c->lock);
 
+	return wraps_lte(c->pcb.snd_una + tcp_snd_wnd(c), c->pcb.snd_nxt);
+}
+
+/**
+ * tcp_poll_notify - reports readiness to a registered poller
+ * @c: the TCP connection
+ * @events: the events (POLLEV_*) that occurred
+ *
+ * The caller must hold @c's lock.
+ */
+static inline void tcp_poll_notify(tcpconn_t *c, unsigned int events)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (c->poll.waiter)
+		poll_trigger(c->poll.waiter, &c->poll, events);
+}
+
+/* is the receiver's advertised window full (i.e. should we probe it)? */
+static inline bool tcp_is_rcv_wnd_full(tcpconn_t *c)
+{
+	assert_spin_lock_held(&c->lock);
+
 	return wraps_lte(c->pcb.snd_una + c->pcb.snd_wnd, c->pcb.snd_nxt);
 }
 
@@ -0,0 +1,410 @@
+/*
+ * tcp_cc.c - congestion control for TCP
+ *
+ * Implements Reno (RFC 5681), CUBIC (RFC 9438), and DCTCP (RFC 8257). The
+ * algorithm is chosen per connection; tcp_cc in the config file sets the
+ * default.
+ */
+
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/tcp.h>
+
+#include "tcp.h"
+
+/*
+ * Common window management
+ */
+
+/**
+ * tcp_cc_init - resets the congestion window of a new connection
+ * @c: the TCP connection
+ *
+ * Called when the connection is established, once the MSS is known.
+ */
+void tcp_cc_init(tcpconn_t *c)
+{
+	assert_spin_lock_held(&c->lock);
+
+	c->snd_cwnd = TCP_INIT_CWND * c->pcb.snd_mss;
+	c->snd_ssthresh = TCP_CWND_MAX;
+	c->snd_cwnd_cnt = 0;
+	c->cc_recovering = false;
+	c->cc->init(c);
+}
+
+/**
+ * tcp_cc_ack - informs congestion control that new data was acknowledged
+ * @c: the TCP connection
+ * @acked: the number of newly acknowledged bytes
+ * @ece: true if the ACK carried an ECN echo
+ *
+ * Must be called after @c->pcb.snd_una is advanced.
+ */
+void tcp_cc_ack(tcpconn_t *c, uint32_t acked, bool ece)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (c->cc_recovering && wraps_gte(c->pcb.snd_una, c->cc_recover))
+		c->cc_recovering = false;
+	if (ece) {
+		c->ece_acks++;
+		/* tell the receiver we reacted, so it stops echoing (RFC 3168) */
+		if (c->cc->ecn)
+			c->ecn_cwr = true;
+	}
+	c->cc->on_ack(c, acked, ece);
+}
+
+/**
+ * tcp_cc_loss - informs congestion control that a segment was lost
+ * @c: the TCP connection
+ * @timeout: true if detected by a retransmission timeout
+ *
+ * Duplicate ACKs reduce the window at most once per window of data, while
+ * a timeout always collapses the window to one segment.
+ */
+void tcp_cc_loss(tcpconn_t *c, bool timeout)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (!timeout && c->cc_recovering)
+		return;
+
+	c->cc->on_loss(c, timeout);
+	if (timeout)
+		c->snd_cwnd = c->pcb.snd_mss;
+	c->cc_recovering = true;
+	c->cc_recover = c->pcb.snd_nxt;
+}
+
+/**
+ * tcp_cc_reno_grow - grows the window using slow start or additive increase
+ * @c: the TCP connection
+ * @acked: the number of newly acknowledged bytes
+ */
+void tcp_cc_reno_grow(tcpconn_t *c, uint32_t acked)
+{
+	uint32_t mss = c->pcb.snd_mss;
+
+	if (c->cc_recovering)
+		return;
+
+	if (c->snd_cwnd < c->snd_ssthresh) {
+		/* slow start with appropriate byte counting (RFC 3465) */
+		c->snd_cwnd += MIN(acked, 2 * mss);
+	} else {
+		/* congestion avoidance, one MSS per window */
+		c->snd_cwnd_cnt += acked;
+		if (c->snd_cwnd_cnt >= c->snd_cwnd) {
+			c->snd_cwnd_cnt -= c->snd_cwnd;
+			c->snd_cwnd += mss;
+		}
+	}
+
+	c->snd_cwnd = MIN(c->snd_cwnd, TCP_CWND_MAX);
+}
+
+/**
+ * tcp_cc_reno_loss - halves the window in response to a loss
+ * @c: the TCP connection
+ * @timeout: true if detected by a retransmission timeout
+ */
+void tcp_cc_reno_loss(tcpconn_t *c, bool timeout)
+{
+	c->snd_ssthresh = MAX(tcp_flight_size(c) / 2, 2 * c->pcb.snd_mss);
+	c->snd_cwnd = c->snd_ssthresh;
+	c->snd_cwnd_cnt = 0;
+}
+
+
+/*
+ * Reno
+ */
+
+static void reno_init(tcpconn_t *c)
+{
+}
+
+static void reno_on_ack(tcpconn_t *c, uint32_t acked, bool ece)
+{
+	tcp_cc_reno_grow(c, acked);
+}
+
+static const struct tcp_cc_ops tcp_cc_reno = {
+	.name		= "reno",
+	.init		= reno_init,
+	.on_ack		= reno_on_ack,
+	.on_loss	= tcp_cc_reno_loss,
+};
+
+
+/*
+ * CUBIC
+ *
+ * Time is kept in units of 2^-10 seconds so that the cubic function can be
+ * evaluated in integer arithmetic (libm isn't linked into the runtime).
+ */
+
+#define CUBIC_C		410	/* 0.4 scaled by 2^10 */
+#define CUBIC_BETA	717	/* 0.7 scaled by 2^10 */
+#define CUBIC_HZ_SHIFT	10
+#define CUBIC_T_MAX	(1U << 16) /* about a minute */
+
+/* the integer cube root of @x */
+static uint32_t cubic_root(uint64_t x)
+{
+	uint64_t y = 0, b;
+	int s;
+
+	for (s = 63; s >= 0; s -= 3) {
+		y <<= 1;
+		b = 3 * y * (y + 1) + 1;
+		if ((x >> s) >= b) {
+			x -= b << s;
+			y++;
+		}
+	}
+
+	return y;
+}
+
+static void cubic_init(tcpconn_t *c)
+{
+	memset(&c->cc_state.cubic, 0, sizeof(c->cc_state.cubic));
+}
+
+/* computes the window one RTT from now along the cubic curve */
+static uint32_t cubic_target(tcpconn_t *c, uint64_t now_us)
+{
+	uint32_t mss = c->pcb.snd_mss;
+	uint64_t t, d, delta;
+
+	t = now_us - c->cc_state.cubic.epoch_us + (c->srtt >> 3);
+	t = (t << CUBIC_HZ_SHIFT) / ONE_SECOND;
+	d = t > c->cc_state.cubic.k ? t - c->cc_state.cubic.k :
+				      c->cc_state.cubic.k - t;
+	d = MIN(d, CUBIC_T_MAX);
+
+	/* C * d^3 segments, converted to bytes */
+	delta = (((d * d * d * mss) >> CUBIC_HZ_SHIFT) * CUBIC_C) >>
+		(2 * CUBIC_HZ_SHIFT + 10);
+
+	if (t > c->cc_state.cubic.k)
+		return MIN(c->cc_state.cubic.origin + delta, TCP_CWND_MAX);
+	return c->cc_state.cubic.origin - MIN(delta, c->cc_state.cubic.origin);
+}
+
+static void cubic_on_ack(tcpconn_t *c, uint32_t acked, bool ece)
+{
+	uint32_t mss = c->pcb.snd_mss;
+	uint64_t now_us, x, inc;
+	uint32_t target;
+
+	if (c->cc_recovering)
+		return;
+
+	if (c->snd_cwnd < c->snd_ssthresh) {
+		tcp_cc_reno_grow(c, acked);
+		return;
+	}
+
+	now_us = microtime();
+	if (!c->cc_state.cubic.epoch_us) {
+		c->cc_state.cubic.epoch_us = now_us;
+		c->cc_state.cubic.w_est = c->snd_cwnd;
+		c->snd_cwnd_cnt = 0;
+		if (c->cc_state.cubic.w_max > c->snd_cwnd) {
+			/* K = cbrt((w_max - cwnd) / C), in 2^-10 seconds */
+			x = ((uint64_t)(c->cc_state.cubic.w_max - c->snd_cwnd)
+			     << 20) / mss;
+			x = (x * 5 / 2) << 10;
+			c->cc_state.cubic.k = cubic_root(x);
+			c->cc_state.cubic.origin = c->cc_state.cubic.w_max;
+		} else {
+			c->cc_state.cubic.k = 0;
+			c->cc_state.cubic.origin = c->snd_cwnd;
+		}
+	}
+
+	/* the window standard TCP would have reached (the TCP-friendly region) */
+	c->cc_state.cubic.w_est += (uint64_t)acked * mss * 9 /
+				   (17 * (uint64_t)c->snd_cwnd);
+
+	target = cubic_target(c, now_us);
+	target = MAX(target, c->cc_state.cubic.w_est);
+	target = MIN(target, c->snd_cwnd + c->snd_cwnd / 2);
+	if (target <= c->snd_cwnd)
+		return;
+
+	/* grow by (target - cwnd) / cwnd per acked byte, keeping the remainder */
+	x = (uint64_t)(target - c->snd_cwnd) * acked + c->snd_cwnd_cnt;
+	inc = x / c->snd_cwnd;
+	c->snd_cwnd_cnt = x % c->snd_cwnd;
+	c->snd_cwnd = MIN(c->snd_cwnd + inc, TCP_CWND_MAX);
+}
+
+static void cubic_on_loss(tcpconn_t *c, bool timeout)
+{
+	uint32_t cwnd = c->snd_cwnd;
+
+	c->cc_state.cubic.epoch_us = 0;
+
+	/* fast convergence: release bandwidth to newer flows */
+	if (cwnd < c->cc_state.cubic.w_max)
+		c->cc_state.cubic.w_max = ((uint64_t)cwnd *
+					   (1024 + CUBIC_BETA)) >> 11;
+	else
+		c->cc_state.cubic.w_max = cwnd;
+
+	c->snd_ssthresh = MAX(((uint64_t)cwnd * CUBIC_BETA) >> 10,
+			      2 * c->pcb.snd_mss);
+	c->snd_cwnd = c->snd_ssthresh;
+	c->snd_cwnd_cnt = 0;
+}
+
+static const struct tcp_cc_ops tcp_cc_cubic = {
+	.name		= "cubic",
+	.init		= cubic_init,
+	.on_ack		= cubic_on_ack,
+	.on_loss	= cubic_on_loss,
+};
+
+
+/*
+ * DCTCP
+ *
+ * Data segments are marked ECT(0), and the receiver echoes the CE marking of
+ * each segment back with ECE. Once per window, alpha is updated to a moving
+ * average of the fraction of marked bytes, and the window shrinks in
+ * proportion to it.
+ */
+
+#define DCTCP_ALPHA_ONE	1024
+#define DCTCP_G_SHIFT	4	/* g = 1/16 */
+
+static void dctcp_init(tcpconn_t *c)
+{
+	c->cc_state.dctcp.alpha = DCTCP_ALPHA_ONE;
+	c->cc_state.dctcp.acked = 0;
+	c->cc_state.dctcp.marked = 0;
+	c->cc_state.dctcp.next_seq = c->pcb.snd_nxt;
+}
+
+static void dctcp_on_ack(tcpconn_t *c, uint32_t acked, bool ece)
+{
+	uint32_t frac, alpha;
+
+	c->cc_state.dctcp.acked += acked;
+	if (ece)
+		c->cc_state.dctcp.marked += acked;
+
+	if (wraps_lt(c->pcb.snd_una, c->cc_state.dctcp.next_seq)) {
+		tcp_cc_reno_grow(c, acked);
+		return;
+	}
+
+	/* a window of data has been acknowledged, so update alpha */
+	frac = ((uint64_t)c->cc_state.dctcp.marked << 10) /
+	       MAX(c->cc_state.dctcp.acked, 1);
+	alpha = c->cc_state.dctcp.alpha;
+	alpha = alpha - (alpha >> DCTCP_G_SHIFT) + (frac >> DCTCP_G_SHIFT);
+	c->cc_state.dctcp.alpha = MIN(alpha, DCTCP_ALPHA_ONE);
+
+	if (c->cc_state.dctcp.marked && !c->cc_recovering) {
+		/* cwnd = cwnd * (1 - alpha / 2) */
+		c->snd_cwnd -= ((uint64_t)c->snd_cwnd *
+				c->cc_state.dctcp.alpha) >> 11;
+		c->snd_cwnd = MAX(c->snd_cwnd, 2 * c->pcb.snd_mss);
+		c->snd_ssthresh = c->snd_cwnd;
+		c->snd_cwnd_cnt = 0;
+	} else {
+		tcp_cc_reno_grow(c, acked);
+	}
+
+	c->cc_state.dctcp.acked = 0;
+	c->cc_state.dctcp.marked = 0;
+	c->cc_state.dctcp.next_seq = c->pcb.snd_nxt;
+}
+
+static const struct tcp_cc_ops tcp_cc_dctcp = {
+	.name		= "dctcp",
+	.ecn		= true,
+	.init		= dctcp_init,
+	.on_ack		= dctcp_on_ack,
+	.on_loss	= tcp_cc_reno_loss,
+};
+
+
+/*
+ * Algorithm selection
+ */
+
+static const struct tcp_cc_ops *tcp_ccs[] = {
+	&tcp_cc_reno,
+	&tcp_cc_cubic,
+	&tcp_cc_dctcp,
+};
+
+/* the algorithm used by new connections */
+const struct tcp_cc_ops *tcp_cc_default = &tcp_cc_cubic;
+
+static const struct tcp_cc_ops *tcp_cc_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tcp_ccs); i++) {
+		if (!strcmp(tcp_ccs[i]->name, name))
+			return tcp_ccs[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * tcp_cc_set_default - sets the congestion control for new connections
+ * @name: the name of the algorithm
+ *
+ * Returns 0 if successful, or -EINVAL if the algorithm is unknown.
+ */
+int tcp_cc_set_default(const char *name)
+{
+	const struct tcp_cc_ops *cc = tcp_cc_find(name);
+
+	if (!cc)
+		return -EINVAL;
+
+	tcp_cc_default = cc;
+	return 0;
+}
+
+/**
+ * tcp_set_cc - sets the congestion control algorithm for a connection
+ * @c: the TCP connection
+ * @name: the name of the algorithm ("reno", "cubic", or "dctcp")
+ *
+ * The congestion window carries over, but the algorithm starts with fresh
+ * state. ECN is negotiated during the handshake, so an ECN-based algorithm
+ * selected on a connection whose peer did not agree to ECN behaves like Reno.
+ *
+ * Returns 0 if successful, or -EINVAL if the algorithm is unknown.
+ */
+int tcp_set_cc(tcpconn_t *c, const char *name)
+{
+	const struct tcp_cc_ops *cc = tcp_cc_find(name);
+
+	if (!cc)
+		return -EINVAL;
+
+	spin_lock_np(&c->lock);
+	c->cc = cc;
+	if (c->pcb.state >= TCP_STATE_ESTABLISHED) {
+		c->snd_cwnd_cnt = 0;
+		cc->init(c);
+	}
+	spin_unlock_np(&c->lock);
+
+	return 0;
+}
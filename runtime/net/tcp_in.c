@@ -1,12 +1,14 @@
 /*
  * tcp_in.c - the ingress datapath for TCP
  *
- * Based on RFC 793 and RFC 1122 (errata).
+ * Based on RFC 793 and RFC 1122 (errata), with SACK from RFC 2018.
  *
  * FIXME: We do too little to prevent heavy fragmentation in the out-of-order
  * RX queue.
  */
 
+#include <string.h>
+
 #include <base/stddef.h>
 #include <runtime/smalloc.h>
 #include <net/ip.h>
@@ -86,6 +88,43 @@ static void tcp_rx_append_text(tcpconn_t *c, struct mbuf *m)
 	list_add_tail(&c->rxq, &m->link);
 }
 
+/*
+ * Decides whether outgoing segments carry ECE after receiving a data segment.
+ * Returns true if ECE was turned on or changed, in which case an ACK should go
+ * out right away.
+ *
+ * With DCTCP, ECE mirrors the CE marking of the latest segment, so the sender
+ * sees the exact marked fraction (RFC 8257 Section 3.2). The peer can't be
+ * told apart from a classic ECN sender, so this assumes DCTCP is configured on
+ * both ends. Otherwise, ECE stays set from the first CE mark until the sender
+ * answers with CWR (RFC 3168 Section 6.1.3), so a lost ACK can't lose the
+ * congestion signal.
+ */
+static bool tcp_rx_ecn_update(tcpconn_t *c, const struct ip_hdr *iphdr,
+			      uint8_t flags)
+{
+	bool ce = (iphdr->tos & IPTOS_ECN_MASK) == IPTOS_ECN_CE;
+
+	assert_spin_lock_held(&c->lock);
+
+	if (!c->ecn_ok)
+		return false;
+
+	if (ACCESS_ONCE(c->cc)->ecn) {
+		if (ce == c->ecn_ce)
+			return false;
+		c->ecn_ce = ce;
+		return true;
+	}
+
+	if (flags & TCP_CWR)
+		c->ecn_ce = false;
+	if (!ce || c->ecn_ce)
+		return false;
+	c->ecn_ce = true;
+	return true;
+}
+
 /* process RX text segments, returning true if @m is used for text */
 static bool tcp_rx_text(tcpconn_t *c, struct mbuf *m, bool *wake, bool *fin)
 {
@@ -117,6 +156,7 @@ static bool tcp_rx_text(tcpconn_t *c, struct mbuf *m, bool *wake, bool *fin)
 			if (wraps_gt(m->seg_end, pos->seg_end)) {
 				list_add_after(&pos->link, &m->link);
 				c->rxq_ooo_len++;
+				c->rxq_ooo_recent = m->seg_seq;
 				goto drain;
 			} else if (wraps_gte(m->seg_seq, pos->seg_seq)) {
 				return false;
@@ -125,6 +165,7 @@ static bool tcp_rx_text(tcpconn_t *c, struct mbuf *m, bool *wake, bool *fin)
 
 		list_add(&c->rxq_ooo, &m->link);
 		c->rxq_ooo_len++;
+		c->rxq_ooo_recent = m->seg_seq;
 	}
 
 drain:
@@ -160,58 +201,152 @@ drain:
 	return true;
 }
 
-/* fast path for handling ingress packets for TCP connections */
-void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
+/* adds a range to the SACK blocks, keeping the most recent range first */
+static int tcp_sack_add(struct tcp_sack_block *blocks, int n,
+			struct tcp_sack_block b, uint32_t recent)
 {
-	tcpconn_t *c = container_of(e, tcpconn_t, e);
-	struct list_head q;
-	thread_t *rx_th = NULL;
-	const struct ip_hdr *iphdr;
-	const struct tcp_hdr *tcphdr;
-	const unsigned char *optp;
-	int optlen;
-	uint64_t nxt_wnd;
-	uint32_t seq, ack, len, snd_nxt, hdr_len, win;
-	bool do_ack = false, slow_path;
+	if (wraps_lte(b.start, recent) && wraps_lt(recent, b.end)) {
+		memmove(&blocks[1], &blocks[0],
+			sizeof(*blocks) * MIN(n, TCP_SACK_MAX_BLOCKS - 1));
+		blocks[0] = b;
+		return MIN(n + 1, TCP_SACK_MAX_BLOCKS);
+	}
 
-	list_head_init(&q);
-	snd_nxt = load_acquire(&c->pcb.snd_nxt);
+	if (n < TCP_SACK_MAX_BLOCKS)
+		blocks[n++] = b;
+	return n;
+}
+
+/**
+ * tcp_sack_blocks - describes the out-of-order RX queue as SACK blocks
+ * @c: the TCP connection
+ * @blocks: an array of TCP_SACK_MAX_BLOCKS to store the blocks
+ *
+ * The block containing the most recently received segment comes first, as
+ * required by RFC 2018, followed by the rest in sequence order.
+ *
+ * Returns the number of blocks.
+ */
+int tcp_sack_blocks(tcpconn_t *c, struct tcp_sack_block *blocks)
+{
+	struct tcp_sack_block cur;
+	struct mbuf *m;
+	bool have = false;
+	int n = 0;
+
+	assert_spin_lock_held(&c->lock);
+
+	list_for_each(&c->rxq_ooo, m, link) {
+		/* merge adjacent and overlapping segments */
+		if (have && wraps_lte(m->seg_seq, cur.end)) {
+			if (wraps_gt(m->seg_end, cur.end))
+				cur.end = m->seg_end;
+			continue;
+		}
+		if (have)
+			n = tcp_sack_add(blocks, n, cur, c->rxq_ooo_recent);
+		cur.start = m->seg_seq;
+		cur.end = m->seg_end;
+		have = true;
+	}
+	if (have)
+		n = tcp_sack_add(blocks, n, cur, c->rxq_ooo_recent);
+
+	return n;
+}
+
+/* a parsed ingress segment, before the connection lock is taken */
+struct tcp_seg {
+	struct mbuf		*m;
+	const struct ip_hdr	*iphdr;
+	const unsigned char	*optp;
+	int			optlen;
+	uint32_t		ack;
+	uint32_t		len;
+	uint32_t		win;
+};
+
+/* parses the headers of @m, returning false (and freeing @m) if malformed */
+static bool tcp_rx_parse(tcpconn_t *c, struct mbuf *m, struct tcp_seg *s)
+{
+	const struct tcp_hdr *tcphdr;
+	uint32_t seq, hdr_len;
 
 	/* find header offsets */
-	iphdr = mbuf_network_hdr(m, *iphdr);
+	s->m = m;
+	s->iphdr = mbuf_network_hdr(m, *s->iphdr);
 	mbuf_mark_transport_offset(m);
 	tcphdr = mbuf_pull_hdr_or_null(m, *tcphdr);
 	if (unlikely(!tcphdr)) {
 		mbuf_free(m);
-		return;
+		return false;
 	}
 
 	/* parse header */
 	seq = ntoh32(tcphdr->seq);
-	ack = ntoh32(tcphdr->ack);
-	win = (uint32_t)ntoh16(tcphdr->win) << c->pcb.snd_wscale;
+	s->ack = ntoh32(tcphdr->ack);
+	s->win = (uint32_t)ntoh16(tcphdr->win) << c->pcb.snd_wscale;
 	hdr_len = tcphdr->off * sizeof(uint32_t);
 	if (unlikely(hdr_len < sizeof(struct tcp_hdr))) {
 		mbuf_free(m);
-		return;
+		return false;
 	}
-	len = ntoh16(iphdr->len) - sizeof(*iphdr) - hdr_len;
-	if (unlikely(len > mbuf_length(m) || len > c->pcb.rcv_mss)) {
+	s->len = ntoh16(s->iphdr->len) - sizeof(*s->iphdr) - hdr_len;
+	if (unlikely(s->len > mbuf_length(m) || s->len > c->pcb.rcv_mss)) {
 		mbuf_free(m);
-		return;
+		return false;
 	}
 
 	m->seg_seq = seq;
-	m->seg_end = seq + len;
+	m->seg_end = seq + s->len;
 	m->flags = tcphdr->flags;
 
 	/* pull off options */
-	optlen = hdr_len - sizeof(struct tcp_hdr);
-	optp = mbuf_pull(m, optlen);
+	s->optlen = hdr_len - sizeof(struct tcp_hdr);
+	s->optp = mbuf_pull(m, s->optlen);
+	return true;
+}
+
+/*
+ * Can @s be merged into the run ending with @prev? It must carry the very next
+ * text, not need the slow path, and have the same ECN markings so congestion
+ * control sees the same signal it would have per segment.
+ */
+static bool tcp_rx_can_merge(const struct tcp_seg *prev,
+			     const struct tcp_seg *s, uint32_t snd_nxt)
+{
+	return s->m->seg_seq == prev->m->seg_end && s->len > 0 &&
+	       (s->m->flags & TCP_SLOWPATH_FLAGS) == 0 &&
+	       (s->m->flags & (TCP_ECE | TCP_CWR)) ==
+	       (prev->m->flags & (TCP_ECE | TCP_CWR)) &&
+	       (s->iphdr->tos & IPTOS_ECN_MASK) ==
+	       (prev->iphdr->tos & IPTOS_ECN_MASK) &&
+	       wraps_lte(prev->ack, s->ack) && wraps_lte(s->ack, snd_nxt);
+}
+
+/*
+ * Receives a run of segments for the same connection. Consecutive in-order
+ * segments are coalesced and handled as if they were one large segment: a
+ * single lock hold, ACK update, wakeup and delayed ACK decision for the whole
+ * run. Returns the number of segments consumed from @segs.
+ */
+static unsigned int tcp_rx_gro(tcpconn_t *c, struct tcp_seg *segs,
+			       unsigned int nr)
+{
+	struct tcp_seg *s = &segs[0], *last;
+	struct list_head q;
+	thread_t *rx_th = NULL;
+	uint64_t nxt_wnd;
+	uint32_t len, snd_nxt, acked;
+	unsigned int i, n;
+	bool do_ack = false, wake, slow_path;
+
+	list_head_init(&q);
+	snd_nxt = load_acquire(&c->pcb.snd_nxt);
 
 	/* Use slow path if not regular flags and the next segment */
-	slow_path = (tcphdr->flags & TCP_SLOWPATH_FLAGS) != 0 ||
-	            (len == 0) || wraps_gt(ack, snd_nxt);
+	slow_path = (s->m->flags & TCP_SLOWPATH_FLAGS) != 0 ||
+	            (s->len == 0) || wraps_gt(s->ack, snd_nxt);
 
 	spin_lock_np(&c->lock);
 
@@ -222,60 +357,85 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	slow_path |= tcp_is_snd_full(c);
 
 	/* Is the packet on the next in-order boundary? */
-	slow_path |= (seq != c->pcb.rcv_nxt) || !list_empty(&c->rxq_ooo);
+	slow_path |= (s->m->seg_seq != c->pcb.rcv_nxt) ||
+		     !list_empty(&c->rxq_ooo);
 
 	/* Does it fit perfectly in the receive window? */
-	slow_path |= c->pcb.rcv_wnd < len;
+	slow_path |= c->pcb.rcv_wnd < s->len;
 
-	/* Does the ack land outside snd_nxt? */
-	slow_path |= wraps_gt(ack, snd_nxt);
+	if (unlikely(slow_path)) {
+		__tcp_rx_conn(c, s->m, s->ack, snd_nxt, s->win, s->optp,
+			      s->optlen);
+		return 1;
+	}
 
-	if (unlikely(slow_path))
-		return __tcp_rx_conn(c, m, ack, snd_nxt, win, optp, optlen);
+	/* coalesce the following segments while they stay in-order */
+	len = s->len;
+	wake = !list_empty(&c->rxq) || (s->m->flags & TCP_PUSH) > 0;
+	for (n = 1; n < nr; n++) {
+		s = &segs[n];
+		if (!tcp_rx_can_merge(&segs[n - 1], s, snd_nxt) ||
+		    c->pcb.rcv_wnd - len < s->len)
+			break;
+		len += s->len;
+		wake = true;
+	}
+	last = &segs[n - 1];
 
-	STAT(RX_TCP_IN_ORDER)++;
+	STAT(RX_TCP_IN_ORDER) += n;
+	STAT(RX_TCP_COALESCED) += n - 1;
 
-	/* process acks and update send window */
-	if (wraps_lte(c->pcb.snd_una, ack)) {
+	/* process acks and update send window, using the latest segment */
+	if (wraps_lte(c->pcb.snd_una, last->ack)) {
 		/* did sent segments get acked? */
-		if (c->pcb.snd_una != ack) {
+		if (c->pcb.snd_una != last->ack) {
 			c->rep_acks = 0;
-			c->pcb.snd_una = ack;
+			acked = last->ack - c->pcb.snd_una;
+			c->pcb.snd_una = last->ack;
+			if (wraps_lt(c->sack_high, last->ack))
+				c->sack_high = last->ack;
 			tcp_conn_ack(c, &q);
+			tcp_cc_ack(c, acked, (last->m->flags & TCP_ECE) > 0);
 		}
 
 		/* should we update the send window? */
-		if (wraps_lt(c->pcb.snd_wl1, seq) ||
-		    (c->pcb.snd_wl1 == seq &&
-		     wraps_lte(c->pcb.snd_wl2, ack))) {
-			c->pcb.snd_wnd = win;
-			c->pcb.snd_wl1 = seq;
-			c->pcb.snd_wl2 = ack;
+		if (wraps_lt(c->pcb.snd_wl1, last->m->seg_seq) ||
+		    (c->pcb.snd_wl1 == last->m->seg_seq &&
+		     wraps_lte(c->pcb.snd_wl2, last->ack))) {
+			c->pcb.snd_wnd = last->win;
+			c->pcb.snd_wl1 = last->m->seg_seq;
+			c->pcb.snd_wl2 = last->ack;
 			c->rep_acks = 0;
 		}
 	}
 
-	nxt_wnd = (uint64_t)m->seg_end;
+	nxt_wnd = (uint64_t)last->m->seg_end;
 	nxt_wnd |= ((uint64_t)(c->pcb.rcv_wnd - len) << 32);
 	store_release(&c->pcb.rcv_nxt_wnd, nxt_wnd);
 
 	/* should we wake a thread */
-	if (!list_empty(&c->rxq) || (tcphdr->flags & TCP_PUSH) > 0)
+	if (wake) {
 		rx_th = waitq_signal(&c->rx_wq, &c->lock);
+		tcp_poll_notify(c, POLLEV_IN);
+	}
 
-	/* handle delayed acks */
-	if (++c->acks_delayed_cnt >= 2) {
+	/* handle delayed acks, counting each coalesced segment */
+	c->acks_delayed_cnt += n;
+	if (tcp_rx_ecn_update(c, last->iphdr, last->m->flags) ||
+	    c->acks_delayed_cnt >= 2) {
 		c->ack_delayed = false;
 		do_ack = true;
 		c->acks_delayed_cnt = 0;
 	} else if (!c->ack_delayed) {
 		c->ack_ts = microtime();
 		c->ack_delayed = true;
-		c->next_timeout = MIN(c->next_timeout, c->ack_ts + TCP_ACK_TIMEOUT);
+		tcp_timer_arm(c, c->ack_ts + TCP_ACK_TIMEOUT);
 	}
 
-	list_add_tail(&c->rxq, &m->link);
-	tcp_debug_ingress_pkt(c, m);
+	for (i = 0; i < n; i++) {
+		list_add_tail(&c->rxq, &segs[i].m->link);
+		tcp_debug_ingress_pkt(c, segs[i].m);
+	}
 	spin_unlock_np(&c->lock);
 
 	/* deferred work (delayed until after the lock was dropped) */
@@ -283,6 +443,131 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	mbuf_list_free(&q);
 	if (do_ack)
 		tcp_tx_ack(c);
+
+	return n;
+}
+
+/* fast path for handling ingress packets for TCP connections */
+void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
+{
+	tcpconn_t *c = container_of(e, tcpconn_t, e);
+	struct tcp_seg s;
+
+	if (likely(tcp_rx_parse(c, m, &s)))
+		tcp_rx_gro(c, &s, 1);
+}
+
+/**
+ * tcp_rx_conn_batch - receives several packets for the same TCP connection
+ * @e: the connection's transport entry
+ * @ms: the packets, in the order they arrived
+ * @nr: the number of packets (at most TRANS_LOOKUP_BATCH)
+ *
+ * This is the receive offload path: runs of in-order data segments are
+ * coalesced so the TCP state machine runs once per run instead of once per
+ * segment.
+ */
+void tcp_rx_conn_batch(struct trans_entry *e, struct mbuf **ms,
+		       unsigned int nr)
+{
+	tcpconn_t *c = container_of(e, tcpconn_t, e);
+	struct tcp_seg segs[TRANS_LOOKUP_BATCH];
+	unsigned int i, n = 0;
+
+	assert(nr <= TRANS_LOOKUP_BATCH);
+
+	/* parse every header before taking the lock */
+	for (i = 0; i < nr; i++) {
+		if (likely(tcp_rx_parse(c, ms[i], &segs[n])))
+			n++;
+	}
+
+	for (i = 0; i < n; i += tcp_rx_gro(c, &segs[i], n - i))
+		;
+}
+
+/* extracts the SACK blocks from a segment's options */
+static int tcp_parse_sack(const unsigned char *ptr, int len,
+			  struct tcp_sack_block *blocks)
+{
+	int n = 0, opsize, i;
+
+	while (len > 0) {
+		int opcode = *ptr;
+
+		if (opcode == TCP_OPT_EOL)
+			break;
+		if (opcode == TCP_OPT_NOP) {
+			ptr++;
+			len--;
+			continue;
+		}
+		if (len < 2)
+			break;
+		opsize = ptr[1];
+		if (opsize < 2 || opsize > len)
+			break;
+
+		if (opcode == TCP_OPT_SACK &&
+		    (opsize - 2) % TCP_OLEN_SACK_BLOCK == 0) {
+			for (i = 0; i < (opsize - 2) / TCP_OLEN_SACK_BLOCK &&
+			     n < TCP_SACK_MAX_BLOCKS; i++, n++) {
+				const unsigned char *b = ptr + 2 +
+							 i * TCP_OLEN_SACK_BLOCK;
+				blocks[n].start = ntoh32(*(uint32_t *)b);
+				blocks[n].end = ntoh32(*(uint32_t *)(b + 4));
+			}
+		}
+
+		ptr += opsize;
+		len -= opsize;
+	}
+
+	return n;
+}
+
+/*
+ * Updates the scoreboard with the SACK blocks in a segment's options, marking
+ * each fully covered segment in the TX queue. Returns true if anything new
+ * was SACKed.
+ */
+static bool tcp_rx_sack(tcpconn_t *c, const unsigned char *optp, int optlen,
+			uint32_t snd_nxt)
+{
+	struct tcp_sack_block blocks[TCP_SACK_MAX_BLOCKS];
+	struct mbuf *m;
+	bool updated = false;
+	int i, n;
+
+	assert_spin_lock_held(&c->lock);
+
+	/* the writer owns the TX queue; the receiver will repeat the blocks */
+	if (c->tx_exclusive)
+		return false;
+
+	n = tcp_parse_sack(optp, optlen, blocks);
+	for (i = 0; i < n; i++) {
+		/* ignore blocks that are stale or out of range */
+		if (!wraps_lt(c->pcb.snd_una, blocks[i].start) ||
+		    !wraps_lt(blocks[i].start, blocks[i].end) ||
+		    wraps_gt(blocks[i].end, snd_nxt))
+			continue;
+
+		list_for_each(&c->txq, m, link) {
+			if (wraps_gte(m->seg_seq, blocks[i].end))
+				break;
+			if (m->sacked || wraps_lt(m->seg_seq, blocks[i].start) ||
+			    wraps_gt(m->seg_end, blocks[i].end))
+				continue;
+			m->sacked = true;
+			updated = true;
+		}
+
+		if (wraps_gt(blocks[i].end, c->sack_high))
+			c->sack_high = blocks[i].end;
+	}
+
+	return updated;
 }
 
 static int tcp_parse_options(tcpconn_t *c, const unsigned char *ptr, int len)
@@ -317,6 +602,11 @@ static int tcp_parse_options(tcpconn_t *c, const unsigned char *ptr, int len)
 				opt_en |= TCP_OPTION_WSCALE;
 			}
 			break;
+		case TCP_OPT_SACK_PERM:
+			opsize = *ptr++;
+			if (opsize == TCP_OLEN_SACK_PERM)
+				opt_en |= TCP_OPTION_SACK;
+			break;
 		default:
 			opsize = *ptr++;
 		}
@@ -327,6 +617,7 @@ static int tcp_parse_options(tcpconn_t *c, const unsigned char *ptr, int len)
 done:
 	c->pcb.snd_mss = MIN(MAX(mss, TCP_MIN_MSS), c->pcb.rcv_mss);
 	c->pcb.snd_wscale = wscale;
+	c->sack_ok = (opt_en & TCP_OPTION_SACK) > 0;
 	if (!(opt_en & TCP_OPTION_WSCALE)) {
 		c->pcb.rcv_wnd = c->winmax = MIN(c->winmax, UINT16_MAX);
 		c->pcb.rcv_wscale = 0;
@@ -344,11 +635,12 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 {
 	struct list_head q, waiters;
 	thread_t *rx_th = NULL;
-	struct mbuf *retransmit = NULL;
+	struct mbuf *retransmit[TCP_RETRANSMIT_BATCH];
 	uint32_t seq, len;
 	bool do_ack = false, do_drop = true, fin = false, snd_was_full;
-	bool ack_same = false, wnd_updated = false;
-	int ret;
+	bool ack_same = false, wnd_updated = false, sacked = false;
+	bool do_retransmit = false;
+	int ret, nr_retransmit = 0;
 
 	list_head_init(&q);
 	list_head_init(&waiters);
@@ -396,6 +688,10 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 			if ((m->flags & TCP_ACK) > 0) {
 				c->pcb.snd_una = ack;
 				tcp_conn_ack(c, &q);
+
+				/* did the peer agree to use ECN? */
+				c->ecn_ok = (m->flags & (TCP_ECE | TCP_CWR)) ==
+					    TCP_ECE;
 			}
 			if (wraps_gt(c->pcb.snd_una, c->pcb.iss)) {
 				do_ack = true;
@@ -464,8 +760,13 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 	if (wraps_lte(c->pcb.snd_una, ack) && wraps_lte(ack, snd_nxt)) {
 		/* did sent segments get acked? */
 		if (c->pcb.snd_una != ack) {
+			uint32_t acked = ack - c->pcb.snd_una;
+
 			c->pcb.snd_una = ack;
+			if (wraps_lt(c->sack_high, ack))
+				c->sack_high = ack;
 			tcp_conn_ack(c, &q);
+			tcp_cc_ack(c, acked, (m->flags & TCP_ECE) > 0);
 		} else {
 			ack_same = true;
 		}
@@ -486,8 +787,14 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 		do_ack = true;
 		goto done;
 	}
-	if (snd_was_full && !tcp_is_snd_full(c))
+	if (snd_was_full && !tcp_is_snd_full(c)) {
 		waitq_release_start(&c->tx_wq, &waiters);
+		tcp_poll_notify(c, POLLEV_OUT);
+	}
+
+	/* update the scoreboard */
+	if (c->sack_ok && optlen > 0)
+		sacked = tcp_rx_sack(c, optp, optlen, snd_nxt);
 
 	/*
 	 * Fast retransmit -> detect a duplicate ACK if:
@@ -500,16 +807,32 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 		     len == 0 && !wnd_updated)) {
 		c->rep_acks++;
 		if (c->rep_acks >= TCP_FAST_RETRANSMIT_THRESH) {
-			if (c->tx_exclusive) {
-				c->do_fast_retransmit = true;
-				c->fast_retransmit_last_ack = ack;
-			} else {
-				retransmit = tcp_tx_fast_retransmit_start(c);
-			}
+			c->fast_retransmits++;
+			if (!c->cc_recovering)
+				c->sack_rxt_high = c->pcb.snd_una;
+			tcp_cc_loss(c, false);
+			do_retransmit = true;
 			c->rep_acks = 0;
+		} else {
+			/* new SACK info during recovery can reveal more holes */
+			do_retransmit = sacked && c->cc_recovering;
 		}
 	} else if (c->pcb.snd_una == ack) {
 		c->rep_acks = 0;
+
+		/* a partial ACK during recovery, so resend the remaining holes */
+		do_retransmit = !ack_same && c->sack_ok && c->cc_recovering &&
+				wraps_gt(c->sack_high, c->pcb.snd_una);
+	}
+
+	if (do_retransmit) {
+		if (c->tx_exclusive) {
+			c->do_fast_retransmit = true;
+			c->fast_retransmit_last_ack = ack;
+		} else {
+			nr_retransmit = tcp_tx_fast_retransmit_start(c,
+								     retransmit);
+		}
 	}
 
 	if (c->pcb.state == TCP_STATE_FIN_WAIT1 &&
@@ -548,8 +871,11 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 			assert(!list_empty(&c->rxq));
 			assert(do_drop == false);
 			rx_th = waitq_signal(&c->rx_wq, &c->lock);
+			tcp_poll_notify(c, POLLEV_IN);
 		}
-		if (++c->acks_delayed_cnt >= 2) {
+		if (tcp_rx_ecn_update(c, mbuf_network_hdr(m, struct ip_hdr),
+				      m->flags) ||
+		    ++c->acks_delayed_cnt >= 2) {
 			do_ack = true;
 		} else if (!c->ack_delayed) {
 			c->ack_delayed = true;
@@ -587,7 +913,7 @@ done:
 	if (rx_th)
 		waitq_signal_finish(rx_th);
 	mbuf_list_free(&q);
-	tcp_tx_fast_retransmit_finish(c, retransmit);
+	tcp_tx_fast_retransmit_finish(c, retransmit, nr_retransmit);
 	if (do_ack)
 		tcp_tx_ack(c);
 	if (do_drop)
@@ -604,6 +930,7 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 	tcpconn_t *c;
 	struct tcp_options opts;
 	uint32_t hdr_len;
+	uint8_t flags = TCP_SYN | TCP_ACK;
 	int optlen, ret;
 
 	/* find header offsets */
@@ -649,6 +976,12 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 	opts.mss = c->pcb.rcv_mss;
 	opts.wscale = c->pcb.rcv_wscale;
 
+	/* accept ECN if offered (RFC 3168 Section 6.1.1) */
+	if ((tcphdr->flags & (TCP_ECE | TCP_CWR)) == (TCP_ECE | TCP_CWR)) {
+		c->ecn_ok = true;
+		flags |= TCP_ECE;
+	}
+
 	/*
 	 * attach the connection to the transport layer. From this point onward
 	 * ingress packets can be dispatched to the connection.
@@ -662,7 +995,7 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 
 	/* finally, send a SYN/ACK to the remote host */
 	spin_lock_np(&c->lock);
-	ret = tcp_tx_ctl(c, TCP_SYN | TCP_ACK, &opts);
+	ret = tcp_tx_ctl(c, flags, &opts);
 	if (unlikely(ret)) {
 		spin_unlock_np(&c->lock);
 		tcp_conn_destroy(c);
@@ -5,6 +5,8 @@
 #include <string.h>
 
 #include <base/stddef.h>
+#include <base/hash.h>
+#include <runtime/smalloc.h>
 #include <net/ip.h>
 #include <net/tcp.h>
 #include <net/chksum.h>
@@ -18,6 +20,30 @@ static void tcp_tx_release_mbuf(struct mbuf *m)
 		net_tx_release_mbuf(m);
 }
 
+/**
+ * tcp_zc_put - drops a reference to a zero-copy write
+ * @zc: the zero-copy write
+ *
+ * Notifies the writer once its buffer is no longer referenced.
+ */
+void tcp_zc_put(struct tcp_zc *zc)
+{
+	if (atomic_dec_and_test(&zc->ref)) {
+		zc->done(zc->arg);
+		sfree(zc);
+	}
+}
+
+static void tcp_tx_release_zc_mbuf(struct mbuf *m)
+{
+	struct tcp_zc *zc = (struct tcp_zc *)m->release_data;
+
+	if (atomic_dec_and_test(&m->ref)) {
+		net_tx_release_mbuf(m);
+		tcp_zc_put(zc);
+	}
+}
+
 static uint16_t tcp_hdr_chksum(uint32_t local_ip, uint32_t remote_ip,
 			       uint16_t len)
 {
@@ -30,6 +56,25 @@ static uint16_t tcp_hdr_chksum(uint32_t local_ip, uint32_t remote_ip,
 	return ipv4_phdr_cksum(IPPROTO_TCP, local_ip, remote_ip, len);
 }
 
+/* transmits a data segment, unless loss injection decides to drop it */
+static int tcp_tx_segment(tcpconn_t *c, struct mbuf *m)
+{
+	uint8_t tos = IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT;
+
+	if (unlikely(cfg_tcp_tx_drop_ppm) &&
+	    rand_crc32c(rdtsc()) % 1000000 < cfg_tcp_tx_drop_ppm) {
+		/* act as if the packet was lost on the wire */
+		mbuf_free(m);
+		return 0;
+	}
+
+	/* retransmissions must not be ECN-capable (RFC 3168 Section 6.1.5) */
+	if (c->ecn_ok && ACCESS_ONCE(c->cc)->ecn && !m->retransmitted)
+		tos = IPTOS_DSCP_CS0 | IPTOS_ECN_ECT0;
+
+	return net_tx_ip_tos(m, IPPROTO_TCP, c->e.raddr.ip, tos);
+}
+
 static __always_inline struct tcp_hdr *
 tcp_push_tcphdr(struct mbuf *m, tcpconn_t *c, uint8_t flags,
 		uint8_t off, uint16_t l4len)
@@ -47,13 +92,55 @@ tcp_push_tcphdr(struct mbuf *m, tcpconn_t *c, uint8_t flags,
 	tcphdr->ack = hton32(ack);
 	tcphdr->off = off;
 	tcphdr->flags = flags;
+	if (ACCESS_ONCE(c->ecn_ce))
+		tcphdr->flags |= TCP_ECE;
+	if (l4len && !m->retransmitted && ACCESS_ONCE(c->ecn_cwr)) {
+		tcphdr->flags |= TCP_CWR;
+		ACCESS_ONCE(c->ecn_cwr) = false;
+	}
 	tcphdr->win = hton16(win >> c->pcb.rcv_wscale);
 	tcphdr->seq = hton32(m->seg_seq);
-	tcphdr->sum = tcp_hdr_chksum(c->e.laddr.ip, c->e.raddr.ip,
-				     off * sizeof(uint32_t) + l4len);
+	/* with TSO, the length is left out of the pseudo header checksum */
+	if (m->txflags & OLFLAG_TCP_TSO)
+		tcphdr->sum = tcp_hdr_chksum(c->e.laddr.ip, c->e.raddr.ip, 0);
+	else
+		tcphdr->sum = tcp_hdr_chksum(c->e.laddr.ip, c->e.raddr.ip,
+					     off * sizeof(uint32_t) + l4len);
 	return tcphdr;
 }
 
+/* the most payload a data segment in @m may carry */
+static uint32_t tcp_tx_seg_max(tcpconn_t *c, struct mbuf *m)
+{
+	uint32_t mss = c->pcb.snd_mss;
+
+	if (m->head_len <= net_get_mtu())
+		return mss;
+	return MIN(cfg_tcp_tso_segs, m->head_len / mss) * mss;
+}
+
+/* the most payload a zero-copy data segment may carry */
+static uint32_t tcp_tx_zc_seg_max(tcpconn_t *c)
+{
+	uint32_t mss = c->pcb.snd_mss;
+	uint32_t max_len = NET_TSO_BUF_LEN - MBUF_HEAD_LEN -
+			   MBUF_DEFAULT_HEADROOM;
+
+	if (cfg_tcp_tso_segs <= 1)
+		return mss;
+	return MIN(cfg_tcp_tso_segs, max_len / mss) * mss;
+}
+
+/* asks the NIC to checksum a data segment and to split it if it's large */
+static void tcp_tx_set_offload(tcpconn_t *c, struct mbuf *m, uint32_t l4len)
+{
+	m->txflags = OLFLAG_TCP_CHKSUM;
+	if (l4len > c->pcb.snd_mss) {
+		m->txflags |= OLFLAG_TCP_TSO;
+		m->tso_segsz = c->pcb.snd_mss;
+	}
+}
+
 /**
  * tcp_tx_raw_rst - send a RST without an established connection
  * @laddr: the local address
@@ -132,16 +219,47 @@ int tcp_tx_raw_rst_ack(struct netaddr laddr, struct netaddr raddr,
 	return ret;
 }
 
+/* writes a SACK option, returning its length in 32-bit words */
+static int tcp_push_sack(struct mbuf *m, const struct tcp_sack_block *blocks,
+			 int n)
+{
+	uint32_t *ptr;
+	int i;
+
+	if (!n)
+		return 0;
+
+	ptr = (uint32_t *)mbuf_push(m, sizeof(uint32_t) * (1 + 2 * n));
+	ptr[0] = hton32((TCP_OPT_NOP << 24) | (TCP_OPT_NOP << 16) |
+			(TCP_OPT_SACK << 8) | (2 + TCP_OLEN_SACK_BLOCK * n));
+	for (i = 0; i < n; i++) {
+		ptr[1 + 2 * i] = hton32(blocks[i].start);
+		ptr[2 + 2 * i] = hton32(blocks[i].end);
+	}
+
+	return 1 + 2 * n;
+}
+
 /**
  * tcp_tx_ack - send an acknowledgement and window update packet
  * @c: the connection to send the ACK
  *
+ * If segments are waiting in the out-of-order queue, the ACK carries SACK
+ * blocks describing them.
+ *
  * Returns 0 if succesful, otherwise fail.
  */
 int tcp_tx_ack(tcpconn_t *c)
 {
+	struct tcp_sack_block blocks[TCP_SACK_MAX_BLOCKS];
 	struct mbuf *m;
-	int ret;
+	int ret, nr_blocks = 0;
+
+	if (c->sack_ok && ACCESS_ONCE(c->rxq_ooo_len) > 0) {
+		spin_lock_np(&c->lock);
+		nr_blocks = tcp_sack_blocks(c, blocks);
+		spin_unlock_np(&c->lock);
+	}
 
 	m = net_tx_alloc_mbuf();
 	if (unlikely(!m))
@@ -149,7 +267,8 @@ int tcp_tx_ack(tcpconn_t *c)
 
 	m->txflags = OLFLAG_TCP_CHKSUM;
 	m->seg_seq = load_acquire(&c->pcb.snd_nxt);
-	tcp_push_tcphdr(m, c, TCP_ACK, 5, 0);
+	ret = tcp_push_sack(m, blocks, nr_blocks);
+	tcp_push_tcphdr(m, c, TCP_ACK, 5 + ret, 0);
 
 	/* transmit packet */
 	tcp_debug_egress_pkt(c, m);
@@ -197,6 +316,12 @@ static int tcp_push_options(struct mbuf *m, const struct tcp_options *opts)
 
 	/* WARNING: the order matters, as some devices are broken */
 
+	if (opts->opt_en & TCP_OPTION_SACK) {
+		ptr = (uint32_t *)mbuf_push(m, sizeof(uint32_t));
+		*ptr = hton32((TCP_OPT_NOP << 24) | (TCP_OPT_NOP << 16) |
+			      (TCP_OPT_SACK_PERM << 8) | TCP_OLEN_SACK_PERM);
+		len++;
+	}
 	if (opts->opt_en & TCP_OPTION_WSCALE) {
 		ptr = (uint32_t *)mbuf_push(m, sizeof(uint32_t));
 		*ptr = hton32((TCP_OPT_NOP << 24) | (TCP_OPT_WSCALE << 16) |
@@ -239,6 +364,8 @@ int tcp_tx_ctl(tcpconn_t *c, uint8_t flags, const struct tcp_options *opts)
 	m->seg_seq = c->pcb.snd_nxt;
 	m->seg_end = c->pcb.snd_nxt + 1;
 	m->flags = flags;
+	m->retransmitted = false;
+	m->sacked = false;
 
 	if (opts)
 		ret = tcp_push_options(m, opts);
@@ -280,7 +407,7 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 	const char *end = pos + len;
 	ssize_t ret = 0;
 	size_t seglen;
-	uint32_t mss = c->pcb.snd_mss;
+	uint32_t mss = c->pcb.snd_mss, segmax;
 
 	assert(c->pcb.state >= TCP_STATE_ESTABLISHED);
 	assert((c->tx_exclusive == true) || spin_lock_held(&c->lock));
@@ -294,18 +421,27 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 		if (c->tx_pending) {
 			m = c->tx_pending;
 			c->tx_pending = NULL;
-			seglen = MIN(end - pos, mss - mbuf_length(m));
+			segmax = tcp_tx_seg_max(c, m);
+			seglen = MIN(end - pos, segmax - mbuf_length(m));
 			m->seg_end += seglen;
 		} else {
-			m = net_tx_alloc_mbuf();
+			/* bulk sends use large buffers that the NIC splits */
+			m = NULL;
+			if (end - pos > mss && cfg_tcp_tso_segs > 1)
+				m = net_tx_alloc_tso_mbuf();
+			if (!m)
+				m = net_tx_alloc_mbuf();
 			if (unlikely(!m)) {
 				ret = -ENOBUFS;
 				break;
 			}
-			seglen = MIN(end - pos, mss);
+			segmax = tcp_tx_seg_max(c, m);
+			seglen = MIN(end - pos, segmax);
 			m->seg_seq = c->pcb.snd_nxt;
 			m->seg_end = c->pcb.snd_nxt + seglen;
 			m->flags = TCP_ACK;
+			m->retransmitted = false;
+			m->sacked = false;
 			atomic_write(&m->ref, 2);
 			m->release = tcp_tx_release_mbuf;
 		}
@@ -316,7 +452,7 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 
 		/* if not pushing, keep the last buffer for later */
 		if (!push && pos == end && mbuf_length(m) -
-		    sizeof(struct tcp_hdr) < mss) {
+		    sizeof(struct tcp_hdr) < segmax) {
 			c->tx_pending = m;
 			break;
 		}
@@ -324,14 +460,14 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 		/* initialize TCP header */
 		if (push && pos == end)
 			m->flags |= TCP_PUSH;
+		tcp_tx_set_offload(c, m, m->seg_end - m->seg_seq);
 		tcp_push_tcphdr(m, c, m->flags, 5, m->seg_end - m->seg_seq);
 
 		/* transmit the packet */
 		list_add_tail(&c->txq, &m->link);
 		tcp_debug_egress_pkt(c, m);
 		m->timestamp = microtime();
-		m->txflags = OLFLAG_TCP_CHKSUM;
-		ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
+		ret = tcp_tx_segment(c, m);
 		if (unlikely(ret)) {
 			/* pretend the packet was sent */
 			atomic_write(&m->ref, 1);
@@ -344,6 +480,140 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 	return ret;
 }
 
+/**
+ * tcp_tx_send_zc - transmit a buffer on a TCP connection without copying it
+ * @c: the TCP connection
+ * @buf: the buffer to transmit (must be valid for net_tx_zc_valid())
+ * @len: the length of the buffer to transmit
+ * @zc: the zero-copy write, gains a reference for each segment
+ *
+ * Each segment holds only headers and points at its payload in @buf.
+ *
+ * WARNING: The caller is responsible for respecting the TCP window size limit.
+ * WARNING: The caller must have write exclusive access to the socket or hold
+ * @c->lock while write exclusion isn't taken.
+ *
+ * Returns the number of bytes transmitted, or < 0 if there was an error. The
+ * return value is positive whenever a segment took a reference on @zc.
+ */
+ssize_t tcp_tx_send_zc(tcpconn_t *c, const void *buf, size_t len,
+		       struct tcp_zc *zc)
+{
+	struct mbuf *m;
+	const char *pos = buf;
+	const char *end = pos + len;
+	ssize_t ret = 0;
+	size_t seglen;
+	uint32_t segmax = tcp_tx_zc_seg_max(c);
+
+	assert(c->pcb.state >= TCP_STATE_ESTABLISHED);
+	assert((c->tx_exclusive == true) || spin_lock_held(&c->lock));
+
+	/* a partial segment can't be extended in place, so send it first */
+	if (c->tx_pending)
+		tcp_tx_send(c, buf, 0, true);
+
+	while (pos < end) {
+		m = net_tx_alloc_mbuf();
+		if (unlikely(!m)) {
+			ret = -ENOBUFS;
+			break;
+		}
+
+		seglen = MIN(end - pos, segmax);
+		m->seg_seq = c->pcb.snd_nxt;
+		m->seg_end = c->pcb.snd_nxt + seglen;
+		m->flags = TCP_ACK;
+		m->retransmitted = false;
+		m->sacked = false;
+		m->ext_data = (unsigned char *)pos;
+		m->ext_len = seglen;
+		m->release_data = (unsigned long)zc;
+		atomic_inc(&zc->ref);
+		atomic_write(&m->ref, 2);
+		m->release = tcp_tx_release_zc_mbuf;
+		store_release(&c->pcb.snd_nxt, c->pcb.snd_nxt + seglen);
+		pos += seglen;
+
+		/* initialize TCP header */
+		if (pos == end)
+			m->flags |= TCP_PUSH;
+		tcp_tx_set_offload(c, m, seglen);
+		tcp_push_tcphdr(m, c, m->flags, 5, seglen);
+
+		/* transmit the packet */
+		list_add_tail(&c->txq, &m->link);
+		tcp_debug_egress_pkt(c, m);
+		m->timestamp = microtime();
+		ret = tcp_tx_segment(c, m);
+		if (unlikely(ret)) {
+			/* pretend the packet was sent */
+			atomic_write(&m->ref, 1);
+		}
+	}
+
+	/* if we sent anything return the length we sent instead of an error */
+	if (pos - (const char *)buf > 0)
+		ret = pos - (const char *)buf;
+	return ret;
+}
+
+/*
+ * Resends a segment larger than the MSS that the NIC still holds as MSS-sized
+ * copies, for when the TSO mbuf pool is drained. The segment must not carry
+ * zero-copy payload.
+ */
+static int tcp_tx_retransmit_split(tcpconn_t *c, struct mbuf *m,
+				   uint16_t l4len, uint8_t opts_len)
+{
+	const unsigned char *opts = mbuf_transport_offset(m) +
+				    sizeof(struct tcp_hdr);
+	const unsigned char *data = opts + sizeof(uint32_t) * opts_len;
+	uint32_t una = load_acquire(&c->pcb.snd_una);
+	uint32_t off = 0, seglen;
+	struct mbuf *newm;
+	int ret;
+
+	assert(m->ext_len == 0);
+
+	/* skip anything that was acknowledged in the meantime */
+	if (wraps_lt(m->seg_seq, una))
+		off = una - m->seg_seq;
+
+	while (off < l4len) {
+		seglen = MIN(l4len - off, c->pcb.snd_mss);
+		newm = net_tx_alloc_mbuf();
+		if (unlikely(!newm))
+			return -ENOMEM;
+		memcpy(mbuf_put(newm, sizeof(uint32_t) * opts_len), opts,
+		       sizeof(uint32_t) * opts_len);
+		memcpy(mbuf_put(newm, seglen), data + off, seglen);
+		newm->seg_seq = m->seg_seq + off;
+		newm->retransmitted = true;
+
+		/* only the last piece carries PUSH and FIN */
+		if (off + seglen == l4len) {
+			newm->flags = m->flags;
+			newm->seg_end = m->seg_end;
+		} else {
+			newm->flags = m->flags & ~(TCP_PUSH | TCP_FIN);
+			newm->seg_end = newm->seg_seq + seglen;
+		}
+
+		tcp_tx_set_offload(c, newm, seglen);
+		tcp_push_tcphdr(newm, c, newm->flags, 5 + opts_len, seglen);
+		tcp_debug_egress_pkt(c, newm);
+		ret = tcp_tx_segment(c, newm);
+		if (unlikely(ret)) {
+			mbuf_free(newm);
+			return ret;
+		}
+		off += seglen;
+	}
+
+	return 0;
+}
+
 static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 {
 	int ret;
@@ -363,16 +633,37 @@ static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 	 * in such corner cases.
 	 */
 	if (unlikely(atomic_read(&m->ref) != 1)) {
-		struct mbuf *newm = net_tx_alloc_mbuf();
+		struct mbuf *newm = NULL;
+		uint32_t linear_len = l4len - m->ext_len;
+		if (linear_len > c->pcb.snd_mss) {
+			newm = net_tx_alloc_tso_mbuf();
+			/* TSO mbufs ran out, so resend it one MSS at a time */
+			if (unlikely(!newm))
+				return tcp_tx_retransmit_split(c, m, l4len,
+							       opts_len);
+		} else {
+			newm = net_tx_alloc_mbuf();
+		}
 		if (unlikely(!newm))
 			return -ENOMEM;
-		memcpy(mbuf_put(newm, sizeof(uint32_t) * opts_len + l4len),
+		memcpy(mbuf_put(newm, sizeof(uint32_t) * opts_len + linear_len),
 		       mbuf_transport_offset(m) + sizeof(struct tcp_hdr),
-		       sizeof(uint32_t) * opts_len + l4len);
+		       sizeof(uint32_t) * opts_len + linear_len);
 		newm->flags = m->flags;
 		newm->seg_seq = m->seg_seq;
 		newm->seg_end = m->seg_end;
-		newm->txflags = OLFLAG_TCP_CHKSUM;
+
+		/* zero-copy payload is shared rather than copied */
+		if (m->ext_len) {
+			struct tcp_zc *zc = (struct tcp_zc *)m->release_data;
+
+			newm->ext_data = m->ext_data;
+			newm->ext_len = m->ext_len;
+			newm->release_data = (unsigned long)zc;
+			newm->release = tcp_tx_release_zc_mbuf;
+			atomic_inc(&zc->ref);
+			atomic_write(&newm->ref, 1);
+		}
 		m = newm;
 	} else {
 		/* strip headers and reset ref count */
@@ -386,48 +677,93 @@ static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 		mbuf_free(m);
 		return 0;
 	} else if (unlikely(wraps_lt(m->seg_seq, una))) {
-		mbuf_pull(m, una - m->seg_seq);
+		l4len -= una - m->seg_seq;
+		if (m->ext_len) {
+			/* zero-copy segments carry all payload externally */
+			m->ext_data += una - m->seg_seq;
+			m->ext_len -= una - m->seg_seq;
+		} else {
+			mbuf_pull(m, una - m->seg_seq);
+		}
 		m->seg_seq = una;
 	}
 
 	/* push the TCP header back on (now with fresher ack) */
+	tcp_tx_set_offload(c, m, l4len);
 	tcp_push_tcphdr(m, c, m->flags, 5 + opts_len, l4len);
 
 	/* transmit the packet */
 	tcp_debug_egress_pkt(c, m);
-	ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
+	ret = tcp_tx_segment(c, m);
 	if (unlikely(ret))
 		mbuf_free(m);
 	return ret;
 }
 
 /**
- * tcp_tx_fast_retransmit - resend the first pending egress packet
+ * tcp_tx_fast_retransmit_start - picks the lost segments to resend
  * @c: the TCP connection in which to send retransmissions
+ * @ms: an array of TCP_RETRANSMIT_BATCH to store the segments
+ *
+ * Without SACK information, only the first unacknowledged segment is resent.
+ * Otherwise, every hole below the highest SACKed sequence is resent, unless
+ * it was already resent during this recovery. Pass the segments to
+ * tcp_tx_fast_retransmit_finish() after releasing @c->lock.
+ *
+ * Returns the number of segments stored in @ms.
  */
-struct mbuf *tcp_tx_fast_retransmit_start(tcpconn_t *c)
+int tcp_tx_fast_retransmit_start(tcpconn_t *c, struct mbuf **ms)
 {
 	struct mbuf *m;
+	uint64_t now = microtime();
+	int i, n = 0;
 
 	assert_spin_lock_held(&c->lock);
 
 	if (c->tx_exclusive)
-		return NULL;
+		return 0;
 
-	m = list_top(&c->txq, struct mbuf, link);
-	if (m) {
-		m->timestamp = microtime();
-		atomic_inc(&m->ref);
+	if (!c->sack_ok || wraps_lte(c->sack_high, c->pcb.snd_una)) {
+		m = list_top(&c->txq, struct mbuf, link);
+		if (m)
+			ms[n++] = m;
+	} else {
+		list_for_each(&c->txq, m, link) {
+			if (wraps_gte(m->seg_seq, c->sack_high))
+				break;
+			if (m->sacked || wraps_lt(m->seg_seq, c->sack_rxt_high))
+				continue;
+			ms[n++] = m;
+			c->sack_rxt_high = m->seg_end;
+			if (n >= TCP_RETRANSMIT_BATCH)
+				break;
+		}
+		c->sack_retransmits += n;
+	}
+
+	for (i = 0; i < n; i++) {
+		ms[i]->timestamp = now;
+		ms[i]->retransmitted = true;
+		atomic_inc(&ms[i]->ref);
 	}
 
-	return m;
+	return n;
 }
 
-void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf *m)
+/**
+ * tcp_tx_fast_retransmit_finish - resends the segments picked by
+ * tcp_tx_fast_retransmit_start()
+ * @c: the TCP connection in which to send retransmissions
+ * @ms: the segments
+ * @n: the number of segments
+ */
+void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf **ms, int n)
 {
-	if (m) {
-		tcp_tx_retransmit_one(c, m);
-		mbuf_free(m);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		tcp_tx_retransmit_one(c, ms[i]);
+		mbuf_free(ms[i]);
 	}
 }
 
@@ -438,7 +774,7 @@ void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf *m)
 void tcp_tx_retransmit(tcpconn_t *c)
 {
 	struct mbuf *m;
-	uint64_t now = microtime();
+	uint64_t now = microtime(), rto = tcp_rto(c);
 
 	assert(spin_lock_held(&c->lock) || c->tx_exclusive);
 
@@ -447,13 +783,18 @@ void tcp_tx_retransmit(tcpconn_t *c)
 	int count = 0;
 	list_for_each(&c->txq, m, link) {
 		/* check if the timeout expired */
-		if (now - m->timestamp < TCP_RETRANSMIT_TIMEOUT)
+		if (now - m->timestamp < rto)
 			break;
 
 		if (wraps_gte(load_acquire(&c->pcb.snd_una), m->seg_end))
 			continue;
 
+		/* SACKed since the timeout cleared the SACK state */
+		if (m->sacked)
+			continue;
+
 		m->timestamp = now;
+		m->retransmitted = true;
 		ret = tcp_tx_retransmit_one(c, m);
 		if (ret)
 			break;
@@ -2,16 +2,57 @@
  * transport.c - handles transport protocol packets (UDP and TCP)
  */
 
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <base/stddef.h>
 #include <base/hash.h>
-#include <runtime/rculist.h>
+#include <base/log.h>
+#include <runtime/rcu.h>
 #include <runtime/sync.h>
 #include <runtime/net.h>
 #include <net/ip.h>
 
 #include "defs.h"
 
-#define TRANS_TBL_SIZE	16384
+/*
+ * The match table is open addressed with linear probing over cache-line
+ * buckets. Each bucket holds a few entries along with a compact signature of
+ * each entry's hash, so a lookup usually reads one line of signatures and then
+ * only the entry it is after. A lookup stops at the first bucket with an empty
+ * slot; removed entries leave a tombstone behind until the table is rebuilt.
+ *
+ * The table grows by migrating a few buckets into a larger table on every
+ * update, rather than all at once. While a migration is in progress, lookups
+ * check the new table first and then the old one. All updates are serialized
+ * by trans_lock, and readers only need an RCU read lock.
+ */
+
+#define TRANS_BUCKET_SLOTS	5
+#define TRANS_MIN_BUCKETS	4096
+#define TRANS_MIGRATE_BATCH	16
+
+/* signatures with the top bit clear are reserved */
+#define TRANS_SIG_EMPTY		0
+#define TRANS_SIG_DELETED	1
+#define TRANS_SIG_VALID		(1u << 31)
+
+struct trans_bucket {
+	uint32_t		sigs[TRANS_BUCKET_SLOTS];
+	uint32_t		pad;
+	struct trans_entry	*entries[TRANS_BUCKET_SLOTS];
+} __aligned(CACHE_LINE_SIZE);
+
+BUILD_ASSERT(sizeof(struct trans_bucket) == CACHE_LINE_SIZE);
+
+struct trans_table {
+	struct trans_bucket	*buckets;
+	unsigned int		mask;
+	unsigned int		used;
+	unsigned int		deleted;
+	struct rcu_head		rcu;
+};
 
 /* ephemeral port definitions (IANA suggested range) */
 #define MIN_EPHEMERAL		49152
@@ -39,8 +80,246 @@ static inline uint32_t trans_hash_5tuple(uint8_t proto, struct netaddr laddr,
 		((uint64_t)proto << 48));
 }
 
+static inline uint32_t trans_entry_hash(struct trans_entry *e)
+{
+	if (e->match == TRANS_MATCH_3TUPLE)
+		return trans_hash_3tuple(e->proto, e->laddr);
+	return trans_hash_5tuple(e->proto, e->laddr, e->raddr);
+}
+
+/* the low hash bits pick the bucket, so keep the rest for the signature */
+static inline uint32_t trans_sig(uint32_t hash)
+{
+	return (hash >> 1) | TRANS_SIG_VALID;
+}
+
+static inline bool trans_entry_matches(struct trans_entry *e, int match,
+				       const struct trans_key *k)
+{
+	if (e->match != match || e->proto != k->proto ||
+	    e->laddr.ip != k->laddr.ip || e->laddr.port != k->laddr.port)
+		return false;
+	return match == TRANS_MATCH_3TUPLE ||
+	       (e->raddr.ip == k->raddr.ip && e->raddr.port == k->raddr.port);
+}
+
 static DEFINE_SPINLOCK(trans_lock);
-static struct rcu_hlist_head trans_tbl[TRANS_TBL_SIZE];
+/* the table that takes insertions */
+static struct trans_table __rcu *trans_tbl;
+/* the table being migrated into trans_tbl, if any */
+static struct trans_table __rcu *trans_old_tbl;
+/* the next bucket of trans_old_tbl to migrate */
+static unsigned int trans_migrate_pos;
+
+static struct trans_table *trans_tbl_alloc(unsigned int nr_buckets)
+{
+	struct trans_table *t;
+
+	t = malloc(sizeof(*t));
+	if (!t)
+		return NULL;
+	t->buckets = aligned_alloc(CACHE_LINE_SIZE,
+				   nr_buckets * sizeof(struct trans_bucket));
+	if (!t->buckets) {
+		free(t);
+		return NULL;
+	}
+	memset(t->buckets, 0, nr_buckets * sizeof(struct trans_bucket));
+	t->mask = nr_buckets - 1;
+	t->used = 0;
+	t->deleted = 0;
+	return t;
+}
+
+static void trans_tbl_release(struct rcu_head *h)
+{
+	struct trans_table *t = container_of(h, struct trans_table, rcu);
+
+	free(t->buckets);
+	free(t);
+}
+
+static struct trans_entry *trans_tbl_find(struct trans_table *t,
+					  uint32_t hash, int match,
+					  const struct trans_key *k)
+{
+	uint32_t sig = trans_sig(hash), s;
+	struct trans_bucket *b;
+	struct trans_entry *e;
+	unsigned int i, n;
+
+	for (n = 0; n <= t->mask; n++) {
+		b = &t->buckets[(hash + n) & t->mask];
+		for (i = 0; i < TRANS_BUCKET_SLOTS; i++) {
+			s = load_acquire(&b->sigs[i]);
+			if (s == TRANS_SIG_EMPTY)
+				return NULL;
+			if (s != sig)
+				continue;
+			e = ACCESS_ONCE(b->entries[i]);
+			if (e && trans_entry_matches(e, match, k))
+				return e;
+		}
+	}
+
+	return NULL;
+}
+
+static void trans_tbl_insert(struct trans_table *t, uint32_t hash,
+			     struct trans_entry *e)
+{
+	struct trans_bucket *b;
+	unsigned int i, n;
+	uint32_t s;
+
+	assert_spin_lock_held(&trans_lock);
+
+	/* the table is kept below full, so there is always a free slot */
+	for (n = 0; n <= t->mask; n++) {
+		b = &t->buckets[(hash + n) & t->mask];
+		for (i = 0; i < TRANS_BUCKET_SLOTS; i++) {
+			s = b->sigs[i];
+			if (s != TRANS_SIG_EMPTY && s != TRANS_SIG_DELETED)
+				continue;
+			if (s == TRANS_SIG_DELETED)
+				t->deleted--;
+			ACCESS_ONCE(b->entries[i]) = e;
+			store_release(&b->sigs[i], trans_sig(hash));
+			t->used++;
+			return;
+		}
+	}
+
+	BUG();
+}
+
+static bool trans_tbl_delete(struct trans_table *t, uint32_t hash,
+			     struct trans_entry *e)
+{
+	uint32_t sig = trans_sig(hash), s;
+	struct trans_bucket *b;
+	unsigned int i, n;
+
+	assert_spin_lock_held(&trans_lock);
+
+	for (n = 0; n <= t->mask; n++) {
+		b = &t->buckets[(hash + n) & t->mask];
+		for (i = 0; i < TRANS_BUCKET_SLOTS; i++) {
+			s = b->sigs[i];
+			if (s == TRANS_SIG_EMPTY)
+				return false;
+			if (s != sig || b->entries[i] != e)
+				continue;
+			store_release(&b->sigs[i], TRANS_SIG_DELETED);
+			ACCESS_ONCE(b->entries[i]) = NULL;
+			t->used--;
+			t->deleted++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* moves up to @nr buckets of the old table into the current one */
+static void trans_tbl_migrate(unsigned int nr)
+{
+	struct trans_table *old, *t;
+	struct trans_bucket *b;
+	struct trans_entry *e;
+	unsigned int i;
+
+	assert_spin_lock_held(&trans_lock);
+
+	old = rcu_dereference_protected(trans_old_tbl, true);
+	if (!old)
+		return;
+	t = rcu_dereference_protected(trans_tbl, true);
+
+	/* entries stay in the old table too, so readers always find them */
+	for (; nr > 0 && trans_migrate_pos <= old->mask; nr--) {
+		b = &old->buckets[trans_migrate_pos++];
+		for (i = 0; i < TRANS_BUCKET_SLOTS; i++) {
+			e = b->entries[i];
+			if (!(b->sigs[i] & TRANS_SIG_VALID) || !e)
+				continue;
+			trans_tbl_insert(t, trans_entry_hash(e), e);
+		}
+	}
+
+	if (trans_migrate_pos <= old->mask)
+		return;
+	rcu_assign_pointer(trans_old_tbl, NULL);
+	rcu_free(&old->rcu, trans_tbl_release);
+}
+
+/*
+ * Returns the bucket count the table should be rebuilt with, or zero if it
+ * has enough room. Tombstones count against the load, so a table that is
+ * mostly tombstones gets rebuilt at the same size.
+ */
+static unsigned int trans_tbl_resize_target(void)
+{
+	struct trans_table *t = rcu_dereference_protected(trans_tbl, true);
+	unsigned int nr_buckets = t->mask + 1;
+	unsigned long slots = (unsigned long)nr_buckets * TRANS_BUCKET_SLOTS;
+
+	assert_spin_lock_held(&trans_lock);
+
+	if ((t->used + t->deleted) * 4UL < slots * 3)
+		return 0;
+	if (t->used * 2UL >= slots)
+		return nr_buckets * 2;
+	return nr_buckets;
+}
+
+/* rebuilds the table with @nr_buckets buckets, migrating lazily */
+static void trans_tbl_resize(unsigned int nr_buckets)
+{
+	struct trans_table *t, *cur;
+
+	/* allocating can take a while for large tables, so drop the lock */
+	t = trans_tbl_alloc(nr_buckets);
+	if (unlikely(!t)) {
+		log_warn_ratelimited("trans: couldn't grow the match table");
+		return;
+	}
+
+	spin_lock_np(&trans_lock);
+
+	/* finish any earlier migration so there are only two tables */
+	trans_tbl_migrate(UINT_MAX);
+
+	/* someone else may have resized already */
+	if (trans_tbl_resize_target() != nr_buckets) {
+		spin_unlock_np(&trans_lock);
+		trans_tbl_release(&t->rcu);
+		return;
+	}
+
+	/* publish the old table first, so readers never lose entries */
+	cur = rcu_dereference_protected(trans_tbl, true);
+	trans_migrate_pos = 0;
+	rcu_assign_pointer(trans_old_tbl, cur);
+	rcu_assign_pointer(trans_tbl, t);
+	trans_tbl_migrate(TRANS_MIGRATE_BATCH);
+	spin_unlock_np(&trans_lock);
+}
+
+/* finds an entry in the current and old tables (either lock held) */
+static struct trans_entry *trans_find(uint32_t hash, int match,
+				      const struct trans_key *k)
+{
+	struct trans_table *t, *old;
+	struct trans_entry *e;
+
+	t = rcu_dereference_protected(trans_tbl, true);
+	old = rcu_dereference_protected(trans_old_tbl, true);
+	e = trans_tbl_find(t, hash, match, k);
+	if (e || !old)
+		return e;
+	return trans_tbl_find(old, hash, match, k);
+}
 
 /**
  * trans_table_add - adds an entry to the match table
@@ -51,9 +330,9 @@ static struct rcu_hlist_head trans_tbl[TRANS_TBL_SIZE];
  */
 int trans_table_add(struct trans_entry *e)
 {
-	struct trans_entry *pos;
-	struct rcu_hlist_node *node;
-	uint32_t idx;
+	struct trans_key k;
+	unsigned int target;
+	uint32_t hash;
 
 	/* port zero is reserved for ephemeral port auto-assign */
 	if (e->laddr.port == 0)
@@ -61,36 +340,24 @@ int trans_table_add(struct trans_entry *e)
 
 	assert(e->match == TRANS_MATCH_3TUPLE ||
 	       e->match == TRANS_MATCH_5TUPLE);
-	if (e->match == TRANS_MATCH_3TUPLE)
-		idx = trans_hash_3tuple(e->proto, e->laddr);
-	else
-		idx = trans_hash_5tuple(e->proto, e->laddr, e->raddr);
-	idx %= TRANS_TBL_SIZE;
+	hash = trans_entry_hash(e);
+	k.proto = e->proto;
+	k.laddr = e->laddr;
+	k.raddr = e->raddr;
 
 	spin_lock_np(&trans_lock);
-	rcu_hlist_for_each(&trans_tbl[idx], node, true) {
-		pos = rcu_hlist_entry(node, struct trans_entry, link);
-		if (pos->match != e->match)
-			continue;
-		if (e->match == TRANS_MATCH_3TUPLE &&
-		    e->proto == pos->proto &&
-		    e->laddr.ip == pos->laddr.ip &&
-		    e->laddr.port == pos->laddr.port) {
-			spin_unlock_np(&trans_lock);
-			return -EADDRINUSE;
-		} else if (e->proto == pos->proto &&
-			   e->laddr.ip == pos->laddr.ip &&
-			   e->laddr.port == pos->laddr.port &&
-			   e->raddr.ip == pos->raddr.ip &&
-			   e->raddr.port == pos->raddr.port) {
-			spin_unlock_np(&trans_lock);
-			return -EADDRINUSE;
-		}
+	if (trans_find(hash, e->match, &k)) {
+		spin_unlock_np(&trans_lock);
+		return -EADDRINUSE;
 	}
-	rcu_hlist_add_head(&trans_tbl[idx], &e->link);
+	trans_tbl_insert(rcu_dereference_protected(trans_tbl, true), hash, e);
+	trans_tbl_migrate(TRANS_MIGRATE_BATCH);
+	target = trans_tbl_resize_target();
 	store_release(&ephemeral_offset, ephemeral_offset + 1);
 	spin_unlock_np(&trans_lock);
 
+	if (unlikely(target))
+		trans_tbl_resize(target);
 	return 0;
 }
 
@@ -140,69 +407,128 @@ int trans_table_add_with_ephemeral_port(struct trans_entry *e)
  */
 void trans_table_remove(struct trans_entry *e)
 {
+	struct trans_table *old;
+	uint32_t hash = trans_entry_hash(e);
+	bool found;
+
 	spin_lock_np(&trans_lock);
-	rcu_hlist_del(&e->link);
+	found = trans_tbl_delete(rcu_dereference_protected(trans_tbl, true),
+				 hash, e);
+	old = rcu_dereference_protected(trans_old_tbl, true);
+	if (old)
+		found |= trans_tbl_delete(old, hash, e);
+	WARN_ON(!found);
+	trans_tbl_migrate(TRANS_MIGRATE_BATCH);
 	spin_unlock_np(&trans_lock);
 }
 
+/**
+ * trans_table_lookup - finds the entry that handles a flow
+ * @k: the flow's protocol and addresses
+ *
+ * A 5-tuple match takes precedence over a 3-tuple match. Must be called with
+ * the RCU read lock held.
+ *
+ * Returns the entry, or NULL if none matches.
+ */
+struct trans_entry *trans_table_lookup(const struct trans_key *k)
+{
+	struct trans_entry *e;
+
+	assert(rcu_read_lock_held());
+
+	e = trans_find(trans_hash_5tuple(k->proto, k->laddr, k->raddr),
+		       TRANS_MATCH_5TUPLE, k);
+	if (e)
+		return e;
+	return trans_find(trans_hash_3tuple(k->proto, k->laddr),
+			  TRANS_MATCH_3TUPLE, k);
+}
+
+/**
+ * trans_table_lookup_batch - finds the entries that handle several flows
+ * @ks: the flows' protocols and addresses
+ * @es: an array to store the entries (NULL if none matches)
+ * @nr: the number of flows
+ *
+ * Hashes the whole batch and prefetches its buckets before probing, so the
+ * cache misses overlap. Must be called with the RCU read lock held.
+ */
+void trans_table_lookup_batch(const struct trans_key *ks,
+			      struct trans_entry **es, unsigned int nr)
+{
+	struct trans_table *t = rcu_dereference(trans_tbl);
+	uint32_t hashes[TRANS_LOOKUP_BATCH];
+	unsigned int i, j, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = MIN(nr - i, TRANS_LOOKUP_BATCH);
+		for (j = 0; j < n; j++) {
+			hashes[j] = trans_hash_5tuple(ks[i + j].proto,
+						      ks[i + j].laddr,
+						      ks[i + j].raddr);
+			prefetch(&t->buckets[hashes[j] & t->mask]);
+		}
+		for (j = 0; j < n; j++) {
+			es[i + j] = trans_find(hashes[j], TRANS_MATCH_5TUPLE,
+					       &ks[i + j]);
+			if (es[i + j])
+				continue;
+			es[i + j] = trans_find(
+				trans_hash_3tuple(ks[i + j].proto,
+						  ks[i + j].laddr),
+				TRANS_MATCH_3TUPLE, &ks[i + j]);
+		}
+	}
+}
+
 /* the first 4 bytes are identical for TCP and UDP */
 struct l4_hdr {
 	uint16_t sport, dport;
 };
 
-static struct trans_entry *trans_lookup(struct mbuf *m)
+static bool trans_parse(struct mbuf *m, struct trans_key *k)
 {
 	const struct ip_hdr *iphdr;
 	const struct l4_hdr *l4hdr;
-	struct trans_entry *e;
-	struct rcu_hlist_node *node;
-	struct netaddr laddr, raddr;
-	uint32_t hash;
-
-	assert(rcu_read_lock_held());
 
 	/* set up the network header pointers */
 	mbuf_mark_transport_offset(m);
 	iphdr = mbuf_network_hdr(m, *iphdr);
 	if (unlikely(iphdr->proto != IPPROTO_UDP &&
 		     iphdr->proto != IPPROTO_TCP))
-		return NULL;
+		return false;
 	l4hdr = (struct l4_hdr *)mbuf_data(m);
 	if (unlikely(mbuf_length(m) < sizeof(*l4hdr)))
-		return NULL;
+		return false;
 
 	/* parse the source and destination network address */
-	laddr.ip = ntoh32(iphdr->daddr);
-	laddr.port = ntoh16(l4hdr->dport);
-	raddr.ip = ntoh32(iphdr->saddr);
-	raddr.port = ntoh16(l4hdr->sport);
-
-	/* attempt to find a 5-tuple match */
-	hash = trans_hash_5tuple(iphdr->proto, laddr, raddr);
-	rcu_hlist_for_each(&trans_tbl[hash % TRANS_TBL_SIZE], node, false) {
-		e = rcu_hlist_entry(node, struct trans_entry, link);
-		if (e->match != TRANS_MATCH_5TUPLE)
-			continue;
-		if (e->proto == iphdr->proto &&
-		    e->laddr.ip == laddr.ip && e->laddr.port == laddr.port &&
-		    e->raddr.ip == raddr.ip && e->raddr.port == raddr.port) {
-			return e;
-		}
-	}
+	k->proto = iphdr->proto;
+	k->laddr.ip = ntoh32(iphdr->daddr);
+	k->laddr.port = ntoh16(l4hdr->dport);
+	k->raddr.ip = ntoh32(iphdr->saddr);
+	k->raddr.port = ntoh16(l4hdr->sport);
+	return true;
+}
 
-	/* attempt to find a 3-tuple match */
-	hash = trans_hash_3tuple(iphdr->proto, laddr);
-	rcu_hlist_for_each(&trans_tbl[hash % TRANS_TBL_SIZE], node, false) {
-		e = rcu_hlist_entry(node, struct trans_entry, link);
-		if (e->match != TRANS_MATCH_3TUPLE)
-			continue;
-		if (e->proto == iphdr->proto &&
-		    e->laddr.ip == laddr.ip && e->laddr.port == laddr.port) {
-			return e;
-		}
-	}
+static struct trans_entry *trans_lookup(struct mbuf *m)
+{
+	struct trans_key k;
 
-	return NULL;
+	assert(rcu_read_lock_held());
+
+	if (unlikely(!trans_parse(m, &k)))
+		return NULL;
+	return trans_table_lookup(&k);
+}
+
+static void trans_rx_unmatched(struct mbuf *m)
+{
+	const struct ip_hdr *iphdr = mbuf_network_hdr(m, *iphdr);
+
+	if (iphdr->proto == IPPROTO_TCP)
+		tcp_rx_closed(m);
+	mbuf_free(m);
 }
 
 /**
@@ -211,17 +537,13 @@ static struct trans_entry *trans_lookup(struct mbuf *m)
  */
 void net_rx_trans(struct mbuf *m)
 {
-	const struct ip_hdr *iphdr;
 	struct trans_entry *e;
 
 	rcu_read_lock();
 	e = trans_lookup(m);
 	if (unlikely(!e)) {
 		rcu_read_unlock();
-		iphdr = mbuf_network_hdr(m, *iphdr);
-		if (iphdr->proto == IPPROTO_TCP)
-			tcp_rx_closed(m);
-		mbuf_free(m);
+		trans_rx_unmatched(m);
 		return;
 	}
 
@@ -229,6 +551,70 @@ void net_rx_trans(struct mbuf *m)
 	rcu_read_unlock();
 }
 
+/**
+ * net_rx_trans_batch - receive a batch of L4 packets
+ * @ms: the mbufs to receive
+ * @nr: the number of mbufs
+ *
+ * Packets for an entry that implements recv_batch() are handed over together
+ * (preserving their order) so the protocol can coalesce them.
+ */
+void net_rx_trans_batch(struct mbuf **ms, unsigned int nr)
+{
+	struct trans_key ks[TRANS_LOOKUP_BATCH];
+	struct trans_entry *es[TRANS_LOOKUP_BATCH];
+	struct mbuf *valid[TRANS_LOOKUP_BATCH];
+	struct mbuf *flow[TRANS_LOOKUP_BATCH];
+	unsigned int i, j, k, n, nvalid, nflow;
+	unsigned long done;
+
+	BUILD_ASSERT(TRANS_LOOKUP_BATCH <= BITS_PER_LONG);
+
+	for (i = 0; i < nr; i += n) {
+		n = MIN(nr - i, TRANS_LOOKUP_BATCH);
+
+		nvalid = 0;
+		for (j = 0; j < n; j++) {
+			if (likely(trans_parse(ms[i + j], &ks[nvalid])))
+				valid[nvalid++] = ms[i + j];
+			else
+				trans_rx_unmatched(ms[i + j]);
+		}
+
+		rcu_read_lock();
+		trans_table_lookup_batch(ks, es, nvalid);
+		done = 0;
+		for (j = 0; j < nvalid; j++) {
+			if (unlikely(!es[j]) || (done & BIT(j)))
+				continue;
+			if (!es[j]->ops->recv_batch) {
+				es[j]->ops->recv(es[j], valid[j]);
+				continue;
+			}
+
+			/* gather the rest of this flow's packets, in order */
+			nflow = 0;
+			for (k = j; k < nvalid; k++) {
+				if (es[k] != es[j])
+					continue;
+				flow[nflow++] = valid[k];
+				done |= BIT(k);
+			}
+
+			if (nflow == 1)
+				es[j]->ops->recv(es[j], valid[j]);
+			else
+				es[j]->ops->recv_batch(es[j], flow, nflow);
+		}
+		rcu_read_unlock();
+
+		for (j = 0; j < nvalid; j++) {
+			if (unlikely(!es[j]))
+				trans_rx_unmatched(valid[j]);
+		}
+	}
+}
+
 /**
  * trans_error - reports a network error to the L4 layer
  * @m: the mbuf that triggered the error
@@ -248,16 +634,19 @@ void trans_error(struct mbuf *m, int err)
 /**
  * trans_init - initializes transport protocol infrastructure
  *
- * Returns 0 (always successful).
+ * Returns 0 if successful, otherwise -ENOMEM.
  */
 int trans_init(void)
 {
-	int i;
+	struct trans_table *t;
 
 	spin_lock_init(&trans_lock);
 
-	for (i = 0; i < TRANS_TBL_SIZE; i++)
-		rcu_hlist_init_head(&trans_tbl[i]);
+	t = trans_tbl_alloc(TRANS_MIN_BUCKETS);
+	if (!t)
+		return -ENOMEM;
+	RCU_INIT_POINTER(trans_tbl, t);
+	RCU_INIT_POINTER(trans_old_tbl, NULL);
 
 	trans_seed = rand_crc32c(0x48FA8BC1 ^ iok.key);
 	return 0;
@@ -20,8 +20,8 @@
 
 unsigned int udp_payload_size;
 
-static int udp_send_raw(struct mbuf *m, size_t len,
-			struct netaddr laddr, struct netaddr raddr)
+static void udp_push_hdr(struct mbuf *m, size_t len,
+			 struct netaddr laddr, struct netaddr raddr)
 {
 	struct udp_hdr *udphdr;
 
@@ -31,6 +31,12 @@ static int udp_send_raw(struct mbuf *m, size_t len,
 	udphdr->dst_port = hton16(raddr.port);
 	udphdr->len = hton16(len + sizeof(*udphdr));
 	udphdr->chksum = 0;
+}
+
+static int udp_send_raw(struct mbuf *m, size_t len,
+			struct netaddr laddr, struct netaddr raddr)
+{
+	udp_push_hdr(m, len, laddr, raddr);
 
 	/* send the IP packet */
 	return net_tx_ip(m, IPPROTO_UDP, raddr.ip);
@@ -44,6 +50,7 @@ static int udp_send_raw(struct mbuf *m, size_t len,
 struct udpconn {
 	struct trans_entry	e;
 	bool			shutdown;
+	bool			nonblocking; /* fail with -EAGAIN, don't block */
 
 	/* ingress support */
 	spinlock_t		inq_lock;
@@ -60,10 +67,20 @@ struct udpconn {
 	int			outq_len;
 	waitq_t			outq_wq;
 
+	/* readiness notifications (see udp_poll_add()) */
+	poll_trigger_t		poll;
+
 	struct kref		ref;
 	struct flow_registration		flow;
 };
 
+/* reports readiness to a registered poller (hold either queue lock) */
+static void udp_poll_notify(udpconn_t *c, unsigned int events)
+{
+	if (c->poll.waiter)
+		poll_trigger(c->poll.waiter, &c->poll, events);
+}
+
 /* handles ingress packets for UDP sockets */
 static void udp_conn_recv(struct trans_entry *e, struct mbuf *m)
 {
@@ -89,6 +106,7 @@ static void udp_conn_recv(struct trans_entry *e, struct mbuf *m)
 
 	/* wake up a waiter */
 	th = waitq_signal(&c->inq_wq, &c->inq_lock);
+	udp_poll_notify(c, POLLEV_IN);
 	spin_unlock_np(&c->inq_lock);
 
 	waitq_signal_finish(th);
@@ -104,6 +122,8 @@ static void udp_conn_err(struct trans_entry *e, int err)
 	spin_lock_np(&c->inq_lock);
 	do_release = !c->inq_err && !c->shutdown;
 	c->inq_err = err;
+	if (do_release)
+		udp_poll_notify(c, POLLEV_IN | POLLEV_HUP);
 	spin_unlock_np(&c->inq_lock);
 
 	if (do_release)
@@ -119,6 +139,7 @@ static const struct trans_ops udp_conn_ops = {
 static void udp_init_conn(udpconn_t *c)
 {
 	c->shutdown = false;
+	c->nonblocking = false;
 
 	/* initialize ingress fields */
 	spin_lock_init(&c->inq_lock);
@@ -135,6 +156,7 @@ static void udp_init_conn(udpconn_t *c)
 	c->outq_len = 0;
 	waitq_init(&c->outq_wq);
 
+	poll_trigger_init(&c->poll);
 	kref_init(&c->ref);
 }
 
@@ -300,8 +322,13 @@ ssize_t udp_read_from(udpconn_t *c, void *buf, size_t len,
 	spin_lock_np(&c->inq_lock);
 
 	/* block until there is an actionable event */
-	while (mbufq_empty(&c->inq) && !c->inq_err && !c->shutdown)
+	while (mbufq_empty(&c->inq) && !c->inq_err && !c->shutdown) {
+		if (c->nonblocking) {
+			spin_unlock_np(&c->inq_lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->inq_wq, &c->inq_lock);
+	}
 
 	/* is the socket drained and shutdown? */
 	if (mbufq_empty(&c->inq) && c->shutdown) {
@@ -345,8 +372,12 @@ static void udp_tx_release_mbuf(struct mbuf *m)
 	spin_lock_np(&c->outq_lock);
 	c->outq_len--;
 	free_conn = (c->outq_free && c->outq_len == 0);
-	if (!c->shutdown)
+	if (!c->shutdown) {
 		th = waitq_signal(&c->outq_wq, &c->outq_lock);
+		/* only report the transition from full */
+		if (c->outq_len + 1 == c->outq_cap)
+			udp_poll_notify(c, POLLEV_OUT);
+	}
 	spin_unlock_np(&c->outq_lock);
 	waitq_signal_finish(th);
 
@@ -389,8 +420,13 @@ ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
 	spin_lock_np(&c->outq_lock);
 
 	/* block until there is an actionable event */
-	while (c->outq_len >= c->outq_cap && !c->shutdown)
+	while (c->outq_len >= c->outq_cap && !c->shutdown) {
+		if (c->nonblocking) {
+			spin_unlock_np(&c->outq_lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->outq_wq, &c->outq_lock);
+	}
 
 	/* is the socket shutdown? */
 	if (c->shutdown) {
@@ -422,6 +458,189 @@ ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
 	return len;
 }
 
+/**
+ * udp_read_batch - reads several datagrams from a UDP socket
+ * @c: the UDP socket
+ * @msgs: an array of buffers; each @len is updated to the number of bytes
+ *        stored (at most the buffer size) and each @raddr to the sender
+ * @nr: the number of entries in @msgs
+ *
+ * WARNING: This a blocking function. It will wait until a datagram is
+ * available, an error occurs, or the socket is shutdown. Then it takes up to
+ * @nr queued datagrams with one acquisition of the queue lock.
+ *
+ * Returns the number of datagrams read. If the socket has been shutdown,
+ * returns 0. If an error occurs, returns < 0 to indicate the error code.
+ */
+ssize_t udp_read_batch(udpconn_t *c, struct udp_msg *msgs, int nr)
+{
+	struct mbufq q;
+	struct mbuf *m;
+	int i, n;
+
+	if (nr <= 0)
+		return -EINVAL;
+
+	spin_lock_np(&c->inq_lock);
+
+	/* block until there is an actionable event */
+	while (mbufq_empty(&c->inq) && !c->inq_err && !c->shutdown) {
+		if (c->nonblocking) {
+			spin_unlock_np(&c->inq_lock);
+			return -EAGAIN;
+		}
+		waitq_wait(&c->inq_wq, &c->inq_lock);
+	}
+
+	/* is the socket drained and shutdown? */
+	if (mbufq_empty(&c->inq) && c->shutdown) {
+		spin_unlock_np(&c->inq_lock);
+		return 0;
+	}
+
+	/* propagate error status code if an error was detected */
+	if (c->inq_err) {
+		spin_unlock_np(&c->inq_lock);
+		return -c->inq_err;
+	}
+
+	/* pop as many mbufs as will fit */
+	n = MIN(nr, c->inq_len);
+	mbufq_init(&q);
+	for (i = 0; i < n; i++)
+		mbufq_push_tail(&q, mbufq_pop_head(&c->inq));
+	c->inq_len -= n;
+	spin_unlock_np(&c->inq_lock);
+
+	/* deliver the payloads */
+	for (i = 0; i < n; i++) {
+		struct ip_hdr *iphdr;
+		struct udp_hdr *udphdr;
+
+		m = mbufq_pop_head(&q);
+		msgs[i].len = MIN(msgs[i].len, mbuf_length(m));
+		memcpy(msgs[i].buf, mbuf_data(m), msgs[i].len);
+		iphdr = mbuf_network_hdr(m, *iphdr);
+		udphdr = mbuf_transport_hdr(m, *udphdr);
+		msgs[i].raddr.ip = ntoh32(iphdr->saddr);
+		msgs[i].raddr.port = ntoh16(udphdr->src_port);
+		mbuf_free(m);
+	}
+
+	return n;
+}
+
+/* gives back egress queue slots that were reserved but not used */
+static void udp_outq_unreserve(udpconn_t *c, int n)
+{
+	thread_t *th = NULL;
+
+	spin_lock_np(&c->outq_lock);
+	c->outq_len -= n;
+	if (!c->shutdown)
+		th = waitq_signal(&c->outq_wq, &c->outq_lock);
+	spin_unlock_np(&c->outq_lock);
+	waitq_signal_finish(th);
+}
+
+/**
+ * udp_write_batch - writes several datagrams to a UDP socket
+ * @c: the UDP socket
+ * @msgs: an array of datagrams; @raddr is ignored if the socket was dialed,
+ *	  and must be set (non-zero) otherwise
+ * @nr: the number of entries in @msgs
+ *
+ * Datagrams are sent in order, and each run of datagrams to the same host
+ * shares one route and ARP lookup. At most UDP_BATCH_MAX datagrams are sent
+ * per call, and fewer if the transmit buffer doesn't have room for all of
+ * them.
+ *
+ * WARNING: This a blocking function. It will wait until space in the transmit
+ * buffer is available or the socket is shutdown.
+ *
+ * Returns the number of datagrams sent. If an error occurs before any are
+ * sent, returns < 0 to indicate the error code.
+ */
+ssize_t udp_write_batch(udpconn_t *c, const struct udp_msg *msgs, int nr)
+{
+	struct mbuf *ms[UDP_BATCH_MAX];
+	struct netaddr addrs[UDP_BATCH_MAX];
+	struct mbuf *m;
+	int i, j, k, n, ret;
+
+	if (nr <= 0)
+		return -EINVAL;
+	nr = MIN(nr, UDP_BATCH_MAX);
+	for (i = 0; i < nr; i++) {
+		if (msgs[i].len > udp_get_payload_size())
+			return -EMSGSIZE;
+		if (c->e.match == TRANS_MATCH_5TUPLE) {
+			addrs[i] = c->e.raddr;
+			continue;
+		}
+
+		/* a listening socket has no default destination */
+		if (!msgs[i].raddr.ip && !msgs[i].raddr.port)
+			return -EDESTADDRREQ;
+		addrs[i] = msgs[i].raddr;
+	}
+
+	spin_lock_np(&c->outq_lock);
+
+	/* block until there is an actionable event */
+	while (c->outq_len >= c->outq_cap && !c->shutdown) {
+		if (c->nonblocking) {
+			spin_unlock_np(&c->outq_lock);
+			return -EAGAIN;
+		}
+		waitq_wait(&c->outq_wq, &c->outq_lock);
+	}
+
+	/* is the socket shutdown? */
+	if (c->shutdown) {
+		spin_unlock_np(&c->outq_lock);
+		return -EPIPE;
+	}
+
+	/* reserve room for as many datagrams as will fit */
+	n = MIN(nr, c->outq_cap - c->outq_len);
+	c->outq_len += n;
+	spin_unlock_np(&c->outq_lock);
+
+	/* build the datagrams */
+	for (i = 0; i < n; i++) {
+		m = net_tx_alloc_mbuf();
+		if (unlikely(!m))
+			break;
+
+		memcpy(mbuf_put(m, msgs[i].len), msgs[i].buf, msgs[i].len);
+		m->release = udp_tx_release_mbuf;
+		m->release_data = (unsigned long)c;
+		udp_push_hdr(m, msgs[i].len, c->e.laddr, addrs[i]);
+		ms[i] = m;
+	}
+	if (unlikely(i < n)) {
+		udp_outq_unreserve(c, n - i);
+		if (i == 0)
+			return -ENOBUFS;
+		n = i;
+	}
+
+	/* send each run of datagrams to the same host as one burst */
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && addrs[j].ip == addrs[i].ip; j++)
+			;
+		ret = net_tx_ip_burst(&ms[i], j - i, IPPROTO_UDP, addrs[i].ip);
+		if (unlikely(ret)) {
+			for (k = i; k < n; k++)
+				mbuf_free(ms[k]);
+			return i > 0 ? i : ret;
+		}
+	}
+
+	return n;
+}
+
 /**
  * udp_read - reads from a UDP socket
  * @c: the UDP socket
@@ -456,12 +675,87 @@ ssize_t udp_write(udpconn_t *c, const void *buf, size_t len)
 	return udp_write_to(c, buf, len, NULL);
 }
 
+/**
+ * udp_poll_add - registers a UDP socket with a poller
+ * @c: the UDP socket
+ * @w: the poller to notify
+ * @events: the events (POLLEV_*) to report
+ * @data: data returned by poll_wait_batch() when an event fires
+ *
+ * Events are edge-triggered: each is reported once when it occurs, so keep
+ * reading or writing until the call would block before waiting again. Events
+ * that are already pending fire right away. A socket can be registered with
+ * one poller at a time.
+ *
+ * Returns 0 if successful, or -EEXIST if @c is already registered.
+ */
+int udp_poll_add(udpconn_t *c, poll_waiter_t *w, unsigned int events,
+		 unsigned long data)
+{
+	unsigned int ready = 0;
+
+	spin_lock_np(&c->inq_lock);
+	spin_lock_np(&c->outq_lock);
+	if (c->poll.waiter) {
+		spin_unlock_np(&c->outq_lock);
+		spin_unlock_np(&c->inq_lock);
+		return -EEXIST;
+	}
+
+	poll_arm(w, &c->poll, events, data);
+	if (!mbufq_empty(&c->inq) || c->inq_err || c->shutdown)
+		ready |= POLLEV_IN;
+	if (c->outq_len < c->outq_cap || c->shutdown)
+		ready |= POLLEV_OUT;
+	if (c->inq_err || c->shutdown)
+		ready |= POLLEV_HUP;
+	udp_poll_notify(c, ready);
+	spin_unlock_np(&c->outq_lock);
+	spin_unlock_np(&c->inq_lock);
+
+	return 0;
+}
+
+/**
+ * udp_set_nonblocking - controls whether reads and writes can block
+ * @c: the UDP socket
+ * @nonblocking: if true, calls that would block fail with -EAGAIN instead
+ *
+ * Use with udp_poll_add() to serve many sockets from one thread.
+ */
+void udp_set_nonblocking(udpconn_t *c, bool nonblocking)
+{
+	/* read under either queue lock, so take both */
+	spin_lock_np(&c->inq_lock);
+	spin_lock_np(&c->outq_lock);
+	c->nonblocking = nonblocking;
+	spin_unlock_np(&c->outq_lock);
+	spin_unlock_np(&c->inq_lock);
+}
+
+/**
+ * udp_poll_del - unregisters a UDP socket from its poller
+ * @c: the UDP socket
+ *
+ * udp_close() does this automatically.
+ */
+void udp_poll_del(udpconn_t *c)
+{
+	spin_lock_np(&c->inq_lock);
+	spin_lock_np(&c->outq_lock);
+	if (c->poll.waiter)
+		poll_disarm(&c->poll);
+	spin_unlock_np(&c->outq_lock);
+	spin_unlock_np(&c->inq_lock);
+}
+
 static void __udp_shutdown(udpconn_t *c)
 {
 	spin_lock_np(&c->inq_lock);
 	spin_lock_np(&c->outq_lock);
 	BUG_ON(c->shutdown);
 	c->shutdown = true;
+	udp_poll_notify(c, POLLEV_IN | POLLEV_OUT | POLLEV_HUP);
 	spin_unlock_np(&c->outq_lock);
 	spin_unlock_np(&c->inq_lock);
 
@@ -502,6 +796,7 @@ void udp_close(udpconn_t *c)
 
 	BUG_ON(!waitq_empty(&c->inq_wq));
 	BUG_ON(!waitq_empty(&c->outq_wq));
+	udp_poll_del(c);
 
 	/* free all in-flight mbufs */
 	while (true) {
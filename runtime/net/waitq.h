@@ -47,7 +47,7 @@ static inline thread_t *waitq_signal(waitq_t *q, spinlock_t *l)
 static inline void waitq_signal_finish(thread_t *th)
 {
 	if (th)
-		thread_ready(th);
+		thread_wake(th);
 }
 
 /**
@@ -71,12 +71,7 @@ static inline void waitq_signal_locked(waitq_t *q, spinlock_t *l)
  */
 static inline void waitq_release(waitq_t *q)
 {
-	while (true) {
-		thread_t *th = list_pop(&q->waiters, thread_t, link);
-		if (!th)
-			break;
-		thread_ready(th);
-	}
+	thread_wake_list(&q->waiters);
 }
 
 static inline void waitq_release_start(waitq_t *q, struct list_head *waiters)
@@ -86,12 +81,7 @@ static inline void waitq_release_start(waitq_t *q, struct list_head *waiters)
 
 static inline void waitq_release_finish(struct list_head *waiters)
 {
-	while (true) {
-		thread_t *th = list_pop(waiters, thread_t, link);
-		if (!th)
-			break;
-		thread_ready(th);
-	}
+	thread_wake_list(waiters);
 }
 
 
@@ -4,6 +4,8 @@
 
 #include <runtime/poll.h>
 
+#include "defs.h"
+
 /**
  * poll_init - initializes a polling waiter object
  * @w: the waiter object to initialize
@@ -13,21 +15,40 @@ void poll_init(poll_waiter_t *w)
 	spin_lock_init(&w->lock);
 	list_head_init(&w->triggered);
 	w->waiting_th = NULL;
+	w->cb = NULL;
+}
+
+/**
+ * poll_init_cb - initializes a waiter that gets callbacks instead
+ * @w: the waiter object to initialize
+ * @cb: called with a trigger's data and events each time it fires
+ *
+ * Nothing ever waits on @w. @cb runs from wherever the event fires (often a
+ * softirq, with locks held), so it must not block.
+ */
+void poll_init_cb(poll_waiter_t *w, poll_cb_t cb)
+{
+	poll_init(w);
+	w->cb = cb;
 }
 
 /**
  * poll_arm - registers a trigger with a waiter
  * @w: the waiter to register with
  * @t: the trigger to register
+ * @mask: the events (POLLEV_*) to report
  * @data: data to provide when the trigger fires
  */
-void poll_arm(poll_waiter_t *w, poll_trigger_t *t, unsigned long data)
+void poll_arm(poll_waiter_t *w, poll_trigger_t *t, unsigned int mask,
+	      unsigned long data)
 {
 	if (WARN_ON(t->waiter != NULL))
 		return;
 
 	t->waiter = w;
 	t->triggered = false;
+	t->mask = mask;
+	t->events = 0;
 	t->data = data;
 }
 
@@ -47,6 +68,7 @@ void poll_disarm(poll_trigger_t *t)
 		list_del(&t->link);
 		t->triggered = false;
 	}
+	t->events = 0;
 	spin_unlock_np(&w->lock);
 
 	t->waiter = NULL;
@@ -59,16 +81,45 @@ void poll_disarm(poll_trigger_t *t)
  * Returns the data provided to the trigger that fired
  */
 unsigned long poll_wait(poll_waiter_t *w)
+{
+	struct poll_event ev;
+
+	poll_wait_batch(w, &ev, 1);
+	return ev.data;
+}
+
+/**
+ * poll_wait_batch - waits for one or more events to trigger
+ * @w: the waiter to wait on
+ * @evs: an array to store the events
+ * @n: the size of @evs
+ *
+ * Each trigger is reported at most once per call, with every event it fired
+ * since it was last reported. It won't be reported again until it fires
+ * again (edge-triggered).
+ *
+ * Returns the number of events stored in @evs (at least one).
+ */
+int poll_wait_batch(poll_waiter_t *w, struct poll_event *evs, int n)
 {
 	thread_t *th = thread_self();
 	poll_trigger_t *t;
+	int i;
 
 	while (true) {
 		spin_lock_np(&w->lock);
-		t = list_pop(&w->triggered, poll_trigger_t, link);
-		if (t) {
+		for (i = 0; i < n; i++) {
+			t = list_pop(&w->triggered, poll_trigger_t, link);
+			if (!t)
+				break;
+			t->triggered = false;
+			evs[i].data = t->data;
+			evs[i].events = t->events;
+			t->events = 0;
+		}
+		if (i > 0) {
 			spin_unlock_np(&w->lock);
-			return t->data;
+			return i;
 		}
 		w->waiting_th = th;
 		thread_park_and_unlock_np(&w->lock);
@@ -79,18 +130,31 @@ unsigned long poll_wait(poll_waiter_t *w)
  * poll_trigger - fires a trigger
  * @w: the waiter to wake up (if it is waiting)
  * @t: the trigger that fired
+ * @events: the events (POLLEV_*) that occurred
+ *
+ * Events outside of the trigger's mask are ignored.
  */
-void poll_trigger(poll_waiter_t *w, poll_trigger_t *t)
+void poll_trigger(poll_waiter_t *w, poll_trigger_t *t, unsigned int events)
 {
 	thread_t *wth = NULL;
 
+	events &= t->mask;
+	if (!events)
+		return;
+
+	if (w->cb) {
+		w->cb(t->data, events);
+		return;
+	}
+
 	spin_lock_np(&w->lock);
+	t->events |= events;
 	if (t->triggered) {
 		spin_unlock_np(&w->lock);
 		return;
 	}
 	t->triggered = true;
-	list_add(&w->triggered, &t->link);
+	list_add_tail(&w->triggered, &t->link);
 	if (w->waiting_th) {
 		wth = w->waiting_th;
 		w->waiting_th = NULL;
@@ -98,5 +162,5 @@ void poll_trigger(poll_waiter_t *w, poll_trigger_t *t)
 	spin_unlock_np(&w->lock);
 
 	if (wth)
-		thread_ready(wth);
+		thread_wake(wth);
 }
@@ -4,8 +4,10 @@
 
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 
 #include "base/log.h"
+#include "base/time.h"
 #include "runtime/thread.h"
 #include "runtime/preempt.h"
 
@@ -15,6 +17,10 @@
 volatile __thread unsigned int preempt_cnt = PREEMPT_NOT_PENDING;
 volatile __thread bool preempt_cede;
 
+/* the time-slice quantum (0 disables time slicing) */
+uint64_t cfg_quantum_us;
+static uint64_t quantum_cycles;
+
 /* set a flag to indicate a preemption request is pending */
 static void set_preempt_needed(void)
 {
@@ -57,6 +63,33 @@ static void handle_sigusr2(int s, siginfo_t *si, void *c)
 	thread_yield();
 }
 
+/* handles time-slice expirations from the per-kthread quantum timer */
+static void handle_sigalrm(int s, siginfo_t *si, void *c)
+{
+	thread_t *th = __self;
+	uint64_t start;
+
+	/* the scheduler was running, or the thread is about to switch out */
+	if (!th)
+		return;
+	start = ACCESS_ONCE(th->run_start_tsc);
+	if (start == UINT64_MAX || rdtsc() - start < quantum_cycles)
+		return;
+
+	/* a cede from the iokernel is already pending */
+	if (preempt_cede)
+		return;
+
+	STAT(TIME_SLICES)++;
+
+	/* yield once the thread leaves its preempt_disable() section */
+	if (!preempt_enabled()) {
+		set_preempt_needed();
+		return;
+	}
+
+	thread_yield();
+}
 
 /**
  * preempt - entry point for preemption
@@ -108,10 +141,68 @@ int preempt_init(void)
 		return -errno;
 	}
 
+	if (cfg_quantum_us && sigaddset(&act.sa_mask, SIGALRM) != 0) {
+		log_err("couldn't set signal handler mask");
+		return -errno;
+	}
+
 	if (sigaction(SIGUSR1, &act, NULL) == -1) {
 		log_err("couldn't register signal handler");
 		return -errno;
 	}
 
+	if (!cfg_quantum_us)
+		return 0;
+
+	quantum_cycles = cfg_quantum_us * cycles_per_us;
+	if (sigemptyset(&act.sa_mask) != 0) {
+		log_err("couldn't empty the signal handler mask");
+		return -errno;
+	}
+
+	act.sa_sigaction = handle_sigalrm;
+	if (sigaction(SIGALRM, &act, NULL) == -1) {
+		log_err("couldn't register signal handler");
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * preempt_init_thread - starts the time-slice timer for the calling kthread
+ *
+ * The timer counts the kthread's CPU time, so it stays quiet while the kthread
+ * is parked. A uthread that started running just after a tick is caught by the
+ * next one, so it can run for up to two quanta before it yields.
+ *
+ * Returns 0 if successful.
+ */
+int preempt_init_thread(void)
+{
+	struct sigevent sev;
+	struct itimerspec its;
+	timer_t timer;
+
+	if (!cfg_quantum_us)
+		return 0;
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGALRM;
+	sev._sigev_un._tid = thread_gettid();
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) == -1) {
+		log_err("preempt: couldn't create timer");
+		return -errno;
+	}
+
+	its.it_interval.tv_sec = cfg_quantum_us / ONE_SECOND;
+	its.it_interval.tv_nsec = (cfg_quantum_us % ONE_SECOND) * 1000;
+	its.it_value = its.it_interval;
+	if (timer_settime(timer, 0, &its, NULL) == -1) {
+		log_err("preempt: couldn't arm timer");
+		return -errno;
+	}
+
 	return 0;
 }
@@ -0,0 +1,270 @@
+/*
+ * prof.c - a sampling profiler for uthreads
+ *
+ * Each kthread arms a timer on its own CPU clock that delivers SIGPROF. The
+ * handler records the interrupted uthread's entry function and call stack
+ * (walking frame pointers, so build with CONFIG_FRAME_POINTERS=y for more
+ * than the leaf) into a per-kthread ring. A background thread drains the
+ * rings into a file that scripts/prof_fold.py turns into folded stacks.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+
+#include "defs.h"
+
+/* the most frames recorded per sample */
+#define PROF_MAX_DEPTH		32
+/* samples buffered per kthread between drains */
+#define PROF_RING_SIZE		1024
+/* how often to drain the rings */
+#define PROF_DRAIN_PERIOD	(100 * ONE_MS)
+
+/* the sample rate in Hz (0 disables the profiler) */
+unsigned int cfg_prof_hz;
+/* where to write samples, defaults to caladan_<pid>.prof */
+char *cfg_prof_path;
+
+struct prof_sample {
+	uintptr_t	entry;	/* the uthread's entry function, 0 if none */
+	unsigned int	depth;
+	uintptr_t	pcs[PROF_MAX_DEPTH]; /* leaf first */
+};
+
+/* single producer (the signal handler), single consumer (the drainer) */
+struct prof_ring {
+	uint32_t		head;
+	uint32_t		tail;
+	uint64_t		drops;
+	struct prof_sample	samples[PROF_RING_SIZE];
+};
+
+static __thread struct prof_ring *prof_ring;
+static struct prof_ring *prof_rings[NCPU];
+static FILE *prof_file;
+
+/* records the call stack of the interrupted context */
+static void handle_sigprof(int s, siginfo_t *si, void *c)
+{
+	ucontext_t *uc = (ucontext_t *)c;
+	struct prof_ring *r = prof_ring;
+	thread_t *th = __self;
+	struct prof_sample *ps;
+	uintptr_t rsp, lo, hi, *fp;
+	uint32_t head;
+	unsigned int n = 0;
+
+	if (unlikely(!r))
+		return;
+
+	head = r->head;
+	if (unlikely(head - load_acquire(&r->tail) >= PROF_RING_SIZE)) {
+		r->drops++;
+		return;
+	}
+
+	ps = &r->samples[head % PROF_RING_SIZE];
+	ps->pcs[n++] = uc->uc_mcontext.gregs[REG_RIP];
+	ps->entry = 0;
+
+	/* only walk frames on the uthread's own stack (not the runtime's) */
+	rsp = uc->uc_mcontext.gregs[REG_RSP];
+	lo = th ? (uintptr_t)th->stack->usable : 0;
+	hi = lo + RUNTIME_STACK_SIZE;
+	if (th && rsp >= lo && rsp < hi) {
+		ps->entry = th->entry_fn;
+		fp = (uintptr_t *)uc->uc_mcontext.gregs[REG_RBP];
+		while (n < PROF_MAX_DEPTH && (uintptr_t)fp >= rsp &&
+		       (uintptr_t)(fp + 2) <= hi &&
+		       ((uintptr_t)fp & (sizeof(uintptr_t) - 1)) == 0) {
+			if (!fp[1])
+				break;
+			ps->pcs[n++] = fp[1];
+			if (fp[0] <= (uintptr_t)fp)
+				break;
+			fp = (uintptr_t *)fp[0];
+		}
+	}
+
+	ps->depth = n;
+	store_release(&r->head, head + 1);
+}
+
+/* writes the executable mappings so addresses can be symbolized */
+static void prof_write_maps(void)
+{
+	char line[512];
+	FILE *f;
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (strstr(line, " r-xp ") && strchr(line, '/'))
+			fprintf(prof_file, "# map %s", line);
+	}
+	fclose(f);
+}
+
+static void prof_drain(struct prof_ring *r)
+{
+	struct prof_sample *ps;
+	uint32_t tail = r->tail, head = load_acquire(&r->head);
+	unsigned int i;
+
+	for (; tail != head; tail++) {
+		ps = &r->samples[tail % PROF_RING_SIZE];
+		fprintf(prof_file, "%lx", ps->entry);
+		for (i = 0; i < ps->depth; i++)
+			fprintf(prof_file, " %lx", ps->pcs[i]);
+		fputc('\n', prof_file);
+	}
+	store_release(&r->tail, tail);
+}
+
+static void prof_worker(void *arg)
+{
+	uint64_t drops;
+	int i;
+
+	while (true) {
+		timer_sleep(PROF_DRAIN_PERIOD);
+
+		drops = 0;
+		for (i = 0; i < maxks; i++) {
+			if (!prof_rings[i])
+				continue;
+			prof_drain(prof_rings[i]);
+			drops += ACCESS_ONCE(prof_rings[i]->drops);
+		}
+		fprintf(prof_file, "# drops %lu\n", drops);
+		fflush(prof_file);
+	}
+}
+
+/**
+ * prof_init_thread - starts sampling the calling kthread
+ *
+ * Returns 0 if successful.
+ */
+int prof_init_thread(void)
+{
+	struct sigevent sev;
+	struct itimerspec its;
+	timer_t timer;
+	struct prof_ring *r;
+
+	if (!cfg_prof_hz)
+		return 0;
+
+	r = aligned_alloc(CACHE_LINE_SIZE, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	memset(r, 0, sizeof(*r));
+	prof_ring = r;
+	prof_rings[myk()->kthread_idx] = r;
+
+	/* sample CPU time, so parked kthreads aren't sampled */
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev._sigev_un._tid = thread_gettid();
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) == -1) {
+		log_err("prof: couldn't create timer");
+		return -errno;
+	}
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 1000000000L / cfg_prof_hz;
+	its.it_value = its.it_interval;
+	if (timer_settime(timer, 0, &its, NULL) == -1) {
+		log_err("prof: couldn't arm timer");
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * prof_init - global initializer for the profiler
+ *
+ * Returns 0 if successful.
+ */
+int prof_init(void)
+{
+	struct sigaction act;
+	char path[64];
+
+	if (!cfg_prof_hz)
+		return 0;
+
+	if (!cfg_prof_path) {
+		snprintf(path, sizeof(path), "caladan_%d.prof", getpid());
+		cfg_prof_path = strdup(path);
+		if (!cfg_prof_path)
+			return -ENOMEM;
+	}
+
+	prof_file = fopen(cfg_prof_path, "w");
+	if (!prof_file) {
+		log_err("prof: couldn't open '%s'", cfg_prof_path);
+		return -errno;
+	}
+	fprintf(prof_file, "# caladan profile hz %u\n", cfg_prof_hz);
+	prof_write_maps();
+
+	act.sa_flags = SA_SIGINFO | SA_RESTART;
+	act.sa_sigaction = handle_sigprof;
+	if (sigemptyset(&act.sa_mask) != 0) {
+		log_err("couldn't empty the signal handler mask");
+		return -errno;
+	}
+
+	/*
+	 * Block the preemption signals while a sample is being recorded, so the
+	 * handler can't cede or yield (and move kthreads) halfway through its
+	 * write to the per-kthread ring.
+	 */
+	if (sigaddset(&act.sa_mask, SIGUSR1) != 0) {
+		log_err("couldn't set signal handler mask");
+		return -errno;
+	}
+	if (sigaddset(&act.sa_mask, SIGUSR2) != 0) {
+		log_err("couldn't set signal handler mask");
+		return -errno;
+	}
+	if (sigaddset(&act.sa_mask, SIGALRM) != 0) {
+		log_err("couldn't set signal handler mask");
+		return -errno;
+	}
+	if (sigaction(SIGPROF, &act, NULL) == -1) {
+		log_err("couldn't register signal handler");
+		return -errno;
+	}
+
+	log_info("prof: sampling at %u Hz into '%s'", cfg_prof_hz,
+		 cfg_prof_path);
+	return 0;
+}
+
+/**
+ * prof_init_late - starts the thread that drains samples
+ *
+ * Returns 0 if successful.
+ */
+int prof_init_late(void)
+{
+	if (!cfg_prof_hz)
+		return 0;
+
+	return thread_spawn(prof_worker, NULL);
+}
@@ -3,6 +3,7 @@
  */
 
 #include <sched.h>
+#include <string.h>
 
 #include <base/stddef.h>
 #include <base/lock.h>
@@ -40,6 +41,21 @@ static __thread uint64_t last_tsc;
 /* used to force timer and network processing after a timeout */
 static __thread uint64_t last_watchdog_tsc;
 
+/* the minimum queueing delay before stealing work from another NUMA node */
+uint64_t cfg_remote_steal_qdelay_us;
+
+/* the levels of the CPU topology, in the order we steal work from them */
+enum {
+	STEAL_SMT = 0,	/* the same physical core (hyperthread siblings) */
+	STEAL_LLC,	/* cores that share a last-level cache */
+	STEAL_NODE,	/* cores on the same NUMA node */
+	STEAL_REMOTE,	/* cores on a different NUMA node */
+	STEAL_NR,
+};
+
+BUILD_ASSERT(STAT_THREADS_STOLEN_REMOTE - STAT_THREADS_STOLEN_SMT ==
+	     STEAL_REMOTE);
+
 /**
  * In inc/runtime/thread.h, this function is declared inline (rather than static
  * inline) so that it is accessible to the Rust bindings. As a result, it must
@@ -70,6 +86,22 @@ static inline bool cores_have_affinity(unsigned int cpua, unsigned int cpub)
 	       cpu_map[cpua].sibling_core == cpub;
 }
 
+/**
+ * steal_level - returns how far apart two cores are in the CPU topology
+ * @cpua: the first core
+ * @cpub: the second core
+ */
+static inline int steal_level(unsigned int cpua, unsigned int cpub)
+{
+	if (cores_have_affinity(cpua, cpub))
+		return STEAL_SMT;
+	if (cpu_map[cpua].llc_core == cpu_map[cpub].llc_core)
+		return STEAL_LLC;
+	if (cpu_map[cpua].numa_node == cpu_map[cpub].numa_node)
+		return STEAL_NODE;
+	return STEAL_REMOTE;
+}
+
 /**
  * jmp_thread - runs a thread, popping its trap frame
  * @th: the thread to run
@@ -147,19 +179,113 @@ static __noreturn void jmp_runtime_nosave(runtime_fn_t fn)
 	__jmp_runtime_nosave(fn, runtime_stack);
 }
 
-static void drain_overflow(struct kthread *l)
+/**
+ * rq_buf_alloc - allocates a zeroed runqueue ring buffer
+ * @size: the number of slots (must be a power of two)
+ *
+ * Returns a buffer, or NULL if out of memory.
+ */
+struct rq_buf *rq_buf_alloc(uint32_t size)
 {
-	thread_t *th;
+	struct rq_buf *b;
+	size_t len;
+
+	assert(is_power_of_two(size));
+	len = align_up(sizeof(*b) + sizeof(thread_t *) * size,
+		       CACHE_LINE_SIZE);
+	b = aligned_alloc(CACHE_LINE_SIZE, len);
+	if (!b)
+		return NULL;
 
-	assert_spin_lock_held(&l->lock);
-	assert(myk() == l || l->parked);
+	memset(b, 0, len);
+	b->mask = size - 1;
+	return b;
+}
+
+/**
+ * rq_grow - enlarges a local runqueue
+ * @rq: the runqueue (owned by the local kthread)
+ * @need: the number of additional slots required
+ *
+ * The old buffer is never freed because a thief could still be reading from
+ * it. Since the size doubles each time, the total memory used is at most twice
+ * the size of the largest buffer.
+ *
+ * Returns the new buffer.
+ */
+struct rq_buf *rq_grow(struct runqueue *rq, uint32_t need)
+{
+	struct rq_buf *old = rq->buf, *b;
+	uint32_t i, head = rq->head;
+	uint32_t tail = rq_top_tail(load_acquire(&rq->top));
+	uint32_t size = old->mask + 1;
+
+	while (size < head - tail + need)
+		size *= 2;
+	b = rq_buf_alloc(size);
+	if (unlikely(!b))
+		panic("sched: couldn't grow the runqueue to %u slots", size);
+
+	/* copy at the same indices, so thieves can't tell the difference */
+	for (i = tail; i != head; i++)
+		b->slots[i & b->mask] = old->slots[i & old->mask];
+	store_release(&rq->buf, b);
+	STAT(RQ_GROWS)++;
+	return b;
+}
+
+/**
+ * rq_steal - moves half of a remote runqueue to the (empty) local runqueue
+ * @l: the local kthread
+ * @r: the remote kthread
+ * @prio: the priority class to steal from
+ *
+ * Returns the number of threads stolen.
+ */
+static uint32_t rq_steal(struct kthread *l, struct kthread *r,
+			 unsigned int prio)
+{
+	struct runqueue *lrq = &l->rqs[prio], *rrq = &r->rqs[prio];
+	struct rq_buf *lb, *rb;
+	uint64_t top;
+	uint32_t i, n, tail, head, lhead = lrq->head;
+
+	assert(rq_len(lrq) == 0);
+
+	while (true) {
+		top = load_acquire(&rrq->top);
+		tail = rq_top_tail(top);
+		head = load_acquire(&rrq->head);
+		rb = load_acquire(&rrq->buf);
+		n = head - tail;
+		if (n == 0)
+			return 0;
+
+		/* the snapshot was inconsistent, try again */
+		if (unlikely(n > rb->mask + 1)) {
+			cpu_relax();
+			continue;
+		}
 
-	while (l->rq_head - l->rq_tail < RUNTIME_RQ_SIZE) {
-		th = list_pop(&l->rq_overflow, thread_t, link);
-		if (!th)
+		/* steal half the tasks */
+		n = div_up(n, 2);
+		lb = lrq->buf;
+		if (unlikely(n > lb->mask + 1))
+			lb = rq_grow(lrq, n);
+		for (i = 0; i < n; i++) {
+			lb->slots[(lhead + i) & lb->mask] =
+				ACCESS_ONCE(rb->slots[(tail + i) & rb->mask]);
+		}
+
+		/* the copies are only valid if nobody else touched the front */
+		if (__sync_bool_compare_and_swap(&rrq->top, top,
+					RQ_TOP(tail + n, rq_top_cnt(top) + n)))
 			break;
-		l->rq[l->rq_head++ % RUNTIME_RQ_SIZE] = th;
 	}
+
+	rq_publish_tail(r);
+	store_release(&lrq->head, lhead + n);
+	return n;
 }
 
 static bool work_available(struct kthread *k)
@@ -171,96 +297,98 @@ static bool work_available(struct kthread *k)
 	}
 #endif
 
-	return ACCESS_ONCE(k->rq_tail) != ACCESS_ONCE(k->rq_head) ||
-	       softirq_pending(k);
+	return !kthread_rq_empty(k) || softirq_pending(k);
 }
 
+/*
+ * Only latency-critical threads count toward the queueing delay reported to
+ * the iokernel, so best-effort backlogs never cause cores to be granted.
+ */
 static void update_oldest_tsc(struct kthread *k)
 {
 	thread_t *th;
 
-	assert_spin_lock_held(&k->lock);
-
 	/* find the oldest thread in the runqueue */
-	if (load_acquire(&k->rq_head) != k->rq_tail) {
-		th = k->rq[k->rq_tail % RUNTIME_RQ_SIZE];
-		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
-	}
+	th = rq_peek(&k->rqs[THREAD_PRIO_LC]);
+	ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th ? th->ready_tsc : UINT64_MAX;
 }
 
-static bool steal_work(struct kthread *l, struct kthread *r)
+/*
+ * Stealing from another NUMA node drags thread stacks and connection state
+ * across the interconnect, so only do it once the remote runqueue has built up
+ * enough queueing delay.
+ */
+static bool remote_steal_allowed(struct kthread *r, unsigned int prio)
 {
+	uint64_t oldest_tsc, now;
 	thread_t *th;
-	uint32_t i, avail, rq_tail, overflow = 0;
+
+	if (!cfg_remote_steal_qdelay_us)
+		return true;
+	th = rq_peek(&r->rqs[prio]);
+	if (!th)
+		return false;
+
+	oldest_tsc = ACCESS_ONCE(th->ready_tsc);
+	now = rdtsc();
+	return now > oldest_tsc &&
+	       now - oldest_tsc >= cfg_remote_steal_qdelay_us * cycles_per_us;
+}
+
+static bool steal_work(struct kthread *l, struct kthread *r, int level,
+		       unsigned int prio)
+{
+	uint32_t avail;
 
 	assert_spin_lock_held(&l->lock);
-	assert(l->rq_head == 0 && l->rq_tail == 0);
+
+	/* adopt the timers of a parked kthread, so it doesn't have to wake up */
+	if (prio == THREAD_PRIO_LC && level != STEAL_REMOTE &&
+	    ACCESS_ONCE(r->parked) && ACCESS_ONCE(r->timern) > 0)
+		timer_merge(r);
 
 	if (!work_available(r))
 		return false;
-	if (!spin_try_lock(&r->lock))
+	if (level == STEAL_REMOTE && !remote_steal_allowed(r, prio))
 		return false;
 
 #ifdef GC
-	if (unlikely(get_gc_gen() != r->local_gc_gen)) {
-		if (!ACCESS_ONCE(r->parked)) {
-			spin_unlock(&r->lock);
+	if (unlikely(get_gc_gen() != ACCESS_ONCE(r->local_gc_gen))) {
+		if (!spin_try_lock(&r->lock))
 			return false;
+		if (get_gc_gen() != r->local_gc_gen) {
+			if (!ACCESS_ONCE(r->parked)) {
+				spin_unlock(&r->lock);
+				return false;
+			}
+			gc_kthread_report(r);
 		}
-		gc_kthread_report(r);
-		drain_overflow(r);
+		spin_unlock(&r->lock);
 	}
 #endif
-	/* try to steal directly from the runqueue */
-	avail = load_acquire(&r->rq_head) - r->rq_tail;
-	if (avail) {
-		/* steal half the tasks */
-		avail = div_up(avail, 2);
-		rq_tail = r->rq_tail;
-		for (i = 0; i < avail; i++)
-			l->rq[i] = r->rq[rq_tail++ % RUNTIME_RQ_SIZE];
-		store_release(&r->rq_tail, rq_tail);
-
-		/*
-		 * Drain the remote overflow queue, so newly readied tasks
-		 * don't cut in front tasks in the oveflow queue
-		 */
-		while (true) {
-			th = list_pop(&r->rq_overflow, thread_t, link);
-			if (!th)
-				break;
-
-			list_add_tail(&l->rq_overflow, &th->link);
-			overflow++;
-		}
 
-		ACCESS_ONCE(r->q_ptrs->rq_tail) += avail + overflow;
+	/* try to steal directly from the runqueue (lock-free) */
+	avail = rq_steal(l, r, prio);
+	if (avail) {
 		update_oldest_tsc(r);
-		spin_unlock(&r->lock);
-
-		l->rq_head = avail;
 		update_oldest_tsc(l);
-		ACCESS_ONCE(l->q_ptrs->rq_head) += avail + overflow;
-		STAT(THREADS_STOLEN) += avail + overflow;
+		ACCESS_ONCE(l->q_ptrs->rq_head) += avail;
+		STAT(THREADS_STOLEN) += avail;
+		l->stats[STAT_THREADS_STOLEN_SMT + level] += avail;
+		trace_event(TRACE_STEAL, NULL, r->kthread_idx, avail);
 		return true;
 	}
 
-	/* check for overflow tasks */
-	th = list_pop(&r->rq_overflow, thread_t, link);
-	if (th) {
-		ACCESS_ONCE(r->q_ptrs->rq_tail)++;
-		update_oldest_tsc(r);
-		spin_unlock(&r->lock);
-		l->rq[l->rq_head++ % RUNTIME_RQ_SIZE] = th;
-		ACCESS_ONCE(l->q_ptrs->oldest_tsc) = th->ready_tsc;
-		ACCESS_ONCE(l->q_ptrs->rq_head)++;
-		STAT(THREADS_STOLEN)++;
-		return true;
-	}
+	/* softirqs are handled with the latency-critical class */
+	if (prio != THREAD_PRIO_LC)
+		return false;
 
 	/* check for softirqs */
+	if (!softirq_pending(r) || !spin_try_lock(&r->lock))
+		return false;
 	if (softirq_sched(r)) {
 		STAT(SOFTIRQS_STOLEN)++;
+		trace_event(TRACE_STEAL, NULL, r->kthread_idx, 0);
 		spin_unlock(&r->lock);
 		return true;
 	}
@@ -269,6 +397,75 @@ static bool steal_work(struct kthread *l, struct kthread *r)
 	return false;
 }
 
+/**
+ * steal_nearest_work - tries to steal work, closest kthreads first
+ * @l: the local kthread
+ *
+ * Kthreads move between cores, so the topology is evaluated against the core
+ * each kthread ran on most recently. Latency-critical work anywhere is taken
+ * before any best-effort work.
+ *
+ * Returns true if work was found.
+ */
+static bool steal_nearest_work(struct kthread *l)
+{
+	struct kthread *r;
+	unsigned int start_idx, prio;
+	int i, level;
+
+	start_idx = rand_crc32c((uintptr_t)l);
+	for (prio = 0; prio < THREAD_PRIO_NR; prio++) {
+		for (level = STEAL_SMT; level < STEAL_NR; level++) {
+			for (i = 0; i < nrks; i++) {
+				r = ks[(start_idx + i) % nrks];
+				if (r == l || steal_level(l->curr_cpu,
+						ACCESS_ONCE(r->curr_cpu)) != level)
+					continue;
+				if (steal_work(l, r, level, prio))
+					return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/**
+ * sched_pop - removes the next thread to run from the local runqueues
+ * @k: the local kthread
+ * @now: the current time stamp counter
+ *
+ * Lower priority classes only run once the higher classes are empty, unless
+ * the thread at their front has passed its deadline.
+ *
+ * Returns a thread, or NULL if all runqueues are empty.
+ */
+static thread_t *sched_pop(struct kthread *k, uint64_t now)
+{
+	thread_t *th;
+	int i;
+
+	for (i = THREAD_PRIO_NR - 1; i > THREAD_PRIO_LC; i--) {
+		th = rq_peek(&k->rqs[i]);
+		if (likely(!th || !ACCESS_ONCE(th->deadline_tsc) ||
+			   ACCESS_ONCE(th->deadline_tsc) > now))
+			continue;
+		th = rq_pop(k, &k->rqs[i]);
+		if (th) {
+			STAT(DEADLINE_RUNS)++;
+			return th;
+		}
+	}
+
+	for (i = THREAD_PRIO_LC; i < THREAD_PRIO_NR; i++) {
+		th = rq_pop(k, &k->rqs[i]);
+		if (th)
+			return th;
+	}
+
+	return NULL;
+}
+
 static __noinline bool do_watchdog(struct kthread *l)
 {
 	bool work;
@@ -284,12 +481,10 @@ static __noinline bool do_watchdog(struct kthread *l)
 /* the main scheduler routine, decides what to run next */
 static __noreturn __noinline void schedule(void)
 {
-	struct kthread *r = NULL, *l = myk();
+	struct kthread *l = myk();
 	uint64_t start_tsc, end_tsc;
 	thread_t *th = NULL;
-	unsigned int start_idx;
 	unsigned int iters = 0;
-	int i, sibling;
 
 	assert_spin_lock_held(&l->lock);
 	assert(l->parked == false);
@@ -330,17 +525,10 @@ static __noreturn __noinline void schedule(void)
 			goto done;
 	}
 
-	/* move overflow tasks into the runqueue */
-	if (unlikely(!list_empty(&l->rq_overflow)))
-		drain_overflow(l);
-
 	/* first try the local runqueue */
-	if (l->rq_head != l->rq_tail)
+	if (!kthread_rq_empty(l))
 		goto done;
 
-	/* reset the local runqueue since it's empty */
-	l->rq_head = l->rq_tail = 0;
-
 again:
 	/* then check for local softirqs */
 	if (softirq_sched(l)) {
@@ -348,20 +536,10 @@ again:
 		goto done;
 	}
 
-	/* then try to steal from a sibling kthread */
-	sibling = cpu_map[l->curr_cpu].sibling_core;
-	r = cpu_map[sibling].recent_kthread;
-	if (r && r != l && steal_work(l, r))
+	/* then try to steal from the nearest kthreads in the topology */
+	if (steal_nearest_work(l))
 		goto done;
 
-	/* try to steal from every kthread */
-	start_idx = rand_crc32c((uintptr_t)l);
-	for (i = 0; i < nrks; i++) {
-		int idx = (start_idx + i) % nrks;
-		if (ks[idx] != l && steal_work(l, ks[idx]))
-			goto done;
-	}
-
 	/* recheck for local softirqs one last time */
 	if (softirq_sched(l)) {
 		STAT(SOFTIRQS_LOCAL)++;
@@ -383,6 +561,7 @@ again:
 
 	l->parked = true;
 	spin_unlock(&l->lock);
+	stack_flush();
 
 	/* did not find anything to run, park this kthread */
 	STAT(SCHED_CYCLES) += rdtsc() - start_tsc;
@@ -396,15 +575,10 @@ again:
 	goto again;
 
 done:
-	/* pop off a thread and run it */
-	assert(l->rq_head != l->rq_tail);
-	th = l->rq[l->rq_tail++ % RUNTIME_RQ_SIZE];
-	ACCESS_ONCE(l->q_ptrs->rq_tail)++;
-
-	/* move overflow tasks into the runqueue */
-	if (unlikely(!list_empty(&l->rq_overflow)))
-		drain_overflow(l);
-
+	/* pop off a thread and run it (thieves may have beaten us to it) */
+	th = sched_pop(l, rdtsc());
+	if (unlikely(!th))
+		goto again;
 	update_oldest_tsc(l);
 	spin_unlock(&l->lock);
 
@@ -427,6 +601,7 @@ done:
 	assert((l->rcu_gen & 0x1) == 0x1);
 
 	/* and jump into the next thread */
+	trace_event(TRACE_THREAD_RUN, th, 0, th->entry_fn);
 	jmp_thread(th);
 }
 
@@ -441,18 +616,20 @@ static __always_inline void enter_schedule(thread_t *curth)
 	/* prepare current thread for sleeping */
 	curth->run_start_tsc = UINT64_MAX;
 	curth->last_cpu = k->curr_cpu;
+	trace_event(TRACE_THREAD_PARK, curth, 0, 0);
 
-	spin_lock(&k->lock);
 	now = rdtsc();
 
 	/* slow path: switch from the uthread stack to the runtime stack */
-	if (k->rq_head == k->rq_tail ||
+	if (
 #ifdef GC
 	    get_gc_gen() != k->local_gc_gen ||
 #endif
 	    (!disable_watchdog &&
 	     unlikely(now - last_watchdog_tsc >
-		      cycles_per_us * RUNTIME_WATCHDOG_US))) {
+		      cycles_per_us * RUNTIME_WATCHDOG_US)) ||
+	    (th = sched_pop(k, now)) == NULL) {
+		spin_lock(&k->lock);
 		jmp_runtime(schedule);
 		return;
 	}
@@ -460,17 +637,7 @@ static __always_inline void enter_schedule(thread_t *curth)
 	/* fast path: switch directly to the next uthread */
 	STAT(PROGRAM_CYCLES) += now - last_tsc;
 	last_tsc = now;
-
-	/* pop the next runnable thread from the queue */
-	th = k->rq[k->rq_tail++ % RUNTIME_RQ_SIZE];
-	ACCESS_ONCE(k->q_ptrs->rq_tail)++;
-
-	/* move overflow tasks into the runqueue */
-	if (unlikely(!list_empty(&k->rq_overflow)))
-		drain_overflow(k);
-
 	update_oldest_tsc(k);
-	spin_unlock(&k->lock);
 
 	/* update exported thread run start time */
 	th->run_start_tsc = MIN(last_tsc, th->run_start_tsc);
@@ -484,6 +651,8 @@ static __always_inline void enter_schedule(thread_t *curth)
 	/* check for misuse of preemption disabling */
 	BUG_ON((preempt_cnt & ~PREEMPT_NOT_PENDING) != 1);
 
+	trace_event(TRACE_THREAD_RUN, th, 0, th->entry_fn);
+
 	/* check if we're switching into the same thread as before */
 	if (unlikely(th == curth)) {
 		th->thread_ready = false;
@@ -545,18 +714,56 @@ void thread_yield(void)
 	enter_schedule(curth);
 }
 
-static void thread_ready_prepare(struct kthread *k, thread_t *th)
+static void thread_ready_prepare_tsc(struct kthread *k, thread_t *th,
+				     uint64_t now)
 {
 	/* check for misuse where a ready thread is marked ready again */
 	BUG_ON(th->thread_ready);
 
 	/* prepare thread to be runnable */
 	th->thread_ready = true;
-	th->ready_tsc = rdtsc();
+	th->ready_tsc = now;
 	if (cores_have_affinity(th->last_cpu, k->curr_cpu))
 		STAT(LOCAL_WAKES)++;
 	else
 		STAT(REMOTE_WAKES)++;
+	trace_event(TRACE_THREAD_READY, th, 0, th->entry_fn);
+}
+
+static void thread_ready_prepare(struct kthread *k, thread_t *th)
+{
+	thread_ready_prepare_tsc(k, th, rdtsc());
+}
+
+/* pushes to the runqueue, but leaves publishing it to the iokernel */
+static void __thread_ready_enqueue(struct kthread *k, thread_t *th)
+{
+	struct runqueue *rq = &k->rqs[th->prio];
+
+	rq_push(rq, th);
+	if (th->prio == THREAD_PRIO_LC && rq_len(rq) == 1)
+		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
+}
+
+static void thread_ready_enqueue(struct kthread *k, thread_t *th)
+{
+	__thread_ready_enqueue(k, th);
+	ACCESS_ONCE(k->q_ptrs->rq_head)++;
+}
+
+static void thread_ready_enqueue_head(struct kthread *k, thread_t *th)
+{
+	struct runqueue *rq = &k->rqs[th->prio];
+	thread_t *oldestth;
+
+	/* inherit the queueing delay of the thread we cut in front of */
+	oldestth = rq_peek(rq);
+	if (oldestth)
+		th->ready_tsc = MIN(th->ready_tsc, oldestth->ready_tsc);
+	rq_push_front(rq, th);
+	if (th->prio == THREAD_PRIO_LC)
+		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
+	ACCESS_ONCE(k->q_ptrs->rq_head)++;
 }
 
 /**
@@ -575,18 +782,7 @@ void thread_ready_locked(thread_t *th)
 	assert_spin_lock_held(&k->lock);
 
 	thread_ready_prepare(k, th);
-	if (unlikely(k->rq_head - k->rq_tail >= RUNTIME_RQ_SIZE)) {
-		assert(k->rq_head - k->rq_tail == RUNTIME_RQ_SIZE);
-		list_add_tail(&k->rq_overflow, &th->link);
-		ACCESS_ONCE(k->q_ptrs->rq_head)++;
-		STAT(RQ_OVERFLOW)++;
-		return;
-	}
-
-	k->rq[k->rq_head++ % RUNTIME_RQ_SIZE] = th;
-	if (k->rq_head - k->rq_tail == 1)
-		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
-	ACCESS_ONCE(k->q_ptrs->rq_head)++;
+	thread_ready_enqueue(k, th);
 }
 
 /**
@@ -600,24 +796,12 @@ void thread_ready_locked(thread_t *th)
 void thread_ready_head_locked(thread_t *th)
 {
 	struct kthread *k = myk();
-	thread_t *oldestth;
 
 	assert_preempt_disabled();
 	assert_spin_lock_held(&k->lock);
 
 	thread_ready_prepare(k, th);
-
-	if (k->rq_head != k->rq_tail)
-		th->ready_tsc = k->rq[k->rq_tail % RUNTIME_RQ_SIZE]->ready_tsc;
-	oldestth = k->rq[--k->rq_tail % RUNTIME_RQ_SIZE];
-	k->rq[k->rq_tail % RUNTIME_RQ_SIZE] = th;
-	if (unlikely(k->rq_head - k->rq_tail > RUNTIME_RQ_SIZE)) {
-		list_add(&k->rq_overflow, &oldestth->link);
-		k->rq_head--;
-		STAT(RQ_OVERFLOW)++;
-	}
-	ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
-	ACCESS_ONCE(k->q_ptrs->rq_head)++;
+	thread_ready_enqueue_head(k, th);
 }
 
 /**
@@ -629,27 +813,10 @@ void thread_ready_head_locked(thread_t *th)
 void thread_ready(thread_t *th)
 {
 	struct kthread *k;
-	uint32_t rq_tail;
 
 	k = getk();
 	thread_ready_prepare(k, th);
-	rq_tail = load_acquire(&k->rq_tail);
-	if (unlikely(k->rq_head - rq_tail >= RUNTIME_RQ_SIZE)) {
-		assert(k->rq_head - rq_tail == RUNTIME_RQ_SIZE);
-		spin_lock(&k->lock);
-		list_add_tail(&k->rq_overflow, &th->link);
-		spin_unlock(&k->lock);
-		ACCESS_ONCE(k->q_ptrs->rq_head)++;
-		putk();
-		STAT(RQ_OVERFLOW)++;
-		return;
-	}
-
-	k->rq[k->rq_head % RUNTIME_RQ_SIZE] = th;
-	store_release(&k->rq_head, k->rq_head + 1);
-	if (k->rq_head - load_acquire(&k->rq_tail) == 1)
-		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
-	ACCESS_ONCE(k->q_ptrs->rq_head)++;
+	thread_ready_enqueue(k, th);
 	putk();
 }
 
@@ -662,34 +829,89 @@ void thread_ready(thread_t *th)
 void thread_ready_head(thread_t *th)
 {
 	struct kthread *k;
-	thread_t *oldestth;
 
 	k = getk();
 	thread_ready_prepare(k, th);
-	spin_lock(&k->lock);
-	if (k->rq_head != k->rq_tail)
-		th->ready_tsc = k->rq[k->rq_tail % RUNTIME_RQ_SIZE]->ready_tsc;
-	oldestth = k->rq[--k->rq_tail % RUNTIME_RQ_SIZE];
-	k->rq[k->rq_tail % RUNTIME_RQ_SIZE] = th;
-	if (unlikely(k->rq_head - k->rq_tail > RUNTIME_RQ_SIZE)) {
-		list_add(&k->rq_overflow, &oldestth->link);
-		k->rq_head--;
-		STAT(RQ_OVERFLOW)++;
+	thread_ready_enqueue_head(k, th);
+	putk();
+}
+
+/**
+ * thread_ready_batch - makes several uthreads runnable (at the tail)
+ * @ths: the threads to mark runnable
+ * @n: the number of threads
+ *
+ * Cheaper than calling thread_ready() on each thread, since the runqueue is
+ * only published to the iokernel once. The threads must all be parked.
+ */
+void thread_ready_batch(thread_t **ths, unsigned int n)
+{
+	struct kthread *k;
+	uint64_t now;
+	unsigned int i;
+
+	if (!n)
+		return;
+
+	k = getk();
+	now = rdtsc();
+	for (i = 0; i < n; i++) {
+		thread_ready_prepare_tsc(k, ths[i], now);
+		__thread_ready_enqueue(k, ths[i]);
 	}
-	spin_unlock(&k->lock);
-	ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
-	ACCESS_ONCE(k->q_ptrs->rq_head)++;
+	ACCESS_ONCE(k->q_ptrs->rq_head) += n;
 	putk();
 }
 
+/**
+ * thread_ready_list - makes a list of uthreads runnable (at the tail)
+ * @l: the threads to mark runnable, linked through their link fields
+ *
+ * Like thread_ready_batch(), but for threads taken from a wait list. @l is
+ * left empty.
+ */
+void thread_ready_list(struct list_head *l)
+{
+	struct kthread *k;
+	thread_t *th;
+	uint64_t now;
+	unsigned int n = 0;
+
+	if (list_empty(l))
+		return;
+
+	k = getk();
+	now = rdtsc();
+	while ((th = list_pop(l, thread_t, link)) != NULL) {
+		thread_ready_prepare_tsc(k, th, now);
+		__thread_ready_enqueue(k, th);
+		n++;
+	}
+	ACCESS_ONCE(k->q_ptrs->rq_head) += n;
+	putk();
+}
+
+/**
+ * thread_wake_batch_finish - makes every thread woken in the batch runnable
+ */
+void thread_wake_batch_finish(void)
+{
+	thread_t *myth = thread_self();
+	struct list_head *l = myth->wake_batch;
+
+	myth->wake_batch = NULL;
+	thread_ready_list(l);
+}
+
 static void thread_finish_cede(void)
 {
 	struct kthread *k = myk();
-	thread_t *th, *myth = thread_self();
+	thread_t *myth = thread_self();
 
 	myth->thread_running = false;
 	myth->thread_ready = true;
 	myth->last_cpu = k->curr_cpu;
+	trace_event(TRACE_THREAD_PARK, myth, 0, 0);
 	__self = NULL;
 
 	/* clear thread run start time */
@@ -697,21 +919,8 @@ static void thread_finish_cede(void)
 
 	STAT(PROGRAM_CYCLES) += rdtsc() - last_tsc;
 
-	/* ensure preempted thread cuts the line,
-	 * possibly displacing the newest element in a full runqueue
-	 * into the overflow queue
-	 */
-	spin_lock(&k->lock);
-	ACCESS_ONCE(k->q_ptrs->oldest_tsc) = myth->ready_tsc;
-	ACCESS_ONCE(k->q_ptrs->rq_head)++;
-	th = k->rq[--k->rq_tail % RUNTIME_RQ_SIZE];
-	k->rq[k->rq_tail % RUNTIME_RQ_SIZE] = myth;
-	if (unlikely(k->rq_head - k->rq_tail > RUNTIME_RQ_SIZE)) {
-		list_add(&k->rq_overflow, &th->link);
-		k->rq_head--;
-		STAT(RQ_OVERFLOW)++;
-	}
-	spin_unlock(&k->lock);
+	/* ensure preempted thread cuts the line */
+	thread_ready_enqueue_head(k, myth);
 
 	/* increment the RCU generation number (even - pretend in sched) */
 	store_release(&k->rcu_gen, k->rcu_gen + 1);
@@ -770,6 +979,9 @@ static __always_inline thread_t *__thread_create(void)
 	th->thread_ready = false;
 	th->thread_running = false;
 	th->run_start_tsc = UINT64_MAX;
+	th->prio = __self ? __self->prio : THREAD_PRIO_LC;
+	th->deadline_tsc = 0;
+	th->wake_batch = NULL;
 
 	return th;
 }
@@ -791,6 +1003,7 @@ thread_t *thread_create(thread_fn_t fn, void *arg)
 	th->tf.rdi = (uint64_t)arg;
 	th->tf.rbp = (uint64_t)0; /* just in case base pointers are enabled */
 	th->tf.rip = (uint64_t)fn;
+	th->entry_fn = (uintptr_t)fn;
 	gc_register_thread(th);
 	return th;
 }
@@ -816,6 +1029,7 @@ thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len)
 	th->tf.rdi = (uint64_t)ptr;
 	th->tf.rbp = (uint64_t)0; /* just in case base pointers are enabled */
 	th->tf.rip = (uint64_t)fn;
+	th->entry_fn = (uintptr_t)fn;
 	*buf = ptr;
 	gc_register_thread(th);
 	return th;
@@ -837,6 +1051,68 @@ int thread_spawn(thread_fn_t fn, void *arg)
 	return 0;
 }
 
+/**
+ * thread_spawn_prio - creates and launches a new thread in a priority class
+ * @fn: a function pointer to the starting method of the thread
+ * @arg: an argument passed to @fn
+ * @prio: the priority class (THREAD_PRIO_*)
+ *
+ * Returns 0 if successful, -EINVAL if @prio is invalid, otherwise -ENOMEM if
+ * out of memory.
+ */
+int thread_spawn_prio(thread_fn_t fn, void *arg, unsigned int prio)
+{
+	thread_t *th;
+
+	if (unlikely(prio >= THREAD_PRIO_NR))
+		return -EINVAL;
+
+	th = thread_create(fn, arg);
+	if (unlikely(!th))
+		return -ENOMEM;
+	th->prio = prio;
+	thread_ready(th);
+	return 0;
+}
+
+/**
+ * thread_set_prio - changes the priority class of the current thread
+ * @prio: the priority class (THREAD_PRIO_*)
+ *
+ * Takes effect the next time the thread is made runnable. Threads spawned
+ * afterward inherit the new class.
+ *
+ * Returns 0 if successful, otherwise -EINVAL if @prio is invalid.
+ */
+int thread_set_prio(unsigned int prio)
+{
+	if (unlikely(prio >= THREAD_PRIO_NR))
+		return -EINVAL;
+
+	thread_self()->prio = prio;
+	return 0;
+}
+
+/**
+ * thread_set_deadline - sets a deadline for the current thread
+ * @deadline_us: the deadline in microseconds (see microtime()), or zero to
+ *               clear it
+ *
+ * A best-effort thread whose deadline has passed runs ahead of the
+ * latency-critical threads on its kthread, bounding how long it can starve.
+ */
+void thread_set_deadline(uint64_t deadline_us)
+{
+	thread_t *th = thread_self();
+
+	if (!deadline_us) {
+		th->deadline_tsc = 0;
+		return;
+	}
+
+	th->deadline_tsc = deadline_us * cycles_per_us + start_tsc;
+}
+
 /**
  * thread_spawn_main - creates and launches the main thread
  * @fn: a function pointer to the starting method of the thread
@@ -870,6 +1146,7 @@ static void thread_finish_exit(void)
 	if (unlikely(th->main_thread))
 		init_shutdown(EXIT_SUCCESS);
 
+	trace_event(TRACE_THREAD_EXIT, th, 0, 0);
 	gc_remove_thread(th);
 	stack_free(th->stack);
 	tcache_free(&perthread_get(thread_pt), th);
@@ -983,6 +1260,10 @@ int sched_init(void)
 			BUG_ON(siblings++);
 			cpu_map[i].sibling_core = j;
 		}
+
+		cpu_map[i].llc_core = bitmap_find_next_set(
+				cpu_info_tbl[i].llc_siblings_mask, cpu_count, 0);
+		cpu_map[i].numa_node = cpu_info_tbl[i].numa_node;
 	}
 
 	return 0;
@@ -22,7 +22,7 @@ static bool softirq_directpath_pending(struct kthread *k)
 static bool softirq_timer_pending(struct kthread *k)
 {
 	return ACCESS_ONCE(k->timern) > 0 &&
-	       ACCESS_ONCE(k->timers[0].deadline_us) <= microtime();
+	       ACCESS_ONCE(k->timers->next_us) <= microtime();
 }
 
 static bool softirq_storage_pending(struct kthread *k)
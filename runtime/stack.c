@@ -1,7 +1,16 @@
 /*
  * stack.c - allocates and manages per-thread stacks
+ *
+ * Stacks are carved out of a contiguous virtual address range, so each
+ * stack's usable area sits right above the guard of the one below it.
+ * Memory is only committed when a stack is first touched. Freed stacks stay
+ * warm for reuse, and a background thread returns the memory of those that
+ * have been idle for STACK_IDLE_US to the OS. Parked kthreads hand their spare
+ * magazine back to the shared pool, which the background thread drains into
+ * the warm list, so stacks cached there age out as well.
  */
 
+#include <stdio.h>
 #include <sys/mman.h>
 
 #include <base/stddef.h>
@@ -10,12 +19,31 @@
 #include <base/atomic.h>
 #include <base/limits.h>
 #include <base/log.h>
+#include <runtime/sync.h>
+#include <runtime/timer.h>
 
 #include "defs.h"
 
 #define STACK_BASE_ADDR	0x200000000000UL
 
+/* how long a free stack stays committed before it is reclaimed */
+#define STACK_IDLE_US		(500 * ONE_MS)
+/* how often to look for idle stacks */
+#define STACK_RECLAIM_PERIOD	(100 * ONE_MS)
+/* the most stacks to reclaim at a time (without holding the lock) */
+#define STACK_RECLAIM_BATCH	64
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL	102
+#endif
+
+/* mappings left for everything else when guards need their own mappings */
+#define STACK_MAP_HEADROOM	(16 * 1024)
+
 static struct tcache *stack_tcache;
+/* the most stacks that can be created */
+static unsigned long stack_max = RUNTIME_MAX_THREADS;
+static bool stack_guard_markers;
 DEFINE_PERTHREAD(struct tcache_perthread, stack_pt);
 
 static struct stack *stack_create(void *base)
@@ -24,11 +52,22 @@ static struct stack *stack_create(void *base)
 	struct stack *s;
 
 	stack_addr = mmap(base, sizeof(struct stack), PROT_READ | PROT_WRITE,
-			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 	if (stack_addr == MAP_FAILED)
 		return NULL;
 
+	/*
+	 * Prefer guard markers in the page tables, they don't split the
+	 * mapping so millions of stacks don't run into vm.max_map_count.
+	 */
 	s = (struct stack *)stack_addr;
+	if (stack_guard_markers) {
+		if (madvise(s->guard, RUNTIME_GUARD_SIZE,
+			    MADV_GUARD_INSTALL) == 0)
+			return s;
+		munmap(stack_addr, sizeof(struct stack));
+		return NULL;
+	}
 	if (mprotect(s->guard, RUNTIME_GUARD_SIZE, PROT_NONE) == - 1) {
 		munmap(stack_addr, sizeof(struct stack));
 		return NULL;
@@ -45,44 +84,60 @@ static void stack_reclaim(struct stack *s)
 	WARN_ON_ONCE(ret);
 }
 
+/* a free stack that is still committed */
+struct warm_stack {
+	struct stack	*s;
+	uint64_t	free_us;	/* when it was freed */
+};
+
 static DEFINE_SPINLOCK(stack_lock);
-static int free_stack_count;
-static struct stack *free_stacks[RUNTIME_MAX_THREADS];
+/* reclaimed stacks (LIFO) */
+static int cold_stack_count;
+static struct stack *cold_stacks[RUNTIME_MAX_THREADS];
+/* committed stacks, a deque ordered from the least recently freed */
+static unsigned int warm_head, warm_tail;
+static struct warm_stack warm_stacks[RUNTIME_MAX_THREADS];
 static atomic64_t stack_pos = ATOMIC_INIT(STACK_BASE_ADDR);
 
+BUILD_ASSERT(is_power_of_two(RUNTIME_MAX_THREADS));
+#define WARM_IDX(i)	((i) & (RUNTIME_MAX_THREADS - 1))
+
 static void stack_tcache_free(struct tcache *tc, int nr, void **items)
 {
+	uint64_t now = microtime();
 	int i;
 
-	/* try to release the backing memory first */
-	for (i = 0; i < nr; i++)
-		stack_reclaim((struct stack *)items[i]);
-
-	/* then make the stacks available for reallocation */
+	/* keep the memory for now, it's likely to be reused soon */
 	spin_lock(&stack_lock);
-	for (i = 0; i < nr; i++)
-		free_stacks[free_stack_count++] = items[i];
-	BUG_ON(free_stack_count >=
-	       RUNTIME_MAX_THREADS + TCACHE_DEFAULT_MAG_SIZE);
+	for (i = 0; i < nr; i++) {
+		struct warm_stack *ws = &warm_stacks[WARM_IDX(warm_tail++)];
+
+		ws->s = items[i];
+		ws->free_us = now;
+	}
+	BUG_ON(warm_tail - warm_head > RUNTIME_MAX_THREADS);
 	spin_unlock(&stack_lock);
 }
 
 static int stack_tcache_alloc(struct tcache *tc, int nr, void **items)
 {
-	void *base;
+	uintptr_t base;
 	int i = 0;
 
+	/* the most recently freed stacks are the most likely to be cached */
 	spin_lock(&stack_lock);
-	while (free_stack_count && i < nr) {
-		items[i++] = free_stacks[--free_stack_count];
-	}
+	while (warm_tail != warm_head && i < nr)
+		items[i++] = warm_stacks[WARM_IDX(--warm_tail)].s;
+	while (cold_stack_count && i < nr)
+		items[i++] = cold_stacks[--cold_stack_count];
 	spin_unlock(&stack_lock);
 
-
 	for (; i < nr; i++) {
-		base = (void *)atomic64_fetch_and_and(&stack_pos,
-						      sizeof(struct stack));
-		items[i] = stack_create(base);
+		base = atomic64_fetch_and_add(&stack_pos, sizeof(struct stack));
+		if (unlikely(base >= STACK_BASE_ADDR +
+			     sizeof(struct stack) * stack_max))
+			goto fail;
+		items[i] = stack_create((void *)base);
 		if (unlikely(!items[i]))
 			goto fail;
 	}
@@ -100,6 +155,85 @@ static const struct tcache_ops stack_tcache_ops = {
 	.free	= stack_tcache_free,
 };
 
+/* returns the memory of stacks that have been free for too long */
+static void stack_reclaim_idle(void)
+{
+	struct stack *batch[STACK_RECLAIM_BATCH];
+	uint64_t now = microtime();
+	int i, n;
+
+	do {
+		/* take the stacks out so they can't be reused meanwhile */
+		n = 0;
+		spin_lock_np(&stack_lock);
+		while (warm_head != warm_tail && n < STACK_RECLAIM_BATCH) {
+			struct warm_stack *ws = &warm_stacks[WARM_IDX(warm_head)];
+
+			if (ws->free_us + STACK_IDLE_US > now)
+				break;
+			batch[n++] = ws->s;
+			warm_head++;
+		}
+		spin_unlock_np(&stack_lock);
+
+		for (i = 0; i < n; i++)
+			stack_reclaim(batch[i]);
+
+		spin_lock_np(&stack_lock);
+		for (i = 0; i < n; i++)
+			cold_stacks[cold_stack_count++] = batch[i];
+		spin_unlock_np(&stack_lock);
+	} while (n == STACK_RECLAIM_BATCH);
+}
+
+static void stack_reclaim_worker(void *arg)
+{
+	while (true) {
+		timer_sleep(STACK_RECLAIM_PERIOD);
+
+		/* move stacks out of the shared magazines so they can age */
+		preempt_disable();
+		tcache_reclaim(stack_tcache);
+		preempt_enable();
+
+		stack_reclaim_idle();
+	}
+}
+
+/* returns true if the kernel supports MADV_GUARD_INSTALL */
+static bool stack_probe_guard_markers(void)
+{
+	void *addr;
+	int ret;
+
+	addr = mmap(NULL, PGSIZE_4KB, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return false;
+	ret = madvise(addr, PGSIZE_4KB, MADV_GUARD_INSTALL);
+	munmap(addr, PGSIZE_4KB);
+	return ret == 0;
+}
+
+/* returns how many stacks fit in vm.max_map_count at two mappings each */
+static unsigned long stack_max_mprotect(void)
+{
+	unsigned long max_map_count;
+	FILE *f;
+
+	f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%lu", &max_map_count) != 1)
+		max_map_count = 0;
+	fclose(f);
+
+	if (max_map_count <= STACK_MAP_HEADROOM)
+		return 0;
+	return MIN((max_map_count - STACK_MAP_HEADROOM) / 2,
+		   RUNTIME_MAX_THREADS);
+}
+
 /**
  * stack_init_thread - intializes per-thread state
  * Returns 0 (always successful).
@@ -116,6 +250,21 @@ int stack_init_thread(void)
  */
 int stack_init(void)
 {
+	/*
+	 * Without guard markers, every stack splits into two mappings, and
+	 * the kernel refuses to create more than vm.max_map_count of them.
+	 */
+	stack_guard_markers = stack_probe_guard_markers();
+	if (!stack_guard_markers) {
+		stack_max = stack_max_mprotect();
+		if (stack_max == 0) {
+			log_err("stack: vm.max_map_count is too low");
+			return -ENOMEM;
+		}
+		log_warn("stack: no MADV_GUARD_INSTALL, limiting to %lu stacks "
+			 "(raise vm.max_map_count for more)", stack_max);
+	}
+
 	stack_tcache = tcache_create("runtime_stacks", &stack_tcache_ops,
 				     TCACHE_DEFAULT_MAG_SIZE,
 				     RUNTIME_STACK_SIZE);
@@ -123,3 +272,12 @@ int stack_init(void)
 		return -ENOMEM;
 	return 0;
 }
+
+/**
+ * stack_init_late - starts the idle stack reclaim thread
+ * Returns 0 if successful.
+ */
+int stack_init_late(void)
+{
+	return thread_spawn(stack_reclaim_worker, NULL);
+}
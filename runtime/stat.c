@@ -25,6 +25,10 @@ static const char *stat_names[] = {
 	"sched_cycles",
 	"program_cycles",
 	"threads_stolen",
+	"threads_stolen_smt",
+	"threads_stolen_llc",
+	"threads_stolen_node",
+	"threads_stolen_remote",
 	"softirqs_stolen",
 	"softirqs_local",
 	"parks",
@@ -34,7 +38,12 @@ static const char *stat_names[] = {
 	"remote_runs",
 	"local_wakes",
 	"remote_wakes",
-	"rq_overflow",
+	"rq_grows",
+	"deadline_runs",
+	"timers_merged",
+	"mutex_spin_acquires",
+	"mutex_parks",
+	"time_slices",
 
 	/* network stack counters */
 	"rx_bytes",
@@ -44,8 +53,10 @@ static const char *stat_names[] = {
 	"drops",
 	"rx_tcp_in_order",
 	"rx_tcp_out_of_order",
+	"rx_tcp_coalesced",
 	"rx_tcp_text_cycles",
 	"txq_overflow",
+	"rx_bottleneck_drops",
 
 	/* directpath counters */
 	"flow_steering_cycles",
@@ -248,11 +248,15 @@ void storage_softirq(void *arg)
 
 	while (true) {
 		preempt_disable();
+		trace_event(TRACE_SOFTIRQ_BEGIN, NULL, TRACE_SOFTIRQ_STORAGE,
+			    k->kthread_idx);
 		do {
 			spin_lock(&q->lock);
 			ret = storage_softirq_one(q);
 			spin_unlock(&q->lock);
 		} while (!preempt_needed() && ret > 0);
+		trace_event(TRACE_SOFTIRQ_END, NULL, TRACE_SOFTIRQ_STORAGE,
+			    k->kthread_idx);
 		k->storage_busy = false;
 		thread_park_and_preempt_enable();
 	}
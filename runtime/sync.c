@@ -2,53 +2,320 @@
  * sync.c - support for synchronization
  */
 
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/hash.h>
 #include <base/lock.h>
 #include <base/log.h>
 #include <runtime/thread.h>
 #include <runtime/sync.h>
+#include <runtime/timer.h>
 
 #include "defs.h"
 
 
+/*
+ * Mutex contention profiling
+ *
+ * When "lock_profile_interval_s" is set, every contended mutex acquisition
+ * records how long it waited in a log2 histogram (in nanoseconds) for the
+ * call site of mutex_lock(), and the hottest sites are logged periodically.
+ */
+
+/* the number of distinct call sites that can be tracked */
+#define LOCK_PROF_SITES		1024
+/* wait-time buckets, the last one catches everything from ~8 ms up */
+#define LOCK_PROF_BUCKETS	24
+/* how many call sites to log */
+#define LOCK_PROF_TOP		16
+
+/* the logging interval in seconds (0 disables profiling) */
+unsigned int cfg_lock_profile_s;
+
+struct lock_prof_site {
+	uintptr_t	pc;
+	uint64_t	waits;
+	uint64_t	wait_cycles;
+	uint64_t	hist[LOCK_PROF_BUCKETS];
+};
+
+static struct lock_prof_site lock_prof_sites[LOCK_PROF_SITES];
+
+static void lock_prof_record(uintptr_t pc, uint64_t cycles)
+{
+	struct lock_prof_site *s;
+	uint64_t ns = cycles * 1000 / cycles_per_us;
+	unsigned int i, idx, bucket;
+
+	bucket = ns ? MIN(63 - __builtin_clzll(ns), LOCK_PROF_BUCKETS - 1) : 0;
+	idx = hash_crc32c_one(0, pc) % LOCK_PROF_SITES;
+	for (i = 0; i < LOCK_PROF_SITES; i++) {
+		s = &lock_prof_sites[(idx + i) % LOCK_PROF_SITES];
+		if (ACCESS_ONCE(s->pc) != pc &&
+		    !__sync_bool_compare_and_swap(&s->pc, 0, pc) &&
+		    ACCESS_ONCE(s->pc) != pc)
+			continue;
+
+		__sync_fetch_and_add(&s->waits, 1);
+		__sync_fetch_and_add(&s->wait_cycles, cycles);
+		__sync_fetch_and_add(&s->hist[bucket], 1);
+		return;
+	}
+
+	/* the table is full, drop the sample */
+}
+
+/* returns the upper bound (in ns) of the bucket holding percentile @pct */
+static uint64_t lock_prof_percentile(struct lock_prof_site *s, uint64_t waits,
+				     unsigned int pct)
+{
+	uint64_t target = div_up(waits * pct, 100), sum = 0;
+	int i;
+
+	for (i = 0; i < LOCK_PROF_BUCKETS - 1; i++) {
+		sum += ACCESS_ONCE(s->hist[i]);
+		if (sum >= target)
+			break;
+	}
+	return 2UL << i;
+}
+
+static int lock_prof_cmp(const void *a, const void *b)
+{
+	const struct lock_prof_site *sa = *(struct lock_prof_site **)a;
+	const struct lock_prof_site *sb = *(struct lock_prof_site **)b;
+	uint64_t ca = ACCESS_ONCE(sa->wait_cycles);
+	uint64_t cb = ACCESS_ONCE(sb->wait_cycles);
+
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/**
+ * mutex_profile_dump - logs the mutex call sites that waited the longest
+ */
+void mutex_profile_dump(void)
+{
+	static struct lock_prof_site *sorted[LOCK_PROF_SITES];
+	struct lock_prof_site *s;
+	uint64_t waits;
+	Dl_info info;
+	int i, n = 0;
+
+	for (i = 0; i < LOCK_PROF_SITES; i++) {
+		if (ACCESS_ONCE(lock_prof_sites[i].pc))
+			sorted[n++] = &lock_prof_sites[i];
+	}
+	qsort(sorted, n, sizeof(*sorted), lock_prof_cmp);
+
+	log_info("mutex: %d contended call sites", n);
+	for (i = 0; i < MIN(n, LOCK_PROF_TOP); i++) {
+		s = sorted[i];
+		waits = ACCESS_ONCE(s->waits);
+		if (!waits)
+			continue;
+
+		/* file offsets can be resolved with addr2line if unexported */
+		memset(&info, 0, sizeof(info));
+		dladdr((void *)s->pc, &info);
+		log_info("mutex: %s+%#lx (%s) waits %lu total %lu us "
+			 "p50 <%lu ns p99 <%lu ns",
+			 info.dli_sname ? info.dli_sname :
+			 info.dli_fname ? info.dli_fname : "?",
+			 s->pc - (uintptr_t)(info.dli_sname ? info.dli_saddr :
+					      info.dli_fbase),
+			 info.dli_sname ? "sym" : "offset", waits,
+			 ACCESS_ONCE(s->wait_cycles) / cycles_per_us,
+			 lock_prof_percentile(s, waits, 50),
+			 lock_prof_percentile(s, waits, 99));
+	}
+}
+
+static void lock_prof_worker(void *arg)
+{
+	while (true) {
+		timer_sleep(cfg_lock_profile_s * ONE_SECOND);
+		mutex_profile_dump();
+	}
+}
+
+/**
+ * sync_init_late - starts logging the mutex contention profile
+ *
+ * Returns 0 if successful.
+ */
+int sync_init_late(void)
+{
+	if (!cfg_lock_profile_s)
+		return 0;
+
+	return thread_spawn(lock_prof_worker, NULL);
+}
+
+
 /*
  * Mutex support
  */
 
 #define WAITER_FLAG (1 << 31)
 
+/* the owner hint for async holders, which can suspend without parking */
+#define MUTEX_OWNER_ASYNC	((thread_t *)1)
+
+/* bounds for the learned spin budget (in nanoseconds) */
+#define MUTEX_SPIN_MIN_NS	100
+#define MUTEX_SPIN_MAX_NS	2000
+
+/*
+ * Spins while the owner is running on another kthread, on the expectation
+ * that it will release soon. Gives up once the owner is descheduled, other
+ * threads are waiting (either parked on the mutex or runnable on this
+ * kthread), or the spin budget runs out. The budget tracks a moving average
+ * of past spins, so mutexes that are held briefly are spun on and mutexes
+ * that are held for long are not.
+ */
+static bool mutex_spin(mutex_t *m)
+{
+	uint64_t start, now, budget, min, max;
+	thread_t *owner;
+	bool acquired = false;
+
+	min = MUTEX_SPIN_MIN_NS * cycles_per_us / 1000;
+	max = MUTEX_SPIN_MAX_NS * cycles_per_us / 1000;
+	budget = MIN(max, 2 * ACCESS_ONCE(m->spin_cycles) + min);
+
+	start = now = rdtsc();
+	while (now - start < budget) {
+		if (atomic_read(&m->held) == 0) {
+			if (mutex_try_lock(m)) {
+				acquired = true;
+				break;
+			}
+		} else if (atomic_read(&m->held) & WAITER_FLAG) {
+			return false;
+		}
+
+		/* an unset owner means it is between acquiring and releasing */
+		owner = ACCESS_ONCE(m->owner);
+		if (owner == MUTEX_OWNER_ASYNC)
+			return false;
+		if (owner && !ACCESS_ONCE(owner->thread_running))
+			return false;
+		if (!kthread_rq_empty(myk()))
+			return false;
+
+		cpu_relax();
+		now = rdtsc();
+	}
+
+	/* learn from spins that ended on their own (like glibc's adaptive) */
+	now = rdtsc() - start;
+	ACCESS_ONCE(m->spin_cycles) = m->spin_cycles +
+		((int64_t)MIN(now, max) - (int64_t)m->spin_cycles) / 8;
+
+	if (acquired) {
+		preempt_disable();
+		STAT(MUTEX_SPIN_ACQUIRES)++;
+		preempt_enable();
+	}
+	return acquired;
+}
+
 void __mutex_lock(mutex_t *m)
 {
+	struct mutex_waiter w;
 	thread_t *myth;
+	uint64_t start_tsc = 0;
+
+	if (unlikely(cfg_lock_profile_s))
+		start_tsc = rdtsc();
+
+	if (mutex_spin(m))
+		goto done;
 
 	spin_lock_np(&m->waiter_lock);
 
 	/* did we race with mutex_unlock? */
+	myth = thread_self();
 	if (atomic_fetch_and_or(&m->held, WAITER_FLAG) == 0) {
 		atomic_write(&m->held, 1);
+		m->owner = myth;
 		spin_unlock_np(&m->waiter_lock);
-		return;
+		goto done;
 	}
 
-	myth = thread_self();
-	list_add_tail(&m->waiters, &myth->link);
+	STAT(MUTEX_PARKS)++;
+	w.th = myth;
+	list_add_tail(&m->waiters, &w.link);
 	thread_park_and_unlock_np(&m->waiter_lock);
+
+done:
+	if (unlikely(cfg_lock_profile_s))
+		lock_prof_record((uintptr_t)__builtin_return_address(0),
+				 rdtsc() - start_tsc);
 }
 
+/**
+ * mutex_lock_async - acquires a mutex without parking
+ * @m: the mutex to acquire
+ * @w: waiter storage, which must stay valid until @fn runs
+ * @fn: called once the mutex has been handed over
+ * @arg: the argument to @fn
+ *
+ * For callers that can't park, like coroutines. @fn runs from inside
+ * mutex_unlock() and must not block. Waiters are served in FIFO order,
+ * whether they parked or not.
+ *
+ * Returns true if the mutex was acquired right away (@fn won't be called).
+ */
+bool mutex_lock_async(mutex_t *m, struct mutex_waiter *w,
+		      void (*fn)(unsigned long arg), unsigned long arg)
+{
+	if (atomic_cmpxchg(&m->held, 0, 1)) {
+		m->owner = MUTEX_OWNER_ASYNC;
+		return true;
+	}
+
+	spin_lock_np(&m->waiter_lock);
+	if (atomic_fetch_and_or(&m->held, WAITER_FLAG) == 0) {
+		atomic_write(&m->held, 1);
+		m->owner = MUTEX_OWNER_ASYNC;
+		spin_unlock_np(&m->waiter_lock);
+		return true;
+	}
+
+	STAT(MUTEX_PARKS)++;
+	w->th = NULL;
+	w->fn = fn;
+	w->arg = arg;
+	list_add_tail(&m->waiters, &w->link);
+	spin_unlock_np(&m->waiter_lock);
+	return false;
+}
 
 void __mutex_unlock(mutex_t *m)
 {
+	struct mutex_waiter *w;
 	thread_t *waketh;
 
 	spin_lock_np(&m->waiter_lock);
 
-	waketh = list_pop(&m->waiters, thread_t, link);
-	if (!waketh) {
+	w = list_pop(&m->waiters, struct mutex_waiter, link);
+	if (!w) {
 		atomic_write(&m->held, 0);
 		spin_unlock_np(&m->waiter_lock);
 		return;
 	}
+
+	/* hand the mutex straight to the waiter */
+	waketh = w->th;
+	m->owner = waketh ? waketh : MUTEX_OWNER_ASYNC;
 	spin_unlock_np(&m->waiter_lock);
-	thread_ready(waketh);
+	if (waketh)
+		thread_ready(waketh);
+	else
+		w->fn(w->arg);
 }
 
 /**
@@ -60,6 +327,8 @@ void mutex_init(mutex_t *m)
 	atomic_write(&m->held, 0);
 	spin_lock_init(&m->waiter_lock);
 	list_head_init(&m->waiters);
+	m->owner = NULL;
+	m->spin_cycles = 0;
 }
 
 /*
@@ -176,12 +445,7 @@ void rwmutex_unlock(rwmutex_t *m)
 		m->read_waiter_count = 0;
 		list_append_list(&tmp, &m->read_waiters);
 		spin_unlock_np(&m->waiter_lock);
-		while (true) {
-			th = list_pop(&tmp, thread_t, link);
-			if (!th)
-				break;
-			thread_ready(th);
-		}
+		thread_wake_list(&tmp);
 		return;
 	}
 
@@ -201,6 +465,138 @@ void rwmutex_unlock(rwmutex_t *m)
 
 }
 
+/*
+ * Big-reader lock support
+ */
+
+/* how many times a writer polls for readers to drain before yielding */
+#define BRLOCK_DRAIN_SPINS	128
+
+/**
+ * brlock_init - initializes a big-reader lock
+ * @l: the lock to initialize
+ *
+ * Returns 0 if successful, or -ENOMEM if out of memory.
+ */
+int brlock_init(brlock_t *l)
+{
+	/* kthreads may not have been counted yet if the runtime isn't up */
+	l->nr_slots = maxks ? maxks : NCPU;
+	l->slots = aligned_alloc(CACHE_LINE_SIZE,
+				 l->nr_slots * sizeof(struct brlock_slot));
+	if (!l->slots)
+		return -ENOMEM;
+	memset(l->slots, 0, l->nr_slots * sizeof(struct brlock_slot));
+
+	l->writer = false;
+	spin_lock_init(&l->waiter_lock);
+	list_head_init(&l->read_waiters);
+	list_head_init(&l->write_waiters);
+	return 0;
+}
+
+/**
+ * brlock_destroy - frees a big-reader lock
+ * @l: the lock to free (must not be held)
+ */
+void brlock_destroy(brlock_t *l)
+{
+	free(l->slots);
+	l->slots = NULL;
+}
+
+/* the slow path of brlock_rdlock(), when a writer holds or wants the lock */
+void __brlock_rdlock(brlock_t *l, unsigned int idx)
+{
+	thread_t *myth;
+
+	while (true) {
+		/* back out, so the writer can drain */
+		atomic_dec(&l->slots[idx].readers);
+
+		spin_lock_np(&l->waiter_lock);
+		if (l->writer) {
+			myth = thread_self();
+			list_add_tail(&l->read_waiters, &myth->link);
+			thread_park_and_unlock_np(&l->waiter_lock);
+		} else {
+			spin_unlock_np(&l->waiter_lock);
+		}
+
+		idx = kthread_idx;
+		atomic_inc(&l->slots[idx].readers);
+		if (likely(!ACCESS_ONCE(l->writer)))
+			return;
+	}
+}
+
+static int brlock_readers(brlock_t *l)
+{
+	int i, sum = 0;
+
+	for (i = 0; i < l->nr_slots; i++)
+		sum += atomic_read(&l->slots[i].readers);
+	return sum;
+}
+
+/**
+ * brlock_wrlock - acquires a write lock on a big-reader lock
+ * @l: the lock to acquire
+ */
+void brlock_wrlock(brlock_t *l)
+{
+	thread_t *myth;
+	int i;
+
+	spin_lock_np(&l->waiter_lock);
+	while (l->writer) {
+		myth = thread_self();
+		list_add_tail(&l->write_waiters, &myth->link);
+		thread_park_and_unlock_np(&l->waiter_lock);
+		spin_lock_np(&l->waiter_lock);
+	}
+	l->writer = true;
+	spin_unlock_np(&l->waiter_lock);
+
+	/*
+	 * New readers back out once they see the writer flag, so wait for the
+	 * existing ones. The barrier pairs with the atomic increment that
+	 * readers make before checking the flag.
+	 */
+	__sync_synchronize();
+	for (i = 0; brlock_readers(l) != 0; i++) {
+		if (i < BRLOCK_DRAIN_SPINS)
+			cpu_relax();
+		else
+			thread_yield();
+	}
+}
+
+/**
+ * brlock_wrunlock - releases a write lock on a big-reader lock
+ * @l: the lock to release
+ */
+void brlock_wrunlock(brlock_t *l)
+{
+	struct list_head tmp;
+	thread_t *th;
+
+	list_head_init(&tmp);
+
+	spin_lock_np(&l->waiter_lock);
+	assert(l->writer);
+	ACCESS_ONCE(l->writer) = false;
+	list_append_list(&tmp, &l->read_waiters);
+	th = list_pop(&l->write_waiters, thread_t, link);
+	spin_unlock_np(&l->waiter_lock);
+
+	/* readers that get in ahead of the next writer are drained by it */
+	if (th)
+		list_add_tail(&tmp, &th->link);
+	thread_wake_list(&tmp);
+}
+
+
 /*
  * Condition variable support
  */
@@ -245,7 +641,6 @@ void condvar_signal(condvar_t *cv)
  */
 void condvar_broadcast(condvar_t *cv)
 {
-	thread_t *waketh;
 	struct list_head tmp;
 
 	list_head_init(&tmp);
@@ -254,12 +649,7 @@ void condvar_broadcast(condvar_t *cv)
 	list_append_list(&tmp, &cv->waiters);
 	spin_unlock_np(&cv->waiter_lock);
 
-	while (true) {
-		waketh = list_pop(&tmp, thread_t, link);
-		if (!waketh)
-			break;
-		thread_ready(waketh);
-	}
+	thread_wake_list(&tmp);
 }
 
 /**
@@ -288,7 +678,6 @@ void condvar_init(condvar_t *cv)
  */
 void waitgroup_add(waitgroup_t *wg, int cnt)
 {
-	thread_t *waketh;
 	struct list_head tmp;
 
 	list_head_init(&tmp);
@@ -300,12 +689,7 @@ void waitgroup_add(waitgroup_t *wg, int cnt)
 		list_append_list(&tmp, &wg->waiters);
 	spin_unlock_np(&wg->lock);
 
-	while (true) {
-		waketh = list_pop(&tmp, thread_t, link);
-		if (!waketh)
-			break;
-		thread_ready(waketh);
-	}
+	thread_wake_list(&tmp);
 }
 
 /**
@@ -374,12 +758,7 @@ bool barrier_wait(barrier_t *b)
 		list_append_list(&tmp, &b->waiters);
 		b->waiting = 0;
 		spin_unlock_np(&b->lock);
-		while (true) {
-			th = list_pop(&tmp, thread_t, link);
-			if (!th)
-				break;
-			thread_ready(th);
-		}
+		thread_wake_list(&tmp);
 		return true;
 	}
 
@@ -1,11 +1,10 @@
 /*
  * timer.c - support for timers
  *
- * So far we use a D-ary heap just like the Go runtime. We may want to consider
- * adding a lower-resolution shared timer wheel as well.
+ * Each kthread has a hierarchical timing wheel, so arming and cancelling a
+ * timer are O(1) no matter how many timers are outstanding.
  */
 
-#include <limits.h>
 #include <stdlib.h>
 
 #include <base/time.h>
@@ -15,97 +14,131 @@
 
 #include "defs.h"
 
-/* the arity of the heap */
-#define D	4
-
-/**
- * is_valid_heap - checks that the timer heap is a valid min heap
- * @heap: the timer heap
- * @n: the number of timers in the heap
- *
- * Returns true if valid, false otherwise.
+/*
+ * The wheel keeps the invariant that a timer at level L agrees with @clk_us
+ * on every bit above level L, but differs in the bits of level L itself. So
+ * the lowest non-empty level always holds the earliest timers, and within a
+ * level, slots never wrap around. Each time @clk_us reaches a slot at a
+ * higher level, its timers are cascaded down to the lower levels. Level 0
+ * slots are exact, so all of their timers are due at once.
  */
-static bool is_valid_heap(struct timer_idx *heap, int n)
+
+static inline uint64_t wheel_slot_us(uint64_t clk_us, int level, int idx)
 {
-	int i, p;
-
-	/* check that each timer's deadline is later or equal to its parent's
-	 * deadline */
-	for (i = n-1; i > 1; i--) {
-		p = (i - 1) / D;
-		if (heap[p].deadline_us > heap[i].deadline_us)
-			return false;
+	int shift = level * TIMER_WHEEL_BITS;
+	uint64_t prefix = 0;
+
+	if (shift + TIMER_WHEEL_BITS < 64)
+		prefix = clk_us & ~((1UL << (shift + TIMER_WHEEL_BITS)) - 1);
+	return prefix | ((uint64_t)idx << shift);
+}
+
+static void wheel_update_next(struct timer_wheel *w)
+{
+	int i;
+
+	for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		if (w->pending[i]) {
+			w->next_us = wheel_slot_us(w->clk_us, i,
+						   __builtin_ctzl(w->pending[i]));
+			return;
+		}
 	}
 
-	return true;
+	w->next_us = UINT64_MAX;
 }
 
-/**
- * timer_heap_is_valid - checks that this kthread's timer heap is a
- * valid min heap
- * @k: the kthread
- */
-static void assert_timer_heap_is_valid(struct kthread *k)
+static void wheel_insert(struct timer_wheel *w, struct timer_entry *e)
 {
-	assert(is_valid_heap(k->timers, k->timern));
+	uint64_t deadline_us = MAX(e->deadline_us, w->clk_us);
+	uint64_t diff = deadline_us ^ w->clk_us;
+	int level = 0, idx;
+
+	if (diff)
+		level = (63 - __builtin_clzl(diff)) / TIMER_WHEEL_BITS;
+	idx = (deadline_us >> (level * TIMER_WHEEL_BITS)) &
+	      (TIMER_WHEEL_SLOTS - 1);
+
+	list_add_tail(&w->slots[level][idx], &e->link);
+	w->pending[level] |= 1UL << idx;
+	e->idx = level * TIMER_WHEEL_SLOTS + idx;
 }
 
-static void sift_up(struct timer_idx *heap, int i)
+static void wheel_remove(struct timer_wheel *w, struct timer_entry *e)
 {
-	struct timer_idx tmp = heap[i];
-	int p;
-
-	while (i > 0) {
-		p = (i - 1) / D;
-		if (tmp.deadline_us >= heap[p].deadline_us)
-			break;
-		heap[i] = heap[p];
-		heap[i].e->idx = i;
-		heap[p] = tmp;
-		heap[p].e->idx = p;
-		i = p;
-	}
+	int level = e->idx / TIMER_WHEEL_SLOTS;
+	int idx = e->idx % TIMER_WHEEL_SLOTS;
+
+	list_del_from(&w->slots[level][idx], &e->link);
+	if (list_empty(&w->slots[level][idx]))
+		w->pending[level] &= ~(1UL << idx);
 }
 
-static void sift_down(struct timer_idx *heap, int i, int n)
+/* an empty wheel can skip straight to the present */
+static void wheel_reset_clk(struct kthread *k)
 {
-	struct timer_idx tmp = heap[i];
-	uint64_t w;
-	int c, j;
-
-	while (1) {
-		w = tmp.deadline_us;
-		c = INT_MAX;
-		for (j = (i * D + 1); j <= (i * D + D); j++) {
-			if (j >= n)
-				break;
-			if (heap[j].deadline_us < w) {
-				w = heap[j].deadline_us;
-				c = j;
-			}
-		}
-		if (c == INT_MAX)
-			break;
-		heap[i] = heap[c];
-		heap[i].e->idx = i;
-		heap[c] = tmp;
-		heap[c].e->idx = c;
-		i = c;
-	}
+	if (!k->timern)
+		k->timers->clk_us = MAX(k->timers->clk_us, microtime());
 }
 
 static void update_q_ptrs(struct kthread *k)
 {
 	uint64_t next_tsc = 0;
 
+	wheel_update_next(k->timers);
 	if (k->timern)
-		next_tsc = k->timers[0].deadline_us * cycles_per_us + start_tsc;
+		next_tsc = k->timers->next_us * cycles_per_us + start_tsc;
 	ACCESS_ONCE(k->q_ptrs->next_timer_tsc) = next_tsc;
 }
 
+/**
+ * wheel_pop_expired - removes the next expired timer from a kthread's wheel
+ * @k: the kthread
+ * @now_us: the current time in microseconds
+ *
+ * Returns a timer, or NULL if no timers have expired.
+ */
+static struct timer_entry *wheel_pop_expired(struct kthread *k, uint64_t now_us)
+{
+	struct timer_wheel *w = k->timers;
+	struct timer_entry *e;
+	struct list_head *slot;
+	int level, idx;
+
+	assert_spin_lock_held(&k->timer_lock);
+
+	while (k->timern > 0 && w->next_us <= now_us) {
+		w->clk_us = w->next_us;
+		for (level = 0; !w->pending[level]; level++)
+			;
+		idx = __builtin_ctzl(w->pending[level]);
+		slot = &w->slots[level][idx];
+
+		if (level == 0) {
+			e = list_pop(slot, struct timer_entry, link);
+			if (list_empty(slot))
+				w->pending[0] &= ~(1UL << idx);
+			k->timern--;
+			update_q_ptrs(k);
+			return e;
+		}
+
+		/* cascade the slot down to the lower levels */
+		w->pending[level] &= ~(1UL << idx);
+		while ((e = list_pop(slot, struct timer_entry, link)) != NULL)
+			wheel_insert(w, e);
+		wheel_update_next(w);
+	}
+
+	return NULL;
+}
+
 /**
  * timer_earliest_deadline - return the first deadline for this kthread or 0 if
  * there are no active timers.
+ *
+ * Timers far in the future are tracked at a coarser resolution, so this may
+ * return an earlier time, when the wheel next needs to be serviced.
  */
 uint64_t timer_earliest_deadline(void)
 {
@@ -116,7 +149,7 @@ uint64_t timer_earliest_deadline(void)
 	if (k->timern == 0)
 		deadline_us = 0;
 	else
-		deadline_us = k->timers[0].deadline_us;
+		deadline_us = ACCESS_ONCE(k->timers->next_us);
 
 	return deadline_us;
 }
@@ -124,24 +157,17 @@ uint64_t timer_earliest_deadline(void)
 static void timer_start_locked(struct timer_entry *e, uint64_t deadline_us)
 {
 	struct kthread *k = myk();
-	int i;
 
 	assert_spin_lock_held(&k->timer_lock);
 
 	/* can't insert a timer twice! */
 	BUG_ON(e->armed);
 
-	i = k->timern++;
-	if (k->timern >= RUNTIME_MAX_TIMERS) {
-		/* TODO: support unlimited timers */
-		BUG();
-	}
-
-	k->timers[i].deadline_us = deadline_us;
-	k->timers[i].e = e;
-	e->idx = i;
+	wheel_reset_clk(k);
+	e->deadline_us = deadline_us;
 	e->localk = k;
-	sift_up(k->timers, i);
+	wheel_insert(k->timers, e);
+	k->timern++;
 	e->armed = true;
 }
 
@@ -173,14 +199,15 @@ void timer_start(struct timer_entry *e, uint64_t deadline_us)
 bool timer_cancel(struct timer_entry *e)
 {
 	struct kthread *k;
-	int last;
 
 try_again:
 	k = load_acquire(&e->localk);
+	if (!k)
+		return false; /* never started */
 	spin_lock_np(&k->timer_lock);
 
 	if (e->localk != k) {
-		/* Timer was merged to a different heap */
+		/* Timer was merged to a different wheel */
 		spin_unlock_np(&k->timer_lock);
 		goto try_again;
 	}
@@ -191,23 +218,58 @@ try_again:
 	}
 	e->armed = false;
 
-	last = --k->timern;
-	if (e->idx == last) {
-		update_q_ptrs(k);
-		spin_unlock_np(&k->timer_lock);
-		return true;
-	}
-
-	k->timers[e->idx] = k->timers[last];
-	k->timers[e->idx].e->idx = e->idx;
-	sift_up(k->timers, e->idx);
-	sift_down(k->timers, e->idx, k->timern);
+	wheel_remove(k->timers, e);
+	k->timern--;
 	update_q_ptrs(k);
 	spin_unlock_np(&k->timer_lock);
 
 	return true;
 }
 
+/**
+ * timer_merge - moves all timers of a parked kthread to the local kthread
+ * @r: the remote kthread
+ *
+ * This lets the timers fire on a core that is already running, instead of
+ * forcing the iokernel to wake @r. Must be called with preemption disabled.
+ */
+void timer_merge(struct kthread *r)
+{
+	struct kthread *k = myk();
+	struct timer_wheel *w = r->timers;
+	struct timer_entry *e;
+	int level, idx;
+
+	assert_preempt_disabled();
+
+	spin_lock(&k->timer_lock);
+	if (!spin_try_lock(&r->timer_lock)) {
+		spin_unlock(&k->timer_lock);
+		return;
+	}
+
+	wheel_reset_clk(k);
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		while (w->pending[level]) {
+			idx = __builtin_ctzl(w->pending[level]);
+			while ((e = list_pop(&w->slots[level][idx],
+					     struct timer_entry, link)) != NULL) {
+				wheel_insert(k->timers, e);
+				store_release(&e->localk, k);
+			}
+			w->pending[level] &= ~(1UL << idx);
+		}
+	}
+
+	STAT(TIMERS_MERGED) += r->timern;
+	k->timern += r->timern;
+	r->timern = 0;
+	update_q_ptrs(r);
+	update_q_ptrs(k);
+	spin_unlock(&r->timer_lock);
+	spin_unlock(&k->timer_lock);
+}
+
 static void timer_finish_sleep(unsigned long arg)
 {
 	thread_t *th = (thread_t *)arg;
@@ -252,33 +314,31 @@ void timer_sleep(uint64_t duration_us)
 
 static void timer_softirq_one(struct kthread *k)
 {
+	struct timer_wheel *w = k->timers;
 	struct timer_entry *e;
 	uint64_t now_us;
-	int i;
 
 	spin_lock(&k->timer_lock);
-	assert_timer_heap_is_valid(k);
 
 	now_us = microtime();
-	while (!preempt_needed() && k->timern > 0 &&
-	       k->timers[0].deadline_us <= now_us) {
-		i = --k->timern;
-		e = k->timers[0].e;
-		if (i > 0) {
-			k->timers[0] = k->timers[i];
-			k->timers[0].e->idx = 0;
-			sift_down(k->timers, 0, i);
-		}
-		update_q_ptrs(k);
+	while (!preempt_needed() &&
+	       (e = wheel_pop_expired(k, now_us)) != NULL) {
+		e->armed = false;
 		spin_unlock(&k->timer_lock);
 
 		/* execute the timer handler */
-		e->armed = false;
+		trace_event(TRACE_TIMER_FIRE, NULL, 0, (uintptr_t)e->fn);
 		e->fn(e->arg);
 		spin_lock(&k->timer_lock);
 		now_us = microtime();
 	}
 
+	/* nothing else is due yet, so catch the wheel up to the present */
+	if (w->next_us > now_us && now_us > w->clk_us) {
+		w->clk_us = now_us;
+		update_q_ptrs(k);
+	}
+
 	spin_unlock(&k->timer_lock);
 }
 
@@ -288,7 +348,11 @@ static void timer_softirq(void *arg)
 
 	while (true) {
 		preempt_disable();
+		trace_event(TRACE_SOFTIRQ_BEGIN, NULL, TRACE_SOFTIRQ_TIMER,
+			    k->kthread_idx);
 		timer_softirq_one(k);
+		trace_event(TRACE_SOFTIRQ_END, NULL, TRACE_SOFTIRQ_TIMER,
+			    k->kthread_idx);
 		k->timer_busy = false;
 		thread_park_and_preempt_enable();
 	}
@@ -304,13 +368,21 @@ int timer_init_thread(void)
 	struct kthread *k = myk();
 	struct timer_spec *ts = &iok.threads[k->kthread_idx].timer_heap;
 	thread_t *th;
+	int i, j;
 
 	k->timers = aligned_alloc(CACHE_LINE_SIZE,
-			align_up(sizeof(struct timer_idx) * RUNTIME_MAX_TIMERS,
-				 CACHE_LINE_SIZE));
+			align_up(sizeof(struct timer_wheel), CACHE_LINE_SIZE));
 	if (!k->timers)
 		return -ENOMEM;
 
+	for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		k->timers->pending[i] = 0;
+		for (j = 0; j < TIMER_WHEEL_SLOTS; j++)
+			list_head_init(&k->timers->slots[i][j]);
+	}
+	k->timers->clk_us = microtime();
+	k->timers->next_us = UINT64_MAX;
+
 	th = thread_create(timer_softirq, k);
 	if (!th)
 		return -ENOMEM;
@@ -0,0 +1,165 @@
+/*
+ * trace.c - per-kthread binary scheduler event traces
+ *
+ * When "runtime_trace_kb" is set, every kthread records scheduler events
+ * (see TRACE_*) into its own ring inside a shared file mapping, so the rings
+ * can be read while the process runs or after it dies. Rings overwrite their
+ * oldest records, keeping the most recent history. The file layout is a
+ * struct trace_file_hdr, followed by one struct trace_ring (a header and
+ * ring_entries records) per kthread. scripts/trace_decode.py turns it into
+ * Chrome trace JSON.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/thread.h>
+
+#include "defs.h"
+
+#define TRACE_MAGIC	0x45434152544c4143UL /* "CALTRACE" */
+#define TRACE_VERSION	1
+
+/* the per-kthread trace ring size in KB (0 disables tracing) */
+unsigned int cfg_trace_kb;
+/* the trace file, defaults to /dev/shm/caladan_<pid>.trace */
+char *cfg_trace_path;
+
+struct trace_file_hdr {
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	nr_rings;
+	uint32_t	ring_entries;
+	uint32_t	rec_size;
+	uint64_t	cycles_per_us;
+} __aligned(CACHE_LINE_SIZE);
+
+struct trace_ring {
+	uint64_t	head;	/* the total number of records ever written */
+	uint32_t	kthread_idx;
+	uint32_t	pad;
+	struct trace_rec recs[] __aligned(CACHE_LINE_SIZE);
+};
+
+__thread struct trace_ring *trace_ring;
+static void *trace_base;
+static uint32_t trace_ring_entries;
+
+static size_t trace_ring_size(void)
+{
+	return sizeof(struct trace_ring) +
+	       trace_ring_entries * sizeof(struct trace_rec);
+}
+
+/**
+ * __trace_event - records an event (the slow path of trace_event())
+ * @type: the event type (TRACE_*)
+ * @th: the uthread involved, or NULL
+ * @arg: a small event-specific argument
+ * @data: an event-specific argument
+ */
+void __trace_event(unsigned int type, thread_t *th, unsigned int arg,
+		   uint64_t data)
+{
+	struct trace_ring *r;
+	struct trace_rec *rec;
+	uint64_t head;
+
+	/* only the owning kthread writes, so stay on it */
+	preempt_disable();
+	r = trace_ring;
+	head = r->head;
+	rec = &r->recs[head & (trace_ring_entries - 1)];
+	rec->tsc = rdtsc();
+	rec->type = type;
+	rec->arg = arg;
+	rec->th = (uintptr_t)th;
+	rec->data = data;
+	store_release(&r->head, head + 1);
+	preempt_enable();
+}
+
+/**
+ * trace_init_thread - starts tracing on the calling kthread
+ *
+ * Returns 0 if successful.
+ */
+int trace_init_thread(void)
+{
+	struct trace_ring *r;
+
+	if (!trace_base)
+		return 0;
+
+	r = (struct trace_ring *)((char *)trace_base +
+		sizeof(struct trace_file_hdr) + kthread_idx * trace_ring_size());
+	r->kthread_idx = kthread_idx;
+	trace_ring = r;
+	return 0;
+}
+
+/**
+ * trace_init - creates the trace file
+ *
+ * Returns 0 if successful.
+ */
+int trace_init(void)
+{
+	struct trace_file_hdr *hdr;
+	char path[64];
+	size_t len;
+	int fd;
+
+	if (!cfg_trace_kb)
+		return 0;
+
+	/* round down to a power of two so the index is a mask */
+	trace_ring_entries = cfg_trace_kb * KB / sizeof(struct trace_rec);
+	trace_ring_entries = 1U << (31 - __builtin_clz(trace_ring_entries));
+
+	if (!cfg_trace_path) {
+		snprintf(path, sizeof(path), "/dev/shm/caladan_%d.trace",
+			 getpid());
+		cfg_trace_path = strdup(path);
+		if (!cfg_trace_path)
+			return -ENOMEM;
+	}
+
+	fd = open(cfg_trace_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_err("trace: couldn't open '%s'", cfg_trace_path);
+		return -errno;
+	}
+
+	len = sizeof(*hdr) + maxks * trace_ring_size();
+	if (ftruncate(fd, len) == -1) {
+		log_err("trace: couldn't size '%s'", cfg_trace_path);
+		close(fd);
+		return -errno;
+	}
+
+	hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		log_err("trace: couldn't map '%s'", cfg_trace_path);
+		return -errno;
+	}
+
+	hdr->version = TRACE_VERSION;
+	hdr->nr_rings = maxks;
+	hdr->ring_entries = trace_ring_entries;
+	hdr->rec_size = sizeof(struct trace_rec);
+	hdr->cycles_per_us = cycles_per_us;
+	store_release(&hdr->magic, TRACE_MAGIC);
+	trace_base = hdr;
+
+	log_info("trace: %u events per kthread in '%s'", trace_ring_entries,
+		 cfg_trace_path);
+	return 0;
+}
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+#
+# prof_fold.py - turns a runtime profile (see "profiler_hz") into folded stacks
+#
+# Each output line is "entry;outermost;...;leaf count", rooted at the function
+# the uthread was spawned with, which flamegraph.pl and speedscope accept.
+#
+# usage: prof_fold.py caladan_<pid>.prof > out.folded
+#        flamegraph.pl out.folded > out.svg
+
+import collections
+import subprocess
+import sys
+
+
+def parse_profile(path):
+    maps = []
+    samples = collections.Counter()
+    drops = 0
+    with open(path) as f:
+        for line in f:
+            if line.startswith("# map "):
+                # start-end perms offset dev inode path
+                fields = line.split()
+                start, end = (int(x, 16) for x in fields[2].split("-"))
+                maps.append((start, end, int(fields[4], 16), fields[7]))
+            elif line.startswith("# drops "):
+                drops = int(line.split()[2])
+            elif not line.startswith("#"):
+                samples[tuple(int(x, 16) for x in line.split())] += 1
+    return maps, samples, drops
+
+
+def find_map(maps, pc):
+    for start, end, offset, path in maps:
+        if start <= pc < end:
+            return path, pc - start + offset
+    return None, pc
+
+
+def symbolize(maps, pcs):
+    # group by object so each one needs a single addr2line run
+    by_obj = collections.defaultdict(set)
+    for pc in pcs:
+        path, addr = find_map(maps, pc)
+        if path:
+            by_obj[path].add(addr)
+
+    names = {}
+    for path, addrs in by_obj.items():
+        addrs = sorted(addrs)
+        out = subprocess.run(
+            ["addr2line", "-f", "-C", "-e", path] + [hex(a) for a in addrs],
+            capture_output=True, text=True).stdout.splitlines()
+        for i, addr in enumerate(addrs):
+            fn = out[2 * i] if 2 * i < len(out) else "??"
+            if fn == "??":
+                fn = "%s+%#x" % (path.rsplit("/", 1)[-1], addr)
+            names[(path, addr)] = fn
+
+    syms = {}
+    for pc in pcs:
+        path, addr = find_map(maps, pc)
+        syms[pc] = names.get((path, addr), "%#x" % pc)
+    return syms
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write("usage: %s [profile]\n" % sys.argv[0])
+        sys.exit(1)
+
+    maps, samples, drops = parse_profile(sys.argv[1])
+
+    # return addresses point after the call, so step back into it
+    def lookup_pcs(sample):
+        entry, leaf, callers = sample[0], sample[1], sample[2:]
+        return [entry, leaf] + [pc - 1 for pc in callers]
+
+    pcs = set()
+    for sample in samples:
+        pcs.update(pc for pc in lookup_pcs(sample) if pc)
+    syms = symbolize(maps, pcs)
+
+    folded = collections.Counter()
+    for sample, count in samples.items():
+        pcs = lookup_pcs(sample)
+        entry = syms[pcs[0]] if pcs[0] else "[runtime]"
+        frames = [syms[pc] for pc in reversed(pcs[1:])]
+        # the outermost frame is usually the entry function itself
+        if frames and frames[0] == entry:
+            frames = frames[1:]
+        folded[";".join([entry] + frames)] += count
+
+    for stack, count in sorted(folded.items()):
+        print("%s %d" % (stack, count))
+    if drops:
+        sys.stderr.write("warning: %d samples were dropped\n" % drops)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+#
+# trace_decode.py - converts a runtime scheduler trace to Chrome trace JSON
+#
+# Enable tracing with "runtime_trace_kb" in the runtime config, then load the
+# output in chrome://tracing or https://ui.perfetto.dev. Each kthread gets a
+# row showing which uthread ran, softirqs, parks, steals, and timers. Each
+# uthread also gets its own row showing when it waited in a runqueue and when
+# it ran (and on which kthread), which is its timeline for one request.
+#
+# usage: trace_decode.py /dev/shm/caladan_<pid>.trace > trace.json
+
+import json
+import struct
+import sys
+
+TRACE_MAGIC = 0x45434152544c4143
+HDR_FMT = "<QIIIIQ"
+HDR_SIZE = 64
+RING_HDR_SIZE = 64
+REC_FMT = "<QIIQQ"
+
+(THREAD_READY, THREAD_RUN, THREAD_PARK, THREAD_EXIT, STEAL, KTHREAD_PARK,
+ KTHREAD_UNPARK, SOFTIRQ_BEGIN, SOFTIRQ_END, TIMER_FIRE) = range(10)
+SOFTIRQ_NAMES = ["iokernel softirq", "directpath softirq", "timer softirq",
+                 "storage softirq"]
+
+KTHREAD_PID = 0
+UTHREAD_PID = 1
+
+
+def read_rings(path):
+    with open(path, "rb") as f:
+        buf = f.read()
+
+    magic, version, nr_rings, entries, rec_size, cycles_per_us = \
+        struct.unpack_from(HDR_FMT, buf, 0)
+    if magic != TRACE_MAGIC or version != 1:
+        sys.exit("%s: not a version 1 trace file" % path)
+
+    ring_size = RING_HDR_SIZE + entries * rec_size
+    rings = []
+    for i in range(nr_rings):
+        off = HDR_SIZE + i * ring_size
+        head, = struct.unpack_from("<Q", buf, off)
+        recs = []
+        # the ring keeps the last @entries records
+        for seq in range(max(0, head - entries), head):
+            recs.append(struct.unpack_from(
+                REC_FMT, buf, off + RING_HDR_SIZE + (seq % entries) * rec_size))
+        rings.append(recs)
+    return rings, cycles_per_us
+
+
+class KthreadState:
+    def __init__(self):
+        self.running = None     # (th, tsc, entry)
+        self.parked = None      # (tsc, voluntary)
+        self.softirqs = {}      # softirq type -> tsc
+
+
+class Decoder:
+    def __init__(self, cycles_per_us, start_tsc):
+        self.cycles_per_us = cycles_per_us
+        self.start_tsc = start_tsc
+        self.events = []
+        self.uthreads = {}
+        self.ready = {}         # th -> tsc it was last made ready
+
+    def ts(self, tsc):
+        return (tsc - self.start_tsc) / self.cycles_per_us
+
+    def add(self, ev, pid, tid, tsc):
+        ev.update(pid=pid, tid=tid, ts=self.ts(tsc))
+        self.events.append(ev)
+
+    def instant(self, pid, tid, name, tsc, args=None):
+        self.add({"ph": "i", "s": "t", "name": name, "args": args or {}},
+                 pid, tid, tsc)
+
+    def span(self, pid, tid, name, start, end, args=None):
+        self.add({"ph": "X", "name": name, "dur": self.ts(end) -
+                  self.ts(start), "args": args or {}}, pid, tid, start)
+
+    def name_row(self, pid, tid, name):
+        self.add({"ph": "M", "name": "thread_name", "args": {"name": name}},
+                 pid, tid, self.start_tsc)
+
+    def uthread_tid(self, th):
+        if th not in self.uthreads:
+            self.uthreads[th] = len(self.uthreads)
+            self.name_row(UTHREAD_PID, self.uthreads[th], "uthread %#x" % th)
+        return self.uthreads[th]
+
+    def record(self, kidx, k, tsc, typ, arg, th, data):
+        if typ in (THREAD_PARK, THREAD_EXIT, KTHREAD_PARK) and k.running:
+            rth, start, entry = k.running
+            self.span(KTHREAD_PID, kidx, "uthread %#x" % rth, start, tsc,
+                      {"entry": "%#x" % entry})
+            self.span(UTHREAD_PID, self.uthread_tid(rth), "running", start,
+                      tsc, {"kthread": kidx, "entry": "%#x" % entry})
+            k.running = None
+
+        if typ == THREAD_READY:
+            self.ready[th] = tsc
+        elif typ == THREAD_RUN:
+            k.running = (th, tsc, data)
+            ready = self.ready.pop(th, None)
+            if ready is not None:
+                self.span(UTHREAD_PID, self.uthread_tid(th), "queued", ready,
+                          tsc)
+        elif typ == THREAD_EXIT:
+            self.instant(UTHREAD_PID, self.uthread_tid(th), "exit", tsc)
+        elif typ == STEAL:
+            name = "steal %d from k%d" % (data, arg) if data else \
+                   "steal softirq from k%d" % arg
+            self.instant(KTHREAD_PID, kidx, name, tsc)
+        elif typ == KTHREAD_PARK:
+            k.parked = (tsc, arg)
+        elif typ == KTHREAD_UNPARK and k.parked:
+            self.span(KTHREAD_PID, kidx, "parked", k.parked[0], tsc,
+                      {"voluntary": bool(k.parked[1]), "cpu": data})
+            k.parked = None
+        elif typ == SOFTIRQ_BEGIN:
+            k.softirqs[arg] = tsc
+        elif typ == SOFTIRQ_END and arg in k.softirqs:
+            self.span(KTHREAD_PID, kidx, SOFTIRQ_NAMES[arg],
+                      k.softirqs.pop(arg), tsc, {"owner": "k%d" % data})
+        elif typ == TIMER_FIRE:
+            self.instant(KTHREAD_PID, kidx, "timer", tsc, {"fn": "%#x" % data})
+
+    def decode(self, rings):
+        # a uthread is readied on one kthread and may run on another, so
+        # replay every ring in a single time order
+        merged = []
+        for kidx, recs in enumerate(rings):
+            self.name_row(KTHREAD_PID, kidx, "kthread %d" % kidx)
+            merged.extend((rec[0], kidx, rec) for rec in recs)
+        merged.sort(key=lambda x: (x[0], x[1]))
+
+        states = [KthreadState() for _ in rings]
+        for _, kidx, rec in merged:
+            self.record(kidx, states[kidx], *rec)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write("usage: %s [trace_file]\n" % sys.argv[0])
+        sys.exit(1)
+
+    rings, cycles_per_us = read_rings(sys.argv[1])
+    tscs = [recs[0][0] for recs in rings if recs]
+    if not tscs:
+        sys.exit("the trace is empty")
+
+    d = Decoder(cycles_per_us, min(tscs))
+    d.decode(rings)
+    json.dump({"traceEvents": d.events, "displayTimeUnit": "ns"}, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,13 +1,19 @@
 #include <stdio.h>
+#include <unistd.h>
 
 #include <base/stddef.h>
 #include <base/log.h>
 #include <base/time.h>
 #include <runtime/runtime.h>
 #include <runtime/sync.h>
+#include <runtime/timer.h>
 
 #define N		50000
 #define NCORES	4
+/* the size of a spawn burst, every thread is alive at the same time */
+#define BURST_N		1000000
+/* long enough for idle stacks to be returned to the OS */
+#define IDLE_US		(2 * ONE_SECOND)
 
 static void work_handler(void *arg)
 {
@@ -16,28 +22,69 @@ static void work_handler(void *arg)
 	waitgroup_wait(wg_parent);
 }
 
-static void main_handler(void *arg)
+/* returns the resident set size of this process in KB */
+static long rss_kb(void)
+{
+	long size, resident;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose(f);
+	return resident * (getpagesize() / KB);
+}
+
+/* returns the number of threads spawned, fewer if stacks ran out */
+static int spawn_burst(int n)
 {
 	waitgroup_t wg;
-	double threads_per_second;
-	uint64_t start_us;
 	int i, ret;
 
-	log_info("started main_handler() thread");
-
 	waitgroup_init(&wg);
-	waitgroup_add(&wg, N);
-	start_us = microtime();
-	for (i = 0; i < N; i++) {
+	waitgroup_add(&wg, n);
+	for (i = 0; i < n; i++) {
 		ret = thread_spawn(work_handler, &wg);
-		BUG_ON(ret);
+		if (ret) {
+			log_warn("stopped the burst at %d threads, ret = %d",
+				 i, ret);
+			waitgroup_add(&wg, i - n);
+			break;
+		}
 		thread_yield();
 	}
-
 	waitgroup_wait(&wg);
+	return i;
+}
+
+static void main_handler(void *arg)
+{
+	double threads_per_second;
+	long rss_before, rss_burst, rss_idle;
+	uint64_t start_us;
+	int n;
+
+	log_info("started main_handler() thread");
+
+	start_us = microtime();
+	spawn_burst(N);
 	threads_per_second = (double)N /
 			     ((microtime() - start_us) * 0.000001);
 	log_info("spawned %f threads / second", threads_per_second);
+
+	rss_before = rss_kb();
+	n = spawn_burst(BURST_N);
+	rss_burst = rss_kb();
+	timer_sleep(IDLE_US);
+	rss_idle = rss_kb();
+	log_info("%d thread burst, RSS before %ld KB, right after %ld KB, "
+		 "after idling for %d us %ld KB", n, rss_before, rss_burst,
+		 IDLE_US, rss_idle);
+
+	/* most of the stack memory the burst touched must be returned */
+	BUG_ON(rss_idle - rss_before > (rss_burst - rss_before) / 4);
 }
 
 int main(int argc, char *argv[])
@@ -0,0 +1,130 @@
+/*
+ * test_net_demux.c - benchmarks transport match table lookups
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/rcu.h>
+
+#include "../runtime/net/defs.h"
+
+#define NLOOKUPS	4000000
+#define NSAMPLES	(1 << 20)
+
+static const unsigned int table_sizes[] = {
+	10000, 100000, 1000000, 4000000,
+};
+
+static void dummy_recv(struct trans_entry *e, struct mbuf *m)
+{
+	BUG();
+}
+
+static const struct trans_ops dummy_ops = {
+	.recv = dummy_recv,
+};
+
+/* one 5-tuple flow per entry, as if each were a TCP connection */
+static void make_key(unsigned int i, struct trans_key *k)
+{
+	k->proto = IPPROTO_TCP;
+	k->laddr.ip = MAKE_IP_ADDR(10, 0, 0, 1);
+	k->laddr.port = 8000;
+	k->raddr.ip = MAKE_IP_ADDR(10, 1, 0, 0) + i / 16;
+	k->raddr.port = 40000 + i % 16;
+}
+
+static void bench_size(unsigned int nr, const uint32_t *samples)
+{
+	struct trans_key ks[TRANS_LOOKUP_BATCH];
+	struct trans_entry *es[TRANS_LOOKUP_BATCH];
+	struct trans_entry *entries;
+	struct trans_key k;
+	uint64_t start_us, add_us, one_us, batch_us;
+	unsigned int i, j, idx;
+
+	entries = calloc(nr, sizeof(*entries));
+	BUG_ON(!entries);
+
+	start_us = microtime();
+	for (i = 0; i < nr; i++) {
+		make_key(i, &k);
+		trans_init_5tuple(&entries[i], k.proto, &dummy_ops,
+				  k.laddr, k.raddr);
+		BUG_ON(trans_table_add(&entries[i]));
+	}
+	add_us = microtime() - start_us;
+
+	start_us = microtime();
+	for (i = 0; i < NLOOKUPS; i++) {
+		idx = samples[i % NSAMPLES] % nr;
+		make_key(idx, &k);
+		rcu_read_lock();
+		BUG_ON(trans_table_lookup(&k) != &entries[idx]);
+		rcu_read_unlock();
+	}
+	one_us = microtime() - start_us;
+
+	start_us = microtime();
+	for (i = 0; i < NLOOKUPS; i += TRANS_LOOKUP_BATCH) {
+		for (j = 0; j < TRANS_LOOKUP_BATCH; j++)
+			make_key(samples[(i + j) % NSAMPLES] % nr, &ks[j]);
+		rcu_read_lock();
+		trans_table_lookup_batch(ks, es, TRANS_LOOKUP_BATCH);
+		for (j = 0; j < TRANS_LOOKUP_BATCH; j++) {
+			BUG_ON(es[j] != &entries[samples[(i + j) % NSAMPLES] %
+						 nr]);
+		}
+		rcu_read_unlock();
+	}
+	batch_us = microtime() - start_us;
+
+	log_info("%u entries: add %.1f ns, lookup %.1f ns, batched %.1f ns",
+		 nr, (double)add_us * 1000 / nr,
+		 (double)one_us * 1000 / NLOOKUPS,
+		 (double)batch_us * 1000 / NLOOKUPS);
+
+	for (i = 0; i < nr; i++)
+		trans_table_remove(&entries[i]);
+	synchronize_rcu();
+	free(entries);
+}
+
+static void main_handler(void *arg)
+{
+	uint32_t *samples;
+	int i;
+
+	samples = malloc(NSAMPLES * sizeof(*samples));
+	BUG_ON(!samples);
+	for (i = 0; i < NSAMPLES; i++)
+		samples[i] = rand();
+
+	for (i = 0; i < ARRAY_SIZE(table_sizes); i++)
+		bench_size(table_sizes[i], samples);
+
+	free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
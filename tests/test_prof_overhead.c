@@ -0,0 +1,242 @@
+/*
+ * test_prof_overhead.c - measures the cost of the sampling profiler
+ *
+ * Runs a fixed CPU-bound workload on every kthread and takes the best time per
+ * iteration over several rounds. The test runs itself twice from the given
+ * config file, once with "profiler_hz 0" and once with "profiler_hz 1000"
+ * (sampling, draining and writing the profile), and checks that profiling
+ * slows the workload by less than 2% and actually records samples.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+
+#define ITERS		(200 * 1000 * 1000)
+#define ROUNDS		10
+#define MAX_OVERHEAD	0.02
+#define PROF_HZ		1000
+#define CHILD_ARG	"child"
+/* the child reports its result on a line starting with this */
+#define RESULT_TAG	"prof_overhead_ns "
+
+static volatile uint64_t sink;
+
+/* a few frames deep, so samples walk a real call stack */
+static __noinline uint64_t mix(uint64_t x)
+{
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+static __noinline uint64_t work(uint64_t n)
+{
+	uint64_t i, x = 1;
+
+	for (i = 0; i < n; i++)
+		x = mix(x);
+	return x;
+}
+
+static void work_handler(void *arg)
+{
+	waitgroup_t *wg = (waitgroup_t *)arg;
+
+	sink += work(ITERS);
+	waitgroup_done(wg);
+}
+
+static void main_handler(void *arg)
+{
+	int i, j, ret, nworkers = runtime_max_cores();
+	double ns, best_ns = 0;
+	uint64_t start_us;
+	waitgroup_t wg;
+
+	for (i = 0; i < ROUNDS; i++) {
+		waitgroup_init(&wg);
+		waitgroup_add(&wg, nworkers);
+		start_us = microtime();
+		for (j = 0; j < nworkers; j++) {
+			ret = thread_spawn(work_handler, &wg);
+			BUG_ON(ret);
+		}
+		waitgroup_wait(&wg);
+
+		ns = (double)(microtime() - start_us) * 1000 / ITERS;
+		if (i == 0 || ns < best_ns)
+			best_ns = ns;
+	}
+
+	log_info("%d workers, best of %d rounds: %.4f ns per iteration",
+		 nworkers, ROUNDS, best_ns);
+	printf(RESULT_TAG "%f\n", best_ns);
+	fflush(stdout);
+}
+
+/* copies @cfg_path to @out_path, overriding the profiler settings */
+static int write_config(const char *cfg_path, const char *out_path,
+			unsigned int hz, const char *prof_path)
+{
+	char line[512];
+	FILE *in, *out;
+
+	in = fopen(cfg_path, "r");
+	if (!in)
+		return -errno;
+	out = fopen(out_path, "w");
+	if (!out) {
+		fclose(in);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		if (!strncmp(line, "profiler_", strlen("profiler_")))
+			continue;
+		fputs(line, out);
+	}
+	fprintf(out, "\nprofiler_hz %u\n", hz);
+	if (prof_path)
+		fprintf(out, "profiler_path %s\n", prof_path);
+
+	fclose(in);
+	fclose(out);
+	return 0;
+}
+
+/* runs the workload in a child process, returning its best ns or < 0 */
+static double run_child(const char *self, const char *cfg_path)
+{
+	char line[512];
+	double ns = -1;
+	int fds[2], status;
+	FILE *f;
+	pid_t pid;
+
+	if (pipe(fds))
+		return -1;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(self, self, cfg_path, CHILD_ARG, (char *)NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	f = fdopen(fds[0], "r");
+	while (f && fgets(line, sizeof(line), f)) {
+		fputs(line, stdout);
+		if (!strncmp(line, RESULT_TAG, strlen(RESULT_TAG)))
+			ns = atof(line + strlen(RESULT_TAG));
+	}
+	if (f)
+		fclose(f);
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		return -1;
+	return ns;
+}
+
+/* counts the samples (non-comment lines) in a profile */
+static long count_samples(const char *prof_path)
+{
+	char line[1024];
+	long n = 0;
+	FILE *f;
+
+	f = fopen(prof_path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] != '#')
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static int run_parent(const char *self, const char *cfg_path)
+{
+	char off_cfg[64], on_cfg[64], prof_path[64];
+	double off_ns, on_ns, overhead;
+	long samples;
+	int ret;
+
+	snprintf(off_cfg, sizeof(off_cfg), "/tmp/prof_off_%d.config",
+		 getpid());
+	snprintf(on_cfg, sizeof(on_cfg), "/tmp/prof_on_%d.config", getpid());
+	snprintf(prof_path, sizeof(prof_path), "/tmp/prof_%d.prof", getpid());
+
+	ret = write_config(cfg_path, off_cfg, 0, NULL);
+	if (!ret)
+		ret = write_config(cfg_path, on_cfg, PROF_HZ, prof_path);
+	if (ret) {
+		printf("couldn't write configs: %d\n", ret);
+		return ret;
+	}
+
+	off_ns = run_child(self, off_cfg);
+	on_ns = run_child(self, on_cfg);
+	samples = count_samples(prof_path);
+	unlink(off_cfg);
+	unlink(on_cfg);
+	unlink(prof_path);
+
+	if (off_ns <= 0 || on_ns <= 0) {
+		printf("a run failed\n");
+		return -EIO;
+	}
+
+	overhead = on_ns / off_ns - 1;
+	printf("profiler off %.4f ns, at %d Hz %.4f ns: %.2f%% overhead, "
+	       "%ld samples\n", off_ns, PROF_HZ, on_ns, overhead * 100,
+	       samples);
+	if (samples <= 0) {
+		printf("FAIL: the profiler recorded no samples\n");
+		return -EIO;
+	}
+	if (overhead > MAX_OVERHEAD) {
+		printf("FAIL: overhead above %.0f%%\n", MAX_OVERHEAD * 100);
+		return -EIO;
+	}
+
+	printf("PASS\n");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("%s: [config_file_path]\n", argv[0]);
+		return -EINVAL;
+	}
+
+	if (argc < 3 || strcmp(argv[2], CHILD_ARG))
+		return run_parent(argv[0], argv[1]);
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
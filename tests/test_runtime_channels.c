@@ -0,0 +1,203 @@
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/chan.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+
+#define ITERS		500000
+#define PRODUCERS	16
+#define FANIN_CAP	256
+
+static chan_t ping, pong;
+static waitgroup_t wg;
+
+static mutex_t pp_lock;
+static condvar_t pp_cv;
+static int pp_turn;
+
+static void chan_pong_handler(void *arg)
+{
+	long v;
+
+	while (chan_recv(&ping, &v) == 0)
+		BUG_ON(chan_send(&pong, &v));
+	waitgroup_done(&wg);
+}
+
+/* a round trip between two uthreads over a pair of channels */
+static void chan_pingpong_test(unsigned int cap)
+{
+	uint64_t start_us;
+	long i, v;
+	int ret;
+
+	BUG_ON(chan_init(&ping, sizeof(long), cap));
+	BUG_ON(chan_init(&pong, sizeof(long), cap));
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, 1);
+	ret = thread_spawn(chan_pong_handler, NULL);
+	BUG_ON(ret);
+
+	start_us = microtime();
+	for (i = 0; i < ITERS; i++) {
+		BUG_ON(chan_send(&ping, &i));
+		BUG_ON(chan_recv(&pong, &v));
+		BUG_ON(v != i);
+	}
+	log_info("channels (cap %u): %f round trips / second", cap,
+		 (double)ITERS / ((microtime() - start_us) * 0.000001));
+
+	chan_close(&ping);
+	chan_close(&pong);
+	BUG_ON(chan_recv(&pong, &v) != -EPIPE);
+	waitgroup_wait(&wg);
+	chan_destroy(&ping);
+	chan_destroy(&pong);
+}
+
+static void cv_pong_handler(void *arg)
+{
+	mutex_lock(&pp_lock);
+	while (true) {
+		while (pp_turn == 0)
+			condvar_wait(&pp_cv, &pp_lock);
+		if (pp_turn < 0)
+			break;
+		pp_turn = 0;
+		condvar_broadcast(&pp_cv);
+	}
+	mutex_unlock(&pp_lock);
+}
+
+/* the same round trip built from a mutex and a condvar, for comparison */
+static void cv_pingpong_test(void)
+{
+	uint64_t start_us;
+	int i, ret;
+
+	mutex_init(&pp_lock);
+	condvar_init(&pp_cv);
+	pp_turn = 0;
+	ret = thread_spawn(cv_pong_handler, NULL);
+	BUG_ON(ret);
+
+	start_us = microtime();
+	mutex_lock(&pp_lock);
+	for (i = 0; i < ITERS; i++) {
+		pp_turn = 1;
+		condvar_broadcast(&pp_cv);
+		while (pp_turn != 0)
+			condvar_wait(&pp_cv, &pp_lock);
+	}
+	pp_turn = -1;
+	condvar_broadcast(&pp_cv);
+	mutex_unlock(&pp_lock);
+	log_info("mutex+condvar: %f round trips / second",
+		 (double)ITERS / ((microtime() - start_us) * 0.000001));
+}
+
+static void producer_handler(void *arg)
+{
+	chan_t *c = (chan_t *)arg;
+	long i;
+
+	for (i = 1; i <= ITERS / PRODUCERS; i++)
+		BUG_ON(chan_send(c, &i));
+	waitgroup_done(&wg);
+}
+
+/* many producers feeding one consumer */
+static void fanin_test(unsigned int cap)
+{
+	const long per = ITERS / PRODUCERS;
+	long v, sum = 0, n = 0;
+	uint64_t start_us;
+	chan_t c;
+	int i, ret;
+
+	BUG_ON(chan_init(&c, sizeof(long), cap));
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, PRODUCERS);
+
+	start_us = microtime();
+	for (i = 0; i < PRODUCERS; i++) {
+		ret = thread_spawn(producer_handler, &c);
+		BUG_ON(ret);
+	}
+	while (n < per * PRODUCERS) {
+		BUG_ON(chan_recv(&c, &v));
+		sum += v;
+		n++;
+	}
+	BUG_ON(sum != PRODUCERS * per * (per + 1) / 2);
+	log_info("fan-in (cap %u): %f messages / second", cap,
+		 (double)n / ((microtime() - start_us) * 0.000001));
+
+	waitgroup_wait(&wg);
+	chan_destroy(&c);
+}
+
+/* select picks a ready case, and times out when nothing is ready */
+static void select_test(void)
+{
+	struct chan_case cases[2];
+	chan_t a, b;
+	long v = 7, out = 0;
+	uint64_t start_us;
+	int ret;
+
+	BUG_ON(chan_init(&a, sizeof(long), 0));
+	BUG_ON(chan_init(&b, sizeof(long), CHAN_UNBOUNDED));
+
+	cases[0] = (struct chan_case){.c = &a, .buf = &out, .send = false};
+	cases[1] = (struct chan_case){.c = &b, .buf = &out, .send = false};
+	BUG_ON(chan_select(cases, 2, 0) != -EAGAIN);
+
+	start_us = microtime();
+	BUG_ON(chan_select(cases, 2, 10000) != -ETIMEDOUT);
+	BUG_ON(microtime() - start_us < 10000);
+
+	BUG_ON(chan_send(&b, &v));
+	ret = chan_select(cases, 2, -1);
+	BUG_ON(ret != 1 || cases[1].ret != 0 || out != 7);
+
+	chan_close(&a);
+	ret = chan_select(cases, 2, -1);
+	BUG_ON(ret != 0 || cases[0].ret != -EPIPE);
+	BUG_ON(chan_try_send(&a, &v) != -EPIPE);
+
+	chan_destroy(&a);
+	chan_destroy(&b);
+	log_info("select passed");
+}
+
+static void main_handler(void *arg)
+{
+	select_test();
+	chan_pingpong_test(0);
+	chan_pingpong_test(1);
+	cv_pingpong_test();
+	fanin_test(FANIN_CAP);
+	fanin_test(CHAN_UNBOUNDED);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -28,6 +28,9 @@ static mutex_t start_lock;
 static condvar_t start_cv;
 static bool start;
 
+static mutex_t counter_lock;
+static long counter;
+
 static void work_handler(void *arg)
 {
 	int bucket;
@@ -63,6 +66,45 @@ static void work_handler(void *arg)
 	waitgroup_done(wg_parent);
 }
 
+/* hammers a mutex with tiny critical sections, where spinning should win */
+static void counter_handler(void *arg)
+{
+	waitgroup_t *wg = (waitgroup_t *)arg;
+	int i;
+
+	for (i = 0; i < ITERS; i++) {
+		mutex_lock(&counter_lock);
+		counter++;
+		mutex_unlock(&counter_lock);
+	}
+
+	waitgroup_done(wg);
+}
+
+static void contended_test(void)
+{
+	waitgroup_t wg;
+	uint64_t start_us;
+	int i, ret;
+
+	mutex_init(&counter_lock);
+	counter = 0;
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, NCORES);
+	start_us = microtime();
+	for (i = 0; i < NCORES; i++) {
+		ret = thread_spawn(counter_handler, &wg);
+		BUG_ON(ret);
+	}
+	waitgroup_wait(&wg);
+
+	BUG_ON(counter != (long)NCORES * ITERS);
+	log_info("%f contended locks / second", (double)counter /
+		 ((microtime() - start_us) * 0.000001));
+	mutex_profile_dump();
+}
+
 static void main_handler(void *arg)
 {
 	waitgroup_t wg;
@@ -134,6 +176,8 @@ static void main_handler(void *arg)
 
 	waitgroup_wait(&wg);
 	log_info("%f messages / second", messages_per_second);
+
+	contended_test();
 }
 
 int main(int argc, char *argv[])
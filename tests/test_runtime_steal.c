@@ -0,0 +1,108 @@
+/*
+ * test_runtime_steal.c - measures work stealing throughput and tail latency
+ *
+ * A single producer readies bursts of short uthreads on its own kthread, so
+ * every other kthread can only get work by stealing it. Reports the task
+ * completion rate and the ready-to-run latency distribution. Run it with
+ * runtime_kthreads set anywhere from 2 to 64 to see how stealing scales.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+
+#define BURST		1024
+#define ROUNDS		1000
+#define N		(BURST * ROUNDS)
+#define WORK_NS		500
+
+struct task {
+	uint64_t	ready_tsc;
+	uint64_t	delay_cycles;
+	waitgroup_t	*wg;
+};
+
+static struct task tasks[N];
+static uint64_t delays[N];
+
+static void task_handler(void *arg)
+{
+	struct task *t = (struct task *)arg;
+	uint64_t start = rdtsc();
+
+	t->delay_cycles = start - t->ready_tsc;
+	while (rdtsc() - start < WORK_NS * cycles_per_us / 1000)
+		cpu_relax();
+	waitgroup_done(t->wg);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double p)
+{
+	return (double)delays[(size_t)(p * (N - 1))] / cycles_per_us;
+}
+
+static void main_handler(void *arg)
+{
+	waitgroup_t wg;
+	uint64_t start_us, elapsed_us;
+	int i, j, ret;
+
+	log_info("started main_handler() thread with %d kthreads",
+		 runtime_max_cores());
+
+	waitgroup_init(&wg);
+	start_us = microtime();
+	for (i = 0; i < ROUNDS; i++) {
+		waitgroup_add(&wg, BURST);
+		for (j = 0; j < BURST; j++) {
+			struct task *t = &tasks[i * BURST + j];
+
+			t->wg = &wg;
+			t->ready_tsc = rdtsc();
+			ret = thread_spawn(task_handler, t);
+			BUG_ON(ret);
+		}
+		waitgroup_wait(&wg);
+	}
+	elapsed_us = microtime() - start_us;
+
+	for (i = 0; i < N; i++)
+		delays[i] = tasks[i].delay_cycles;
+	qsort(delays, N, sizeof(uint64_t), cmp_u64);
+
+	log_info("%f tasks / second", (double)N / (elapsed_us * 0.000001));
+	log_info("ready-to-run latency: p50 %.2f us, p99 %.2f us, "
+		 "p99.9 %.2f us, max %.2f us",
+		 percentile_us(0.5), percentile_us(0.99),
+		 percentile_us(0.999), percentile_us(1.0));
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
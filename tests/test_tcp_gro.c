@@ -0,0 +1,471 @@
+/*
+ * test_tcp_gro.c - checks and benchmarks TCP receive coalescing
+ *
+ * Connects a few fake peers to a local listener by injecting hand-built
+ * segments straight into the receive path (net_rx_batch()), the way a burst
+ * would arrive from the NIC. Each peer has a transport entry of its own that
+ * catches what the listener sends back over loopback, so the test can check
+ * the ACKs as well as the bytes tcp_read() returns. Covers in-order runs,
+ * interleaved flows, out-of-order segments and CE marks, then compares the
+ * cost of a bulk receive with and without coalescing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <runtime/runtime.h>
+#include <runtime/smalloc.h>
+#include <runtime/sync.h>
+#include <runtime/tcp.h>
+#include <runtime/timer.h>
+
+#include "../runtime/net/defs.h"
+#include "../runtime/net/tcp.h"
+
+#define GRO_PORT	8005
+#define PEER_PORT	7777
+#define PEER_ISN	0x10000
+#define SEG_LEN		1024
+#define BATCH		TRANS_LOOKUP_BATCH
+#define BENCH_ROUNDS	4000
+/* long enough for any delayed ACK to go out and loop back */
+#define SETTLE_US	(4 * TCP_ACK_TIMEOUT)
+#define ACK_LOG		64
+
+enum {
+	PEER_A = 0,
+	PEER_B,
+	PEER_ECN,
+	NR_PEERS,
+};
+
+struct ack_rec {
+	uint32_t	ack;
+	uint8_t		flags;
+};
+
+/* a fake remote host, driven by hand */
+struct peer {
+	struct trans_entry	e;
+	struct netaddr		addr;
+	tcpconn_t		*c;
+	uint32_t		snd_nxt;	/* our next sequence number */
+
+	/* what the listener sent us, protected by @lock */
+	spinlock_t		lock;
+	bool			synack;
+	uint32_t		iss;
+	unsigned int		nacks;
+	struct ack_rec		acks[ACK_LOG];
+};
+
+static struct peer peers[NR_PEERS];
+static struct netaddr laddr;
+
+static inline unsigned char gro_pattern(uint32_t off)
+{
+	return off % 251;
+}
+
+static uint64_t stat_sum(int idx)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < maxks; i++)
+		sum += ACCESS_ONCE(ks[i]->stats[idx]);
+	return sum;
+}
+
+/* receives the listener's replies to a peer */
+static void peer_recv(struct trans_entry *e, struct mbuf *m)
+{
+	struct peer *p = container_of(e, struct peer, e);
+	const struct tcp_hdr *tcphdr;
+	struct ack_rec *rec;
+
+	tcphdr = mbuf_pull_hdr_or_null(m, *tcphdr);
+	if (!tcphdr || (tcphdr->flags & TCP_RST) > 0)
+		goto out;
+
+	spin_lock_np(&p->lock);
+	if ((tcphdr->flags & TCP_SYN) > 0) {
+		p->iss = ntoh32(tcphdr->seq);
+		p->synack = true;
+	}
+	rec = &p->acks[p->nacks++ % ACK_LOG];
+	rec->ack = ntoh32(tcphdr->ack);
+	rec->flags = tcphdr->flags;
+	spin_unlock_np(&p->lock);
+
+out:
+	mbuf_free(m);
+}
+
+static const struct trans_ops peer_ops = {
+	.recv = peer_recv,
+};
+
+static unsigned int peer_nacks(struct peer *p)
+{
+	unsigned int n;
+
+	spin_lock_np(&p->lock);
+	n = p->nacks;
+	spin_unlock_np(&p->lock);
+	return n;
+}
+
+/* returns the @i'th segment the listener sent to @p */
+static struct ack_rec peer_ack(struct peer *p, unsigned int i)
+{
+	struct ack_rec rec;
+
+	spin_lock_np(&p->lock);
+	BUG_ON(i >= p->nacks || p->nacks - i > ACK_LOG);
+	rec = p->acks[i % ACK_LOG];
+	spin_unlock_np(&p->lock);
+	return rec;
+}
+
+/* builds a segment from @p to the listener, as the NIC would deliver it */
+static struct mbuf *peer_seg(struct peer *p, uint8_t flags, uint8_t tos,
+			     const unsigned char *opts, int optlen,
+			     unsigned int len)
+{
+	unsigned int hdr_len = sizeof(struct tcp_hdr) + optlen;
+	unsigned int pkt_len = sizeof(struct eth_hdr) +
+			       sizeof(struct ip_hdr) + hdr_len + len;
+	struct eth_hdr *eth_hdr;
+	struct ip_hdr *iphdr;
+	struct tcp_hdr *tcphdr;
+	unsigned char *buf, *payload;
+	struct mbuf *m;
+	unsigned int i;
+
+	m = smalloc(pkt_len + MBUF_HEAD_LEN);
+	BUG_ON(!m);
+	buf = (unsigned char *)m + MBUF_HEAD_LEN;
+	memset(buf, 0, pkt_len - len);
+
+	eth_hdr = (struct eth_hdr *)buf;
+	eth_hdr->dhost = netcfg.mac;
+	eth_hdr->shost = netcfg.mac;
+	eth_hdr->type = hton16(ETHTYPE_IP);
+
+	iphdr = (struct ip_hdr *)(eth_hdr + 1);
+	iphdr->version = IPVERSION;
+	iphdr->header_len = sizeof(*iphdr) / sizeof(uint32_t);
+	iphdr->tos = tos;
+	iphdr->len = hton16(sizeof(*iphdr) + hdr_len + len);
+	iphdr->ttl = 64;
+	iphdr->proto = IPPROTO_TCP;
+	iphdr->saddr = hton32(p->addr.ip);
+	iphdr->daddr = hton32(laddr.ip);
+
+	tcphdr = (struct tcp_hdr *)(iphdr + 1);
+	tcphdr->sport = hton16(p->addr.port);
+	tcphdr->dport = hton16(laddr.port);
+	tcphdr->seq = hton32(p->snd_nxt);
+	tcphdr->ack = hton32(p->iss + 1);
+	tcphdr->off = hdr_len / sizeof(uint32_t);
+	tcphdr->flags = flags;
+	tcphdr->win = hton16(UINT16_MAX);
+	memcpy(tcphdr + 1, opts, optlen);
+
+	payload = (unsigned char *)(tcphdr + 1) + optlen;
+	for (i = 0; i < len; i++)
+		payload[i] = gro_pattern(p->snd_nxt - PEER_ISN - 1 + i);
+	p->snd_nxt += len;
+
+	mbuf_init(m, buf, pkt_len, 0);
+	m->len = pkt_len;
+	/* there are no checksums to verify, like with RX offloads */
+	m->csum_type = CHECKSUM_TYPE_UNNECESSARY;
+	m->csum = 0;
+	m->rss_hash = 0;
+	m->release = (void (*)(struct mbuf *))sfree;
+	return m;
+}
+
+static struct mbuf *peer_data(struct peer *p, uint8_t tos)
+{
+	return peer_seg(p, TCP_ACK, tos, NULL, 0, SEG_LEN);
+}
+
+static void inject(struct mbuf **ms, unsigned int nr)
+{
+	preempt_disable();
+	net_rx_batch(ms, nr);
+	preempt_enable();
+}
+
+/* opens a connection from @p to the listener, offering ECN if @ecn */
+static void peer_connect(struct peer *p, tcpqueue_t *q, bool ecn)
+{
+	static const unsigned char syn_opts[] = {
+		TCP_OPT_MSS, TCP_OLEN_MSS, SEG_LEN >> 8, SEG_LEN & 0xff,
+		TCP_OPT_NOP, TCP_OPT_WSCALE, TCP_OLEN_WSCALE, 0,
+	};
+	uint8_t flags = TCP_SYN;
+	struct ack_rec rec;
+	struct mbuf *m;
+	int ret;
+
+	if (ecn)
+		flags |= TCP_ECE | TCP_CWR;
+	p->snd_nxt = PEER_ISN;
+	m = peer_seg(p, flags, 0, syn_opts, sizeof(syn_opts), 0);
+	p->snd_nxt++;
+	inject(&m, 1);
+
+	timer_sleep(SETTLE_US);
+	BUG_ON(!p->synack);
+	rec = peer_ack(p, 0);
+	BUG_ON(rec.ack != PEER_ISN + 1);
+	BUG_ON(((rec.flags & TCP_ECE) > 0) != ecn);
+
+	m = peer_seg(p, TCP_ACK, 0, NULL, 0, 0);
+	inject(&m, 1);
+	ret = tcp_accept(q, &p->c);
+	BUG_ON(ret);
+}
+
+/* reads @len bytes from @p's connection, checking they're in order */
+static void peer_read(struct peer *p, size_t len)
+{
+	static unsigned char buf[BATCH * SEG_LEN];
+	uint32_t off = p->snd_nxt - PEER_ISN - 1 - len;
+	size_t done = 0;
+	ssize_t ret, i;
+
+	BUG_ON(len > sizeof(buf));
+	while (done < len) {
+		ret = tcp_read(p->c, buf, len - done);
+		BUG_ON(ret <= 0);
+		for (i = 0; i < ret; i++)
+			BUG_ON(buf[i] != gro_pattern(off + done + i));
+		done += ret;
+	}
+}
+
+/* a run of in-order segments is coalesced and acked once */
+static void test_in_order(void)
+{
+	struct peer *p = &peers[PEER_A];
+	struct mbuf *ms[4];
+	uint64_t merged;
+	unsigned int i, n;
+	struct ack_rec rec;
+
+	timer_sleep(SETTLE_US);
+	n = peer_nacks(p);
+	merged = stat_sum(STAT_RX_TCP_COALESCED);
+
+	for (i = 0; i < ARRAY_SIZE(ms); i++)
+		ms[i] = peer_data(p, 0);
+	inject(ms, ARRAY_SIZE(ms));
+
+	timer_sleep(SETTLE_US);
+	BUG_ON(stat_sum(STAT_RX_TCP_COALESCED) - merged != ARRAY_SIZE(ms) - 1);
+	BUG_ON(peer_nacks(p) != n + 1);
+	rec = peer_ack(p, n);
+	BUG_ON(rec.ack != p->snd_nxt);
+
+	peer_read(p, ARRAY_SIZE(ms) * SEG_LEN);
+	log_info("in-order test passed");
+}
+
+/* segments of two flows are grouped per flow, keeping their order */
+static void test_interleaved(void)
+{
+	struct peer *a = &peers[PEER_A], *b = &peers[PEER_B];
+	struct mbuf *ms[6];
+	uint64_t merged;
+	unsigned int i, na, nb;
+
+	timer_sleep(SETTLE_US);
+	na = peer_nacks(a);
+	nb = peer_nacks(b);
+	merged = stat_sum(STAT_RX_TCP_COALESCED);
+
+	for (i = 0; i < ARRAY_SIZE(ms); i++)
+		ms[i] = peer_data(i % 2 ? b : a, 0);
+	inject(ms, ARRAY_SIZE(ms));
+
+	timer_sleep(SETTLE_US);
+	BUG_ON(stat_sum(STAT_RX_TCP_COALESCED) - merged != ARRAY_SIZE(ms) - 2);
+	BUG_ON(peer_nacks(a) != na + 1 || peer_nacks(b) != nb + 1);
+	BUG_ON(peer_ack(a, na).ack != a->snd_nxt);
+	BUG_ON(peer_ack(b, nb).ack != b->snd_nxt);
+
+	peer_read(a, ARRAY_SIZE(ms) / 2 * SEG_LEN);
+	peer_read(b, ARRAY_SIZE(ms) / 2 * SEG_LEN);
+	log_info("interleaved test passed");
+}
+
+/* out-of-order segments take the slow path and are reassembled */
+static void test_out_of_order(void)
+{
+	struct peer *p = &peers[PEER_A];
+	struct mbuf *ms[3];
+	uint64_t merged, ooo;
+	uint32_t base = p->snd_nxt;
+	unsigned int i, n;
+
+	timer_sleep(SETTLE_US);
+	n = peer_nacks(p);
+	merged = stat_sum(STAT_RX_TCP_COALESCED);
+	ooo = stat_sum(STAT_RX_TCP_OUT_OF_ORDER);
+
+	/* deliver the third segment first, then the first and second */
+	for (i = 0; i < ARRAY_SIZE(ms); i++)
+		ms[(i + 1) % ARRAY_SIZE(ms)] = peer_data(p, 0);
+	inject(ms, ARRAY_SIZE(ms));
+
+	timer_sleep(SETTLE_US);
+	BUG_ON(stat_sum(STAT_RX_TCP_COALESCED) != merged);
+	BUG_ON(stat_sum(STAT_RX_TCP_OUT_OF_ORDER) - ooo != 1);
+
+	/* the hole is reported at once, then filled */
+	BUG_ON(peer_nacks(p) < n + 2);
+	BUG_ON(peer_ack(p, n).ack != base);
+	BUG_ON(peer_ack(p, peer_nacks(p) - 1).ack != p->snd_nxt);
+
+	peer_read(p, ARRAY_SIZE(ms) * SEG_LEN);
+	log_info("out-of-order test passed");
+}
+
+/* a change in CE marking splits a run and is echoed right away */
+static void test_ce(void)
+{
+	struct peer *p = &peers[PEER_ECN];
+	struct mbuf *ms[4];
+	uint64_t merged;
+	uint32_t base = p->snd_nxt;
+	struct ack_rec rec;
+	unsigned int n;
+
+	timer_sleep(SETTLE_US);
+	n = peer_nacks(p);
+	merged = stat_sum(STAT_RX_TCP_COALESCED);
+
+	ms[0] = peer_data(p, IPTOS_ECN_ECT0);
+	ms[1] = peer_data(p, IPTOS_ECN_ECT0);
+	ms[2] = peer_data(p, IPTOS_ECN_CE);
+	ms[3] = peer_data(p, IPTOS_ECN_CE);
+	inject(ms, ARRAY_SIZE(ms));
+
+	timer_sleep(SETTLE_US);
+	BUG_ON(stat_sum(STAT_RX_TCP_COALESCED) - merged != 2);
+	BUG_ON(peer_nacks(p) != n + 2);
+	rec = peer_ack(p, n);
+	BUG_ON(rec.ack != base + 2 * SEG_LEN || (rec.flags & TCP_ECE) > 0);
+	rec = peer_ack(p, n + 1);
+	BUG_ON(rec.ack != p->snd_nxt || (rec.flags & TCP_ECE) == 0);
+
+	peer_read(p, ARRAY_SIZE(ms) * SEG_LEN);
+	log_info("CE test passed");
+}
+
+/*
+ * Times the receive path over full batches of one flow. Alternating the ECN
+ * field keeps every segment on the fast path but stops any two from merging.
+ */
+static void bench_bulk(bool merge)
+{
+	struct peer *p = &peers[PEER_A];
+	struct mbuf *ms[BATCH];
+	uint64_t start_us, rx_us = 0, merged;
+	unsigned int i, j, n;
+
+	timer_sleep(SETTLE_US);
+	n = peer_nacks(p);
+	merged = stat_sum(STAT_RX_TCP_COALESCED);
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		for (j = 0; j < BATCH; j++) {
+			ms[j] = peer_data(p, merge || j % 2 ?
+					  IPTOS_ECN_NOTECT : IPTOS_ECN_ECT0);
+		}
+
+		start_us = microtime();
+		inject(ms, BATCH);
+		rx_us += microtime() - start_us;
+
+		peer_read(p, BATCH * SEG_LEN);
+	}
+
+	timer_sleep(SETTLE_US);
+	log_info("bulk receive (%s): %.1f ns per segment, %.2f segments "
+		 "merged and %.2f segments sent per batch",
+		 merge ? "coalesced" : "not coalesced",
+		 (double)rx_us * 1000 / (BENCH_ROUNDS * BATCH),
+		 (double)(stat_sum(STAT_RX_TCP_COALESCED) - merged) /
+		 BENCH_ROUNDS,
+		 (double)(peer_nacks(p) - n) / BENCH_ROUNDS);
+}
+
+static void main_handler(void *arg)
+{
+	tcpqueue_t *q;
+	int i, ret;
+
+	laddr.ip = net_local_ip();
+	laddr.port = GRO_PORT;
+	ret = tcp_listen(laddr, 4096, &q);
+	BUG_ON(ret);
+
+	for (i = 0; i < NR_PEERS; i++) {
+		struct peer *p = &peers[i];
+
+		spin_lock_init(&p->lock);
+		p->addr.ip = laddr.ip;
+		p->addr.port = PEER_PORT + i;
+		trans_init_5tuple(&p->e, IPPROTO_TCP, &peer_ops, p->addr,
+				  laddr);
+		ret = trans_table_add(&p->e);
+		BUG_ON(ret);
+		peer_connect(p, q, i == PEER_ECN);
+	}
+
+	test_in_order();
+	test_interleaved();
+	test_out_of_order();
+	test_ce();
+	bench_bulk(true);
+	bench_bulk(false);
+
+	for (i = 0; i < NR_PEERS; i++) {
+		tcp_abort(peers[i].c);
+		tcp_close(peers[i].c);
+	}
+	timer_sleep(SETTLE_US);
+	for (i = 0; i < NR_PEERS; i++)
+		trans_table_remove(&peers[i].e);
+	tcp_qclose(q);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
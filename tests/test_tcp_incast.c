@@ -0,0 +1,301 @@
+/*
+ * test_tcp_incast.c - measures TCP incast under each congestion control
+ *
+ * Run the SERVER (the senders) in one runtime and the CLIENT (the aggregator)
+ * in another. Each round, the aggregator asks every flow for a response at
+ * once and waits for all of them, so the responses collide at its ingress.
+ *
+ * A real switch isn't needed: build with CONFIG_NET_EMULATION=y and set
+ * "host_rx_bottleneck_mbps" in the
+ * aggregator's config to put an emulated port of that capacity in front of
+ * it, "host_rx_bottleneck_queue_kb" for its buffer, and
+ * "host_rx_bottleneck_ecn_kb" for its ECN marking threshold. Select the
+ * senders' algorithm with "tcp_cc" in their config, or per connection with
+ * the optional [cc] argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+#include <runtime/tcp.h>
+
+#define INCAST_PORT	8002
+
+static struct netaddr raddr;
+static int nflows;
+static uint32_t resp_bytes;
+static int rounds;
+static const char *cc_name;
+
+struct flow {
+	tcpconn_t	*c;
+	waitgroup_t	*wg;
+	bool		failed;
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void client_flow(void *arg)
+{
+	struct flow *f = arg;
+	char buf[4096];
+	uint32_t req = resp_bytes;
+	size_t n = 0;
+	ssize_t ret;
+
+	ret = tcp_write(f->c, &req, sizeof(req));
+	if (ret != sizeof(req)) {
+		log_err("tcp_write() failed, ret = %ld", ret);
+		f->failed = true;
+		goto done;
+	}
+
+	while (n < resp_bytes) {
+		ret = tcp_read(f->c, buf, MIN(sizeof(buf), resp_bytes - n));
+		if (ret <= 0) {
+			log_err("tcp_read() failed, ret = %ld", ret);
+			f->failed = true;
+			goto done;
+		}
+		n += ret;
+	}
+
+done:
+	waitgroup_done(f->wg);
+}
+
+static void do_client(void *arg)
+{
+	struct netaddr laddr;
+	struct flow *flows;
+	waitgroup_t wg;
+	uint64_t *round_us, start_us, total_us = 0;
+	int i, j, ret;
+
+	laddr.ip = 0;
+	laddr.port = 0;
+
+	flows = calloc(nflows, sizeof(*flows));
+	round_us = malloc(sizeof(*round_us) * rounds);
+	BUG_ON(!flows || !round_us);
+
+	for (i = 0; i < nflows; i++) {
+		ret = tcp_dial(laddr, raddr, &flows[i].c);
+		if (ret) {
+			log_err("tcp_dial() failed, ret = %d", ret);
+			return;
+		}
+		flows[i].wg = &wg;
+	}
+
+	waitgroup_init(&wg);
+	for (i = 0; i < rounds; i++) {
+		waitgroup_add(&wg, nflows);
+		start_us = microtime();
+		for (j = 0; j < nflows; j++) {
+			ret = thread_spawn(client_flow, &flows[j]);
+			BUG_ON(ret);
+		}
+		waitgroup_wait(&wg);
+		round_us[i] = microtime() - start_us;
+		total_us += round_us[i];
+
+		for (j = 0; j < nflows; j++) {
+			if (flows[j].failed)
+				goto out;
+		}
+	}
+
+out:
+	for (j = 0; j < nflows; j++)
+		tcp_close(flows[j].c);
+	if (i == 0)
+		return;
+
+	qsort(round_us, i, sizeof(uint64_t), cmp_u64);
+	log_info("%d flows x %u bytes, %d rounds: p50 %ld us, p99 %ld us, "
+		 "max %ld us, goodput %.1f Mbps", nflows, resp_bytes, i,
+		 round_us[i / 2], round_us[(size_t)(i * 0.99)], round_us[i - 1],
+		 (double)nflows * resp_bytes * i * 8 / total_us);
+}
+
+static DEFINE_SPINLOCK(server_lock);
+static int server_conns;
+static struct tcp_stats server_totals;
+
+static void server_worker(void *arg)
+{
+	static const char payload[4096];
+	tcpconn_t *c = (tcpconn_t *)arg;
+	struct tcp_stats st;
+	uint32_t req;
+	size_t n;
+	ssize_t ret;
+
+	if (cc_name && tcp_set_cc(c, cc_name))
+		log_err("unknown congestion control '%s'", cc_name);
+
+	/* send a response of the requested size for each request */
+	while (true) {
+		ret = tcp_read(c, &req, sizeof(req));
+		if (ret != sizeof(req))
+			break;
+
+		for (n = 0; n < req; n += ret) {
+			ret = tcp_write(c, payload, MIN(sizeof(payload), req - n));
+			if (ret < 0)
+				goto done;
+		}
+	}
+
+done:
+	tcp_get_stats(c, &st);
+	tcp_close(c);
+
+	/* report totals once the last flow goes away */
+	spin_lock_np(&server_lock);
+	server_totals.timeouts += st.timeouts;
+	server_totals.fast_retransmits += st.fast_retransmits;
+	server_totals.ece_acks += st.ece_acks;
+	if (--server_conns == 0) {
+		log_info("%ld timeouts, %ld fast retransmits, %ld ECE acks",
+			 server_totals.timeouts, server_totals.fast_retransmits,
+			 server_totals.ece_acks);
+		memset(&server_totals, 0, sizeof(server_totals));
+	}
+	spin_unlock_np(&server_lock);
+}
+
+static void do_server(void *arg)
+{
+	struct netaddr laddr;
+	tcpqueue_t *q;
+	int ret;
+
+	laddr.ip = 0;
+	laddr.port = INCAST_PORT;
+
+	ret = tcp_listen(laddr, 4096, &q);
+	BUG_ON(ret);
+
+	while (true) {
+		tcpconn_t *c;
+
+		ret = tcp_accept(q, &c);
+		BUG_ON(ret);
+		spin_lock_np(&server_lock);
+		server_conns++;
+		spin_unlock_np(&server_lock);
+		ret = thread_spawn(server_worker, c);
+		BUG_ON(ret);
+	}
+}
+
+static int str_to_ip(const char *str, uint32_t *addr)
+{
+	uint8_t a, b, c, d;
+	if(sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) {
+		return -EINVAL;
+	}
+
+	*addr = MAKE_IP_ADDR(a, b, c, d);
+	return 0;
+}
+
+static int str_to_long(const char *str, long *val)
+{
+	char *endptr;
+
+	*val = strtol(str, &endptr, 10);
+	if (endptr == str || (*endptr != '\0' && *endptr != '\n') ||
+	    ((*val == LONG_MIN || *val == LONG_MAX) && errno == ERANGE))
+		return -EINVAL;
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("%s: [config_file_path] SERVER [cc]\n", prog);
+	printf("%s: [config_file_path] CLIENT [ip] [nflows] [resp_bytes] "
+	       "[rounds]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	long tmp;
+	uint32_t addr;
+	thread_fn_t fn;
+
+	if (argc < 3) {
+		usage(argv[0]);
+		return -EINVAL;
+	}
+
+	if (!strcmp(argv[2], "SERVER")) {
+		fn = do_server;
+		if (argc > 3)
+			cc_name = argv[3];
+		goto start;
+	} else if (strcmp(argv[2], "CLIENT")) {
+		printf("invalid mode '%s'\n", argv[2]);
+		return -EINVAL;
+	}
+
+	fn = do_client;
+	if (argc < 7) {
+		usage(argv[0]);
+		return -EINVAL;
+	}
+
+	ret = str_to_ip(argv[3], &addr);
+	if (ret) {
+		printf("couldn't parse [ip] '%s'\n", argv[3]);
+		return -EINVAL;
+	}
+	raddr.ip = addr;
+	raddr.port = INCAST_PORT;
+
+	ret = str_to_long(argv[4], &tmp);
+	if (ret || tmp <= 0) {
+		printf("couldn't parse [nflows] '%s'\n", argv[4]);
+		return -EINVAL;
+	}
+	nflows = tmp;
+
+	ret = str_to_long(argv[5], &tmp);
+	if (ret || tmp <= 0 || tmp > UINT32_MAX) {
+		printf("couldn't parse [resp_bytes] '%s'\n", argv[5]);
+		return -EINVAL;
+	}
+	resp_bytes = tmp;
+
+	ret = str_to_long(argv[6], &tmp);
+	if (ret || tmp <= 0) {
+		printf("couldn't parse [rounds] '%s'\n", argv[6]);
+		return -EINVAL;
+	}
+	rounds = tmp;
+
+start:
+	ret = runtime_init(argv[1], fn, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
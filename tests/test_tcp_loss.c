@@ -0,0 +1,214 @@
+/*
+ * test_tcp_loss.c - measures TCP loss recovery latency
+ *
+ * The client sends small echo requests one at a time over a single
+ * connection and records the latency of each. Add "tcp_tx_drop_ppm" to the
+ * config file on either side to inject loss; requests that hit a drop show up
+ * in the tail, and the recovery latency is how long they took.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <runtime/runtime.h>
+#include <runtime/tcp.h>
+
+#define LOSS_PORT	8001
+#define PAYLOAD_LEN	64
+/* requests slower than this many median latencies had to recover a loss */
+#define RECOVERY_FACTOR	10
+
+static struct netaddr raddr;
+static int nreqs;
+static uint64_t *lat_us;
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void do_client(void *arg)
+{
+	unsigned char buf[PAYLOAD_LEN];
+	struct netaddr laddr;
+	struct tcp_stats st;
+	uint64_t start_us, median, recovered_us = 0;
+	int i, j, recovered = 0;
+	tcpconn_t *c;
+	ssize_t ret;
+
+	laddr.ip = 0;
+	laddr.port = 0;
+	memset(buf, 0xAB, sizeof(buf));
+
+	lat_us = malloc(sizeof(*lat_us) * nreqs);
+	BUG_ON(!lat_us);
+
+	ret = tcp_dial(laddr, raddr, &c);
+	if (ret) {
+		log_err("tcp_dial() failed, ret = %ld", ret);
+		return;
+	}
+
+	for (i = 0; i < nreqs; i++) {
+		size_t n = 0;
+
+		start_us = microtime();
+		ret = tcp_write(c, buf, sizeof(buf));
+		if (ret != sizeof(buf)) {
+			log_err("tcp_write() failed, ret = %ld", ret);
+			break;
+		}
+		while (n < sizeof(buf)) {
+			ret = tcp_read(c, buf + n, sizeof(buf) - n);
+			if (ret <= 0) {
+				log_err("tcp_read() failed, ret = %ld", ret);
+				goto out;
+			}
+			n += ret;
+		}
+		lat_us[i] = microtime() - start_us;
+	}
+
+out:
+	tcp_get_stats(c, &st);
+	tcp_close(c);
+	if (i == 0)
+		return;
+
+	qsort(lat_us, i, sizeof(uint64_t), cmp_u64);
+	median = lat_us[i / 2];
+	for (j = 0; j < i; j++) {
+		if (lat_us[j] < median * RECOVERY_FACTOR)
+			continue;
+		recovered++;
+		recovered_us += lat_us[j];
+	}
+
+	log_info("%d requests: p50 %ld us, p99 %ld us, p99.9 %ld us, "
+		 "max %ld us", i, median, lat_us[(size_t)(i * 0.99)],
+		 lat_us[(size_t)(i * 0.999)], lat_us[i - 1]);
+	log_info("%d recoveries, mean recovery latency %.1f us", recovered,
+		 recovered ? (double)recovered_us / recovered : 0.0);
+	log_info("srtt %u us, rttvar %u us, rto %u us, %ld timeouts, "
+		 "%ld fast retransmits, %ld SACK retransmits", st.srtt_us,
+		 st.rttvar_us, st.rto_us, st.timeouts, st.fast_retransmits,
+		 st.sack_retransmits);
+}
+
+static void server_worker(void *arg)
+{
+	unsigned char buf[PAYLOAD_LEN];
+	tcpconn_t *c = (tcpconn_t *)arg;
+	ssize_t ret;
+
+	/* echo the data back */
+	while (true) {
+		ret = tcp_read(c, buf, sizeof(buf));
+		if (ret <= 0)
+			break;
+
+		ret = tcp_write(c, buf, ret);
+		if (ret < 0)
+			break;
+	}
+
+	tcp_close(c);
+}
+
+static void do_server(void *arg)
+{
+	struct netaddr laddr;
+	tcpqueue_t *q;
+	int ret;
+
+	laddr.ip = 0;
+	laddr.port = LOSS_PORT;
+
+	ret = tcp_listen(laddr, 4096, &q);
+	BUG_ON(ret);
+
+	while (true) {
+		tcpconn_t *c;
+
+		ret = tcp_accept(q, &c);
+		BUG_ON(ret);
+		ret = thread_spawn(server_worker, c);
+		BUG_ON(ret);
+	}
+}
+
+static int str_to_ip(const char *str, uint32_t *addr)
+{
+	uint8_t a, b, c, d;
+	if(sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) {
+		return -EINVAL;
+	}
+
+	*addr = MAKE_IP_ADDR(a, b, c, d);
+	return 0;
+}
+
+static int str_to_long(const char *str, long *val)
+{
+	char *endptr;
+
+	*val = strtol(str, &endptr, 10);
+	if (endptr == str || (*endptr != '\0' && *endptr != '\n') ||
+	    ((*val == LONG_MIN || *val == LONG_MAX) && errno == ERANGE))
+		return -EINVAL;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	long tmp;
+	uint32_t addr;
+	thread_fn_t fn;
+
+	if (argc < 5) {
+		printf("%s: [config_file_path] [mode] [ip] [nreqs]\n", argv[0]);
+		return -EINVAL;
+	}
+
+	if (!strcmp(argv[2], "CLIENT")) {
+		fn = do_client;
+	} else if (!strcmp(argv[2], "SERVER")) {
+		fn = do_server;
+	} else {
+		printf("invalid mode '%s'\n", argv[2]);
+		return -EINVAL;
+	}
+
+	ret = str_to_ip(argv[3], &addr);
+	if (ret) {
+		printf("couldn't parse [ip] '%s'\n", argv[3]);
+		return -EINVAL;
+	}
+	raddr.ip = addr;
+	raddr.port = LOSS_PORT;
+
+	ret = str_to_long(argv[4], &tmp);
+	if (ret || tmp <= 0) {
+		printf("couldn't parse [nreqs] '%s'\n", argv[4]);
+		return -EINVAL;
+	}
+	nreqs = tmp;
+
+	ret = runtime_init(argv[1], fn, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
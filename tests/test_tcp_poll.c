@@ -0,0 +1,253 @@
+/*
+ * test_tcp_poll.c - serves many TCP connections from a single thread
+ *
+ * The server registers every accepted connection with one poller and echoes
+ * data back using nonblocking reads and writes, so it needs no thread (and
+ * no stack) per connection. The client opens many connections and runs
+ * echo requests on all of them concurrently.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <runtime/runtime.h>
+#include <runtime/poll.h>
+#include <runtime/sync.h>
+#include <runtime/tcp.h>
+
+#define POLL_PORT	8002
+#define PAYLOAD_LEN	64
+#define POLL_BATCH	64
+
+static struct netaddr raddr;
+static int nconns;
+static int nreqs;
+
+static waitgroup_t client_wg;
+
+static void client_worker(void *arg)
+{
+	unsigned char buf[PAYLOAD_LEN];
+	tcpconn_t *c = (tcpconn_t *)arg;
+	ssize_t ret;
+	int i;
+
+	memset(buf, 0xAB, sizeof(buf));
+	for (i = 0; i < nreqs; i++) {
+		size_t n = 0;
+
+		ret = tcp_write(c, buf, sizeof(buf));
+		if (ret != sizeof(buf)) {
+			log_err("tcp_write() failed, ret = %ld", ret);
+			break;
+		}
+		while (n < sizeof(buf)) {
+			ret = tcp_read(c, buf + n, sizeof(buf) - n);
+			if (ret <= 0) {
+				log_err("tcp_read() failed, ret = %ld", ret);
+				goto out;
+			}
+			n += ret;
+		}
+	}
+
+out:
+	tcp_close(c);
+	waitgroup_done(&client_wg);
+}
+
+static void do_client(void *arg)
+{
+	struct netaddr laddr;
+	uint64_t start_us;
+	tcpconn_t *c;
+	int i, ret;
+
+	laddr.ip = 0;
+	laddr.port = 0;
+	waitgroup_init(&client_wg);
+	waitgroup_add(&client_wg, nconns);
+
+	start_us = microtime();
+	for (i = 0; i < nconns; i++) {
+		ret = tcp_dial(laddr, raddr, &c);
+		if (ret) {
+			log_err("tcp_dial() failed, ret = %d", ret);
+			waitgroup_add(&client_wg, i - nconns);
+			break;
+		}
+		ret = thread_spawn(client_worker, c);
+		BUG_ON(ret);
+	}
+
+	waitgroup_wait(&client_wg);
+	log_info("%d connections x %d requests took %ld us", i, nreqs,
+		 microtime() - start_us);
+}
+
+/* per-connection state, a pending echo that didn't fit in the window */
+struct poll_conn {
+	tcpconn_t	*c;
+	size_t		pending;
+	unsigned char	buf[PAYLOAD_LEN];
+};
+
+/* echoes until the connection would block, returns false to close it */
+static bool server_echo(struct poll_conn *pc)
+{
+	ssize_t ret;
+
+	while (true) {
+		while (pc->pending > 0) {
+			ret = tcp_write(pc->c, pc->buf, pc->pending);
+			if (ret == -EAGAIN)
+				return true;
+			if (ret < 0)
+				return false;
+			pc->pending -= ret;
+			memmove(pc->buf, pc->buf + ret, pc->pending);
+		}
+
+		ret = tcp_read(pc->c, pc->buf, sizeof(pc->buf));
+		if (ret == -EAGAIN)
+			return true;
+		if (ret <= 0)
+			return false;
+		pc->pending = ret;
+	}
+}
+
+static void server_poller(void *arg)
+{
+	poll_waiter_t *w = (poll_waiter_t *)arg;
+	struct poll_event evs[POLL_BATCH];
+	int i, n;
+
+	while (true) {
+		n = poll_wait_batch(w, evs, POLL_BATCH);
+		for (i = 0; i < n; i++) {
+			struct poll_conn *pc = (struct poll_conn *)evs[i].data;
+
+			if (server_echo(pc))
+				continue;
+			tcp_close(pc->c);
+			free(pc);
+		}
+	}
+}
+
+static void do_server(void *arg)
+{
+	struct netaddr laddr;
+	poll_waiter_t w;
+	tcpqueue_t *q;
+	int ret;
+
+	laddr.ip = 0;
+	laddr.port = POLL_PORT;
+
+	ret = tcp_listen(laddr, 4096, &q);
+	BUG_ON(ret);
+
+	poll_init(&w);
+	ret = thread_spawn(server_poller, &w);
+	BUG_ON(ret);
+
+	while (true) {
+		struct poll_conn *pc;
+		tcpconn_t *c;
+
+		ret = tcp_accept(q, &c);
+		BUG_ON(ret);
+
+		pc = malloc(sizeof(*pc));
+		BUG_ON(!pc);
+		pc->c = c;
+		pc->pending = 0;
+		tcp_set_nonblocking(c, true);
+		ret = tcp_poll_add(c, &w, POLLEV_IN | POLLEV_OUT | POLLEV_HUP,
+				   (unsigned long)pc);
+		BUG_ON(ret);
+	}
+}
+
+static int str_to_ip(const char *str, uint32_t *addr)
+{
+	uint8_t a, b, c, d;
+	if(sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) {
+		return -EINVAL;
+	}
+
+	*addr = MAKE_IP_ADDR(a, b, c, d);
+	return 0;
+}
+
+static int str_to_long(const char *str, long *val)
+{
+	char *endptr;
+
+	*val = strtol(str, &endptr, 10);
+	if (endptr == str || (*endptr != '\0' && *endptr != '\n') ||
+	    ((*val == LONG_MIN || *val == LONG_MAX) && errno == ERANGE))
+		return -EINVAL;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	long tmp;
+	uint32_t addr;
+	thread_fn_t fn;
+
+	if (argc < 6) {
+		printf("%s: [config_file_path] [mode] [ip] [nconns] [nreqs]\n",
+		       argv[0]);
+		return -EINVAL;
+	}
+
+	if (!strcmp(argv[2], "CLIENT")) {
+		fn = do_client;
+	} else if (!strcmp(argv[2], "SERVER")) {
+		fn = do_server;
+	} else {
+		printf("invalid mode '%s'\n", argv[2]);
+		return -EINVAL;
+	}
+
+	ret = str_to_ip(argv[3], &addr);
+	if (ret) {
+		printf("couldn't parse [ip] '%s'\n", argv[3]);
+		return -EINVAL;
+	}
+	raddr.ip = addr;
+	raddr.port = POLL_PORT;
+
+	ret = str_to_long(argv[4], &tmp);
+	if (ret || tmp <= 0) {
+		printf("couldn't parse [nconns] '%s'\n", argv[4]);
+		return -EINVAL;
+	}
+	nconns = tmp;
+
+	ret = str_to_long(argv[5], &tmp);
+	if (ret || tmp <= 0) {
+		printf("couldn't parse [nreqs] '%s'\n", argv[5]);
+		return -EINVAL;
+	}
+	nreqs = tmp;
+
+	ret = runtime_init(argv[1], fn, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
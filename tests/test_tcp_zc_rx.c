@@ -0,0 +1,286 @@
+/*
+ * test_tcp_zc_rx.c - checks the receive window under zero-copy reads
+ *
+ * The server borrows payload with tcp_read_zc() and holds on to it. The
+ * client sends more than a window's worth, so it must stall once the borrowed
+ * bytes close the window; the server then checks that the window reopens as
+ * views are handed back and that every byte arrives intact. A second
+ * connection closes while views are still lent out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <runtime/runtime.h>
+#include <runtime/tcp.h>
+#include <runtime/timer.h>
+
+#define ZC_PORT		8003
+#define ZC_BATCH	32
+/* must be well above the receive window */
+#define ZC_TOTAL	(16 * 1024 * 1024)
+#define ZC_CLOSE_LEN	(256 * 1024)
+#define ZC_CHUNK	(64 * 1024)
+/* the sender is considered stalled after this long without new data */
+#define ZC_STALL_US	(100 * ONE_MS)
+
+#define MODE_WINDOW	'W'
+#define MODE_CLOSE	'C'
+
+static struct netaddr raddr;
+
+static inline unsigned char zc_pattern(size_t off)
+{
+	return off % 251;
+}
+
+static void zc_check(const struct iovec *iov, size_t off)
+{
+	const unsigned char *p = iov->iov_base;
+	size_t i;
+
+	for (i = 0; i < iov->iov_len; i++)
+		BUG_ON(p[i] != zc_pattern(off + i));
+}
+
+static int client_send(tcpconn_t *c, unsigned char mode, size_t len)
+{
+	unsigned char buf[ZC_CHUNK];
+	size_t off = 0, n, i;
+	ssize_t ret;
+
+	ret = tcp_write(c, &mode, 1);
+	if (ret != 1)
+		return ret < 0 ? ret : -EIO;
+	if (mode == MODE_WINDOW) {
+		/* wait until the server recorded its initial window */
+		ret = tcp_read(c, buf, 1);
+		if (ret != 1)
+			return ret < 0 ? ret : -EIO;
+	}
+
+	while (off < len) {
+		n = MIN(len - off, sizeof(buf));
+		for (i = 0; i < n; i++)
+			buf[i] = zc_pattern(off + i);
+		ret = tcp_write(c, buf, n);
+		if (ret <= 0)
+			return ret < 0 ? ret : -EIO;
+		off += ret;
+	}
+
+	return 0;
+}
+
+static void do_client(void *arg)
+{
+	struct netaddr laddr;
+	unsigned char byte;
+	tcpconn_t *c;
+	ssize_t ret;
+
+	laddr.ip = 0;
+	laddr.port = 0;
+
+	ret = tcp_dial(laddr, raddr, &c);
+	BUG_ON(ret);
+	ret = client_send(c, MODE_WINDOW, ZC_TOTAL);
+	BUG_ON(ret);
+	/* the server acks once it has read (and checked) everything */
+	ret = tcp_read(c, &byte, 1);
+	BUG_ON(ret != 1);
+	tcp_close(c);
+	log_info("window test passed");
+
+	/* the server closes this one mid-stream, so errors are expected */
+	ret = tcp_dial(laddr, raddr, &c);
+	BUG_ON(ret);
+	ret = client_send(c, MODE_CLOSE, ZC_CLOSE_LEN);
+	if (ret == 0)
+		ret = tcp_read(c, &byte, 1);
+	BUG_ON(ret > 0);
+	tcp_close(c);
+	log_info("close test passed (ret = %ld)", ret);
+}
+
+static void server_window(tcpconn_t *c)
+{
+	struct iovec iov[ZC_BATCH];
+	struct tcp_stats st;
+	uint32_t wnd0;
+	size_t received = 0, lent = 0, released;
+	unsigned char byte = 0;
+	uint64_t idle_since;
+	ssize_t ret;
+	int i;
+
+	tcp_get_stats(c, &st);
+	wnd0 = st.rcv_wnd;
+	ret = tcp_write(c, &byte, 1);
+	BUG_ON(ret != 1);
+
+	/* borrow everything and hold it until the sender stalls */
+	tcp_set_nonblocking(c, true);
+	idle_since = microtime();
+	while (microtime() - idle_since < ZC_STALL_US) {
+		ret = tcp_read_zc(c, iov, ZC_BATCH);
+		if (ret == -EAGAIN) {
+			timer_sleep(ONE_MS);
+			continue;
+		}
+		BUG_ON(ret <= 0);
+		for (i = 0; i < ret; i++) {
+			zc_check(&iov[i], received);
+			received += iov[i].iov_len;
+		}
+		lent = received;
+		idle_since = microtime();
+	}
+
+	/* the lent out bytes must keep the window closed */
+	tcp_get_stats(c, &st);
+	log_info("initial window %u, %ld bytes lent, window now %u", wnd0,
+		 lent, st.rcv_wnd);
+	BUG_ON(received >= ZC_TOTAL);
+	BUG_ON(st.rcv_wnd + lent != wnd0);
+
+	/* hand back half (likely ending mid-buffer), the window must reopen */
+	released = lent / 2;
+	tcp_read_zc_release(c, released);
+	lent -= released;
+	tcp_get_stats(c, &st);
+	BUG_ON(st.rcv_wnd + lent > wnd0);
+
+	/* the sender resumes; read the rest, handing back each batch at once */
+	tcp_set_nonblocking(c, false);
+	tcp_read_zc_release(c, lent);
+	lent = 0;
+	while (received < ZC_TOTAL) {
+		ret = tcp_read_zc(c, iov, ZC_BATCH);
+		BUG_ON(ret <= 0);
+		for (i = 0; i < ret; i++) {
+			zc_check(&iov[i], received);
+			received += iov[i].iov_len;
+			lent += iov[i].iov_len;
+		}
+		tcp_read_zc_release(c, lent);
+		lent = 0;
+	}
+	BUG_ON(received != ZC_TOTAL);
+
+	/* nothing is lent out or queued, so the window is fully open again */
+	tcp_get_stats(c, &st);
+	BUG_ON(st.rcv_wnd != wnd0);
+
+	ret = tcp_write(c, &byte, 1);
+	BUG_ON(ret != 1);
+	log_info("window test passed, %ld bytes", received);
+}
+
+static void server_close(tcpconn_t *c)
+{
+	struct iovec iov[ZC_BATCH];
+	size_t received = 0;
+	ssize_t ret;
+	int i;
+
+	/* borrow a bit and close while the views are still lent out */
+	while (received < ZC_CLOSE_LEN / 2) {
+		ret = tcp_read_zc(c, iov, ZC_BATCH);
+		BUG_ON(ret <= 0);
+		for (i = 0; i < ret; i++) {
+			zc_check(&iov[i], received);
+			received += iov[i].iov_len;
+		}
+	}
+	log_info("closing with %ld bytes lent out", received);
+}
+
+static void server_worker(void *arg)
+{
+	tcpconn_t *c = (tcpconn_t *)arg;
+	unsigned char mode;
+	ssize_t ret;
+
+	ret = tcp_read(c, &mode, 1);
+	if (ret == 1 && mode == MODE_WINDOW)
+		server_window(c);
+	else if (ret == 1 && mode == MODE_CLOSE)
+		server_close(c);
+	tcp_close(c);
+}
+
+static void do_server(void *arg)
+{
+	struct netaddr laddr;
+	tcpqueue_t *q;
+	int ret;
+
+	laddr.ip = 0;
+	laddr.port = ZC_PORT;
+
+	ret = tcp_listen(laddr, 4096, &q);
+	BUG_ON(ret);
+
+	while (true) {
+		tcpconn_t *c;
+
+		ret = tcp_accept(q, &c);
+		BUG_ON(ret);
+		ret = thread_spawn(server_worker, c);
+		BUG_ON(ret);
+	}
+}
+
+static int str_to_ip(const char *str, uint32_t *addr)
+{
+	uint8_t a, b, c, d;
+	if(sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) {
+		return -EINVAL;
+	}
+
+	*addr = MAKE_IP_ADDR(a, b, c, d);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	uint32_t addr;
+	thread_fn_t fn;
+
+	if (argc < 4) {
+		printf("%s: [config_file_path] [mode] [ip]\n", argv[0]);
+		return -EINVAL;
+	}
+
+	if (!strcmp(argv[2], "CLIENT")) {
+		fn = do_client;
+	} else if (!strcmp(argv[2], "SERVER")) {
+		fn = do_server;
+	} else {
+		printf("invalid mode '%s'\n", argv[2]);
+		return -EINVAL;
+	}
+
+	ret = str_to_ip(argv[3], &addr);
+	if (ret) {
+		printf("couldn't parse [ip] '%s'\n", argv[3]);
+		return -EINVAL;
+	}
+	raddr.ip = addr;
+	raddr.port = ZC_PORT;
+
+	ret = runtime_init(argv[1], fn, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * test_tcp_zc_tx.c - checks the lifetime of zero-copy TCP writes
+ *
+ * The client sends a buffer from tcp_zc_alloc() that spans many segments and
+ * waits for every completion callback, makes sure an empty write completes
+ * nothing, and then tears down a connection with zero-copy writes still in
+ * flight, which must still run each callback exactly once. Set
+ * "tcp_zc_region_mb" in the client's config file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+#include <runtime/tcp.h>
+#include <runtime/timer.h>
+
+#define ZC_PORT		8004
+/* spans many segments */
+#define ZC_LEN		(1024 * 1024)
+#define ZC_ROUNDS	16
+#define ZC_CHUNK	(64 * 1024)
+#define ZC_HOLD_US	ONE_SECOND
+
+#define MODE_STREAM	'S'
+#define MODE_HOLD	'H'
+
+static struct netaddr raddr;
+static unsigned char *zc_buf;
+
+static inline unsigned char zc_pattern(size_t off)
+{
+	return (off % ZC_LEN) % 251;
+}
+
+static void zc_done(void *arg)
+{
+	waitgroup_done((waitgroup_t *)arg);
+}
+
+static void zc_done_never(void *arg)
+{
+	BUG();
+}
+
+/* writes @len bytes of zc_buf, returns the number of writes in flight */
+static ssize_t client_write(tcpconn_t *c, size_t len, waitgroup_t *wg)
+{
+	size_t off = 0;
+	ssize_t ret, n = 0;
+
+	while (off < len) {
+		waitgroup_add(wg, 1);
+		ret = tcp_write_zc(c, zc_buf + off, len - off, zc_done, wg);
+		if (ret <= 0) {
+			/* the callback only runs for successful writes */
+			waitgroup_done(wg);
+			return n > 0 ? n : ret;
+		}
+		off += ret;
+		n++;
+	}
+
+	return n;
+}
+
+static void client_stream(void)
+{
+	struct netaddr laddr = {0, 0};
+	unsigned char mode = MODE_STREAM;
+	waitgroup_t wg;
+	tcpconn_t *c;
+	ssize_t ret;
+	int i;
+
+	ret = tcp_dial(laddr, raddr, &c);
+	BUG_ON(ret);
+	ret = tcp_write(c, &mode, 1);
+	BUG_ON(ret != 1);
+
+	/* an empty write must not take (or leak) a reference */
+	ret = tcp_write_zc(c, zc_buf, 0, zc_done_never, NULL);
+	BUG_ON(ret != 0);
+
+	waitgroup_init(&wg);
+	for (i = 0; i < ZC_ROUNDS; i++) {
+		ret = client_write(c, ZC_LEN, &wg);
+		BUG_ON(ret <= 0);
+	}
+
+	/* the server acks once it has read (and checked) everything */
+	ret = tcp_read(c, &mode, 1);
+	BUG_ON(ret != 1);
+	waitgroup_wait(&wg);
+
+	ret = tcp_write_zc(c, zc_buf, 0, zc_done_never, NULL);
+	BUG_ON(ret != 0);
+	tcp_close(c);
+	log_info("stream test passed, %d bytes", ZC_ROUNDS * ZC_LEN);
+}
+
+static void client_teardown(void)
+{
+	struct netaddr laddr = {0, 0};
+	unsigned char mode = MODE_HOLD;
+	waitgroup_t wg;
+	tcpconn_t *c;
+	ssize_t ret, n = 0;
+
+	ret = tcp_dial(laddr, raddr, &c);
+	BUG_ON(ret);
+	ret = tcp_write(c, &mode, 1);
+	BUG_ON(ret != 1);
+
+	/* the server doesn't read, so this fills the window and stops */
+	tcp_set_nonblocking(c, true);
+	waitgroup_init(&wg);
+	while (true) {
+		ret = client_write(c, ZC_LEN, &wg);
+		if (ret <= 0)
+			break;
+		n += ret;
+	}
+	BUG_ON(ret != -EAGAIN);
+	BUG_ON(n == 0);
+
+	/* tearing down must release every in-flight segment exactly once */
+	tcp_abort(c);
+	ret = tcp_write_zc(c, zc_buf, ZC_LEN, zc_done_never, NULL);
+	BUG_ON(ret > 0);
+	tcp_close(c);
+	waitgroup_wait(&wg);
+	log_info("teardown test passed, %ld writes in flight", n);
+}
+
+static void do_client(void *arg)
+{
+	size_t i;
+
+	zc_buf = tcp_zc_alloc(ZC_LEN);
+	if (!zc_buf) {
+		log_err("couldn't allocate, raise tcp_zc_region_mb");
+		return;
+	}
+	for (i = 0; i < ZC_LEN; i++)
+		zc_buf[i] = zc_pattern(i);
+
+	client_stream();
+	client_teardown();
+}
+
+static void server_stream(tcpconn_t *c)
+{
+	unsigned char buf[ZC_CHUNK];
+	size_t received = 0;
+	ssize_t ret, i;
+
+	while (received < ZC_ROUNDS * ZC_LEN) {
+		ret = tcp_read(c, buf, sizeof(buf));
+		BUG_ON(ret <= 0);
+		for (i = 0; i < ret; i++)
+			BUG_ON(buf[i] != zc_pattern(received + i));
+		received += ret;
+	}
+
+	ret = tcp_write(c, buf, 1);
+	BUG_ON(ret != 1);
+}
+
+static void server_worker(void *arg)
+{
+	tcpconn_t *c = (tcpconn_t *)arg;
+	unsigned char mode;
+	ssize_t ret;
+
+	ret = tcp_read(c, &mode, 1);
+	if (ret == 1 && mode == MODE_STREAM) {
+		server_stream(c);
+	} else if (ret == 1 && mode == MODE_HOLD) {
+		/* read nothing until well after the client gives up */
+		timer_sleep(ZC_HOLD_US);
+	}
+
+	/* drain until the client closes */
+	while (tcp_read(c, &mode, 1) > 0)
+		;
+	tcp_close(c);
+}
+
+static void do_server(void *arg)
+{
+	struct netaddr laddr;
+	tcpqueue_t *q;
+	int ret;
+
+	laddr.ip = 0;
+	laddr.port = ZC_PORT;
+
+	ret = tcp_listen(laddr, 4096, &q);
+	BUG_ON(ret);
+
+	while (true) {
+		tcpconn_t *c;
+
+		ret = tcp_accept(q, &c);
+		BUG_ON(ret);
+		ret = thread_spawn(server_worker, c);
+		BUG_ON(ret);
+	}
+}
+
+static int str_to_ip(const char *str, uint32_t *addr)
+{
+	uint8_t a, b, c, d;
+	if(sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) {
+		return -EINVAL;
+	}
+
+	*addr = MAKE_IP_ADDR(a, b, c, d);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	uint32_t addr;
+	thread_fn_t fn;
+
+	if (argc < 4) {
+		printf("%s: [config_file_path] [mode] [ip]\n", argv[0]);
+		return -EINVAL;
+	}
+
+	if (!strcmp(argv[2], "CLIENT")) {
+		fn = do_client;
+	} else if (!strcmp(argv[2], "SERVER")) {
+		fn = do_server;
+	} else {
+		printf("invalid mode '%s'\n", argv[2]);
+		return -EINVAL;
+	}
+
+	ret = str_to_ip(argv[3], &addr);
+	if (ret) {
+		printf("couldn't parse [ip] '%s'\n", argv[3]);
+		return -EINVAL;
+	}
+	raddr.ip = addr;
+	raddr.port = ZC_PORT;
+
+	ret = runtime_init(argv[1], fn, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}